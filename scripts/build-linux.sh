@@ -36,7 +36,7 @@ CFLAGS_DEBUG="-O0 -g -D_DEBUG -DDEBUG -DBUILD_INTERNAL"
 CFLAGS_INTERNAL="-O2 -DNDEBUG -DBUILD_INTERNAL"
 CFLAGS_RELEASE="-O2 -DNDEBUG"
 
-LDFLAGS="-lm"
+LDFLAGS="-lm -pthread"
 
 ###############################################################################
 # Create directories
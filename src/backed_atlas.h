@@ -0,0 +1,157 @@
+// Reader for the binary atlas written by sprite backer with --binary.
+//
+// The file is meant to be mapped (or read) into memory and used in place:
+// every table sits at an 8 byte aligned offset from the start of the file,
+// all values are little-endian, and names are offsets into a string table of
+// NUL-terminated UTF-8. Nothing needs to be parsed or fixed up after loading.
+//
+//     size_t size;
+//     const void* data = MapFile("spritesheet.bin", &size);
+//     const backed_atlas_t* atlas = BackedAtlasOpen(data, size);
+//     const backed_sprite_t* sprite = &BackedAtlasSprites(atlas)[index];
+//
+// Sprites are in config order, the same order as sprite_id in the header.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BACKED_ATLAS_MAGIC 0x4B434142u // "BACK"
+#define BACKED_ATLAS_VERSION 2
+
+typedef struct
+{
+    uint32_t magic;                 // BACKED_ATLAS_MAGIC
+    uint32_t version;               // BACKED_ATLAS_VERSION
+    uint32_t file_size;             // Size of the whole file in bytes
+    uint32_t page_count;            // Number of atlas pages
+    uint32_t width, height;         // Atlas page size
+    uint32_t sprite_count;
+    uint32_t sprites;               // Offset of backed_sprite_t[sprite_count]
+    uint32_t font_count;
+    uint32_t fonts;                 // Offset of backed_font_t[font_count]
+    uint32_t strings;               // Offset of the string table
+    uint32_t string_size;           // Size of the string table in bytes
+    uint32_t alpha_mode;            // backed_alpha_mode_t of the atlas pixels
+    uint32_t reserved;
+} backed_atlas_t;
+
+typedef enum
+{
+    BACKED_ALPHA_STRAIGHT,          // Blend with SRC_ALPHA, ONE_MINUS_SRC_ALPHA
+    BACKED_ALPHA_PREMULTIPLIED,     // Color times alpha in linear light, blend with ONE, ONE_MINUS_SRC_ALPHA
+    BACKED_ALPHA_PREMULTIPLIED_GAMMA, // Color bytes times alpha, blend with ONE, ONE_MINUS_SRC_ALPHA
+} backed_alpha_mode_t;
+
+typedef struct
+{
+    int32_t x, y, w, h;             // Position in atlas and sprite size
+    float u0, v0, u1, v1;           // UV coordinates
+    int32_t page;                   // Atlas page
+    int32_t rotated;                // Stored turned 90 degrees clockwise, the atlas region is h x w
+    int32_t trim_x, trim_y;         // Offset of the trimmed region in the source image
+    int32_t source_w, source_h;     // Source image size before trimming
+    uint32_t name;                  // String table offset
+    uint32_t reserved;
+} backed_sprite_t;
+
+typedef struct
+{
+    uint32_t codepoint;             // Unicode codepoint
+    int32_t w, h;                   // Dimensions
+    float u0, v0, u1, v1;           // UV coordinates
+    float xoff, yoff;               // Offset from baseline
+    float advance;                  // Advance to next glyph
+    int32_t page;                   // Atlas page
+} backed_glyph_t;
+
+typedef enum
+{
+    BACKED_GLYPH_BITMAP,            // Coverage in alpha
+    BACKED_GLYPH_SDF,               // Signed distance in alpha
+    BACKED_GLYPH_MSDF,              // Multi-channel distance in RGB, true distance in alpha
+} backed_glyph_mode_t;
+
+typedef struct
+{
+    uint32_t name;                  // String table offset
+    int32_t size;                   // Size in pixels
+    int32_t ascent, descent, line_gap;
+    uint32_t mode;                  // backed_glyph_mode_t
+    float distance_range;           // Distance fields: pixels from value 0 to 1, 0.5 is the edge
+    uint32_t glyph_count;
+    uint32_t glyphs;                // Offset of backed_glyph_t[glyph_count], ascending codepoints
+    uint32_t glyph_page_count;      // Number of 256 codepoint pages, up to the highest glyph
+    uint32_t glyph_pages;           // Offset of uint32_t[glyph_page_count], block of each page
+    uint32_t glyph_blocks;          // Offset of uint32_t[256] per block, glyph index + 1 or 0
+    uint32_t kern_count;
+    uint32_t kern_keys;             // Offset of uint64_t[kern_count], first << 32 | second, ascending
+    uint32_t kern_advances;         // Offset of float[kern_count], pixels to add between the pair
+    uint32_t reserved;
+} backed_font_t;
+
+// Checks the header and returns the atlas, or 0 when the data is not a
+// binary atlas of this version. The data must be 8 byte aligned.
+static inline const backed_atlas_t* BackedAtlasOpen(const void* data, size_t size)
+{
+    const backed_atlas_t* atlas = (const backed_atlas_t*) data;
+    if (!data || ((uintptr_t) data & 7) || size < sizeof(backed_atlas_t))
+    {
+        return 0;
+    }
+    if (atlas->magic != BACKED_ATLAS_MAGIC || atlas->version != BACKED_ATLAS_VERSION || atlas->file_size > size)
+    {
+        return 0;
+    }
+    return atlas;
+}
+
+#define BACKED_ATLAS_AT(atlas, type, offset) ((const type*) ((const uint8_t*) (atlas) + (offset)))
+
+static inline const backed_sprite_t* BackedAtlasSprites(const backed_atlas_t* atlas)
+{
+    return BACKED_ATLAS_AT(atlas, backed_sprite_t, atlas->sprites);
+}
+
+static inline const backed_font_t* BackedAtlasFonts(const backed_atlas_t* atlas)
+{
+    return BACKED_ATLAS_AT(atlas, backed_font_t, atlas->fonts);
+}
+
+static inline const char* BackedAtlasString(const backed_atlas_t* atlas, uint32_t name)
+{
+    return BACKED_ATLAS_AT(atlas, char, atlas->strings + name);
+}
+
+static inline const backed_glyph_t* BackedAtlasGlyphs(const backed_atlas_t* atlas, const backed_font_t* font)
+{
+    return BACKED_ATLAS_AT(atlas, backed_glyph_t, font->glyphs);
+}
+
+// Glyph for a codepoint, or 0 when the font does not have it
+static inline const backed_glyph_t* BackedAtlasGlyph(const backed_atlas_t* atlas, const backed_font_t* font, uint32_t codepoint)
+{
+    uint32_t page = codepoint >> 8;
+    if (page >= font->glyph_page_count)
+    {
+        return 0;
+    }
+    uint32_t block = BACKED_ATLAS_AT(atlas, uint32_t, font->glyph_pages)[page];
+    uint32_t index = BACKED_ATLAS_AT(atlas, uint32_t, font->glyph_blocks)[(block << 8) | (codepoint & 0xFF)];
+    return index ? &BackedAtlasGlyphs(atlas, font)[index - 1] : 0;
+}
+
+// Kerning between two codepoints, 0 when the pair has none
+static inline float BackedAtlasKerning(const backed_atlas_t* atlas, const backed_font_t* font, uint32_t first, uint32_t second)
+{
+    const uint64_t* keys = BACKED_ATLAS_AT(atlas, uint64_t, font->kern_keys);
+    uint64_t key = ((uint64_t) first << 32) | second;
+    uint32_t lo = 0, hi = font->kern_count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key) lo = mid + 1; else hi = mid;
+    }
+    return (lo < font->kern_count && keys[lo] == key) ? BACKED_ATLAS_AT(atlas, float, font->kern_advances)[lo] : 0.0f;
+}
@@ -1,6 +1,25 @@
 
+#if defined(PLATFORM_LINUX)
+#define _POSIX_C_SOURCE 200809L // inotify, nanosecond file times with -std=c17
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
+#include <float.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
@@ -9,6 +28,8 @@
 #include <stb/stb_image.h>
 #include <stb/stb_image_write.h>
 
+#include "backed_atlas.h"
+
 #define GLOBAL static
 #define INTERNAL static
 
@@ -19,20 +40,35 @@
 #define GIGABYTES(value) (MEGABYTES(value) << 10)
 
 #define MAX_NAME 64
-#define MAX_FILENAME 256
-#define MAX_IMAGES 256
-#define MAX_FONTS 16
-#define MAX_CHARSET 4096
-#define MAX_GLYPHS 128
+#define MAX_FILENAME 1024
+#define MAX_CODEPOINT 0x10FFFF
+
+#define MAX_THREADS 64
 
 typedef uint32_t bool32_t;
 
+// Size and last write of an input, taken just before it is read so a change
+// made while baking still shows up in watch mode. Zero until taken, -1 when
+// the file is missing.
 typedef struct
 {
-    char name[MAX_NAME];
-    char filename[MAX_FILENAME];
-    int x, y, width, height;
+    int64_t time;
+    int64_t size;
+} file_stamp_t;
+
+typedef struct
+{
+    char* name;
+    char* filename;
+    int x, y, width, height;    // width and height are the trimmed size
+    int trim_x, trim_y;         // Offset of the trimmed region in the source image
+    int source_width, source_height;
+    int page;
+    bool32_t rotated;           // Stored turned 90 degrees clockwise
     uint8_t* pixels;
+    uint64_t hash;              // Of the (trimmed) pixels and size
+    int alias;                  // Earlier image with the same pixels, or -1
+    file_stamp_t stamp;
 } image_t;
 
 typedef struct
@@ -41,125 +77,451 @@ typedef struct
     float xoff, yoff;
     float xadvance;
     int w, h;
+    int page;
 } glyph_t;
 
 typedef struct
 {
     int codepoint;
+    int glyph_index;
     glyph_t glyph;
 } glyph_mapping_t;
 
 typedef struct
 {
-    char name[MAX_NAME];
-    char filename[MAX_FILENAME];
+    uint64_t key;               // First codepoint << 32 | second codepoint
+    float advance;              // In pixels
+} kern_pair_t;
+
+typedef enum
+{
+    GLYPH_BITMAP,               // Coverage
+    GLYPH_SDF,                  // Signed distance in one channel
+    GLYPH_MSDF,                 // Multi-channel distance in RGB, true distance in alpha
+} glyph_mode_t;
+
+#define DEFAULT_SDF_SPREAD 4
+
+typedef struct
+{
+    uint64_t key;
+    uint8_t* data;
+    size_t size;
+} cache_entry_t;
+
+typedef struct
+{
+    char* filename;
+    file_stamp_t stamp;
+} charset_file_t;
+
+typedef struct
+{
+    char* name;
+    char* filename;
     int size;
+    glyph_mode_t mode;
+    int spread;                 // Distance field reach in pixels on each side of the edge
     stbtt_fontinfo info;
     uint8_t* data;
+    size_t data_size;
     float scale;
     int ascent, descent, line_gap;
-    glyph_mapping_t glyphs[MAX_GLYPHS];
+    glyph_mapping_t* glyphs;    // One per codepoint at most, filled by CreateAtlas
     int glyph_count;
-    int codepoints[MAX_GLYPHS];
+    kern_pair_t* kerning;       // Pairs between baked glyphs, sorted by key
+    int kerning_count;
+    int* codepoints;
     int codepoint_count;
+    int codepoint_capacity;
+    bool32_t all_glyphs;        // Charset "*", codepoints are filled by LoadFont
+    charset_file_t* charset_files; // Read by the charset, watched for changes
+    int charset_file_count;
+    int charset_file_capacity;
+    cache_entry_t baked;        // Glyphs and kerning of the last bake, kept in watch mode
+    file_stamp_t stamp;
 } font_t;
 
 typedef struct
 {
     int font_index;
     int codepoint;
+    int glyph_index;
     uint8_t* bitmap;
+    size_t bitmap_offset;       // Into the glyph bitmap arena
+    int channels;               // 1, or 4 for MSDF
     int width, height;
     int xoff, yoff;
     float xadvance;
+    uint64_t hash;              // Of the bitmap and its size
+    const uint8_t* cached;      // Bitmap from the cache, copied instead of rasterized
+    int alias;                  // Earlier glyph with the same bitmap, or -1
+    int x, y, page;             // Placed bitmap position
 } packed_glyph_t;
 
+typedef enum
+{
+    SORT_AREA,
+    SORT_MAX_SIDE,
+    SORT_PERIMETER,
+    SORT_HEIGHT,
+    SORT_COUNT,
+} sort_order_t;
+
+GLOBAL const char* sort_order_names[SORT_COUNT] = {
+    "AREA",
+    "MAX_SIDE",
+    "PERIMETER",
+    "HEIGHT",
+};
+
+typedef enum
+{
+    HEURISTIC_SHORT_SIDE_FIT,
+    HEURISTIC_LONG_SIDE_FIT,
+    HEURISTIC_AREA_FIT,
+    HEURISTIC_BOTTOM_LEFT,
+    HEURISTIC_CONTACT_POINT,
+    HEURISTIC_COUNT,
+    HEURISTIC_BEST = HEURISTIC_COUNT, // Try every heuristic and sort order
+} pack_heuristic_t;
+
+GLOBAL const char* heuristic_names[HEURISTIC_COUNT + 1] = {
+    "SHORT_SIDE_FIT",
+    "LONG_SIDE_FIT",
+    "AREA_FIT",
+    "BOTTOM_LEFT",
+    "CONTACT_POINT",
+    "BEST",
+};
+
+#define TEXTURE_BLOCK_SIZE 4
+
+typedef enum
+{
+    TEXTURE_NONE,
+    TEXTURE_BC1,
+    TEXTURE_BC3,
+    TEXTURE_BC7,
+    TEXTURE_ETC2,
+    TEXTURE_COUNT,
+} texture_format_t;
+
+GLOBAL const char* texture_format_names[TEXTURE_COUNT] = {
+    "NONE",
+    "BC1",
+    "BC3",
+    "BC7",
+    "ETC2",
+};
+
+// Mip levels are averaged 2x2 (BOX) or with a wider Kaiser windowed sinc,
+// sharper on detailed sprites
+typedef enum
+{
+    MIP_BOX,
+    MIP_KAISER,
+    MIP_FILTER_COUNT,
+} mip_filter_t;
+
+GLOBAL const char* mip_filter_names[MIP_FILTER_COUNT] = {
+    "BOX",
+    "KAISER",
+};
+
+#define MAX_MIP_LEVELS 16
+#define MIP_KAISER_TAPS 6
+
+// Same values as backed_alpha_mode_t
+typedef enum
+{
+    ALPHA_STRAIGHT,
+    ALPHA_PREMULTIPLIED,        // Color times alpha in linear light, stored as sRGB
+    ALPHA_PREMULTIPLIED_GAMMA,  // Stored color bytes times alpha
+} alpha_mode_t;
+
+#define DEFAULT_MAX_ATLAS_SIZE 8192
+
 typedef struct
 {
     uint32_t width, height;
-    uint8_t* pixels;
-    image_t images[MAX_IMAGES];
+    bool32_t auto_size;         // Search the smallest size that fits
+    int max_size;
+    bool32_t power_of_two;
+    bool32_t non_square;
+    bool32_t allow_rotation;    // Images may be turned 90 degrees to pack tighter
+    bool32_t trim;              // Pack only the non-transparent part of each image
+    bool32_t block_align;       // Round packed rects up to whole 4x4 blocks
+    texture_format_t texture_format; // Also written as KTX2 when not TEXTURE_NONE
+    int mip_levels;             // Levels in the KTX2, 0 or 1 without MIPMAPS
+    mip_filter_t mip_filter;
+    alpha_mode_t alpha_mode;    // Applied to the pixels once packed
+    sort_order_t sort_order;
+    pack_heuristic_t heuristic;
+    int page_count;
+    uint8_t* pixels;            // page_count pages of width * height RGBA
+    image_t* images;
     int image_count;
-    font_t fonts[MAX_FONTS];
+    int image_capacity;
+    font_t* fonts;
     int font_count;
+    int font_capacity;
+    cache_entry_t baked_layout; // Layout of the last bake, kept in watch mode
+    file_stamp_t config_stamp;
+    image_t* kept_images;       // Decoded images of the last load by filename, while reloading
+    int kept_image_count;
+    bool32_t kept_trim;
 } atlas_t;
 
 GLOBAL atlas_t global_atlas;
+GLOBAL int global_thread_count = 1;
+GLOBAL bool32_t global_print_stats;
+GLOBAL bool32_t global_export_binary;
+GLOBAL bool32_t global_watch;
 
 //////////////////////////////////////////////////////////////////////////////
-// Config parser
+// Threads
 //////////////////////////////////////////////////////////////////////////////
 
+#if defined(PLATFORM_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#undef LoadImage
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef void work_proc_t(void* data, int index);
+
+typedef struct
+{
+    work_proc_t* proc;
+    void* data;
+    int count;
+    volatile long next_index;
+} work_queue_t;
+
+INTERNAL long
+AtomicIncrement(volatile long* value)
+{
+#if defined(PLATFORM_WIN32)
+    return InterlockedIncrement(value);
+#else
+    return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
 INTERNAL int
-DecodeUTF8(const char** str, OUT int* codepoint)
+GetProcessorCount(void)
 {
-    const uint8_t* s = (uint8_t*) *str;
+#if defined(PLATFORM_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int) info.dwNumberOfProcessors;
+#else
+    int count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
-    if (s[0] == 0)
+    if (count < 1)
+    {
+        count = 1;
+    }
+    if (count > MAX_THREADS)
     {
-         return 0;
+        count = MAX_THREADS;
     }
 
-    if ((s[0] & 0x80) == 0)
+    return count;
+}
+
+INTERNAL void
+WorkQueueDrain(work_queue_t* queue)
+{
+    for (;;)
     {
-        *codepoint = s[0];
-        *str += 1;
-        return 1;
+        int index = (int) AtomicIncrement(&queue->next_index) - 1;
+        if (index >= queue->count)
+        {
+            break;
+        }
+
+        queue->proc(queue->data, index);
     }
+}
+
+#if defined(PLATFORM_WIN32)
+INTERNAL DWORD WINAPI
+WorkerThreadProc(LPVOID param)
+{
+    WorkQueueDrain((work_queue_t*) param);
+    return 0;
+}
+#else
+INTERNAL void*
+WorkerThreadProc(void* param)
+{
+    WorkQueueDrain((work_queue_t*) param);
+    return 0;
+}
+#endif
+
+// Calls proc(data, i) for every i in [0, count) spread over the worker
+// threads. The calling thread takes part in the work and the function only
+// returns once every index has been processed. Indices are handed out in
+// increasing order but may complete in any order, so each call must only
+// write to its own output slot.
+INTERNAL void
+ParallelFor(int count, work_proc_t* proc, void* data)
+{
+    work_queue_t queue = { proc, data, count, 0 };
 
-    if ((s[0] & 0xE0) == 0xC0)
+    int thread_count = global_thread_count < count ? global_thread_count : count;
+    int started = 0;
+
+#if defined(PLATFORM_WIN32)
+    HANDLE threads[MAX_THREADS];
+    for (int i = 1; i < thread_count; ++i)
     {
-        *codepoint = ((s[0] & 0x1F) << 6) | (s[1] & 0x3f);
-        *str += 2;
-        return 2;
+        HANDLE thread = CreateThread(0, 0, WorkerThreadProc, &queue, 0, 0);
+        if (thread)
+        {
+            threads[started++] = thread;
+        }
     }
 
-    if ((s[0] & 0xF0) == 0xE0)
+    WorkQueueDrain(&queue);
+
+    for (int i = 0; i < started; ++i)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[MAX_THREADS];
+    for (int i = 1; i < thread_count; ++i)
     {
-        *codepoint = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
-        *str += 3;
-        return 3;
+        if (pthread_create(&threads[started], 0, WorkerThreadProc, &queue) == 0)
+        {
+            started++;
+        }
     }
 
-    if ((s[0] & 0xF8) == 0xF0) {
-        *codepoint = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
-        *str += 4;
-        return 4;
+    WorkQueueDrain(&queue);
+
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], 0);
     }
-    
-    *codepoint = '?';
-    *str += 1;
-    return 1;
+#endif
 }
 
-INTERNAL bool32_t
-LoadImage(const char* filename, const char* name, OUT image_t* image)
+//////////////////////////////////////////////////////////////////////////////
+// Timing
+//////////////////////////////////////////////////////////////////////////////
+
+INTERNAL double
+GetSeconds(void)
 {
-    int width, height, channels;
-    uint8_t* data = stbi_load(filename, &width, &height, &channels, 4);
-    if (!data)
+#if defined(PLATFORM_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#endif
+}
+
+INTERNAL void
+SleepMilliseconds(int milliseconds)
+{
+#if defined(PLATFORM_WIN32)
+    Sleep(milliseconds);
+#else
+    struct timespec ts = { milliseconds / 1000, (long) (milliseconds % 1000) * 1000000 };
+    nanosleep(&ts, 0);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Memory
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(PLATFORM_WIN32)
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Largest resident set of the process so far, in bytes
+INTERNAL size_t
+GetPeakMemoryUsage(void)
+{
+#if defined(PLATFORM_WIN32)
+    PROCESS_MEMORY_COUNTERS counters = { 0 };
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
     {
-        printf("Error: Failed to load image: %s\n", filename);
         return 0;
     }
+#if defined(PLATFORM_MACOS)
+    return (size_t) usage.ru_maxrss;
+#else
+    return (size_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Makes room for one more item at items[count], doubling the capacity when
+// full. New items are zeroed.
+INTERNAL void*
+GrowArray(void* items, int count, OUT int* capacity, size_t item_size)
+{
+    if (count < *capacity)
+    {
+        return items;
+    }
 
-    strcpy(image->name, name);
-    strcpy(image->filename, filename);
+    int new_capacity = *capacity ? *capacity * 2 : 16;
+    uint8_t* result = (uint8_t*) realloc(items, (size_t) new_capacity * item_size);
+    if (!result)
+    {
+        printf("Error: Out of memory.\n");
+        exit(1);
+    }
 
-    image->width = width;
-    image->height = height;
-    image->pixels = data;
+    memset(result + (size_t) *capacity * item_size, 0, (size_t) (new_capacity - *capacity) * item_size);
+    *capacity = new_capacity;
 
-    return 1;
+    return result;
 }
 
-INTERNAL bool32_t
-LoadFont(const char* filename, const char* name, char* charset, int size, OUT font_t* font)
+INTERNAL char*
+CopyString(const char* string)
+{
+    size_t size = strlen(string) + 1;
+    char* result = (char*) malloc(size);
+    memcpy(result, string, size);
+    return result;
+}
+
+// Returns the file contents in a malloc'd buffer, or 0 if it cannot be read
+INTERNAL uint8_t*
+ReadEntireFile(const char* filename, OUT size_t* size)
 {
     FILE* f = fopen(filename, "rb");
     if (!f)
     {
-        printf("Error: Cannot open font file: %s\n", filename);
         return 0;
     }
 
@@ -167,804 +529,10698 @@ LoadFont(const char* filename, const char* name, char* charset, int size, OUT fo
     long file_size = ftell(f);
     fseek(f, 0, SEEK_SET);
 
-    font->data = (uint8_t*) calloc(file_size, 1);
-    if (!font->data)
+    uint8_t* data = file_size >= 0 ? (uint8_t*) malloc(file_size ? file_size : 1) : 0;
+    if (data && fread(data, 1, file_size, f) != (size_t) file_size)
     {
-        printf("Error: Cannot allocate memory for font: %s\n", filename);
-        fclose(f);
-        return 0;
+        free(data);
+        data = 0;
     }
-
-    fread(font->data, 1, file_size, f);
     fclose(f);
 
-    if (!stbtt_InitFont(&font->info, font->data, 0))
-    {
-        printf("Error: Cannot initialize font: %s\n", filename);
-        free(font->data);
-        return 0;
-    }
+    *size = (size_t) file_size;
+    return data;
+}
 
-    strcpy(font->name, name);
-    strcpy(font->filename, name);
-    font->size = size;
-    font->scale = stbtt_ScaleForPixelHeight(&font->info, (float)size);
-    stbtt_GetFontVMetrics(&font->info, &font->ascent, &font->descent, &font->line_gap);
-    font->glyph_count = 0;
+#if !defined(PLATFORM_WIN32)
+#include <sys/stat.h>
+#endif
 
-    char* p = charset;
-    while (*p && font->codepoint_count < MAX_GLYPHS)
+INTERNAL file_stamp_t
+GetFileStamp(const char* filename)
+{
+    file_stamp_t stamp = { -1, -1 };
+#if defined(PLATFORM_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExA(filename, GetFileExInfoStandard, &data))
     {
-        if (*p == '\r' || *p == '\n' || *p == '\0')
-        {
-            break;
-        }
-
-        int codepoint;
-        DecodeUTF8(&p, &codepoint);
-
-        bool32_t found = 0;
-        for (int i = 0; i < font->codepoint_count; ++i)
-        {
-            if (font->codepoints[i] == codepoint)
-            {
-                found = 1;
-                break;
-            }
-        }
-
-        if (!found)
-        {
-            font->codepoints[font->codepoint_count++] = codepoint;
-        }
+        stamp.time = (int64_t) (((uint64_t) data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+        stamp.size = (int64_t) (((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow);
+    }
+#else
+    struct stat st;
+    if (stat(filename, &st) == 0)
+    {
+#if defined(PLATFORM_MACOS)
+        stamp.time = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        stamp.time = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        stamp.size = (int64_t) st.st_size;
     }
+#endif
+    return stamp;
+}
 
-    return 1;
+// Outputs are written to <filename>.tmp and moved over the old file once
+// complete, so a game hot-reloading them never reads a half-written file
+INTERNAL void
+GetTempFilename(const char* filename, char* temp, size_t size)
+{
+    snprintf(temp, size, "%s.tmp", filename);
 }
 
 INTERNAL bool32_t
-ParseConfig(const char* config, OUT atlas_t* atlas)
+CommitTempFile(const char* temp, const char* filename)
 {
-    FILE* f = fopen(config, "r");
-    if (!f)
+#if defined(PLATFORM_WIN32)
+    bool32_t ok = MoveFileExA(temp, filename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool32_t ok = rename(temp, filename) == 0;
+#endif
+    if (!ok)
     {
-        printf("Error: Cannot open config file: %s\n", config);
-        return 0;
+        printf("Error: Cannot replace %s\n", filename);
+        remove(temp);
     }
 
-    atlas->font_count = 0;
-    atlas->image_count = 0;
+    return ok;
+}
 
-    char line[MAX_CHARSET];
-    while (fgets(line, sizeof(line), f))
-    {
-        if (line[0] == '\0' || line[0] == '#' || line[0] == '\r' || line[0] == '\n')
-        {
-            continue;
-        }
+//////////////////////////////////////////////////////////////////////////////
+// Hashing
+//////////////////////////////////////////////////////////////////////////////
 
-        char cmd[MAX_NAME];
-        sscanf(line, "%s", cmd);
+// Eight bytes per step; only used to find identical pixel data, so it just
+// needs to be fast and spread the bits well
+INTERNAL uint64_t
+HashBytes(const uint8_t* data, size_t size, uint64_t seed)
+{
+    uint64_t hash = seed ^ 0x9E3779B97F4A7C15ull ^ (size * 0xC2B2AE3D27D4EB4Full);
+    size_t i = 0;
 
-        if (strncmp(cmd, "ATLAS_SIZE", 10) == 0)
-        {
-            sscanf(line, "ATLAS_SIZE %d", &atlas->width);
-            atlas->height = atlas->width;
-        }
-        else if (strncmp(cmd, "FONT", 4) == 0)
-        {
-            char filename[MAX_FILENAME], name[MAX_NAME], charset[MAX_CHARSET];
-            int size;
-            
-            if (sscanf(line, "FONT %s %d %s %s", filename, &size, charset, name) == 4)
-            {
-                if (atlas->font_count < MAX_FONTS)
-                {
-                    if (LoadFont(filename, name, charset, size, &atlas->fonts[atlas->font_count]))
-                    {
-                        atlas->font_count++;
-                    }
-                    else
-                    {
-                        printf("Error: Failed to load font: %s\n", filename);
-                        return 0;
-                    }
-                }
-                else
-                {
-                    printf("Error: No more fonts can be loaded. Increase number of fonts allowed.\n");
-                    return 0;
-                }
-            }
-            else
-            {
-                printf("Error: Invalid font config: %s\n", line);
-                return 0;
-            }
-        }
-        else if (strncmp(cmd, "IMAGE", 5) == 0)
-        {
-            char filename[MAX_FILENAME], name[MAX_NAME];
-            if (sscanf(line, "IMAGE %s %s", filename, name))
-            {
-                if (atlas->image_count < MAX_IMAGES)
-                {
-                    if (LoadImage(filename, name, &atlas->images[atlas->image_count]))
-                    {
-                        atlas->image_count++;
-                    }
-                    else
-                    {
-                        printf("Error: Failed to load image: %s\n", filename);
-                        return 0;
-                    }
-                }
-                else
-                {
-                    printf("Error: No more images can be loaded. Increase the number of allowed images.\n");
-                    return 0;
-                }
-            }
-            else
-            {
-                printf("Error: Invalid image format: %s\n", line);
-            }
-        }
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
     }
 
-    fclose(f);
+    for (; i < size; ++i)
+    {
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
 
-    // White image
-    image_t* image = &atlas->images[atlas->image_count++];
-    strcpy(image->name, "WHITE");
-    image->width = 4;
-    image->height = 4;
-    image->pixels = 0;
-    
-    return (atlas->font_count > 0 || atlas->image_count > 0);
+    hash ^= hash >> 29;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 32;
+
+    return hash;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// Max Rects
+// Asset cache
 //////////////////////////////////////////////////////////////////////////////
 
-typedef struct 
-{
-    int x, y, width, height;
-} rect_t;
+// With --cache <dir>, decoded images, rasterized fonts and packing layouts
+// are stored in files named after a hash of everything that produced them:
+// <key>.img from the PNG bytes, <key>.font from the TTF bytes, size, mode
+// and codepoints, <key>.layout from the rect sizes and packing settings. A
+// changed input just hashes to a new name, nothing is ever invalidated.
+// Old entries are not cleaned up, deleting the directory is always safe.
 
-typedef struct
-{
-    rect_t* rects;
-    int count;
-    int capacity;
-} maxrects_t;
+#include <errno.h>
 
-INTERNAL maxrects_t
-CreateMaxRects(int width, int height)
+#if defined(PLATFORM_WIN32)
+#include <direct.h>
+#endif
+
+#define CACHE_MAGIC 0x48434142u // "BACH"
+#define CACHE_VERSION 1
+
+typedef struct
 {
-    maxrects_t result = { 0 };
-    result.capacity = 512;
-    result.rects = (rect_t*) calloc(result.capacity * sizeof(rect_t), 1);
-    result.count = 1;
-    result.rects[0] = (rect_t){0, 0, width, height};
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              // Payload bytes following the header
+} cache_header_t;
 
-    return result;
-}
+GLOBAL const char* global_cache_dir;
+GLOBAL volatile long global_cache_image_hits;
+GLOBAL volatile long global_cache_temp_count;
+GLOBAL int global_cache_font_hits;
+GLOBAL bool32_t global_cache_layout_hit;
+
+INTERNAL bool32_t
+CreateCacheDirectory(const char* path)
+{
+#if defined(PLATFORM_WIN32)
+    int result = _mkdir(path);
+#else
+    int result = mkdir(path, 0755);
+#endif
+    if (result != 0 && errno != EEXIST)
+    {
+        printf("Error: Cannot create cache directory: %s\n", path);
+        return 0;
+    }
+
+    return 1;
+}
 
 INTERNAL void
-FreeMaxRects(maxrects_t* mr)
+GetCacheFilename(uint64_t key, const char* kind, char* filename, size_t size)
 {
-    free(mr->rects);
+    snprintf(filename, size, "%s/%016llx.%s", global_cache_dir, (unsigned long long) key, kind);
+}
+
+// Returns the payload of a cache entry in a malloc'd buffer, or 0 when there
+// is none or it is from another version or cut short
+INTERNAL uint8_t*
+ReadCacheEntry(uint64_t key, const char* kind, OUT size_t* size)
+{
+    char filename[MAX_FILENAME];
+    GetCacheFilename(key, kind, filename, sizeof(filename));
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        return 0;
+    }
+
+    cache_header_t header;
+    uint8_t* payload = 0;
+    if (fread(&header, sizeof(header), 1, f) == 1 &&
+        header.magic == CACHE_MAGIC && header.version == CACHE_VERSION && header.size <= SIZE_MAX)
+    {
+        payload = (uint8_t*) malloc(header.size ? (size_t) header.size : 1);
+        if (payload && fread(payload, 1, (size_t) header.size, f) != (size_t) header.size)
+        {
+            free(payload);
+            payload = 0;
+        }
+    }
+    fclose(f);
+
+    *size = payload ? (size_t) header.size : 0;
+    return payload;
+}
+
+// Racing writers of one entry each get their own temp file, so none of them
+// truncates a file another one is about to move into place
+INTERNAL void
+GetCacheTempFilename(const char* filename, char* temp, size_t size)
+{
+#if defined(PLATFORM_WIN32)
+    unsigned long process = (unsigned long) GetCurrentProcessId();
+#else
+    unsigned long process = (unsigned long) getpid();
+#endif
+    snprintf(temp, size, "%s.%lu.%ld.tmp", filename, process, AtomicIncrement(&global_cache_temp_count));
+}
+
+// Writes the parts back to back as one entry, through a temp file moved over
+// the final name once complete. Entries with the same key have the same
+// content, so whichever writer moves its file last leaves a valid entry.
+INTERNAL void
+WriteCacheEntry(uint64_t key, const char* kind, const void* const* parts, const size_t* sizes, int count)
+{
+    char filename[MAX_FILENAME];
+    GetCacheFilename(key, kind, filename, sizeof(filename));
+
+    char temp[MAX_FILENAME + 48];
+    GetCacheTempFilename(filename, temp, sizeof(temp));
+
+    FILE* f = fopen(temp, "wb");
+    if (!f)
+    {
+        return;
+    }
+
+    cache_header_t header = { CACHE_MAGIC, CACHE_VERSION, 0 };
+    for (int i = 0; i < count; ++i)
+    {
+        header.size += sizes[i];
+    }
+
+    bool32_t ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int i = 0; i < count && ok; ++i)
+    {
+        ok = fwrite(parts[i], 1, sizes[i], f) == sizes[i];
+    }
+
+    if ((fclose(f) != 0) || !ok)
+    {
+        remove(temp);
+        return;
+    }
+
+    CommitTempFile(temp, filename);
+}
+
+// Fonts and layouts are also kept in memory between bakes in watch mode,
+// so even without a directory only what changed is rebuilt
+
+INTERNAL bool32_t
+CacheEnabled(void)
+{
+    return global_cache_dir || global_watch;
+}
+
+// Returns the entry for key from the last bake or the cache directory, or 0.
+// The caller owns the result, a kept entry is handed over.
+INTERNAL uint8_t*
+TakeCacheEntry(uint64_t key, const char* kind, cache_entry_t* kept, OUT size_t* size)
+{
+    if (kept->data && kept->key == key)
+    {
+        uint8_t* data = kept->data;
+        *size = kept->size;
+        kept->data = 0;
+        return data;
+    }
+
+    free(kept->data);
+    kept->data = 0;
+
+    return global_cache_dir ? ReadCacheEntry(key, kind, size) : 0;
+}
+
+// Writes a newly built entry to the cache directory, then keeps it for the
+// next bake in watch mode or frees it
+INTERNAL void
+KeepCacheEntry(uint64_t key, const char* kind, uint8_t* data, size_t size, bool32_t built, cache_entry_t* kept)
+{
+    if (built && global_cache_dir)
+    {
+        const void* parts[] = { data };
+        WriteCacheEntry(key, kind, parts, &size, 1);
+    }
+
+    free(kept->data);
+    kept->data = 0;
+
+    if (global_watch)
+    {
+        *kept = (cache_entry_t){ key, data, size };
+    }
+    else
+    {
+        free(data);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Config parser
+//////////////////////////////////////////////////////////////////////////////
+
+// Returns the number of bytes read, or 0 at the end of the string or on a
+// sequence that is not valid UTF-8: a stray or truncated continuation, an
+// overlong form, a surrogate or anything past MAX_CODEPOINT
+INTERNAL int
+DecodeUTF8(const char** str, OUT int* codepoint)
+{
+    const uint8_t* s = (uint8_t*) *str;
+
+    int length;
+    int value;
+    int min_value;
+    if ((s[0] & 0x80) == 0)
+    {
+        if (s[0] == 0)
+        {
+            return 0;
+        }
+        *codepoint = s[0];
+        *str += 1;
+        return 1;
+    }
+    else if ((s[0] & 0xE0) == 0xC0)
+    {
+        length = 2;
+        value = s[0] & 0x1F;
+        min_value = 0x80;
+    }
+    else if ((s[0] & 0xF0) == 0xE0)
+    {
+        length = 3;
+        value = s[0] & 0x0F;
+        min_value = 0x800;
+    }
+    else if ((s[0] & 0xF8) == 0xF0)
+    {
+        length = 4;
+        value = s[0] & 0x07;
+        min_value = 0x10000;
+    }
+    else
+    {
+        return 0;
+    }
+
+    // The terminating NUL fails this check, so a truncated sequence never
+    // reads past the string
+    for (int i = 1; i < length; ++i)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+        value = (value << 6) | (s[i] & 0x3F);
+    }
+
+    if (value < min_value || value > MAX_CODEPOINT || (value >= 0xD800 && value <= 0xDFFF))
+    {
+        return 0;
+    }
+
+    *codepoint = value;
+    *str += length;
+    return length;
+}
+
+INTERNAL bool32_t
+LoadImage(const uint8_t* file, size_t file_size, OUT image_t* image)
+{
+    int width, height, channels;
+    uint8_t* data = stbi_load_from_memory(file, (int) file_size, &width, &height, &channels, 4);
+    if (!data)
+    {
+        return 0;
+    }
+
+    image->width = width;
+    image->height = height;
+    image->source_width = width;
+    image->source_height = height;
+    image->pixels = data;
+
+    return 1;
+}
+
+// Reads a whole line, however long, growing the buffer as needed. Returns
+// 0 at the end of the file.
+INTERNAL bool32_t
+ReadLine(FILE* f, char** line, size_t* capacity)
+{
+    size_t length = 0;
+
+    for (;;)
+    {
+        if (*capacity - length < 2)
+        {
+            *capacity = *capacity ? *capacity * 2 : 256;
+            *line = (char*) realloc(*line, *capacity);
+        }
+
+        if (!fgets(*line + length, (int) (*capacity - length), f))
+        {
+            return length > 0;
+        }
+
+        length += strlen(*line + length);
+        if (length > 0 && (*line)[length - 1] == '\n')
+        {
+            return 1;
+        }
+    }
+}
+
+// Splits off the next whitespace separated token, terminating it in place
+INTERNAL char*
+NextToken(char** cursor)
+{
+    char* p = *cursor;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    {
+        p++;
+    }
+
+    if (!*p)
+    {
+        *cursor = p;
+        return 0;
+    }
+
+    char* token = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+        p++;
+    }
+
+    if (*p)
+    {
+        *p++ = '\0';
+    }
+    *cursor = p;
+
+    return token;
+}
+
+INTERNAL void
+AddCodepoint(font_t* font, int codepoint)
+{
+    font->codepoints = (int*) GrowArray(font->codepoints, font->codepoint_count, &font->codepoint_capacity, sizeof(int));
+    font->codepoints[font->codepoint_count++] = codepoint;
+}
+
+// Adds the codepoint unless it is out of range or the seen bitset already
+// has it
+INTERNAL void
+AddUniqueCodepoint(font_t* font, uint64_t* seen, int codepoint)
+{
+    if (codepoint < 0 || codepoint > MAX_CODEPOINT)
+    {
+        return;
+    }
+
+    uint64_t bit = 1ull << (codepoint & 63);
+    if (!(seen[codepoint >> 6] & bit))
+    {
+        seen[codepoint >> 6] |= bit;
+        AddCodepoint(font, codepoint);
+    }
+}
+
+// Parses "U+XXXX" (the "U+" is optional after a dash)
+INTERNAL bool32_t
+ParseCodepoint(const char** str, bool32_t prefix_optional, OUT int* codepoint)
+{
+    const char* p = *str;
+    if (p[0] == 'U' && p[1] == '+')
+    {
+        p += 2;
+    }
+    else if (!prefix_optional)
+    {
+        return 0;
+    }
+
+    char* end;
+    long value = strtol(p, &end, 16);
+    if (end == p || value < 0 || value > MAX_CODEPOINT)
+    {
+        return 0;
+    }
+
+    *codepoint = (int) value;
+    *str = end;
+    return 1;
+}
+
+// Comma separated codepoints and inclusive ranges:
+// U+0020-U+007E,U+00E9,U+4E00-U+9FFF
+INTERNAL bool32_t
+ParseCodepointRanges(const char* spec, font_t* font, uint64_t* seen)
+{
+    const char* p = spec;
+    while (*p)
+    {
+        int first, last;
+        if (!ParseCodepoint(&p, 0, &first))
+        {
+            return 0;
+        }
+
+        last = first;
+        if (*p == '-')
+        {
+            p++;
+            if (!ParseCodepoint(&p, 1, &last) || last < first)
+            {
+                return 0;
+            }
+        }
+
+        if (*p == ',')
+        {
+            p++;
+        }
+        else if (*p)
+        {
+            return 0;
+        }
+
+        for (int codepoint = first; codepoint <= last; ++codepoint)
+        {
+            AddUniqueCodepoint(font, seen, codepoint);
+        }
+    }
+
+    return 1;
+}
+
+// One charset token: ranges when it starts with "U+", otherwise the literal
+// UTF-8 characters
+INTERNAL bool32_t
+ParseCharsetToken(const char* token, font_t* font, uint64_t* seen)
+{
+    if (token[0] == 'U' && token[1] == '+')
+    {
+        if (!ParseCodepointRanges(token, font, seen))
+        {
+            printf("Error: Invalid codepoint range: %s\n", token);
+            return 0;
+        }
+        return 1;
+    }
+
+    const char* p = token;
+    while (*p)
+    {
+        if (*p == '\r' || *p == '\n')
+        {
+            break;
+        }
+
+        int codepoint = 0;
+        if (!DecodeUTF8(&p, &codepoint))
+        {
+            printf("Error: Invalid UTF-8 in charset: %s\n", token);
+            return 0;
+        }
+        AddUniqueCodepoint(font, seen, codepoint);
+    }
+
+    return 1;
+}
+
+// Charset file: whitespace separated tokens, each literal characters or ranges
+INTERNAL bool32_t
+ParseCharsetFile(const char* filename, font_t* font, uint64_t* seen)
+{
+    font->charset_files = (charset_file_t*) GrowArray(font->charset_files, font->charset_file_count,
+                                                      &font->charset_file_capacity, sizeof(charset_file_t));
+    charset_file_t* file = &font->charset_files[font->charset_file_count++];
+    file->filename = CopyString(filename);
+    file->stamp = GetFileStamp(filename);
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        printf("Error: Cannot open charset file: %s\n", filename);
+        return 0;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* contents = (char*) calloc(file_size + 1, 1);
+    fread(contents, 1, file_size, f);
+    fclose(f);
+
+    bool32_t ok = 1;
+    char* cursor = contents;
+    char* token;
+    while (ok && (token = NextToken(&cursor)))
+    {
+        ok = ParseCharsetToken(token, font, seen);
+    }
+
+    free(contents);
+    return ok;
 }
 
-INTERNAL int
-MaxRectsFindPosition(maxrects_t* mr, int width, int height, OUT int* x, OUT int* y)
-{
-    int best_short_side = INT_MAX;
-    int best_long_side = INT_MAX;
-    int best_index = -1;
-    int best_x = 0, best_y = 0;
+// Charsets are literal UTF-8 characters, codepoint ranges (U+0020-U+007E),
+// @file to read them from a file, or * for every glyph in the font.
+// Duplicates are dropped with a bitset over the whole Unicode range.
+INTERNAL bool32_t
+ParseCharset(const char* charset, OUT font_t* font)
+{
+    if (strcmp(charset, "*") == 0)
+    {
+        font->all_glyphs = 1;
+        return 1;
+    }
+
+    uint64_t* seen = (uint64_t*) calloc(MAX_CODEPOINT / 64 + 1, sizeof(uint64_t));
+    for (int i = 0; i < font->codepoint_count; ++i)
+    {
+        seen[font->codepoints[i] >> 6] |= 1ull << (font->codepoints[i] & 63);
+    }
+
+    bool32_t ok;
+    if (charset[0] == '@')
+    {
+        ok = ParseCharsetFile(charset + 1, font, seen);
+    }
+    else
+    {
+        ok = ParseCharsetToken(charset, font, seen);
+    }
+
+    free(seen);
+    return ok;
+}
+
+INTERNAL bool32_t
+LoadFont(OUT font_t* font)
+{
+    const char* filename = font->filename;
+    font->stamp = GetFileStamp(filename);
+    font->data = ReadEntireFile(filename, &font->data_size);
+    if (!font->data)
+    {
+        printf("Error: Cannot read font file: %s\n", filename);
+        return 0;
+    }
+
+    if (!stbtt_InitFont(&font->info, font->data, 0))
+    {
+        printf("Error: Cannot initialize font: %s\n", filename);
+        free(font->data);
+        return 0;
+    }
+
+    font->scale = stbtt_ScaleForPixelHeight(&font->info, (float)font->size);
+    stbtt_GetFontVMetrics(&font->info, &font->ascent, &font->descent, &font->line_gap);
+    font->glyph_count = 0;
+
+    if (font->all_glyphs)
+    {
+        // Every mapped codepoint that draws something
+        for (int codepoint = 0; codepoint <= MAX_CODEPOINT; ++codepoint)
+        {
+            int glyph_index = stbtt_FindGlyphIndex(&font->info, codepoint);
+            if (glyph_index != 0 && !stbtt_IsGlyphEmpty(&font->info, glyph_index))
+            {
+                AddCodepoint(font, codepoint);
+            }
+        }
+    }
+
+    return 1;
+}
+
+INTERNAL bool32_t
+ParseConfig(const char* config, OUT atlas_t* atlas)
+{
+    atlas->config_stamp = GetFileStamp(config);
+    FILE* f = fopen(config, "r");
+    if (!f)
+    {
+        printf("Error: Cannot open config file: %s\n", config);
+        return 0;
+    }
+
+    atlas->font_count = 0;
+    atlas->image_count = 0;
+
+    char* line = 0;
+    size_t line_capacity = 0;
+    while (ReadLine(f, &line, &line_capacity))
+    {
+        if (line[0] == '\0' || line[0] == '#' || line[0] == '\r' || line[0] == '\n')
+        {
+            continue;
+        }
+
+        char cmd[MAX_NAME] = { 0 };
+        sscanf(line, "%63s", cmd);
+
+        if (strncmp(cmd, "ATLAS_SIZE", 10) == 0)
+        {
+            char size[MAX_NAME] = { 0 };
+            sscanf(line, "ATLAS_SIZE %63s", size);
+
+            if (strcmp(size, "AUTO") == 0)
+            {
+                // ATLAS_SIZE AUTO [max_size] [POT] [NONSQUARE]
+                atlas->auto_size = 1;
+                atlas->max_size = DEFAULT_MAX_ATLAS_SIZE;
+
+                char* option = strtok(line + strlen("ATLAS_SIZE AUTO"), " \t\r\n");
+                while (option)
+                {
+                    if (strcmp(option, "POT") == 0)
+                    {
+                        atlas->power_of_two = 1;
+                    }
+                    else if (strcmp(option, "NONSQUARE") == 0)
+                    {
+                        atlas->non_square = 1;
+                    }
+                    else if (atoi(option) > 0)
+                    {
+                        atlas->max_size = atoi(option);
+                    }
+                    else
+                    {
+                        printf("Error: Unknown atlas size option: %s\n", option);
+                        return 0;
+                    }
+
+                    option = strtok(0, " \t\r\n");
+                }
+            }
+            else
+            {
+                atlas->auto_size = 0;
+                atlas->width = atoi(size);
+                atlas->height = atlas->width;
+            }
+        }
+        else if (strncmp(cmd, "TRIM", 4) == 0)
+        {
+            atlas->trim = 1;
+        }
+        else if (strncmp(cmd, "ALLOW_ROTATION", 14) == 0)
+        {
+            atlas->allow_rotation = 1;
+        }
+        else if (strncmp(cmd, "BLOCK_ALIGN", 11) == 0)
+        {
+            atlas->block_align = 1;
+        }
+        else if (strncmp(cmd, "COMPRESS", 8) == 0)
+        {
+            char format[MAX_NAME] = { 0 };
+            sscanf(line, "COMPRESS %63s", format);
+
+            int found = -1;
+            for (int i = 0; i < TEXTURE_COUNT; ++i)
+            {
+                if (strcmp(format, texture_format_names[i]) == 0)
+                {
+                    found = i;
+                    break;
+                }
+            }
+
+            if (found == -1)
+            {
+                printf("Error: Unknown texture format: %s\n", format);
+                return 0;
+            }
+
+            atlas->texture_format = (texture_format_t) found;
+        }
+        else if (strncmp(cmd, "MIPMAPS", 7) == 0)
+        {
+            // MIPMAPS <levels> [BOX|KAISER]
+            char levels[MAX_NAME] = { 0 };
+            char filter[MAX_NAME] = { 0 };
+            sscanf(line, "MIPMAPS %63s %63s", levels, filter);
+
+            atlas->mip_levels = atoi(levels);
+            if (atlas->mip_levels < 1 || atlas->mip_levels > MAX_MIP_LEVELS)
+            {
+                printf("Error: Mip levels must be between 1 and %d: %s\n", MAX_MIP_LEVELS, levels);
+                return 0;
+            }
+
+            atlas->mip_filter = MIP_BOX;
+            if (filter[0])
+            {
+                int found = -1;
+                for (int i = 0; i < MIP_FILTER_COUNT; ++i)
+                {
+                    if (strcmp(filter, mip_filter_names[i]) == 0)
+                    {
+                        found = i;
+                        break;
+                    }
+                }
+
+                if (found == -1)
+                {
+                    printf("Error: Unknown mip filter: %s\n", filter);
+                    return 0;
+                }
+
+                atlas->mip_filter = (mip_filter_t) found;
+            }
+        }
+        else if (strncmp(cmd, "PREMULTIPLY", 11) == 0)
+        {
+            // PREMULTIPLY [LINEAR|GAMMA]
+            char mode[MAX_NAME] = { 0 };
+            sscanf(line, "PREMULTIPLY %63s", mode);
+
+            if (mode[0] == '\0' || strcmp(mode, "LINEAR") == 0)
+            {
+                atlas->alpha_mode = ALPHA_PREMULTIPLIED;
+            }
+            else if (strcmp(mode, "GAMMA") == 0)
+            {
+                atlas->alpha_mode = ALPHA_PREMULTIPLIED_GAMMA;
+            }
+            else
+            {
+                printf("Error: Unknown premultiply mode: %s\n", mode);
+                return 0;
+            }
+        }
+        else if (strncmp(cmd, "SORT_BY", 7) == 0)
+        {
+            char order[MAX_NAME] = { 0 };
+            sscanf(line, "SORT_BY %63s", order);
+
+            int found = -1;
+            for (int i = 0; i < SORT_COUNT; ++i)
+            {
+                if (strcmp(order, sort_order_names[i]) == 0)
+                {
+                    found = i;
+                    break;
+                }
+            }
+
+            if (found == -1)
+            {
+                printf("Error: Unknown sort order: %s\n", order);
+                return 0;
+            }
+
+            atlas->sort_order = (sort_order_t) found;
+        }
+        else if (strncmp(cmd, "HEURISTIC", 9) == 0)
+        {
+            char heuristic[MAX_NAME] = { 0 };
+            sscanf(line, "HEURISTIC %63s", heuristic);
+
+            int found = -1;
+            for (int i = 0; i <= HEURISTIC_COUNT; ++i)
+            {
+                if (strcmp(heuristic, heuristic_names[i]) == 0)
+                {
+                    found = i;
+                    break;
+                }
+            }
+
+            if (found == -1)
+            {
+                printf("Error: Unknown heuristic: %s\n", heuristic);
+                return 0;
+            }
+
+            atlas->heuristic = (pack_heuristic_t) found;
+        }
+        else if (strncmp(cmd, "FONT", 4) == 0)
+        {
+            // FONT <filename> <size> <charset> <name> [SDF|MSDF [spread]]
+            char* cursor = line;
+            NextToken(&cursor);
+            char* filename = NextToken(&cursor);
+            char* size = NextToken(&cursor);
+            char* charset = NextToken(&cursor);
+            char* name = NextToken(&cursor);
+            char* mode = NextToken(&cursor);
+            char* spread = NextToken(&cursor);
+
+            glyph_mode_t glyph_mode = GLYPH_BITMAP;
+            if (mode && strcmp(mode, "SDF") == 0)
+            {
+                glyph_mode = GLYPH_SDF;
+            }
+            else if (mode && strcmp(mode, "MSDF") == 0)
+            {
+                glyph_mode = GLYPH_MSDF;
+            }
+            else if (mode)
+            {
+                printf("Error: Unknown font mode: %s\n", mode);
+                return 0;
+            }
+
+            if (spread && atoi(spread) <= 0)
+            {
+                printf("Error: Invalid distance field spread: %s\n", spread);
+                return 0;
+            }
+
+            if (name)
+            {
+                atlas->fonts = (font_t*) GrowArray(atlas->fonts, atlas->font_count, &atlas->font_capacity, sizeof(font_t));
+                font_t* font = &atlas->fonts[atlas->font_count++];
+                font->name = CopyString(name);
+                font->filename = CopyString(filename);
+                font->size = atoi(size);
+                font->mode = glyph_mode;
+                font->spread = spread ? atoi(spread) : DEFAULT_SDF_SPREAD;
+                if (!ParseCharset(charset, font))
+                {
+                    return 0;
+                }
+            }
+            else
+            {
+                printf("Error: Invalid font config: %s\n", line);
+                return 0;
+            }
+        }
+        else if (strncmp(cmd, "IMAGE", 5) == 0)
+        {
+            // IMAGE <filename> <name>
+            char* cursor = line;
+            NextToken(&cursor);
+            char* filename = NextToken(&cursor);
+            char* name = NextToken(&cursor);
+
+            if (name)
+            {
+                atlas->images = (image_t*) GrowArray(atlas->images, atlas->image_count, &atlas->image_capacity, sizeof(image_t));
+                image_t* image = &atlas->images[atlas->image_count++];
+                image->name = CopyString(name);
+                image->filename = CopyString(filename);
+            }
+            else
+            {
+                printf("Error: Invalid image format: %s\n", line);
+            }
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    // MSDF glyphs keep distances in RGB, multiplying them by alpha breaks them
+    for (int i = 0; i < atlas->font_count && atlas->alpha_mode != ALPHA_STRAIGHT; ++i)
+    {
+        if (atlas->fonts[i].mode == GLYPH_MSDF)
+        {
+            printf("Error: PREMULTIPLY cannot be used with the MSDF font %s\n", atlas->fonts[i].name);
+            return 0;
+        }
+    }
+
+    // White image
+    atlas->images = (image_t*) GrowArray(atlas->images, atlas->image_count, &atlas->image_capacity, sizeof(image_t));
+    image_t* image = &atlas->images[atlas->image_count++];
+    image->name = CopyString("WHITE");
+    image->width = 4;
+    image->height = 4;
+    image->source_width = 4;
+    image->source_height = 4;
+    image->pixels = 0;
+    
+    return (atlas->font_count > 0 || atlas->image_count > 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Asset loading
+//////////////////////////////////////////////////////////////////////////////
+
+// Returns the first pixel in [start, end) with a non-zero alpha, or end
+INTERNAL int
+FindFirstOpaquePixel(const uint8_t* row, int start, int end)
+{
+    int x = start;
+
+#if defined(SIMD_SSE2)
+    __m128i alpha_mask = _mm_set1_epi32((int) 0xFF000000);
+    for (; x + 4 <= end; x += 4)
+    {
+        __m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i*) (row + x*4)), alpha_mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_setzero_si128())) != 0xFFFF)
+        {
+            break;
+        }
+    }
+#elif defined(SIMD_NEON)
+    uint32x4_t alpha_mask = vdupq_n_u32(0xFF000000);
+    for (; x + 4 <= end; x += 4)
+    {
+        uint32x4_t alpha = vandq_u32(vld1q_u32((const uint32_t*) (row + x*4)), alpha_mask);
+        if (vmaxvq_u32(alpha) != 0)
+        {
+            break;
+        }
+    }
+#endif
+
+    for (; x < end; ++x)
+    {
+        if (row[x*4 + 3])
+        {
+            return x;
+        }
+    }
+
+    return end;
+}
+
+// Returns the last pixel in [start, end) with a non-zero alpha, or start - 1
+INTERNAL int
+FindLastOpaquePixel(const uint8_t* row, int start, int end)
+{
+    int x = end;
+
+#if defined(SIMD_SSE2)
+    __m128i alpha_mask = _mm_set1_epi32((int) 0xFF000000);
+    for (; x - 4 >= start; x -= 4)
+    {
+        __m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i*) (row + (x - 4)*4)), alpha_mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_setzero_si128())) != 0xFFFF)
+        {
+            break;
+        }
+    }
+#elif defined(SIMD_NEON)
+    uint32x4_t alpha_mask = vdupq_n_u32(0xFF000000);
+    for (; x - 4 >= start; x -= 4)
+    {
+        uint32x4_t alpha = vandq_u32(vld1q_u32((const uint32_t*) (row + (x - 4)*4)), alpha_mask);
+        if (vmaxvq_u32(alpha) != 0)
+        {
+            break;
+        }
+    }
+#endif
+
+    for (; x > start; --x)
+    {
+        if (row[(x - 1)*4 + 3])
+        {
+            return x - 1;
+        }
+    }
+
+    return start - 1;
+}
+
+// Shrinks the image to the bounding box of its non-transparent pixels,
+// moving the rows to the front of the pixel buffer. Fully transparent
+// images end up 0x0.
+INTERNAL void
+TrimImage(image_t* image)
+{
+    int width = image->width;
+    int height = image->height;
+    uint8_t* pixels = image->pixels;
+
+    int top = 0;
+    while (top < height && FindFirstOpaquePixel(pixels + top*width*4, 0, width) == width)
+    {
+        top++;
+    }
+
+    if (top == height)
+    {
+        image->width = 0;
+        image->height = 0;
+        return;
+    }
+
+    int bottom = height - 1;
+    while (FindFirstOpaquePixel(pixels + bottom*width*4, 0, width) == width)
+    {
+        bottom--;
+    }
+
+    // Each row only needs scanning outside the columns already known to be kept
+    int min_x = width;
+    int max_x = -1;
+    for (int y = top; y <= bottom; ++y)
+    {
+        const uint8_t* row = pixels + y*width*4;
+        int first = FindFirstOpaquePixel(row, 0, min_x);
+        if (first < min_x)
+        {
+            min_x = first;
+        }
+
+        int last = FindLastOpaquePixel(row, max_x + 1, width);
+        if (last > max_x)
+        {
+            max_x = last;
+        }
+    }
+
+    int trimmed_width = max_x - min_x + 1;
+    int trimmed_height = bottom - top + 1;
+    for (int y = 0; y < trimmed_height; ++y)
+    {
+        memmove(pixels + y*trimmed_width*4, pixels + ((top + y)*width + min_x)*4, trimmed_width*4);
+    }
+
+    image->trim_x = min_x;
+    image->trim_y = top;
+    image->width = trimmed_width;
+    image->height = trimmed_height;
+}
+
+typedef struct
+{
+    image_t* images;
+    bool32_t* loaded;           // Per image
+    bool32_t trim;
+    int* indices;               // Images to load, or 0 for all
+    const image_t* kept;        // Decoded images of the last load, sorted by filename
+    int kept_count;
+} load_images_work_t;
+
+// Decoded and trimmed image as stored in the cache, followed by its pixels
+typedef struct
+{
+    int width, height;
+    int source_width, source_height;
+    int trim_x, trim_y;
+    uint64_t hash;
+} cached_image_t;
+
+INTERNAL bool32_t
+LoadCachedImage(uint64_t key, OUT image_t* image)
+{
+    size_t size;
+    uint8_t* entry = ReadCacheEntry(key, "img", &size);
+    if (!entry)
+    {
+        return 0;
+    }
+
+    cached_image_t cached;
+    memcpy(&cached, entry, size < sizeof(cached) ? size : sizeof(cached));
+    if (size != sizeof(cached) + (size_t) cached.width * cached.height * 4)
+    {
+        free(entry);
+        return 0;
+    }
+
+    // The pixels move to the front, so they can be freed like decoded ones
+    memmove(entry, entry + sizeof(cached), size - sizeof(cached));
+    image->width = cached.width;
+    image->height = cached.height;
+    image->source_width = cached.source_width;
+    image->source_height = cached.source_height;
+    image->trim_x = cached.trim_x;
+    image->trim_y = cached.trim_y;
+    image->hash = cached.hash;
+    image->pixels = entry;
+
+    return 1;
+}
+
+INTERNAL void
+StoreCachedImage(uint64_t key, const image_t* image)
+{
+    cached_image_t cached = {
+        image->width, image->height,
+        image->source_width, image->source_height,
+        image->trim_x, image->trim_y,
+        image->hash,
+    };
+
+    const void* parts[] = { &cached, image->pixels };
+    size_t sizes[] = { sizeof(cached), (size_t) image->width * image->height * 4 };
+    WriteCacheEntry(key, "img", parts, sizes, 2);
+}
+
+INTERNAL int
+CompareImageFilenames(const void* a, const void* b)
+{
+    return strcmp(((const image_t*) a)->filename, ((const image_t*) b)->filename);
+}
+
+// Copies the pixels decoded by the last load when the file still has the
+// stamp it had then. A copy, since the config may list a file twice.
+INTERNAL bool32_t
+CopyKeptImage(const image_t* kept, int kept_count, OUT image_t* image)
+{
+    image_t key = { 0 };
+    key.filename = image->filename;
+    const image_t* found = kept_count ? (const image_t*) bsearch(&key, kept, kept_count, sizeof(image_t), CompareImageFilenames) : 0;
+    if (!found || found->stamp.time != image->stamp.time || found->stamp.size != image->stamp.size)
+    {
+        return 0;
+    }
+
+    size_t size = (size_t) found->width * found->height * 4;
+    image->pixels = (uint8_t*) malloc(size ? size : 1);
+    memcpy(image->pixels, found->pixels, size);
+    image->width = found->width;
+    image->height = found->height;
+    image->source_width = found->source_width;
+    image->source_height = found->source_height;
+    image->trim_x = found->trim_x;
+    image->trim_y = found->trim_y;
+    image->hash = found->hash;
+
+    return 1;
+}
+
+INTERNAL void
+LoadImageWork(void* data, int index)
+{
+    load_images_work_t* work = (load_images_work_t*) data;
+    if (work->indices)
+    {
+        index = work->indices[index];
+    }
+    image_t* image = &work->images[index];
+
+    image->stamp = GetFileStamp(image->filename);
+    if (CopyKeptImage(work->kept, work->kept_count, image))
+    {
+        AtomicIncrement(&global_cache_image_hits);
+        work->loaded[index] = 1;
+        return;
+    }
+
+    size_t file_size;
+    uint8_t* file = ReadEntireFile(image->filename, &file_size);
+    if (!file)
+    {
+        return;
+    }
+
+    uint64_t key = 0;
+    if (global_cache_dir)
+    {
+        key = HashBytes(file, file_size, ((uint64_t) CACHE_VERSION << 32) | work->trim);
+        if (LoadCachedImage(key, image))
+        {
+            AtomicIncrement(&global_cache_image_hits);
+            work->loaded[index] = 1;
+            free(file);
+            return;
+        }
+    }
+
+    work->loaded[index] = LoadImage(file, file_size, image);
+    free(file);
+
+    if (work->loaded[index] && work->trim)
+    {
+        TrimImage(image);
+    }
+
+    if (work->loaded[index])
+    {
+        image->hash = HashBytes(image->pixels, (size_t) image->width * image->height * 4,
+                                ((uint64_t) image->width << 32) | (uint32_t) image->height);
+
+        if (global_cache_dir)
+        {
+            StoreCachedImage(key, image);
+        }
+    }
+}
+
+// Loads every font and image listed by ParseConfig. Images are decoded in
+// parallel; each one lands in its own slot so the order of atlas->images
+// (and therefore the generated sprite ids) matches the config file.
+INTERNAL bool32_t
+LoadAssets(atlas_t* atlas)
+{
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        if (!LoadFont(&atlas->fonts[i]))
+        {
+            printf("Error: Failed to load font: %s\n", atlas->fonts[i].filename);
+            return 0;
+        }
+    }
+
+    // The last image is the generated white sprite, nothing to decode
+    int image_count = atlas->image_count - 1;
+
+    bool32_t* loaded = (bool32_t*) calloc(image_count + 1, sizeof(bool32_t));
+    // Images of the last load are only reused when trimmed the same way
+    bool32_t use_kept = atlas->kept_trim == atlas->trim;
+    load_images_work_t work = { atlas->images, loaded, atlas->trim, 0,
+                                use_kept ? atlas->kept_images : 0, use_kept ? atlas->kept_image_count : 0 };
+    ParallelFor(image_count, LoadImageWork, &work);
+
+    for (int i = 0; i < image_count; ++i)
+    {
+        if (!loaded[i])
+        {
+            printf("Error: Failed to load image: %s\n", atlas->images[i].filename);
+            return 0;
+        }
+    }
+
+    free(loaded);
+
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Max Rects
+//////////////////////////////////////////////////////////////////////////////
+
+// Free rectangles live in insertion order and removed ones are only marked
+// (width == 0) until the next compaction, so slot order always matches the
+// order a plain linear scan would see. Two indices sit on top of the slots:
+//
+// - size classes: slots bucketed by floor(log2(width)) x floor(log2(height)),
+//   so a fit query only visits buckets that can hold the requested size and
+//   skips buckets whose smallest possible leftover is already worse than the
+//   best candidate found.
+// - cells: a coarse grid over the atlas listing the slots overlapping each
+//   cell, so placing a rect only splits the free rects under it.
+// - origin cells: the same grid, but each slot is only listed in the cell
+//   holding its top-left corner, for finding rects inside a given area.
+//
+// Each placement only prunes the free rects its split created, against the
+// rects overlapping them, so the list never fills up with contained rects.
+//
+// Index entries are not removed eagerly; stale slots are dropped the next
+// time a list is walked and everything is rebuilt on compaction.
+
+#define MAXRECTS_SIZE_CLASSES 16
+#define MAXRECTS_GRID_CELLS 32
+#define MAXRECTS_MIN_CELL_SIZE 16
+
+typedef struct 
+{
+    int x, y, width, height;
+} rect_t;
+
+typedef struct
+{
+    int* items;
+    int count;
+    int capacity;
+} index_list_t;
+
+// Size class entries carry a copy of the size so the fit test does not
+// have to touch the rect itself
+typedef struct
+{
+    int slot;
+    int width, height;
+} size_class_entry_t;
+
+typedef struct
+{
+    size_class_entry_t* items;
+    int count;
+    int capacity;
+} size_class_t;
+
+typedef struct
+{
+    rect_t* rects;
+    int count;          // Slots in use, including removed ones
+    int capacity;
+    int free_count;     // Live free rectangles
+
+    size_class_t size_classes[MAXRECTS_SIZE_CLASSES][MAXRECTS_SIZE_CLASSES];
+    index_list_t* cells;
+    index_list_t* origin_cells;
+    int cell_size;
+    int cells_x, cells_y;
+
+    uint32_t* marks;
+    uint32_t mark;
+    int* candidates;
+
+    // Placed rects, only needed to score contact points
+    int width, height;
+    rect_t* used;
+    int used_count;
+    int used_capacity;
+    index_list_t* used_cells;
+    uint32_t* used_marks;
+    uint32_t used_mark;
+} maxrects_t;
+
+INTERNAL void
+IndexListPush(index_list_t* list, int item)
+{
+    if (list->count >= list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = (int*) realloc(list->items, list->capacity * sizeof(int));
+    }
+    list->items[list->count++] = item;
+}
+
+INTERNAL int
+SizeClass(int value)
+{
+    int result = 0;
+    while (value > 1 && result < MAXRECTS_SIZE_CLASSES - 1)
+    {
+        value >>= 1;
+        result++;
+    }
+    return result;
+}
+
+INTERNAL void
+MaxRectsIndexRect(maxrects_t* mr, int slot)
+{
+    rect_t r = mr->rects[slot];
+
+    size_class_t* size_class = &mr->size_classes[SizeClass(r.width)][SizeClass(r.height)];
+    if (size_class->count >= size_class->capacity)
+    {
+        size_class->capacity = size_class->capacity ? size_class->capacity * 2 : 16;
+        size_class->items = (size_class_entry_t*) realloc(size_class->items, size_class->capacity * sizeof(size_class_entry_t));
+    }
+    size_class->items[size_class->count++] = (size_class_entry_t){ slot, r.width, r.height };
+
+    int cx0 = r.x / mr->cell_size;
+    int cy0 = r.y / mr->cell_size;
+    int cx1 = (r.x + r.width - 1) / mr->cell_size;
+    int cy1 = (r.y + r.height - 1) / mr->cell_size;
+
+    for (int cy = cy0; cy <= cy1; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1; ++cx)
+        {
+            IndexListPush(&mr->cells[cy * mr->cells_x + cx], slot);
+        }
+    }
+
+    IndexListPush(&mr->origin_cells[cy0 * mr->cells_x + cx0], slot);
+}
+
+INTERNAL void
+MaxRectsAddRect(maxrects_t* mr, rect_t rect)
+{
+    if (mr->count >= mr->capacity)
+    {
+        mr->capacity *= 2;
+        mr->rects = (rect_t*)realloc(mr->rects, mr->capacity * sizeof(rect_t));
+        mr->marks = (uint32_t*)realloc(mr->marks, mr->capacity * sizeof(uint32_t));
+        mr->candidates = (int*)realloc(mr->candidates, mr->capacity * sizeof(int));
+    }
+
+    int slot = mr->count++;
+    mr->rects[slot] = rect;
+    mr->marks[slot] = 0;
+    mr->free_count++;
+
+    MaxRectsIndexRect(mr, slot);
+}
+
+INTERNAL void
+MaxRectsRemoveRect(maxrects_t* mr, int slot)
+{
+    mr->rects[slot].width = 0;
+    mr->free_count--;
+}
+
+INTERNAL maxrects_t
+CreateMaxRects(int width, int height)
+{
+    maxrects_t result = { 0 };
+    result.capacity = 512;
+    result.rects = (rect_t*) calloc(result.capacity * sizeof(rect_t), 1);
+    result.marks = (uint32_t*) calloc(result.capacity * sizeof(uint32_t), 1);
+    result.candidates = (int*) calloc(result.capacity * sizeof(int), 1);
+
+    int largest_side = width > height ? width : height;
+    result.cell_size = (largest_side + MAXRECTS_GRID_CELLS - 1) / MAXRECTS_GRID_CELLS;
+    if (result.cell_size < MAXRECTS_MIN_CELL_SIZE)
+    {
+        result.cell_size = MAXRECTS_MIN_CELL_SIZE;
+    }
+    result.cells_x = (width + result.cell_size - 1) / result.cell_size;
+    result.cells_y = (height + result.cell_size - 1) / result.cell_size;
+    result.cells = (index_list_t*) calloc(result.cells_x * result.cells_y * sizeof(index_list_t), 1);
+    result.origin_cells = (index_list_t*) calloc(result.cells_x * result.cells_y * sizeof(index_list_t), 1);
+
+    result.width = width;
+    result.height = height;
+    result.used_capacity = 512;
+    result.used = (rect_t*) calloc(result.used_capacity * sizeof(rect_t), 1);
+    result.used_marks = (uint32_t*) calloc(result.used_capacity * sizeof(uint32_t), 1);
+    result.used_cells = (index_list_t*) calloc(result.cells_x * result.cells_y * sizeof(index_list_t), 1);
+
+    MaxRectsAddRect(&result, (rect_t){0, 0, width, height});
+
+    return result;
+}
+
+INTERNAL void
+FreeMaxRects(maxrects_t* mr)
+{
+    for (int i = 0; i < MAXRECTS_SIZE_CLASSES; ++i)
+    {
+        for (int j = 0; j < MAXRECTS_SIZE_CLASSES; ++j)
+        {
+            free(mr->size_classes[i][j].items);
+        }
+    }
+
+    for (int i = 0; i < mr->cells_x * mr->cells_y; ++i)
+    {
+        free(mr->cells[i].items);
+        free(mr->origin_cells[i].items);
+        free(mr->used_cells[i].items);
+    }
+
+    free(mr->cells);
+    free(mr->origin_cells);
+    free(mr->used_cells);
+    free(mr->used_marks);
+    free(mr->used);
+    free(mr->candidates);
+    free(mr->marks);
+    free(mr->rects);
+}
+
+// Drops removed slots, keeping the live ones in order, and rebuilds the
+// indices. Only called between placements, never while a list is walked.
+INTERNAL void
+MaxRectsCompact(maxrects_t* mr)
+{
+    int count = 0;
+    for (int i = 0; i < mr->count; ++i)
+    {
+        if (mr->rects[i].width > 0)
+        {
+            mr->rects[count++] = mr->rects[i];
+        }
+    }
+    mr->count = count;
+
+    for (int i = 0; i < MAXRECTS_SIZE_CLASSES; ++i)
+    {
+        for (int j = 0; j < MAXRECTS_SIZE_CLASSES; ++j)
+        {
+            mr->size_classes[i][j].count = 0;
+        }
+    }
+
+    for (int i = 0; i < mr->cells_x * mr->cells_y; ++i)
+    {
+        mr->cells[i].count = 0;
+        mr->origin_cells[i].count = 0;
+    }
+
+    for (int i = 0; i < mr->count; ++i)
+    {
+        mr->marks[i] = 0;
+        MaxRectsIndexRect(mr, i);
+    }
+    mr->mark = 0;
+}
+
+INTERNAL int
+IntervalOverlap(int a0, int a1, int b0, int b1)
+{
+    int start = a0 > b0 ? a0 : b0;
+    int end = a1 < b1 ? a1 : b1;
+    return end > start ? end - start : 0;
+}
+
+// Length of the rect's perimeter touching the atlas border or placed rects
+INTERNAL int
+MaxRectsContactScore(maxrects_t* mr, int x, int y, int width, int height)
+{
+    int score = 0;
+
+    if (x == 0 || x + width == mr->width)
+    {
+        score += height;
+    }
+    if (y == 0 || y + height == mr->height)
+    {
+        score += width;
+    }
+
+    // Neighbours touching an edge overlap the rect grown by one pixel
+    int cx0 = (x > 0 ? x - 1 : 0) / mr->cell_size;
+    int cy0 = (y > 0 ? y - 1 : 0) / mr->cell_size;
+    int cx1 = (x + width) / mr->cell_size;
+    int cy1 = (y + height) / mr->cell_size;
+
+    mr->used_mark++;
+    for (int cy = cy0; cy <= cy1 && cy < mr->cells_y; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1 && cx < mr->cells_x; ++cx)
+        {
+            index_list_t* cell = &mr->used_cells[cy * mr->cells_x + cx];
+            for (int k = 0; k < cell->count; ++k)
+            {
+                int index = cell->items[k];
+                if (mr->used_marks[index] == mr->used_mark)
+                {
+                    continue;
+                }
+                mr->used_marks[index] = mr->used_mark;
+
+                rect_t u = mr->used[index];
+                if (u.x == x + width || u.x + u.width == x)
+                {
+                    score += IntervalOverlap(u.y, u.y + u.height, y, y + height);
+                }
+                if (u.y == y + height || u.y + u.height == y)
+                {
+                    score += IntervalOverlap(u.x, u.x + u.width, x, x + width);
+                }
+            }
+        }
+    }
+
+    return score;
+}
+
+// Scores placing a width x height rect at the top-left of a free rect,
+// lower is better, score_a first and score_b on ties
+INTERNAL void
+MaxRectsScorePosition(maxrects_t* mr, pack_heuristic_t heuristic, rect_t r, int width, int height,
+                      OUT int* score_a, OUT int* score_b)
+{
+    int leftover_width = r.width - width;
+    int leftover_height = r.height - height;
+    int short_side = leftover_height < leftover_width ? leftover_height : leftover_width;
+    int long_side = leftover_height > leftover_width ? leftover_height : leftover_width;
+
+    switch (heuristic)
+    {
+        case HEURISTIC_LONG_SIDE_FIT:
+        {
+            *score_a = long_side;
+            *score_b = short_side;
+        } break;
+
+        case HEURISTIC_AREA_FIT:
+        {
+            *score_a = r.width * r.height - width * height;
+            *score_b = short_side;
+        } break;
+
+        case HEURISTIC_BOTTOM_LEFT:
+        {
+            *score_a = r.y + height;
+            *score_b = r.x;
+        } break;
+
+        case HEURISTIC_CONTACT_POINT:
+        {
+            *score_a = -MaxRectsContactScore(mr, r.x, r.y, width, height);
+            *score_b = r.y;
+        } break;
+
+        default:
+        {
+            *score_a = short_side;
+            *score_b = long_side;
+        } break;
+    }
+}
+
+// Lowest score_a any free rect in a size class can reach, used to skip
+// whole classes. Position based heuristics cannot be bounded by size.
+INTERNAL int
+SizeClassLowerBound(pack_heuristic_t heuristic, int cw, int ch, int width, int height)
+{
+    int min_leftover_width = (1 << cw) - width;
+    int min_leftover_height = (1 << ch) - height;
+    if (min_leftover_width < 0)
+    {
+        min_leftover_width = 0;
+    }
+    if (min_leftover_height < 0)
+    {
+        min_leftover_height = 0;
+    }
+
+    switch (heuristic)
+    {
+        case HEURISTIC_SHORT_SIDE_FIT:
+        {
+            return min_leftover_height < min_leftover_width ? min_leftover_height : min_leftover_width;
+        }
+
+        case HEURISTIC_LONG_SIDE_FIT:
+        {
+            return min_leftover_height > min_leftover_width ? min_leftover_height : min_leftover_width;
+        }
+
+        case HEURISTIC_AREA_FIT:
+        {
+            int min_area_fit = (1 << cw) * (1 << ch) - width * height;
+            return min_area_fit > 0 ? min_area_fit : 0;
+        }
+
+        default:
+        {
+            return INT_MIN;
+        }
+    }
+}
+
+INTERNAL int
+MaxRectsFindBest(maxrects_t* mr, pack_heuristic_t heuristic, int width, int height,
+                 OUT int* x, OUT int* y, OUT int* score_a_out, OUT int* score_b_out)
+{
+    int best_score_a = INT_MAX;
+    int best_score_b = INT_MAX;
+    int best_index = -1;
+
+    for (int cw = SizeClass(width); cw < MAXRECTS_SIZE_CLASSES; ++cw)
+    {
+        for (int ch = SizeClass(height); ch < MAXRECTS_SIZE_CLASSES; ++ch)
+        {
+            if (SizeClassLowerBound(heuristic, cw, ch, width, height) > best_score_a)
+            {
+                continue;
+            }
+
+            size_class_t* list = &mr->size_classes[cw][ch];
+            int kept = 0;
+
+            for (int k = 0; k < list->count; ++k)
+            {
+                size_class_entry_t entry = list->items[k];
+
+                if (entry.width >= width && entry.height >= height)
+                {
+                    if (mr->rects[entry.slot].width == 0)
+                    {
+                        continue;
+                    }
+
+                    int score_a, score_b;
+                    MaxRectsScorePosition(mr, heuristic, mr->rects[entry.slot], width, height, &score_a, &score_b);
+
+                    // Ties go to the oldest rect, same as a scan in slot order
+                    if (score_a < best_score_a ||
+                        (score_a == best_score_a && score_b < best_score_b) ||
+                        (score_a == best_score_a && score_b == best_score_b && entry.slot < best_index))
+                    {
+                        best_score_a = score_a;
+                        best_score_b = score_b;
+                        best_index = entry.slot;
+                    }
+                }
+
+                list->items[kept++] = entry;
+            }
+
+            list->count = kept;
+        }
+    }
+
+    if (best_index != -1)
+    {
+        *x = mr->rects[best_index].x;
+        *y = mr->rects[best_index].y;
+    }
+
+    *score_a_out = best_score_a;
+    *score_b_out = best_score_b;
+
+    return best_index;
+}
+
+// Also tries the rect turned 90 degrees when allowed; the turned
+// orientation is only used when it scores strictly better
+INTERNAL int
+MaxRectsFindPositionRotated(maxrects_t* mr, pack_heuristic_t heuristic, int width, int height,
+                            bool32_t allow_rotation, OUT int* x, OUT int* y, OUT bool32_t* rotated)
+{
+    int score_a, score_b;
+    int index = MaxRectsFindBest(mr, heuristic, width, height, x, y, &score_a, &score_b);
+    *rotated = 0;
+
+    if (allow_rotation && width != height)
+    {
+        int rotated_x, rotated_y, rotated_score_a, rotated_score_b;
+        int rotated_index = MaxRectsFindBest(mr, heuristic, height, width, &rotated_x, &rotated_y,
+                                             &rotated_score_a, &rotated_score_b);
+
+        if (rotated_index != -1 &&
+            (index == -1 || rotated_score_a < score_a ||
+             (rotated_score_a == score_a && rotated_score_b < score_b)))
+        {
+            *x = rotated_x;
+            *y = rotated_y;
+            *rotated = 1;
+            index = rotated_index;
+        }
+    }
+
+    return index;
+}
+
+INTERNAL bool32_t
+RectContains(rect_t a, rect_t b)
+{
+    return a.x <= b.x &&
+           a.y <= b.y &&
+           (a.x + a.width) >= (b.x + b.width) &&
+           (a.y + a.height) >= (b.y + b.height);
+}
+
+INTERNAL bool32_t
+RectIntersects(rect_t a, rect_t b)
+{
+    return !(a.x >= b.x + b.width ||
+             a.x + a.width <= b.x ||
+             a.y >= b.y + b.height ||
+             a.y + a.height <= b.y);
+}
+
+INTERNAL void
+MaxRectsSplitFreeRect(maxrects_t* mr, int index, int x, int y, int width, int height)
+{
+    rect_t free_rect = mr->rects[index];
+
+    MaxRectsRemoveRect(mr, index);
+
+    rect_t new_rects[4];
+    int new_count = 0;
+
+    // Top
+    if (y > free_rect.y)
+    {
+        new_rects[new_count++] = (rect_t){
+            free_rect.x, free_rect.y,
+            free_rect.width, y - free_rect.y
+        };
+    }
+
+    // Bottom
+    if (y + height < free_rect.y + free_rect.height)
+    {
+        new_rects[new_count++] = (rect_t){
+            free_rect.x, y + height,
+            free_rect.width, free_rect.y + free_rect.height - (y + height)
+        };
+    }
+    
+    // Left
+    if (x > free_rect.x)
+    {
+        new_rects[new_count++] = (rect_t){
+            free_rect.x, free_rect.y,
+            x - free_rect.x, free_rect.height
+        };
+    }
+    
+    // Right
+    if (x + width < free_rect.x + free_rect.width)
+    {
+        new_rects[new_count++] = (rect_t){
+            x + width, free_rect.y,
+            free_rect.x + free_rect.width - (x + width), free_rect.height
+        };
+    }
+
+    // Add new rectangles, removing those that are contained by others
+    for (int i = 0; i < new_count; i++)
+    {
+        bool32_t contained = 0;
+        
+        // Check if this rect is contained by any other new rect
+        for (int j = 0; j < new_count; j++)
+        {
+            if (i != j && RectContains(new_rects[j], new_rects[i]))
+            {
+                contained = 1;
+                break;
+            }
+        }
+        
+        if (!contained)
+        {
+            MaxRectsAddRect(mr, new_rects[i]);
+        }
+    }
+}
+
+INTERNAL int
+CompareInts(const void* a, const void* b)
+{
+    int ia = *(const int*) a;
+    int ib = *(const int*) b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Collects the live free rects overlapping area into mr->candidates, in
+// slot order, and returns how many there are
+INTERNAL int
+MaxRectsGatherOverlapping(maxrects_t* mr, rect_t area)
+{
+    int candidate_count = 0;
+    mr->mark++;
+
+    int cx0 = area.x / mr->cell_size;
+    int cy0 = area.y / mr->cell_size;
+    int cx1 = (area.x + area.width - 1) / mr->cell_size;
+    int cy1 = (area.y + area.height - 1) / mr->cell_size;
+
+    for (int cy = cy0; cy <= cy1 && cy < mr->cells_y; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1 && cx < mr->cells_x; ++cx)
+        {
+            index_list_t* cell = &mr->cells[cy * mr->cells_x + cx];
+            int kept = 0;
+
+            for (int k = 0; k < cell->count; ++k)
+            {
+                int slot = cell->items[k];
+                if (mr->rects[slot].width == 0)
+                {
+                    continue;
+                }
+                cell->items[kept++] = slot;
+
+                if (mr->marks[slot] != mr->mark && RectIntersects(area, mr->rects[slot]))
+                {
+                    mr->marks[slot] = mr->mark;
+                    mr->candidates[candidate_count++] = slot;
+                }
+            }
+
+            cell->count = kept;
+        }
+    }
+
+    qsort(mr->candidates, candidate_count, sizeof(int), CompareInts);
+
+    return candidate_count;
+}
+
+INTERNAL bool32_t
+MaxRectsIsContained(maxrects_t* mr, int slot)
+{
+    // Any rect containing this one also covers its top-left corner
+    rect_t rect = mr->rects[slot];
+    index_list_t* cell = &mr->cells[(rect.y / mr->cell_size) * mr->cells_x + (rect.x / mr->cell_size)];
+
+    for (int k = 0; k < cell->count; ++k)
+    {
+        int other = cell->items[k];
+        if (other != slot && mr->rects[other].width > 0 && RectContains(mr->rects[other], rect))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+INTERNAL void
+MaxRectsRemoveContainedBy(maxrects_t* mr, int slot)
+{
+    // Rects inside this one have their top-left corner inside it too
+    rect_t rect = mr->rects[slot];
+    int cx0 = rect.x / mr->cell_size;
+    int cy0 = rect.y / mr->cell_size;
+    int cx1 = (rect.x + rect.width - 1) / mr->cell_size;
+    int cy1 = (rect.y + rect.height - 1) / mr->cell_size;
+
+    for (int cy = cy0; cy <= cy1 && cy < mr->cells_y; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1 && cx < mr->cells_x; ++cx)
+        {
+            index_list_t* cell = &mr->origin_cells[cy * mr->cells_x + cx];
+            int kept = 0;
+
+            for (int k = 0; k < cell->count; ++k)
+            {
+                int other = cell->items[k];
+                if (mr->rects[other].width == 0)
+                {
+                    continue;
+                }
+
+                if (other != slot && RectContains(rect, mr->rects[other]))
+                {
+                    MaxRectsRemoveRect(mr, other);
+                    continue;
+                }
+
+                cell->items[kept++] = other;
+            }
+
+            cell->count = kept;
+        }
+    }
+}
+
+// Removes redundant rects after a placement. The free list holds no
+// contained rects before the split, so only the rects it created need to
+// be checked, and only against the rects around them.
+INTERNAL void
+MaxRectsPruneNewRects(maxrects_t* mr, int first_new)
+{
+    for (int n = first_new; n < mr->count; ++n)
+    {
+        if (mr->rects[n].width == 0)
+        {
+            continue;
+        }
+
+        if (MaxRectsIsContained(mr, n))
+        {
+            MaxRectsRemoveRect(mr, n);
+        }
+        else
+        {
+            MaxRectsRemoveContainedBy(mr, n);
+        }
+    }
+}
+
+// Records a placed rect and indexes it in the grid cells it covers
+INTERNAL void
+MaxRectsAddUsedRect(maxrects_t* mr, rect_t rect)
+{
+    if (mr->used_count >= mr->used_capacity)
+    {
+        mr->used_capacity *= 2;
+        mr->used = (rect_t*)realloc(mr->used, mr->used_capacity * sizeof(rect_t));
+        mr->used_marks = (uint32_t*)realloc(mr->used_marks, mr->used_capacity * sizeof(uint32_t));
+    }
+
+    int index = mr->used_count++;
+    mr->used[index] = rect;
+    mr->used_marks[index] = 0;
+
+    int cx0 = rect.x / mr->cell_size;
+    int cy0 = rect.y / mr->cell_size;
+    int cx1 = (rect.x + rect.width - 1) / mr->cell_size;
+    int cy1 = (rect.y + rect.height - 1) / mr->cell_size;
+
+    for (int cy = cy0; cy <= cy1; ++cy)
+    {
+        for (int cx = cx0; cx <= cx1; ++cx)
+        {
+            IndexListPush(&mr->used_cells[cy * mr->cells_x + cx], index);
+        }
+    }
+}
+
+// Splits every free rect overlapping the placed rect, in slot order, and
+// prunes the pieces that ended up inside other free rects
+INTERNAL void
+MaxRectsPlaceRect(maxrects_t* mr, rect_t placed)
+{
+    MaxRectsAddUsedRect(mr, placed);
+
+    int first_new = mr->count;
+    int candidate_count = MaxRectsGatherOverlapping(mr, placed);
+
+    // New rects never overlap the placed one, so they are not in the list
+    for (int i = 0; i < candidate_count; ++i)
+    {
+        MaxRectsSplitFreeRect(mr, mr->candidates[i], placed.x, placed.y, placed.width, placed.height);
+    }
+
+    MaxRectsPruneNewRects(mr, first_new);
+}
+
+INTERNAL void
+MaxRectsCompactIfSparse(maxrects_t* mr)
+{
+    int removed = mr->count - mr->free_count;
+    if (removed > 256 && removed > mr->free_count)
+    {
+        MaxRectsCompact(mr);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Create atlas
+//////////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+    TYPE_IMAGE,
+    TYPE_GLYPH,
+} rect_type_t;
+
+typedef struct
+{
+    int width, height;
+    int original_index;
+    void* user_data;
+    rect_type_t type; // 0=white, 1=image, 2=glyph
+    int order;        // Position in the collected list, breaks sort ties
+    uint64_t sort_key;
+    int x, y;         // Packed position, including padding
+    int page;
+    bool32_t can_rotate;
+    bool32_t rotated; // Turned 90 degrees clockwise, width and height are swapped
+} packed_rect_t;
+
+INTERNAL uint64_t
+RectSortKey(sort_order_t sort_order, int width, int height)
+{
+    uint64_t w = (uint64_t) width;
+    uint64_t h = (uint64_t) height;
+    uint64_t max_side = w > h ? w : h;
+    uint64_t min_side = w > h ? h : w;
+
+    switch (sort_order)
+    {
+        case SORT_MAX_SIDE:  return (max_side << 32) | min_side;
+        case SORT_PERIMETER: return ((w + h) << 32) | (w * h);
+        case SORT_HEIGHT:    return (h << 32) | w;
+        default:             return w * h;
+    }
+}
+
+// Largest key first, ties keep the order the rects were collected in so
+// the packing is the same on every run
+INTERNAL int
+ComparePackedRects(const void* a, const void* b)
+{
+    const packed_rect_t* ra = (const packed_rect_t*) a;
+    const packed_rect_t* rb = (const packed_rect_t*) b;
+
+    if (ra->sort_key != rb->sort_key)
+    {
+        return ra->sort_key > rb->sort_key ? -1 : 1;
+    }
+
+    return (ra->order > rb->order) - (ra->order < rb->order);
+}
+
+typedef struct
+{
+    font_t* fonts;
+    packed_glyph_t* glyphs;
+} rasterize_glyphs_work_t;
+
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    pack_heuristic_t heuristic;
+    sort_order_t sort_order;
+    packed_rect_t* rects;       // Own copy, in packing order
+    bool32_t packed;
+    int width, height;
+    int page_count;
+    int used_width, used_height;
+} pack_attempt_t;
+
+typedef struct
+{
+    pack_attempt_t* attempts;
+    const packed_rect_t* rects;
+    int rect_count;
+    int width, height;
+} pack_work_t;
+
+// Packs a copy of the rects into a width x height bin. Leaves the rects in
+// packing order with their positions filled in.
+INTERNAL void
+PackRects(pack_attempt_t* attempt, const packed_rect_t* source, int count, int width, int height)
+{
+    packed_rect_t* rects = (packed_rect_t*) calloc(count ? count : 1, sizeof(packed_rect_t));
+    memcpy(rects, source, count * sizeof(packed_rect_t));
+    attempt->rects = rects;
+    attempt->packed = 0;
+    attempt->width = width;
+    attempt->height = height;
+    attempt->page_count = 1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        rects[i].order = i;
+        rects[i].sort_key = RectSortKey(attempt->sort_order, rects[i].width, rects[i].height);
+    }
+
+    qsort(rects, count, sizeof(packed_rect_t), ComparePackedRects);
+
+    maxrects_t maxrects = CreateMaxRects(width, height);
+    int used_width = 0, used_height = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        int x, y;
+        bool32_t rotated;
+        int best_index = MaxRectsFindPositionRotated(&maxrects, attempt->heuristic, rects[i].width, rects[i].height,
+                                                     rects[i].can_rotate, &x, &y, &rotated);
+
+        if (best_index == -1)
+        {
+            FreeMaxRects(&maxrects);
+            return;
+        }
+
+        if (rotated)
+        {
+            int temp = rects[i].width;
+            rects[i].width = rects[i].height;
+            rects[i].height = temp;
+            rects[i].rotated = !rects[i].rotated;
+        }
+
+        rects[i].x = x;
+        rects[i].y = y;
+        rects[i].page = 0;
+
+        if (x + rects[i].width > used_width)
+        {
+            used_width = x + rects[i].width;
+        }
+        if (y + rects[i].height > used_height)
+        {
+            used_height = y + rects[i].height;
+        }
+
+        // Split the free rectangle
+        rect_t placed = {x, y, rects[i].width, rects[i].height};
+        MaxRectsPlaceRect(&maxrects, placed);
+        MaxRectsCompactIfSparse(&maxrects);
+    }
+
+    FreeMaxRects(&maxrects);
+
+    attempt->packed = 1;
+    attempt->used_width = used_width;
+    attempt->used_height = used_height;
+}
+
+INTERNAL void
+PackWork(void* data, int index)
+{
+    pack_work_t* work = (pack_work_t*) data;
+    PackRects(&work->attempts[index], work->rects, work->rect_count, work->width, work->height);
+}
+
+// Picks the attempt whose placed rects cover the smallest bounding box,
+// earlier attempts win ties. Returns -1 when nothing fit.
+INTERNAL int
+SelectDensestAttempt(pack_attempt_t* attempts, int count)
+{
+    int best = -1;
+    long long best_area = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (!attempts[i].packed)
+        {
+            continue;
+        }
+
+        long long area = (long long) attempts[i].used_width * attempts[i].used_height;
+        if (best == -1 || area < best_area)
+        {
+            best = i;
+            best_area = area;
+        }
+    }
+
+    return best;
+}
+
+// Packs with the given heuristic and sort order, or with every combination
+// for HEURISTIC_BEST, keeping the densest result. Combinations run on the
+// worker pool when parallel is set.
+INTERNAL bool32_t
+PackAtlas(pack_heuristic_t heuristic, sort_order_t sort_order, const packed_rect_t* rects, int count,
+          int width, int height, bool32_t parallel, OUT pack_attempt_t* result)
+{
+    int attempt_count = 1;
+    pack_attempt_t attempts[HEURISTIC_COUNT * SORT_COUNT] = { 0 };
+
+    if (heuristic == HEURISTIC_BEST)
+    {
+        attempt_count = 0;
+        for (int h = 0; h < HEURISTIC_COUNT; ++h)
+        {
+            for (int o = 0; o < SORT_COUNT; ++o)
+            {
+                attempts[attempt_count].heuristic = (pack_heuristic_t) h;
+                attempts[attempt_count].sort_order = (sort_order_t) o;
+                attempt_count++;
+            }
+        }
+    }
+    else
+    {
+        attempts[0].heuristic = heuristic;
+        attempts[0].sort_order = sort_order;
+    }
+
+    pack_work_t work = { attempts, rects, count, width, height };
+    if (parallel)
+    {
+        ParallelFor(attempt_count, PackWork, &work);
+    }
+    else
+    {
+        for (int i = 0; i < attempt_count; ++i)
+        {
+            PackWork(&work, i);
+        }
+    }
+
+    int best = SelectDensestAttempt(attempts, attempt_count);
+    for (int i = 0; i < attempt_count; ++i)
+    {
+        if (i != best)
+        {
+            free(attempts[i].rects);
+        }
+    }
+
+    if (best == -1)
+    {
+        return 0;
+    }
+
+    *result = attempts[best];
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Atlas size search
+//////////////////////////////////////////////////////////////////////////////
+
+// Packing only needs the rect sizes, so every candidate size reuses the
+// same decoded images and rasterized glyphs. Candidates run on the worker
+// pool: a square atlas probes several sides per round (a k-ary search), a
+// non-square one searches the smallest height for a spread of widths.
+
+#define SIZE_SEARCH_WIDTHS 32
+#define SIZE_SEARCH_STEP 4
+
+typedef struct
+{
+    const atlas_t* atlas;
+    const packed_rect_t* rects;
+    int rect_count;
+    const int* sides;           // Candidate sides, ascending
+    int side_count;
+    int min_height;
+    int* widths;
+    pack_attempt_t* results;
+} size_search_work_t;
+
+INTERNAL int
+NextPowerOfTwo(int value)
+{
+    int result = 1;
+    while (result < value)
+    {
+        result <<= 1;
+    }
+    return result;
+}
+
+// Lists the allowed sides from min_side to max_size: powers of two, or
+// multiples of SIZE_SEARCH_STEP
+INTERNAL int*
+ListCandidateSides(const atlas_t* atlas, int min_side, OUT int* count)
+{
+    int capacity = atlas->max_size / SIZE_SEARCH_STEP + 32;
+    int* sides = (int*) calloc(capacity, sizeof(int));
+    *count = 0;
+
+    if (atlas->power_of_two)
+    {
+        for (int side = NextPowerOfTwo(min_side); side <= atlas->max_size; side <<= 1)
+        {
+            sides[(*count)++] = side;
+        }
+    }
+    else
+    {
+        int first = (min_side + SIZE_SEARCH_STEP - 1) / SIZE_SEARCH_STEP * SIZE_SEARCH_STEP;
+        for (int side = first; side <= atlas->max_size; side += SIZE_SEARCH_STEP)
+        {
+            sides[(*count)++] = side;
+        }
+    }
+
+    return sides;
+}
+
+INTERNAL void
+ProbeSquareWork(void* data, int index)
+{
+    size_search_work_t* work = (size_search_work_t*) data;
+    int side = work->widths[index];
+
+    PackAtlas(work->atlas->heuristic, work->atlas->sort_order, work->rects, work->rect_count,
+              side, side, 0, &work->results[index]);
+}
+
+// Binary searches the smallest candidate height that fits widths[index]
+INTERNAL void
+FitHeightWork(void* data, int index)
+{
+    size_search_work_t* work = (size_search_work_t*) data;
+    int width = work->widths[index];
+
+    int lo = 0;
+    int hi = work->side_count;
+    while (lo < work->side_count && work->sides[lo] < work->min_height)
+    {
+        lo++;
+    }
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        pack_attempt_t attempt = { 0 };
+
+        if (PackAtlas(work->atlas->heuristic, work->atlas->sort_order, work->rects, work->rect_count,
+                      width, work->sides[mid], 0, &attempt))
+        {
+            free(work->results[index].rects);
+            work->results[index] = attempt;
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+}
+
+INTERNAL bool32_t
+FindSmallestAtlas(const atlas_t* atlas, const packed_rect_t* rects, int count, OUT pack_attempt_t* result)
+{
+    long long total_area = 0;
+    int max_width = 1, max_height = 1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        total_area += (long long) rects[i].width * rects[i].height;
+        max_width = rects[i].width > max_width ? rects[i].width : max_width;
+        max_height = rects[i].height > max_height ? rects[i].height : max_height;
+    }
+
+    int min_side = (int) ceil(sqrt((double) total_area));
+    int max_dim = max_width > max_height ? max_width : max_height;
+    int side_count;
+    int square_min = min_side > max_dim ? min_side : max_dim;
+    int* sides = ListCandidateSides(atlas, atlas->non_square ? 1 : square_min, &side_count);
+
+    int probe_count = global_thread_count > 2 ? global_thread_count : 2;
+    int* widths = (int*) calloc(probe_count > SIZE_SEARCH_WIDTHS ? probe_count : SIZE_SEARCH_WIDTHS, sizeof(int));
+    pack_attempt_t* results = (pack_attempt_t*) calloc(probe_count > SIZE_SEARCH_WIDTHS ? probe_count : SIZE_SEARCH_WIDTHS,
+                                                       sizeof(pack_attempt_t));
+    bool32_t found = 0;
+
+    size_search_work_t work = { atlas, rects, count, sides, side_count, 0, widths, results };
+
+    if (atlas->non_square)
+    {
+        // Widths between the narrowest that can hold the content within
+        // max_size and a generous multiple of the square side
+        int min_width = (int) ((total_area + atlas->max_size - 1) / atlas->max_size);
+        min_width = min_width > max_width ? min_width : max_width;
+        int max_width_candidate = 2 * min_side + max_width;
+        max_width_candidate = max_width_candidate < atlas->max_size ? max_width_candidate : atlas->max_size;
+
+        // Powers of two can all fall outside that range, so it always reaches
+        // the first allowed width
+        for (int i = 0; i < side_count; ++i)
+        {
+            if (sides[i] >= min_width)
+            {
+                max_width_candidate = sides[i] > max_width_candidate ? sides[i] : max_width_candidate;
+                break;
+            }
+        }
+
+        // Spread the widths evenly over the range when there are many
+        int step = (max_width_candidate - min_width) / SIZE_SEARCH_WIDTHS;
+        int width_count = 0;
+
+        for (int i = 0; i < side_count && width_count < SIZE_SEARCH_WIDTHS; ++i)
+        {
+            int side = sides[i];
+            if (side < min_width || side > max_width_candidate)
+            {
+                continue;
+            }
+
+            if (width_count > 0 && side - widths[width_count - 1] < step)
+            {
+                continue;
+            }
+
+            widths[width_count++] = side;
+        }
+
+        work.min_height = max_height;
+        ParallelFor(width_count, FitHeightWork, &work);
+
+        // Smallest area wins, then the squarer atlas
+        int best = -1;
+        for (int i = 0; i < width_count; ++i)
+        {
+            if (!results[i].packed)
+            {
+                continue;
+            }
+
+            long long area = (long long) results[i].width * results[i].height;
+            if (best == -1)
+            {
+                best = i;
+                continue;
+            }
+
+            long long best_area = (long long) results[best].width * results[best].height;
+            int long_side = results[i].width > results[i].height ? results[i].width : results[i].height;
+            int best_long_side = results[best].width > results[best].height ? results[best].width : results[best].height;
+
+            if (area < best_area || (area == best_area && long_side < best_long_side))
+            {
+                best = i;
+            }
+        }
+
+        for (int i = 0; i < width_count; ++i)
+        {
+            if (i != best)
+            {
+                free(results[i].rects);
+            }
+        }
+
+        if (best != -1)
+        {
+            *result = results[best];
+            found = 1;
+        }
+    }
+
+    // Also the fallback when no width packs
+    if (!found)
+    {
+        // The answer is the first fitting side in [lo, hi)
+        int lo = 0;
+        int hi = side_count;
+        while (lo < hi && sides[lo] < square_min)
+        {
+            lo++;
+        }
+
+        while (lo < hi)
+        {
+            int probes = probe_count < hi - lo ? probe_count : hi - lo;
+            int probe_index[MAX_THREADS + 2];
+
+            for (int j = 0; j < probes; ++j)
+            {
+                probe_index[j] = lo + ((hi - lo - 1) * (j + 1)) / probes;
+                widths[j] = sides[probe_index[j]];
+                results[j] = (pack_attempt_t){ 0 };
+            }
+
+            ParallelFor(probes, ProbeSquareWork, &work);
+
+            int first_fit = -1;
+            for (int j = 0; j < probes; ++j)
+            {
+                if (first_fit == -1 && results[j].packed)
+                {
+                    first_fit = j;
+                }
+                else if (results[j].packed)
+                {
+                    free(results[j].rects);
+                }
+            }
+
+            if (first_fit == -1)
+            {
+                lo = probe_index[probes - 1] + 1;
+                continue;
+            }
+
+            if (found)
+            {
+                free(result->rects);
+            }
+            *result = results[first_fit];
+            found = 1;
+
+            hi = probe_index[first_fit];
+            lo = first_fit > 0 ? probe_index[first_fit - 1] + 1 : lo;
+        }
+    }
+
+    free(results);
+    free(widths);
+    free(sides);
+
+    return found;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Pages
+//////////////////////////////////////////////////////////////////////////////
+
+// Used when the content does not fit in one atlas. Each font is kept on a
+// single page when possible, so text never switches textures mid-string:
+// fonts, largest first, go to the first page they can be repacked into
+// together with what is already there. Images (and any font too large for
+// a page) then fill the remaining space first-fit, page by page.
+
+typedef struct
+{
+    int* items;                 // Indices into the source rects
+    int item_count;
+    pack_attempt_t layout;
+    maxrects_t maxrects;
+} page_t;
+
+typedef struct
+{
+    int font_index;
+    long long area;
+} font_group_t;
+
+INTERNAL int
+RectFontIndex(const packed_rect_t* rect)
+{
+    if (rect->type != TYPE_GLYPH)
+    {
+        return -1;
+    }
+    return ((const packed_glyph_t*) rect->user_data)->font_index;
+}
+
+INTERNAL int
+CompareFontGroups(const void* a, const void* b)
+{
+    const font_group_t* ga = (const font_group_t*) a;
+    const font_group_t* gb = (const font_group_t*) b;
+
+    if (ga->area != gb->area)
+    {
+        return ga->area > gb->area ? -1 : 1;
+    }
+    return (ga->font_index > gb->font_index) - (ga->font_index < gb->font_index);
+}
+
+// Packs the page's items plus the extra ones; replaces the page layout and
+// item list when everything fits
+INTERNAL bool32_t
+TryRepackPage(page_t* page, const packed_rect_t* rects, const int* extra, int extra_count,
+              pack_heuristic_t heuristic, sort_order_t sort_order, int width, int height)
+{
+    int count = page->item_count + extra_count;
+    int* items = (int*) calloc(count, sizeof(int));
+    packed_rect_t* candidate = (packed_rect_t*) calloc(count, sizeof(packed_rect_t));
+
+    if (page->item_count)
+    {
+        memcpy(items, page->items, page->item_count * sizeof(int));
+    }
+    memcpy(items + page->item_count, extra, extra_count * sizeof(int));
+    for (int i = 0; i < count; ++i)
+    {
+        candidate[i] = rects[items[i]];
+        candidate[i].original_index = i; // Back to the page item
+    }
+
+    pack_attempt_t layout = { 0 };
+    bool32_t packed = PackAtlas(heuristic, sort_order, candidate, count, width, height, 1, &layout);
+    free(candidate);
+
+    if (!packed)
+    {
+        free(items);
+        return 0;
+    }
+
+    free(page->items);
+    free(page->layout.rects);
+    page->items = items;
+    page->item_count = count;
+    page->layout = layout;
+
+    return 1;
+}
+
+INTERNAL bool32_t
+PaginateAtlas(const atlas_t* atlas, const packed_rect_t* rects, int count, int width, int height,
+              OUT pack_attempt_t* result)
+{
+    page_t* pages = (page_t*) calloc(count + 1, sizeof(page_t));
+    int page_count = 0;
+
+    // Rects that are placed one by one in the second pass
+    int* loose = (int*) calloc(count + 1, sizeof(int));
+    int loose_count = 0;
+
+    int* group = (int*) calloc(count + 1, sizeof(int));
+    font_group_t* fonts = (font_group_t*) calloc(atlas->font_count + 1, sizeof(font_group_t));
+
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        fonts[i].font_index = i;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        int font_index = RectFontIndex(&rects[i]);
+        if (font_index >= 0)
+        {
+            fonts[font_index].area += (long long) rects[i].width * rects[i].height;
+        }
+        else
+        {
+            loose[loose_count++] = i;
+        }
+    }
+
+    qsort(fonts, atlas->font_count, sizeof(font_group_t), CompareFontGroups);
+
+    for (int f = 0; f < atlas->font_count; ++f)
+    {
+        int group_count = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            if (RectFontIndex(&rects[i]) == fonts[f].font_index)
+            {
+                group[group_count++] = i;
+            }
+        }
+
+        if (group_count == 0)
+        {
+            continue;
+        }
+
+        bool32_t placed = 0;
+        for (int p = 0; p < page_count + 1 && !placed; ++p)
+        {
+            placed = TryRepackPage(&pages[p], rects, group, group_count,
+                                   atlas->heuristic, atlas->sort_order, width, height);
+            if (placed && p == page_count)
+            {
+                page_count++;
+            }
+        }
+
+        if (!placed)
+        {
+            printf("Warning: Font %s does not fit on one page, its glyphs will span pages.\n",
+                   atlas->fonts[fonts[f].font_index].name);
+            memcpy(loose + loose_count, group, group_count * sizeof(int));
+            loose_count += group_count;
+        }
+    }
+
+    // Seed a free-rect list per page with what the first pass placed
+    for (int p = 0; p < page_count; ++p)
+    {
+        pages[p].maxrects = CreateMaxRects(width, height);
+        for (int i = 0; i < pages[p].item_count; ++i)
+        {
+            packed_rect_t* placed = &pages[p].layout.rects[i];
+            MaxRectsPlaceRect(&pages[p].maxrects, (rect_t){ placed->x, placed->y, placed->width, placed->height });
+        }
+        MaxRectsCompactIfSparse(&pages[p].maxrects);
+    }
+
+    packed_rect_t* sorted = (packed_rect_t*) calloc(loose_count + 1, sizeof(packed_rect_t));
+    for (int i = 0; i < loose_count; ++i)
+    {
+        sorted[i] = rects[loose[i]];
+        sorted[i].order = loose[i];
+        sorted[i].sort_key = RectSortKey(atlas->sort_order, sorted[i].width, sorted[i].height);
+    }
+    qsort(sorted, loose_count, sizeof(packed_rect_t), ComparePackedRects);
+
+    // One by one placement cannot try every heuristic
+    pack_heuristic_t heuristic = atlas->heuristic == HEURISTIC_BEST ? HEURISTIC_SHORT_SIDE_FIT : atlas->heuristic;
+
+    result->rects = (packed_rect_t*) calloc(count + 1, sizeof(packed_rect_t));
+    int placed_count = 0;
+    bool32_t ok = 1;
+
+    for (int i = 0; i < loose_count && ok; ++i)
+    {
+        packed_rect_t rect = sorted[i];
+        bool32_t placed = 0;
+
+        for (int p = 0; p <= page_count && !placed; ++p)
+        {
+            if (p == page_count)
+            {
+                pages[p].maxrects = CreateMaxRects(width, height);
+            }
+
+            int x, y;
+            bool32_t rotated;
+            if (MaxRectsFindPositionRotated(&pages[p].maxrects, heuristic, rect.width, rect.height,
+                                            rect.can_rotate, &x, &y, &rotated) != -1)
+            {
+                if (rotated)
+                {
+                    int temp = rect.width;
+                    rect.width = rect.height;
+                    rect.height = temp;
+                    rect.rotated = !rect.rotated;
+                }
+
+                MaxRectsPlaceRect(&pages[p].maxrects, (rect_t){ x, y, rect.width, rect.height });
+                MaxRectsCompactIfSparse(&pages[p].maxrects);
+
+                rect.x = x;
+                rect.y = y;
+                rect.page = p;
+                result->rects[placed_count++] = rect;
+                placed = 1;
+
+                if (p == page_count)
+                {
+                    page_count++;
+                }
+            }
+            else if (p == page_count)
+            {
+                printf("Error: A %dx%d sprite does not fit in a %dx%d page.\n",
+                       rect.width, rect.height, width, height);
+                FreeMaxRects(&pages[p].maxrects);
+                ok = 0;
+            }
+        }
+    }
+
+    for (int p = 0; p < page_count; ++p)
+    {
+        for (int i = 0; i < pages[p].item_count; ++i)
+        {
+            packed_rect_t rect = pages[p].layout.rects[i];
+            rect.original_index = rects[pages[p].items[rect.original_index]].original_index;
+            rect.page = p;
+            result->rects[placed_count++] = rect;
+        }
+
+        FreeMaxRects(&pages[p].maxrects);
+        free(pages[p].layout.rects);
+        free(pages[p].items);
+    }
+
+    result->packed = ok;
+    result->heuristic = atlas->heuristic;
+    result->sort_order = atlas->sort_order;
+    result->width = width;
+    result->height = height;
+    result->page_count = page_count;
+    result->used_width = width;
+    result->used_height = height;
+
+    free(sorted);
+    free(fonts);
+    free(group);
+    free(loose);
+    free(pages);
+
+    return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Duplicates
+//////////////////////////////////////////////////////////////////////////////
+
+// Images and glyphs with identical pixels share one atlas region. Items are
+// bucketed by content hash in an open addressing table and a hash match is
+// confirmed by comparing the pixels, so a collision never merges two
+// different sprites.
+
+typedef bool32_t same_content_proc_t(void* data, int a, int b);
+
+// Sets alias[i] to the first earlier item with the same content, or -1.
+// Returns the number of duplicates found.
+INTERNAL int
+FindDuplicates(const uint64_t* hashes, int count, same_content_proc_t* same_content, void* data, OUT int* alias)
+{
+    int capacity = NextPowerOfTwo(count * 2 + 1);
+    int* table = (int*) calloc(capacity, sizeof(int)); // Item index + 1, 0 is empty
+    int duplicate_count = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        alias[i] = -1;
+
+        int slot = (int) (hashes[i] & (capacity - 1));
+        while (table[slot])
+        {
+            int other = table[slot] - 1;
+            if (hashes[other] == hashes[i] && same_content(data, other, i))
+            {
+                alias[i] = other;
+                duplicate_count++;
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        if (alias[i] == -1)
+        {
+            table[slot] = i + 1;
+        }
+    }
+
+    free(table);
+    return duplicate_count;
+}
+
+INTERNAL bool32_t
+SameImagePixels(void* data, int a, int b)
+{
+    const image_t* images = (const image_t*) data;
+    const image_t* ia = &images[a];
+    const image_t* ib = &images[b];
+
+    // The generated white sprite has no pixels and is never merged
+    if (!ia->pixels || !ib->pixels || ia->width != ib->width || ia->height != ib->height)
+    {
+        return 0;
+    }
+    return memcmp(ia->pixels, ib->pixels, (size_t) ia->width * ia->height * 4) == 0;
+}
+
+INTERNAL bool32_t
+SameGlyphBitmap(void* data, int a, int b)
+{
+    const packed_glyph_t* glyphs = (const packed_glyph_t*) data;
+    const packed_glyph_t* ga = &glyphs[a];
+    const packed_glyph_t* gb = &glyphs[b];
+
+    if (ga->width != gb->width || ga->height != gb->height || ga->channels != gb->channels)
+    {
+        return 0;
+    }
+    return memcmp(ga->bitmap, gb->bitmap, (size_t) ga->width * ga->height * ga->channels) == 0;
+}
+
+// Pages are handed out per font, so a layout split into pages only merges
+// glyphs within a font
+INTERNAL bool32_t
+SameGlyphBitmapInFont(void* data, int a, int b)
+{
+    const packed_glyph_t* glyphs = (const packed_glyph_t*) data;
+    return glyphs[a].font_index == glyphs[b].font_index && SameGlyphBitmap(data, a, b);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Blitting
+//////////////////////////////////////////////////////////////////////////////
+
+// Row kernels for copying sprites into the atlas. RGBA rows are plain
+// memcpy; glyph coverage rows are expanded to white RGBA with the alpha
+// set to the coverage. The expand kernel is picked once at startup from
+// what the CPU supports.
+
+typedef void expand_alpha_row_proc_t(uint8_t* dst, const uint8_t* src, int count);
+
+GLOBAL expand_alpha_row_proc_t* global_expand_alpha_row;
+GLOBAL const char* global_expand_alpha_row_name;
+
+INTERNAL void
+CopyRgbaRow(uint8_t* dst, const uint8_t* src, int count)
+{
+    memcpy(dst, src, (size_t) count * 4);
+}
+
+INTERNAL void
+FillRgbaRow(uint8_t* dst, uint32_t color, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        memcpy(dst + i*4, &color, 4);
+    }
+}
+
+INTERNAL void
+ExpandAlphaRowScalar(uint8_t* dst, const uint8_t* src, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        dst[i*4 + 0] = 0xFF;
+        dst[i*4 + 1] = 0xFF;
+        dst[i*4 + 2] = 0xFF;
+        dst[i*4 + 3] = src[i];
+    }
+}
+
+#if defined(SIMD_SSE2)
+INTERNAL void
+ExpandAlphaRowSse2(uint8_t* dst, const uint8_t* src, int count)
+{
+    // Each alpha byte is repeated into all four bytes of its pixel, then
+    // the color bytes are forced to 0xFF
+    __m128i white = _mm_set1_epi32(0x00FFFFFF);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i alpha = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i lo = _mm_unpacklo_epi8(alpha, alpha);
+        __m128i hi = _mm_unpackhi_epi8(alpha, alpha);
+
+        _mm_storeu_si128((__m128i*) (dst + i*4 + 0), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), white));
+        _mm_storeu_si128((__m128i*) (dst + i*4 + 16), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), white));
+        _mm_storeu_si128((__m128i*) (dst + i*4 + 32), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), white));
+        _mm_storeu_si128((__m128i*) (dst + i*4 + 48), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), white));
+    }
+
+    ExpandAlphaRowScalar(dst + i*4, src + i, count - i);
+}
+
+TARGET_AVX2 INTERNAL void
+ExpandAlphaRowAvx2(uint8_t* dst, const uint8_t* src, int count)
+{
+    // Eight alpha bytes widen to eight pixels and move to the top byte
+    __m256i white = _mm256_set1_epi32(0x00FFFFFF);
+    int i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        for (int j = 0; j < 32; j += 8)
+        {
+            __m256i alpha = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (src + i + j)));
+            _mm256_storeu_si256((__m256i*) (dst + (i + j)*4), _mm256_or_si256(_mm256_slli_epi32(alpha, 24), white));
+        }
+    }
+
+    ExpandAlphaRowSse2(dst + i*4, src + i, count - i);
+}
+
+INTERNAL bool32_t
+CpuHasAvx2(void)
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return 0;
+    }
+
+    // The OS has to save the ymm registers too
+    __cpuid(info, 1);
+    bool32_t has_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+
+    __cpuidex(info, 7, 0);
+    return has_avx && (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if defined(SIMD_NEON)
+INTERNAL void
+ExpandAlphaRowNeon(uint8_t* dst, const uint8_t* src, int count)
+{
+    uint8x16x4_t pixels;
+    pixels.val[0] = vdupq_n_u8(0xFF);
+    pixels.val[1] = pixels.val[0];
+    pixels.val[2] = pixels.val[0];
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        pixels.val[3] = vld1q_u8(src + i);
+        vst4q_u8(dst + i*4, pixels);
+    }
+
+    ExpandAlphaRowScalar(dst + i*4, src + i, count - i);
+}
+#endif
+
+INTERNAL void
+InitBlitKernels(void)
+{
+    global_expand_alpha_row = ExpandAlphaRowScalar;
+    global_expand_alpha_row_name = "scalar";
+
+#if defined(SIMD_SSE2)
+    global_expand_alpha_row = ExpandAlphaRowSse2;
+    global_expand_alpha_row_name = "sse2";
+
+    if (CpuHasAvx2())
+    {
+        global_expand_alpha_row = ExpandAlphaRowAvx2;
+        global_expand_alpha_row_name = "avx2";
+    }
+#elif defined(SIMD_NEON)
+    global_expand_alpha_row = ExpandAlphaRowNeon;
+    global_expand_alpha_row_name = "neon";
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Distance fields
+//////////////////////////////////////////////////////////////////////////////
+
+// SDF glyphs come straight from stbtt_GetGlyphSDF. MSDF glyphs are built
+// here from the glyph outline, a simplified take on Chlumsky's multi-channel
+// distance fields:
+//
+// - Each contour is split at its corners and the runs between corners get
+//   alternating two-channel colors, so the two edges meeting at a corner
+//   never share all channels.
+// - Curves are flattened into segments that keep their edge's color.
+// - Each channel stores the signed pseudo-distance to the nearest segment
+//   of that color; past the ends of an edge the distance to its extended
+//   line is used, which is what keeps corners sharp through the median.
+// - Alpha holds the true signed distance (sign from the nonzero winding),
+//   for effects that need it. There is no clash correction pass.
+//
+// Distances map to bytes like stbtt_GetGlyphSDF does: SDF_ON_EDGE_VALUE on
+// the outline, larger inside, spread pixels to either side covering the
+// rest of the range.
+
+#define SDF_ON_EDGE_VALUE 128
+#define MSDF_CURVE_STEPS 8
+#define MSDF_CORNER_THRESHOLD 0.05f    // sin(3 degrees)
+
+enum
+{
+    EDGE_RED = 1,
+    EDGE_GREEN = 2,
+    EDGE_BLUE = 4,
+    EDGE_CYAN = EDGE_GREEN | EDGE_BLUE,
+    EDGE_MAGENTA = EDGE_RED | EDGE_BLUE,
+    EDGE_YELLOW = EDGE_RED | EDGE_GREEN,
+    EDGE_WHITE = EDGE_RED | EDGE_GREEN | EDGE_BLUE,
+};
+
+typedef struct
+{
+    float x[4], y[4];           // Start, controls, end
+    int control_count;          // 0 line, 1 quadratic, 2 cubic
+    int color;
+} msdf_edge_t;
+
+typedef struct
+{
+    float x0, y0, x1, y1;
+    int color;
+    bool32_t edge_start;        // First segment of its edge
+    bool32_t edge_end;          // Last segment of its edge
+} msdf_segment_t;
+
+// Direction the edge leaves its start point, or arrives at its end point
+INTERNAL void
+MsdfEdgeDirection(const msdf_edge_t* edge, bool32_t at_end, OUT float* dx, OUT float* dy)
+{
+    int last = edge->control_count + 1;
+    int from = at_end ? last - 1 : 0;
+    int to = at_end ? last : 1;
+
+    *dx = edge->x[to] - edge->x[from];
+    *dy = edge->y[to] - edge->y[from];
+    if (*dx == 0 && *dy == 0)
+    {
+        *dx = edge->x[last] - edge->x[0];
+        *dy = edge->y[last] - edge->y[0];
+    }
+
+    float length = sqrtf(*dx * *dx + *dy * *dy);
+    if (length > 0)
+    {
+        *dx /= length;
+        *dy /= length;
+    }
+}
+
+INTERNAL bool32_t
+MsdfIsCorner(const msdf_edge_t* previous, const msdf_edge_t* next)
+{
+    float ax, ay, bx, by;
+    MsdfEdgeDirection(previous, 1, &ax, &ay);
+    MsdfEdgeDirection(next, 0, &bx, &by);
+
+    float dot = ax * bx + ay * by;
+    float cross = ax * by - ay * bx;
+    return dot <= 0 || fabsf(cross) > MSDF_CORNER_THRESHOLD;
+}
+
+// Colors one contour's edges so the edges on either side of a corner differ
+// in at least one channel
+INTERNAL void
+MsdfColorContour(msdf_edge_t* edges, int count)
+{
+    int corners[64];
+    int corner_count = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (MsdfIsCorner(&edges[(i + count - 1) % count], &edges[i]) && corner_count < 64)
+        {
+            corners[corner_count++] = i;
+        }
+    }
+
+    if (corner_count == 0)
+    {
+        // Smooth contour, every channel sees every edge
+        for (int i = 0; i < count; ++i)
+        {
+            edges[i].color = EDGE_WHITE;
+        }
+    }
+    else if (corner_count == 1)
+    {
+        // Teardrop: split the contour in three after the corner
+        const int colors[3] = { EDGE_MAGENTA, EDGE_WHITE, EDGE_YELLOW };
+        for (int i = 0; i < count; ++i)
+        {
+            int index = (corners[0] + i) % count;
+            edges[index].color = count >= 3 ? colors[(3 * i) / count] : EDGE_WHITE;
+        }
+    }
+    else
+    {
+        const int colors[3] = { EDGE_CYAN, EDGE_MAGENTA, EDGE_YELLOW };
+        for (int c = 0; c < corner_count; ++c)
+        {
+            int color = colors[c % 3];
+
+            // The last run wraps around to the first, they must differ
+            if (c == corner_count - 1 && c % 3 == 0)
+            {
+                color = colors[1];
+            }
+
+            int end = c + 1 < corner_count ? corners[c + 1] : corners[0] + count;
+            for (int i = corners[c]; i < end; ++i)
+            {
+                edges[i % count].color = color;
+            }
+        }
+    }
+}
+
+INTERNAL void
+MsdfEvaluateEdge(const msdf_edge_t* edge, float t, OUT float* x, OUT float* y)
+{
+    float u = 1.0f - t;
+    switch (edge->control_count)
+    {
+        case 0: {
+            *x = u * edge->x[0] + t * edge->x[1];
+            *y = u * edge->y[0] + t * edge->y[1];
+        } break;
+
+        case 1: {
+            *x = u*u * edge->x[0] + 2*u*t * edge->x[1] + t*t * edge->x[2];
+            *y = u*u * edge->y[0] + 2*u*t * edge->y[1] + t*t * edge->y[2];
+        } break;
+
+        default: {
+            *x = u*u*u * edge->x[0] + 3*u*u*t * edge->x[1] + 3*u*t*t * edge->x[2] + t*t*t * edge->x[3];
+            *y = u*u*u * edge->y[0] + 3*u*u*t * edge->y[1] + 3*u*t*t * edge->y[2] + t*t*t * edge->y[3];
+        } break;
+    }
+}
+
+// Turns the glyph outline into colored segments. Returns the segment count.
+INTERNAL int
+MsdfBuildSegments(const stbtt_vertex* vertices, int vertex_count, OUT msdf_segment_t** segments_out)
+{
+    msdf_edge_t* edges = (msdf_edge_t*) calloc(vertex_count + 1, sizeof(msdf_edge_t));
+    msdf_segment_t* segments = (msdf_segment_t*) calloc((vertex_count + 1) * MSDF_CURVE_STEPS, sizeof(msdf_segment_t));
+    int segment_count = 0;
+
+    int v = 0;
+    while (v < vertex_count)
+    {
+        // One contour: a move followed by lines and curves
+        float x = vertices[v].x;
+        float y = vertices[v].y;
+        int edge_count = 0;
+
+        for (v++; v < vertex_count && vertices[v].type != STBTT_vmove; ++v)
+        {
+            const stbtt_vertex* vertex = &vertices[v];
+            msdf_edge_t edge = { 0 };
+            edge.x[0] = x;
+            edge.y[0] = y;
+
+            if (vertex->type == STBTT_vcurve)
+            {
+                edge.control_count = 1;
+                edge.x[1] = vertex->cx;
+                edge.y[1] = vertex->cy;
+            }
+            else if (vertex->type == STBTT_vcubic)
+            {
+                edge.control_count = 2;
+                edge.x[1] = vertex->cx;
+                edge.y[1] = vertex->cy;
+                edge.x[2] = vertex->cx1;
+                edge.y[2] = vertex->cy1;
+            }
+
+            edge.x[edge.control_count + 1] = vertex->x;
+            edge.y[edge.control_count + 1] = vertex->y;
+            x = vertex->x;
+            y = vertex->y;
+
+            // Zero length lines only confuse corner detection
+            if (edge.control_count > 0 || edge.x[0] != edge.x[1] || edge.y[0] != edge.y[1])
+            {
+                edges[edge_count++] = edge;
+            }
+        }
+
+        if (edge_count == 0)
+        {
+            continue;
+        }
+
+        MsdfColorContour(edges, edge_count);
+
+        for (int e = 0; e < edge_count; ++e)
+        {
+            int steps = edges[e].control_count ? MSDF_CURVE_STEPS : 1;
+            float px = edges[e].x[0];
+            float py = edges[e].y[0];
+
+            for (int s = 1; s <= steps; ++s)
+            {
+                float nx, ny;
+                MsdfEvaluateEdge(&edges[e], (float) s / (float) steps, &nx, &ny);
+
+                msdf_segment_t* segment = &segments[segment_count++];
+                segment->x0 = px;
+                segment->y0 = py;
+                segment->x1 = nx;
+                segment->y1 = ny;
+                segment->color = edges[e].color;
+                segment->edge_start = (s == 1);
+                segment->edge_end = (s == steps);
+
+                px = nx;
+                py = ny;
+            }
+        }
+    }
+
+    free(edges);
+    *segments_out = segments;
+    return segment_count;
+}
+
+INTERNAL uint8_t
+DistanceToByte(float distance, float spread)
+{
+    float value = SDF_ON_EDGE_VALUE + distance * ((float) SDF_ON_EDGE_VALUE / spread);
+    value = value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value);
+    return (uint8_t) (value + 0.5f);
+}
+
+INTERNAL void
+GenerateGlyphMsdf(const font_t* font, packed_glyph_t* glyph)
+{
+    stbtt_vertex* vertices = 0;
+    int vertex_count = stbtt_GetGlyphShape(&font->info, glyph->glyph_index, &vertices);
+
+    msdf_segment_t* segments = 0;
+    int segment_count = MsdfBuildSegments(vertices, vertex_count, &segments);
+    stbtt_FreeShape(&font->info, vertices);
+
+    // Which side is inside depends on the contour winding of the font format
+    float area = 0;
+    for (int i = 0; i < segment_count; ++i)
+    {
+        area += segments[i].x0 * segments[i].y1 - segments[i].x1 * segments[i].y0;
+    }
+    float inside_sign = area > 0 ? 1.0f : -1.0f;
+
+    const int channel_masks[3] = { EDGE_RED, EDGE_GREEN, EDGE_BLUE };
+    float spread = (float) font->spread;
+
+    for (int y = 0; y < glyph->height; ++y)
+    {
+        for (int x = 0; x < glyph->width; ++x)
+        {
+            // Pixel center in font units, which are y up
+            float px = ((float) (glyph->xoff + x) + 0.5f) / font->scale;
+            float py = -((float) (glyph->yoff + y) + 0.5f) / font->scale;
+
+            float best_distance[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+            float best_orthogonality[3] = { 0 };
+            int best_segment[3] = { -1, -1, -1 };
+            float min_distance = FLT_MAX;
+            int winding = 0;
+
+            for (int i = 0; i < segment_count; ++i)
+            {
+                const msdf_segment_t* segment = &segments[i];
+                float dx = segment->x1 - segment->x0;
+                float dy = segment->y1 - segment->y0;
+                float ax = px - segment->x0;
+                float ay = py - segment->y0;
+                float length_squared = dx * dx + dy * dy;
+
+                float t = length_squared > 0 ? (ax * dx + ay * dy) / length_squared : 0;
+                t = t < 0 ? 0 : (t > 1 ? 1 : t);
+                float cx = ax - t * dx;
+                float cy = ay - t * dy;
+                float distance = sqrtf(cx * cx + cy * cy);
+                float cross = dx * ay - dy * ax;
+                float orthogonality = (distance > 0 && length_squared > 0)
+                    ? fabsf(cross) / (sqrtf(length_squared) * distance) : 1.0f;
+
+                if (distance < min_distance)
+                {
+                    min_distance = distance;
+                }
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    if (!(segment->color & channel_masks[c]))
+                    {
+                        continue;
+                    }
+
+                    // Segments sharing the nearest point: the one the point
+                    // is more squarely beside decides the side
+                    float difference = distance - best_distance[c];
+                    if (difference < -1e-4f ||
+                        (difference <= 1e-4f && orthogonality > best_orthogonality[c]))
+                    {
+                        best_distance[c] = distance;
+                        best_orthogonality[c] = orthogonality;
+                        best_segment[c] = i;
+                    }
+                }
+
+                // Nonzero winding along a ray to +x
+                if ((segment->y0 <= py) != (segment->y1 <= py))
+                {
+                    float crossing = segment->x0 + (py - segment->y0) * dx / dy;
+                    if (crossing > px)
+                    {
+                        winding += dy > 0 ? 1 : -1;
+                    }
+                }
+            }
+
+            uint8_t* out = glyph->bitmap + ((size_t) y * glyph->width + x) * 4;
+            for (int c = 0; c < 3; ++c)
+            {
+                if (best_segment[c] == -1)
+                {
+                    out[c] = 0;
+                    continue;
+                }
+
+                const msdf_segment_t* segment = &segments[best_segment[c]];
+                float dx = segment->x1 - segment->x0;
+                float dy = segment->y1 - segment->y0;
+                float ax = px - segment->x0;
+                float ay = py - segment->y0;
+                float length = sqrtf(dx * dx + dy * dy);
+                float cross = length > 0 ? (dx * ay - dy * ax) / length : 0;
+                float t = length > 0 ? (ax * dx + ay * dy) / (length * length) : 0;
+
+                float distance = best_distance[c];
+                if ((t < 0 && segment->edge_start) || (t > 1 && segment->edge_end))
+                {
+                    distance = fabsf(cross); // Pseudo-distance to the extended edge
+                }
+
+                float sign = (cross * inside_sign) >= 0 ? 1.0f : -1.0f;
+                out[c] = DistanceToByte(sign * distance * font->scale, spread);
+            }
+
+            float sign = winding != 0 ? 1.0f : -1.0f;
+            out[3] = DistanceToByte(sign * min_distance * font->scale, spread);
+        }
+    }
+
+    free(segments);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Kerning
+//////////////////////////////////////////////////////////////////////////////
+
+// Pairs come from the font's own tables instead of asking stb about every
+// ordered pair of baked glyphs: the pair adjustment subtables of GPOS when
+// the font has one, the kern table otherwise, the same choice as
+// stbtt_GetGlyphKernAdvance. Like stb, only subtables that adjust the x
+// advance of the first glyph are read, and the first subtable covering the
+// first glyph wins. One first glyph per work item; with the glyphs in
+// codepoint order, concatenating the rows gives the pairs sorted by key.
+
+typedef struct
+{
+    int glyph_index;
+    int position;               // Into font->glyphs
+} glyph_ref_t;
+
+typedef struct
+{
+    int position;               // Of the second glyph
+    int order;                  // Earlier table data wins
+    int advance;                // Font units
+} kern_candidate_t;
+
+typedef struct
+{
+    size_t offset;              // Of the GPOS pair adjustment subtable in the font data
+    int format;
+    int class_count;            // Format 2: second glyph classes
+    int* class_starts;          // Format 2: baked glyphs grouped by second class
+    int* class_positions;
+} pair_subtable_t;
+
+typedef struct
+{
+    const font_t* font;
+    const glyph_ref_t* refs;    // Baked glyphs sorted by glyph index
+    const pair_subtable_t* subtables;
+    int subtable_count;
+    const stbtt_kerningentry* kern; // Sorted kern table, used without GPOS
+    int kern_count;
+    kern_pair_t** rows;
+    int* row_counts;
+} kerning_work_t;
+
+INTERNAL int
+CompareGlyphMappings(const void* a, const void* b)
+{
+    const glyph_mapping_t* ga = (const glyph_mapping_t*) a;
+    const glyph_mapping_t* gb = (const glyph_mapping_t*) b;
+    return (ga->codepoint > gb->codepoint) - (ga->codepoint < gb->codepoint);
+}
+
+INTERNAL int
+CompareGlyphRefs(const void* a, const void* b)
+{
+    const glyph_ref_t* ra = (const glyph_ref_t*) a;
+    const glyph_ref_t* rb = (const glyph_ref_t*) b;
+    if (ra->glyph_index != rb->glyph_index)
+    {
+        return (ra->glyph_index > rb->glyph_index) - (ra->glyph_index < rb->glyph_index);
+    }
+    return (ra->position > rb->position) - (ra->position < rb->position);
+}
+
+INTERNAL int
+CompareKerningEntries(const void* a, const void* b)
+{
+    const stbtt_kerningentry* ea = (const stbtt_kerningentry*) a;
+    const stbtt_kerningentry* eb = (const stbtt_kerningentry*) b;
+    if (ea->glyph1 != eb->glyph1)
+    {
+        return (ea->glyph1 > eb->glyph1) - (ea->glyph1 < eb->glyph1);
+    }
+    if (ea->glyph2 != eb->glyph2)
+    {
+        return (ea->glyph2 > eb->glyph2) - (ea->glyph2 < eb->glyph2);
+    }
+    return (ea->advance > eb->advance) - (ea->advance < eb->advance);
+}
+
+INTERNAL int
+CompareKernCandidates(const void* a, const void* b)
+{
+    const kern_candidate_t* ca = (const kern_candidate_t*) a;
+    const kern_candidate_t* cb = (const kern_candidate_t*) b;
+    if (ca->position != cb->position)
+    {
+        return (ca->position > cb->position) - (ca->position < cb->position);
+    }
+    return (ca->order > cb->order) - (ca->order < cb->order);
+}
+
+// Big endian, 0 past the end of the font so a broken offset reads as empty
+INTERNAL int
+ReadFontU16(const font_t* font, size_t offset)
+{
+    if (offset + 2 > font->data_size)
+    {
+        return 0;
+    }
+    return (font->data[offset] << 8) | font->data[offset + 1];
+}
+
+INTERNAL int
+ReadFontS16(const font_t* font, size_t offset)
+{
+    return (int16_t) ReadFontU16(font, offset);
+}
+
+// Index of the glyph in an OpenType coverage table, -1 when not covered
+INTERNAL int
+GetCoverageIndex(const font_t* font, size_t coverage, int glyph_index)
+{
+    int format = ReadFontU16(font, coverage);
+    int count = ReadFontU16(font, coverage + 2);
+    int lo = 0, hi = count - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (format == 1)
+        {
+            int glyph = ReadFontU16(font, coverage + 4 + (size_t) mid * 2);
+            if (glyph == glyph_index)
+            {
+                return mid;
+            }
+            if (glyph < glyph_index) lo = mid + 1; else hi = mid - 1;
+        }
+        else if (format == 2)
+        {
+            size_t range = coverage + 4 + (size_t) mid * 6;
+            int start = ReadFontU16(font, range);
+            int end = ReadFontU16(font, range + 2);
+            if (glyph_index >= start && glyph_index <= end)
+            {
+                return ReadFontU16(font, range + 4) + glyph_index - start;
+            }
+            if (end < glyph_index) lo = mid + 1; else hi = mid - 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Class of the glyph in an OpenType class definition, glyphs not listed are
+// class 0, -1 for an unknown format
+INTERNAL int
+GetGlyphClass(const font_t* font, size_t class_def, int glyph_index)
+{
+    int format = ReadFontU16(font, class_def);
+    if (format == 1)
+    {
+        int start = ReadFontU16(font, class_def + 2);
+        int count = ReadFontU16(font, class_def + 4);
+        if (glyph_index >= start && glyph_index < start + count)
+        {
+            return ReadFontU16(font, class_def + 6 + (size_t) (glyph_index - start) * 2);
+        }
+        return 0;
+    }
+
+    if (format == 2)
+    {
+        int lo = 0, hi = ReadFontU16(font, class_def + 2) - 1;
+        while (lo <= hi)
+        {
+            int mid = (lo + hi) / 2;
+            size_t range = class_def + 4 + (size_t) mid * 6;
+            int start = ReadFontU16(font, range);
+            int end = ReadFontU16(font, range + 2);
+            if (glyph_index >= start && glyph_index <= end)
+            {
+                return ReadFontU16(font, range + 4);
+            }
+            if (end < glyph_index) lo = mid + 1; else hi = mid - 1;
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+// Lists the GPOS pair adjustment subtables in lookup order. Class based
+// subtables also get the baked glyphs grouped by second class, so a row
+// only visits the glyphs of classes that have an adjustment.
+INTERNAL pair_subtable_t*
+CollectPairSubtables(const font_t* font, OUT int* count)
+{
+    pair_subtable_t* subtables = 0;
+    int capacity = 0;
+    *count = 0;
+
+    size_t gpos = (size_t) font->info.gpos;
+    if (ReadFontU16(font, gpos) != 1 || ReadFontU16(font, gpos + 2) != 0)
+    {
+        return 0;
+    }
+
+    size_t lookup_list = gpos + ReadFontU16(font, gpos + 8);
+    int lookup_count = ReadFontU16(font, lookup_list);
+    for (int i = 0; i < lookup_count; ++i)
+    {
+        size_t lookup = lookup_list + ReadFontU16(font, lookup_list + 2 + (size_t) i * 2);
+        if (ReadFontU16(font, lookup) != 2)
+        {
+            continue; // Not pair adjustment
+        }
+
+        int subtable_count = ReadFontU16(font, lookup + 4);
+        for (int j = 0; j < subtable_count; ++j)
+        {
+            subtables = (pair_subtable_t*) GrowArray(subtables, *count, &capacity, sizeof(pair_subtable_t));
+            pair_subtable_t* subtable = &subtables[(*count)++];
+            subtable->offset = lookup + ReadFontU16(font, lookup + 6 + (size_t) j * 2);
+            subtable->format = ReadFontU16(font, subtable->offset);
+            if (subtable->format != 2)
+            {
+                continue;
+            }
+
+            size_t class_def = subtable->offset + ReadFontU16(font, subtable->offset + 10);
+            subtable->class_count = ReadFontU16(font, subtable->offset + 14);
+            subtable->class_starts = (int*) calloc(subtable->class_count + 2, sizeof(int));
+            subtable->class_positions = (int*) malloc(((size_t) font->glyph_count + 1) * sizeof(int));
+
+            // Counting sort by class, glyphs with a class past the count never kern
+            int* classes = (int*) malloc(((size_t) font->glyph_count + 1) * sizeof(int));
+            for (int g = 0; g < font->glyph_count; ++g)
+            {
+                classes[g] = GetGlyphClass(font, class_def, font->glyphs[g].glyph_index);
+                if (classes[g] >= 0 && classes[g] < subtable->class_count)
+                {
+                    subtable->class_starts[classes[g] + 2]++;
+                }
+            }
+            for (int c = 0; c < subtable->class_count; ++c)
+            {
+                subtable->class_starts[c + 2] += subtable->class_starts[c + 1];
+            }
+            for (int g = 0; g < font->glyph_count; ++g)
+            {
+                if (classes[g] >= 0 && classes[g] < subtable->class_count)
+                {
+                    subtable->class_positions[subtable->class_starts[classes[g] + 1]++] = g;
+                }
+            }
+            free(classes);
+        }
+    }
+
+    return subtables;
+}
+
+INTERNAL void
+FreePairSubtables(pair_subtable_t* subtables, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        free(subtables[i].class_starts);
+        free(subtables[i].class_positions);
+    }
+    free(subtables);
+}
+
+// Adds a candidate for every baked glyph drawn with the given glyph index
+INTERNAL kern_candidate_t*
+AddKernCandidates(const kerning_work_t* work, int glyph_index, int order, int advance,
+                  kern_candidate_t* candidates, int* count, int* capacity)
+{
+    int lo = 0, hi = work->font->glyph_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (work->refs[mid].glyph_index < glyph_index) lo = mid + 1; else hi = mid;
+    }
+
+    for (; lo < work->font->glyph_count && work->refs[lo].glyph_index == glyph_index; ++lo)
+    {
+        candidates = (kern_candidate_t*) GrowArray(candidates, *count, capacity, sizeof(kern_candidate_t));
+        candidates[*count].position = work->refs[lo].position;
+        candidates[*count].order = order;
+        candidates[*count].advance = advance;
+        (*count)++;
+    }
+    return candidates;
+}
+
+INTERNAL kern_candidate_t*
+CollectGposCandidates(const kerning_work_t* work, int first_glyph, kern_candidate_t* candidates, int* count, int* capacity)
+{
+    const font_t* font = work->font;
+    int order = 0;
+
+    for (int s = 0; s < work->subtable_count; ++s)
+    {
+        const pair_subtable_t* subtable = &work->subtables[s];
+        size_t table = subtable->offset;
+        int coverage = GetCoverageIndex(font, table + ReadFontU16(font, table + 2), first_glyph);
+        if (coverage < 0)
+        {
+            continue;
+        }
+
+        // Only an x advance on the first glyph, anything else ends the lookup as in stb
+        if (ReadFontU16(font, table + 4) != 4 || ReadFontU16(font, table + 6) != 0)
+        {
+            break;
+        }
+
+        if (subtable->format == 1)
+        {
+            if (coverage >= ReadFontU16(font, table + 8))
+            {
+                break;
+            }
+
+            size_t pair_set = table + ReadFontU16(font, table + 10 + (size_t) coverage * 2);
+            int pair_count = ReadFontU16(font, pair_set);
+            for (int i = 0; i < pair_count; ++i)
+            {
+                size_t record = pair_set + 2 + (size_t) i * 4;
+                candidates = AddKernCandidates(work, ReadFontU16(font, record), order++, ReadFontS16(font, record + 2),
+                                               candidates, count, capacity);
+            }
+            continue; // Second glyphs missing from the set fall through to later subtables
+        }
+
+        if (subtable->format == 2)
+        {
+            int first_class = GetGlyphClass(font, table + ReadFontU16(font, table + 8), first_glyph);
+            if (first_class >= 0 && first_class < ReadFontU16(font, table + 12))
+            {
+                size_t records = table + 16 + (size_t) first_class * subtable->class_count * 2;
+                for (int c = 0; c < subtable->class_count; ++c)
+                {
+                    int advance = ReadFontS16(font, records + (size_t) c * 2);
+                    if (advance == 0)
+                    {
+                        continue;
+                    }
+                    for (int i = subtable->class_starts[c]; i < subtable->class_starts[c + 1]; ++i)
+                    {
+                        candidates = (kern_candidate_t*) GrowArray(candidates, *count, capacity, sizeof(kern_candidate_t));
+                        candidates[*count].position = subtable->class_positions[i];
+                        candidates[*count].order = order;
+                        candidates[*count].advance = advance;
+                        (*count)++;
+                    }
+                }
+            }
+        }
+        break; // Class pairs cover every second glyph
+    }
+
+    return candidates;
+}
+
+INTERNAL kern_candidate_t*
+CollectKernTableCandidates(const kerning_work_t* work, int first_glyph, kern_candidate_t* candidates, int* count, int* capacity)
+{
+    int lo = 0, hi = work->kern_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (work->kern[mid].glyph1 < first_glyph) lo = mid + 1; else hi = mid;
+    }
+
+    for (int i = lo; i < work->kern_count && work->kern[i].glyph1 == first_glyph; ++i)
+    {
+        candidates = AddKernCandidates(work, work->kern[i].glyph2, i, work->kern[i].advance, candidates, count, capacity);
+    }
+    return candidates;
+}
+
+INTERNAL void
+KerningRowWork(void* data, int index)
+{
+    kerning_work_t* work = (kerning_work_t*) data;
+    const font_t* font = work->font;
+    const glyph_mapping_t* first = &font->glyphs[index];
+
+    kern_candidate_t* candidates = 0;
+    int candidate_count = 0, candidate_capacity = 0;
+    if (work->subtables)
+    {
+        candidates = CollectGposCandidates(work, first->glyph_index, candidates, &candidate_count, &candidate_capacity);
+    }
+    else
+    {
+        candidates = CollectKernTableCandidates(work, first->glyph_index, candidates, &candidate_count, &candidate_capacity);
+    }
+
+    // Second glyphs in codepoint order, the earliest data for each one wins
+    if (candidate_count > 1)
+    {
+        qsort(candidates, candidate_count, sizeof(kern_candidate_t), CompareKernCandidates);
+    }
+
+    kern_pair_t* row = 0;
+    int count = 0, capacity = 0;
+
+    for (int i = 0; i < candidate_count; ++i)
+    {
+        if ((i > 0 && candidates[i].position == candidates[i - 1].position) || candidates[i].advance == 0)
+        {
+            continue;
+        }
+
+        const glyph_mapping_t* second = &font->glyphs[candidates[i].position];
+        row = (kern_pair_t*) GrowArray(row, count, &capacity, sizeof(kern_pair_t));
+        row[count].key = ((uint64_t) (uint32_t) first->codepoint << 32) | (uint32_t) second->codepoint;
+        row[count].advance = candidates[i].advance * font->scale;
+        count++;
+    }
+
+    free(candidates);
+    work->rows[index] = row;
+    work->row_counts[index] = count;
+}
+
+INTERNAL void
+CollectKerning(atlas_t* atlas)
+{
+    for (int f = 0; f < atlas->font_count; ++f)
+    {
+        font_t* font = &atlas->fonts[f];
+        if (font->kerning)
+        {
+            continue; // Taken from the cache
+        }
+
+        if (!font->info.kern && !font->info.gpos)
+        {
+            continue;
+        }
+
+        qsort(font->glyphs, font->glyph_count, sizeof(glyph_mapping_t), CompareGlyphMappings);
+
+        glyph_ref_t* refs = (glyph_ref_t*) malloc(((size_t) font->glyph_count + 1) * sizeof(glyph_ref_t));
+        for (int i = 0; i < font->glyph_count; ++i)
+        {
+            refs[i].glyph_index = font->glyphs[i].glyph_index;
+            refs[i].position = i;
+        }
+        qsort(refs, font->glyph_count, sizeof(glyph_ref_t), CompareGlyphRefs);
+
+        kerning_work_t work = { 0 };
+        work.font = font;
+        work.refs = refs;
+
+        pair_subtable_t* subtables = 0;
+        stbtt_kerningentry* kern = 0;
+        if (font->info.gpos)
+        {
+            subtables = CollectPairSubtables(font, &work.subtable_count);
+            work.subtables = subtables;
+        }
+        else
+        {
+            work.kern_count = stbtt_GetKerningTableLength(&font->info);
+            kern = (stbtt_kerningentry*) malloc(((size_t) work.kern_count + 1) * sizeof(stbtt_kerningentry));
+            work.kern_count = stbtt_GetKerningTable(&font->info, kern, work.kern_count);
+            qsort(kern, work.kern_count, sizeof(stbtt_kerningentry), CompareKerningEntries);
+            work.kern = kern;
+        }
+
+        if (!subtables && !work.kern_count)
+        {
+            free(kern);
+            free(refs);
+            continue;
+        }
+
+        kern_pair_t** rows = (kern_pair_t**) calloc(font->glyph_count + 1, sizeof(kern_pair_t*));
+        int* row_counts = (int*) calloc(font->glyph_count + 1, sizeof(int));
+        work.rows = rows;
+        work.row_counts = row_counts;
+        ParallelFor(font->glyph_count, KerningRowWork, &work);
+
+        int total = 0;
+        for (int i = 0; i < font->glyph_count; ++i)
+        {
+            total += row_counts[i];
+        }
+
+        font->kerning = (kern_pair_t*) calloc(total + 1, sizeof(kern_pair_t));
+        for (int i = 0; i < font->glyph_count; ++i)
+        {
+            if (row_counts[i])
+            {
+                memcpy(font->kerning + font->kerning_count, rows[i], row_counts[i] * sizeof(kern_pair_t));
+                font->kerning_count += row_counts[i];
+            }
+            free(rows[i]);
+        }
+
+        free(row_counts);
+        free(rows);
+        FreePairSubtables(subtables, work.subtable_count);
+        free(kern);
+        free(refs);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+INTERNAL void
+RasterizeGlyphWork(void* data, int index)
+{
+    rasterize_glyphs_work_t* work = (rasterize_glyphs_work_t*) data;
+    packed_glyph_t* glyph = &work->glyphs[index];
+    font_t* font = &work->fonts[glyph->font_index];
+
+    if (glyph->cached)
+    {
+        memcpy(glyph->bitmap, glyph->cached, (size_t) glyph->width * glyph->height * glyph->channels);
+        return;
+    }
+
+    switch (font->mode)
+    {
+        case GLYPH_BITMAP: {
+            stbtt_MakeGlyphBitmap(&font->info, glyph->bitmap, glyph->width, glyph->height, glyph->width,
+                                  font->scale, font->scale, glyph->glyph_index);
+        } break;
+
+        case GLYPH_SDF: {
+            int width, height, xoff, yoff;
+            uint8_t* sdf = stbtt_GetGlyphSDF(&font->info, font->scale, glyph->glyph_index, font->spread,
+                                             SDF_ON_EDGE_VALUE, (float) SDF_ON_EDGE_VALUE / (float) font->spread,
+                                             &width, &height, &xoff, &yoff);
+            if (sdf)
+            {
+                // Same box as the metrics pass, clamp anyway
+                int copy_width = width < glyph->width ? width : glyph->width;
+                int copy_height = height < glyph->height ? height : glyph->height;
+                for (int y = 0; y < copy_height; ++y)
+                {
+                    memcpy(glyph->bitmap + y * glyph->width, sdf + y * width, copy_width);
+                }
+                stbtt_FreeSDF(sdf, 0);
+            }
+        } break;
+
+        case GLYPH_MSDF: {
+            GenerateGlyphMsdf(font, glyph);
+        } break;
+    }
+
+    glyph->hash = HashBytes(glyph->bitmap, (size_t) glyph->width * glyph->height * glyph->channels,
+                            ((uint64_t) glyph->width << 32) | (uint32_t) glyph->height);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Rasterized font as stored in the cache: this header, the glyphs, the
+// kerning pairs, then the bitmaps back to back in glyph order
+typedef struct
+{
+    int glyph_count;
+    int kerning_count;
+    uint64_t bitmap_size;
+} cached_font_t;
+
+typedef struct
+{
+    int codepoint;
+    int glyph_index;
+    int channels;
+    int width, height;
+    int xoff, yoff;
+    float xadvance;
+    uint64_t hash;
+} cached_glyph_t;
+
+INTERNAL uint64_t
+GetFontCacheKey(const font_t* font)
+{
+    int params[4] = { CACHE_VERSION, font->size, font->mode, font->spread };
+    uint64_t key = HashBytes(font->data, font->data_size, HashBytes((const uint8_t*) params, sizeof(params), 0));
+    return HashBytes((const uint8_t*) font->codepoints, (size_t) font->codepoint_count * sizeof(int), key);
+}
+
+// Appends the glyphs of a font cache entry the way the metrics pass would
+// and takes over its kerning. The glyphs point into the entry for their
+// bitmaps. Returns 0 if the entry does not fit the font.
+INTERNAL bool32_t
+UseFontEntry(const uint8_t* entry, size_t size, int font_index, font_t* font, packed_glyph_t* glyphs,
+             OUT int* glyph_count, OUT size_t* bitmap_size)
+{
+    cached_font_t header;
+    memcpy(&header, entry, size < sizeof(header) ? size : sizeof(header));
+    size_t expected = sizeof(header) + (size_t) header.glyph_count * sizeof(cached_glyph_t) +
+                      (size_t) header.kerning_count * sizeof(kern_pair_t) + header.bitmap_size;
+    if (size < sizeof(header) || size != expected || header.glyph_count > font->codepoint_count)
+    {
+        return 0;
+    }
+
+    const cached_glyph_t* cached = (const cached_glyph_t*) (entry + sizeof(header));
+    const kern_pair_t* kerning = (const kern_pair_t*) (cached + header.glyph_count);
+    const uint8_t* bitmap = (const uint8_t*) (kerning + header.kerning_count);
+
+    for (int j = 0; j < header.glyph_count; ++j)
+    {
+        packed_glyph_t* glyph = &glyphs[(*glyph_count)++];
+        glyph->font_index = font_index;
+        glyph->codepoint = cached[j].codepoint;
+        glyph->glyph_index = cached[j].glyph_index;
+        glyph->bitmap_offset = *bitmap_size;
+        glyph->channels = cached[j].channels;
+        glyph->width = cached[j].width;
+        glyph->height = cached[j].height;
+        glyph->xoff = cached[j].xoff;
+        glyph->yoff = cached[j].yoff;
+        glyph->xadvance = cached[j].xadvance;
+        glyph->hash = cached[j].hash;
+        glyph->cached = bitmap;
+
+        size_t glyph_size = (size_t) glyph->width * glyph->height * glyph->channels;
+        bitmap += glyph_size;
+        *bitmap_size += glyph_size;
+    }
+
+    font->kerning = (kern_pair_t*) malloc(((size_t) header.kerning_count + 1) * sizeof(kern_pair_t));
+    memcpy(font->kerning, kerning, (size_t) header.kerning_count * sizeof(kern_pair_t));
+    font->kerning_count = header.kerning_count;
+
+    return 1;
+}
+
+INTERNAL uint8_t*
+BuildFontEntry(int font_index, const font_t* font, const packed_glyph_t* glyphs, int glyph_count, OUT size_t* size)
+{
+    cached_font_t header = { 0, font->kerning_count, 0 };
+    int first = -1;
+    for (int i = 0; i < glyph_count; ++i)
+    {
+        if (glyphs[i].font_index == font_index)
+        {
+            first = first < 0 ? i : first;
+            header.glyph_count++;
+            header.bitmap_size += (uint64_t) glyphs[i].width * glyphs[i].height * glyphs[i].channels;
+        }
+    }
+
+    size_t glyphs_size = (size_t) header.glyph_count * sizeof(cached_glyph_t);
+    size_t kerning_size = (size_t) font->kerning_count * sizeof(kern_pair_t);
+    *size = sizeof(header) + glyphs_size + kerning_size + (size_t) header.bitmap_size;
+
+    uint8_t* entry = (uint8_t*) malloc(*size);
+    memcpy(entry, &header, sizeof(header));
+    memcpy(entry + sizeof(header) + glyphs_size, font->kerning, kerning_size);
+
+    // A font's glyphs are consecutive, and so are their bitmaps
+    cached_glyph_t* cached = (cached_glyph_t*) (entry + sizeof(header));
+    for (int j = 0; j < header.glyph_count; ++j)
+    {
+        const packed_glyph_t* glyph = &glyphs[first + j];
+        cached[j] = (cached_glyph_t){
+            glyph->codepoint, glyph->glyph_index, glyph->channels,
+            glyph->width, glyph->height, glyph->xoff, glyph->yoff,
+            glyph->xadvance, glyph->hash,
+        };
+    }
+
+    if (header.glyph_count)
+    {
+        memcpy(entry + sizeof(header) + glyphs_size + kerning_size, glyphs[first].bitmap, (size_t) header.bitmap_size);
+    }
+
+    return entry;
+}
+
+// Packing result as stored in the cache, followed by one cached_rect_t per
+// rect in the order CreateAtlas collects them
+typedef struct
+{
+    int width, height;
+    int page_count;
+    int heuristic, sort_order;
+    int used_width, used_height;
+    int rect_count;
+    int glyphs_within_fonts;    // Split into pages, glyphs only merged within a font
+} cached_layout_t;
+
+typedef struct
+{
+    int x, y;
+    int width, height;          // As placed, swapped when rotated
+    int page;
+    int rotated;
+} cached_rect_t;
+
+// Everything that decides where the rects go: the packing settings and,
+// for each rect, its size, kind and font
+INTERNAL uint64_t
+GetLayoutCacheKey(const atlas_t* atlas, const packed_rect_t* rects, int count, int padding)
+{
+    // CreateAtlas overwrites the size in AUTO mode, only the maximum matters there
+    int width = atlas->auto_size ? 0 : (int) atlas->width;
+    int height = atlas->auto_size ? 0 : (int) atlas->height;
+    int settings[] = {
+        CACHE_VERSION, padding, atlas->mip_levels, width, height, atlas->auto_size, atlas->max_size,
+        atlas->power_of_two, atlas->non_square, atlas->allow_rotation, atlas->sort_order, atlas->heuristic,
+    };
+
+    int* sizes = (int*) calloc((size_t) count * 5 + 1, sizeof(int));
+    for (int i = 0; i < count; ++i)
+    {
+        sizes[i*5 + 0] = rects[i].width;
+        sizes[i*5 + 1] = rects[i].height;
+        sizes[i*5 + 2] = rects[i].type;
+        sizes[i*5 + 3] = rects[i].can_rotate;
+        sizes[i*5 + 4] = RectFontIndex(&rects[i]);
+    }
+
+    uint64_t key = HashBytes((const uint8_t*) sizes, (size_t) count * 5 * sizeof(int),
+                             HashBytes((const uint8_t*) settings, sizeof(settings), 0));
+    free(sizes);
+
+    return key;
+}
+
+INTERNAL bool32_t
+UseLayoutEntry(const uint8_t* entry, size_t size, const packed_rect_t* rects, int count, OUT pack_attempt_t* result)
+{
+    cached_layout_t header;
+    memcpy(&header, entry, size < sizeof(header) ? size : sizeof(header));
+    if (size != sizeof(header) + (size_t) count * sizeof(cached_rect_t) || header.rect_count != count)
+    {
+        return 0;
+    }
+
+    const cached_rect_t* cached = (const cached_rect_t*) (entry + sizeof(header));
+    result->rects = (packed_rect_t*) calloc(count ? count : 1, sizeof(packed_rect_t));
+    memcpy(result->rects, rects, count * sizeof(packed_rect_t));
+    for (int i = 0; i < count; ++i)
+    {
+        result->rects[i].x = cached[i].x;
+        result->rects[i].y = cached[i].y;
+        result->rects[i].width = cached[i].width;
+        result->rects[i].height = cached[i].height;
+        result->rects[i].page = cached[i].page;
+        result->rects[i].rotated = cached[i].rotated;
+    }
+
+    result->heuristic = (pack_heuristic_t) header.heuristic;
+    result->sort_order = (sort_order_t) header.sort_order;
+    result->packed = 1;
+    result->width = header.width;
+    result->height = header.height;
+    result->page_count = header.page_count;
+    result->used_width = header.used_width;
+    result->used_height = header.used_height;
+
+    return 1;
+}
+
+// The packed rects come back in packing order; slots maps a rect back to
+// its position in the collected list
+INTERNAL uint8_t*
+BuildLayoutEntry(const pack_attempt_t* result, int count, const int* image_slots, const int* glyph_slots,
+                 bool32_t glyphs_within_fonts, OUT size_t* size)
+{
+    cached_layout_t header = {
+        result->width, result->height, result->page_count,
+        result->heuristic, result->sort_order,
+        result->used_width, result->used_height,
+        count, glyphs_within_fonts,
+    };
+
+    *size = sizeof(header) + (size_t) count * sizeof(cached_rect_t);
+    uint8_t* entry = (uint8_t*) malloc(*size);
+    memcpy(entry, &header, sizeof(header));
+
+    cached_rect_t* cached = (cached_rect_t*) (entry + sizeof(header));
+    for (int i = 0; i < count; ++i)
+    {
+        const packed_rect_t* rect = &result->rects[i];
+        int slot = rect->type == TYPE_IMAGE ? image_slots[rect->original_index] : glyph_slots[rect->original_index];
+        cached[slot] = (cached_rect_t){ rect->x, rect->y, rect->width, rect->height, rect->page, rect->rotated };
+    }
+
+    return entry;
+}
+
+INTERNAL bool32_t
+LayoutEntryWithinFonts(const uint8_t* entry, size_t size)
+{
+    cached_layout_t header;
+    if (size < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, entry, sizeof(header));
+    return header.glyphs_within_fonts;
+}
+
+// Font and rect slot of every glyph with glyphs merged across fonts. With
+// the rect sizes this also fixes the rects of a layout that only merges
+// within fonts, which is what a layout split into pages is cached with.
+INTERNAL uint64_t
+GetGlyphAliasKey(const packed_glyph_t* glyphs, int count, const int* glyph_slots, uint64_t seed)
+{
+    int* uses = (int*) calloc((size_t) count * 2 + 1, sizeof(int));
+    for (int i = 0; i < count; ++i)
+    {
+        uses[i*2 + 0] = glyphs[i].font_index;
+        uses[i*2 + 1] = glyph_slots[glyphs[i].alias != -1 ? glyphs[i].alias : i];
+    }
+
+    uint64_t key = HashBytes((const uint8_t*) uses, (size_t) count * 2 * sizeof(int), seed);
+    free(uses);
+
+    return key;
+}
+
+#define DEFAULT_PADDING 2
+
+// Every mip level halves the border around a sprite, so with mipmaps it
+// starts at 2^(levels - 1) pixels to keep a texel of border down to the
+// last level. It stops growing once the sprite would be down to four texels
+// by the level it protects, smaller sprites are only a blur by then. The
+// result is the texel size of the deepest level the sprite is kept clean
+// for, and the grid the packed rects stay on.
+INTERNAL int
+GetSpriteMipGrid(const atlas_t* atlas, int width, int height)
+{
+    int size = width > height ? width : height;
+    int grid = DEFAULT_PADDING;
+    while (atlas->mip_levels > 1 && grid < (1 << (atlas->mip_levels - 1)) && grid*8 <= size)
+    {
+        grid *= 2;
+    }
+    return grid;
+}
+
+// The box filter stays inside the texels of the level above, so a border of
+// one grid is enough. Each KAISER level also reads MIP_KAISER_TAPS / 2 - 1
+// texels past them on either side, which by the level of the grid adds up
+// to less than (MIP_KAISER_TAPS / 2 - 1) grids. With the sprite starting on
+// the grid and its size rounded up to it (see GetSpriteRectSize), that many
+// grids of border keep every texel touching the sprite inside its rect.
+INTERNAL int
+GetSpritePadding(const atlas_t* atlas, int width, int height)
+{
+    int grid = GetSpriteMipGrid(atlas, width, height);
+    int grids = 1;
+    if (atlas->mip_levels > 1 && atlas->mip_filter == MIP_KAISER && MIP_KAISER_TAPS / 2 - 1 > grids)
+    {
+        grids = MIP_KAISER_TAPS / 2 - 1;
+    }
+    return grids * grid;
+}
+
+// Side of the packed rect for a sprite side. KAISER rounds the sprite up to
+// the grid first, so the border on the far side also starts on the grid.
+INTERNAL int
+GetSpriteRectSize(const atlas_t* atlas, int size, int grid, int padding)
+{
+    if (atlas->mip_levels > 1 && atlas->mip_filter == MIP_KAISER)
+    {
+        size = (size + grid - 1) / grid * grid;
+    }
+    return size + padding*2;
+}
+
+// Repeats the outermost pixels of a sprite over the rest of its packed rect,
+// so filtering and mip levels pick up the sprite's own edge instead of the
+// empty atlas around it
+INTERNAL void
+ExtrudeSprite(uint8_t* pixels, int atlas_width, const packed_rect_t* rect, int x, int y, int width, int height)
+{
+    if (width == 0 || height == 0)
+    {
+        return;
+    }
+
+    size_t stride = (size_t) atlas_width * 4;
+    int left = x - rect->x;
+    int right = rect->x + rect->width - (x + width);
+    for (int py = y; py < y + height; ++py)
+    {
+        uint8_t* row = pixels + py*stride;
+        uint32_t first, last;
+        memcpy(&first, row + x*4, 4);
+        memcpy(&last, row + (x + width - 1)*4, 4);
+        FillRgbaRow(row + rect->x*4, first, left);
+        FillRgbaRow(row + (x + width)*4, last, right);
+    }
+
+    const uint8_t* top = pixels + y*stride + rect->x*4;
+    const uint8_t* bottom = pixels + (y + height - 1)*stride + rect->x*4;
+    for (int py = rect->y; py < y; ++py)
+    {
+        CopyRgbaRow(pixels + py*stride + rect->x*4, top, rect->width);
+    }
+    for (int py = y + height; py < rect->y + rect->height; ++py)
+    {
+        CopyRgbaRow(pixels + py*stride + rect->x*4, bottom, rect->width);
+    }
+}
+
+// Appends a rect for each glyph that is not a duplicate. Identical bitmaps
+// share a rect across fonts, or only within each font for a layout split
+// into pages: fonts get their pages one by one, so a glyph sharing another
+// font's rect could end up on a page its own font is not on. Returns the
+// number of duplicates.
+INTERNAL int
+AddGlyphRects(const atlas_t* atlas, packed_glyph_t* glyphs, int glyph_count, bool32_t within_fonts,
+              packed_rect_t* rects, int* rect_count, int* glyph_slots, int* max_grid, OUT bool32_t* across_fonts)
+{
+    uint64_t* hashes = (uint64_t*) calloc(glyph_count + 1, sizeof(uint64_t));
+    int* aliases = (int*) calloc(glyph_count + 1, sizeof(int));
+
+    for (int i = 0; i < glyph_count; ++i)
+    {
+        hashes[i] = glyphs[i].hash;
+        if (within_fonts)
+        {
+            hashes[i] ^= (uint64_t) glyphs[i].font_index * 0x9E3779B97F4A7C15ull;
+        }
+    }
+    int duplicates = FindDuplicates(hashes, glyph_count, within_fonts ? SameGlyphBitmapInFont : SameGlyphBitmap,
+                                    glyphs, aliases);
+
+    *across_fonts = 0;
+    for (int i = 0; i < glyph_count; ++i)
+    {
+        glyphs[i].alias = aliases[i];
+        if (aliases[i] != -1)
+        {
+            *across_fonts |= glyphs[aliases[i]].font_index != glyphs[i].font_index;
+            continue;
+        }
+
+        int index = (*rect_count)++;
+        glyph_slots[i] = index;
+        int padding = GetSpritePadding(atlas, glyphs[i].width, glyphs[i].height);
+        int grid = GetSpriteMipGrid(atlas, glyphs[i].width, glyphs[i].height);
+        *max_grid = grid > *max_grid ? grid : *max_grid;
+        rects[index] = (packed_rect_t){ 0 };
+        rects[index].width = GetSpriteRectSize(atlas, glyphs[i].width, grid, padding);
+        rects[index].height = GetSpriteRectSize(atlas, glyphs[i].height, grid, padding);
+        rects[index].type = TYPE_GLYPH;
+        rects[index].original_index = i;
+        rects[index].user_data = &glyphs[i];
+    }
+
+    free(aliases);
+    free(hashes);
+
+    return duplicates;
+}
+
+INTERNAL void
+AlignRectSizes(packed_rect_t* rects, int count, int align)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        rects[i].width = (rects[i].width + align - 1) / align * align;
+        rects[i].height = (rects[i].height + align - 1) / align * align;
+    }
+}
+
+INTERNAL bool32_t
+CreateAtlas(OUT atlas_t* atlas)
+{
+    int max_grid = DEFAULT_PADDING;
+    
+    // Collect and sort all rects
+    int total_codepoints = 0;
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        total_codepoints += atlas->fonts[i].codepoint_count;
+    }
+
+    int total_rects = atlas->image_count + total_codepoints + 1;
+
+    packed_rect_t* rects = (packed_rect_t*) calloc(total_rects * sizeof(packed_rect_t), 1);
+    int rect_index = 0;
+
+    // Images, identical ones only once
+    uint64_t* hashes = (uint64_t*) calloc(total_rects, sizeof(uint64_t));
+    int* aliases = (int*) calloc(total_rects, sizeof(int));
+
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        hashes[i] = atlas->images[i].hash;
+    }
+    int duplicate_images = FindDuplicates(hashes, atlas->image_count, SameImagePixels, atlas->images, aliases);
+
+    // Position of each packed image and glyph in rects, for the layout cache
+    int* image_slots = (int*) calloc(atlas->image_count + 1, sizeof(int));
+    int* glyph_slots = (int*) calloc(total_codepoints + 1, sizeof(int));
+
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        atlas->images[i].alias = aliases[i];
+        if (aliases[i] != -1)
+        {
+            continue;
+        }
+
+        image_slots[i] = rect_index;
+        int padding = GetSpritePadding(atlas, atlas->images[i].width, atlas->images[i].height);
+        int grid = GetSpriteMipGrid(atlas, atlas->images[i].width, atlas->images[i].height);
+        max_grid = grid > max_grid ? grid : max_grid;
+        rects[rect_index].width = GetSpriteRectSize(atlas, atlas->images[i].width, grid, padding);
+        rects[rect_index].height = GetSpriteRectSize(atlas, atlas->images[i].height, grid, padding);
+        rects[rect_index].type = TYPE_IMAGE;
+        rects[rect_index].original_index = i;
+        rects[rect_index].user_data = &atlas->images[i];
+        rects[rect_index].can_rotate = atlas->allow_rotation;
+        rect_index++;
+    }
+
+    // Fonts
+    int temp_glyph_count = 0;
+    packed_glyph_t* temp_glyphs = (packed_glyph_t*) calloc(
+        (total_codepoints + 1) * sizeof(packed_glyph_t), 1);
+
+    // Bitmap offsets are handed out during the metrics pass, the arena is
+    // allocated once the total is known
+    size_t bitmap_size = 0;
+    cache_entry_t* font_entries = (cache_entry_t*) calloc(atlas->font_count + 1, sizeof(cache_entry_t));
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+
+        // Output of an earlier bake in watch mode
+        free(font->glyphs);
+        free(font->kerning);
+        font->glyphs = 0;
+        font->glyph_count = 0;
+        font->kerning = 0;
+        font->kerning_count = 0;
+
+        if (CacheEnabled())
+        {
+            cache_entry_t* entry = &font_entries[i];
+            entry->key = GetFontCacheKey(font);
+            entry->data = TakeCacheEntry(entry->key, "font", &font->baked, &entry->size);
+            if (entry->data && UseFontEntry(entry->data, entry->size, i, font, temp_glyphs, &temp_glyph_count, &bitmap_size))
+            {
+                global_cache_font_hits++;
+                continue;
+            }
+
+            free(entry->data);
+            entry->data = 0;
+        }
+
+        for (int j = 0; j < font->codepoint_count; ++j)
+        {
+            int c = font->codepoints[j];
+            
+            int glyph_index = stbtt_FindGlyphIndex(&font->info, c);
+            if (glyph_index == 0)
+            {
+                printf("Error: Cannot find glyph index for codepoint (%d) of %s\n", c, font->name);
+                continue;
+            }
+
+            int ix0, iy0, ix1, iy1;
+            stbtt_GetGlyphBitmapBox(&font->info, glyph_index, font->scale, font->scale, &ix0, &iy0, &ix1, &iy1);
+            int gw = ix1 - ix0;
+            int gh = iy1 - iy0;
+            int xoff = ix0;
+            int yoff = iy0;
+
+            if ((gw == 0 && gh == 0))
+            {
+                printf("Error: Cannot get codepoint (%d) of %s\n", c, font->name);
+                continue;
+            }
+
+            // Distance fields reach spread pixels past the outline, the
+            // same box stbtt_GetGlyphSDF uses
+            int channels = 1;
+            if (font->mode != GLYPH_BITMAP)
+            {
+                gw += font->spread * 2;
+                gh += font->spread * 2;
+                xoff -= font->spread;
+                yoff -= font->spread;
+                channels = font->mode == GLYPH_MSDF ? 4 : 1;
+            }
+
+            int advance, lsb;
+            stbtt_GetGlyphHMetrics(&font->info, glyph_index, &advance, &lsb);
+
+            temp_glyphs[temp_glyph_count].font_index = i;
+            temp_glyphs[temp_glyph_count].codepoint = c;
+            temp_glyphs[temp_glyph_count].glyph_index = glyph_index;
+            temp_glyphs[temp_glyph_count].bitmap_offset = bitmap_size;
+            temp_glyphs[temp_glyph_count].channels = channels;
+            temp_glyphs[temp_glyph_count].width = gw;
+            temp_glyphs[temp_glyph_count].height = gh;
+            temp_glyphs[temp_glyph_count].xoff = xoff;
+            temp_glyphs[temp_glyph_count].yoff = yoff;
+            temp_glyphs[temp_glyph_count].xadvance = advance * font->scale;
+
+            bitmap_size += (size_t) gw * gh * channels;
+            temp_glyph_count++;
+        }
+    }
+
+    uint8_t* bitmap_memory = (uint8_t*) calloc(bitmap_size ? bitmap_size : 1, 1);
+    if (!bitmap_memory)
+    {
+        printf("Error: Cannot allocate memory for font bitmaps.\n");
+        return 0;
+    }
+
+    for (int i = 0; i < temp_glyph_count; ++i)
+    {
+        temp_glyphs[i].bitmap = bitmap_memory + temp_glyphs[i].bitmap_offset;
+    }
+
+    if (global_print_stats)
+    {
+        printf("Glyph bitmaps: %d glyphs, %.1f KB\n", temp_glyph_count, (double) bitmap_size / 1024.0);
+    }
+
+    // Rasterize glyphs. Every glyph already owns its slice of bitmap memory,
+    // so the result does not depend on which thread renders it.
+    rasterize_glyphs_work_t rasterize_work = { atlas->fonts, temp_glyphs };
+    ParallelFor(temp_glyph_count, RasterizeGlyphWork, &rasterize_work);
+
+    // Glyphs, identical bitmaps only once, also across fonts
+    int first_glyph_rect = rect_index;
+    bool32_t across_fonts = 0;
+    bool32_t within_fonts = 0;
+    int duplicate_glyphs = AddGlyphRects(atlas, temp_glyphs, temp_glyph_count, 0, rects, &rect_index,
+                                         glyph_slots, &max_grid, &across_fonts);
+
+    free(aliases);
+    free(hashes);
+
+    // Rects covering whole blocks also stay on block boundaries, since the
+    // packer only places rects against the atlas edges and each other. The
+    // same goes for mip levels: on the largest grid, a box texel never
+    // covers two sprites down to the last level any sprite's padding
+    // protects. The grids are powers of two, so block boundaries stay too.
+    int align = atlas->block_align ? TEXTURE_BLOCK_SIZE : 1;
+    if (atlas->mip_levels > 1 && max_grid > align)
+    {
+        align = max_grid;
+    }
+
+    AlignRectSizes(rects, rect_index, align);
+
+    pack_attempt_t result = { 0 };
+    bool32_t packed = 0;
+    cache_entry_t layout = { 0 };
+    global_cache_layout_hit = 0;
+    if (CacheEnabled())
+    {
+        layout.key = GetLayoutCacheKey(atlas, rects, rect_index, DEFAULT_PADDING);
+        layout.key = GetGlyphAliasKey(temp_glyphs, temp_glyph_count, glyph_slots, layout.key);
+        layout.data = TakeCacheEntry(layout.key, "layout", &atlas->baked_layout, &layout.size);
+        if (layout.data && across_fonts && LayoutEntryWithinFonts(layout.data, layout.size))
+        {
+            rect_index = first_glyph_rect;
+            duplicate_glyphs = AddGlyphRects(atlas, temp_glyphs, temp_glyph_count, 1, rects, &rect_index,
+                                             glyph_slots, &max_grid, &across_fonts);
+            AlignRectSizes(rects + first_glyph_rect, rect_index - first_glyph_rect, align);
+            within_fonts = 1;
+        }
+        global_cache_layout_hit = layout.data && UseLayoutEntry(layout.data, layout.size, rects, rect_index, &result);
+    }
+
+    if (global_cache_layout_hit)
+    {
+        printf("Reused cached layout: %d page%s of %dx%d\n", result.page_count,
+               result.page_count == 1 ? "" : "s", result.width, result.height);
+    }
+    else
+    {
+        if (atlas->auto_size)
+        {
+            packed = FindSmallestAtlas(atlas, rects, rect_index, &result);
+
+            // Pages get as large as allowed when nothing fits in one
+            atlas->width = atlas->max_size;
+            if (atlas->power_of_two)
+            {
+                atlas->width = NextPowerOfTwo(atlas->max_size + 1) >> 1;
+            }
+            atlas->height = atlas->width;
+        }
+        else
+        {
+            packed = PackAtlas(atlas->heuristic, atlas->sort_order, rects, rect_index,
+                               atlas->width, atlas->height, 1, &result);
+        }
+
+        if (!packed)
+        {
+            if (across_fonts && !within_fonts)
+            {
+                rect_index = first_glyph_rect;
+                duplicate_glyphs = AddGlyphRects(atlas, temp_glyphs, temp_glyph_count, 1, rects, &rect_index,
+                                                 glyph_slots, &max_grid, &across_fonts);
+                AlignRectSizes(rects + first_glyph_rect, rect_index - first_glyph_rect, align);
+                within_fonts = 1;
+            }
+
+            if (!PaginateAtlas(atlas, rects, rect_index, atlas->width, atlas->height, &result))
+            {
+                printf("Error: Atlas is too small.\n");
+                return 0; // Program will exit, no need to free memory
+            }
+
+            printf("Atlas split into %d pages of %dx%d\n", result.page_count, atlas->width, atlas->height);
+        }
+        else if (atlas->auto_size)
+        {
+            printf("Atlas size: %dx%d\n", result.width, result.height);
+        }
+
+        if (CacheEnabled())
+        {
+            free(layout.data);
+            layout.data = BuildLayoutEntry(&result, rect_index, image_slots, glyph_slots, within_fonts, &layout.size);
+        }
+    }
+
+    if (duplicate_images || duplicate_glyphs)
+    {
+        printf("Merged %d duplicate images and %d duplicate glyphs%s\n", duplicate_images, duplicate_glyphs,
+               within_fonts ? " within each font" : "");
+    }
+
+    if (CacheEnabled())
+    {
+        KeepCacheEntry(layout.key, "layout", layout.data, layout.size, !global_cache_layout_hit, &atlas->baked_layout);
+    }
+
+    atlas->width = result.width;
+    atlas->height = result.height;
+    atlas->page_count = result.page_count;
+
+    if (packed && atlas->heuristic == HEURISTIC_BEST)
+    {
+        printf("Best packing: HEURISTIC %s, SORT_BY %s (%dx%d used)\n",
+               heuristic_names[result.heuristic], sort_order_names[result.sort_order],
+               result.used_width, result.used_height);
+    }
+
+    size_t page_size = (size_t) atlas->width * atlas->height * 4;
+    free(atlas->pixels);
+    atlas->pixels = (uint8_t*) calloc(page_size * atlas->page_count, 1);
+    if (!atlas->pixels)
+    {
+        printf("Error: Cannot allocate memory for atlas.\n");
+        return 0;
+    }
+
+    packed_rect_t* placed = result.rects;
+    for (int i = 0; i < rect_index; ++i)
+    {
+        int content_x = 0;
+        int content_y = 0;
+        int region_width = 0;
+        int region_height = 0;
+        int page = placed[i].page;
+        uint8_t* pixels = atlas->pixels + page * page_size;
+
+        // Place content based on type
+        switch (placed[i].type)
+        {
+            case TYPE_IMAGE: { // Images
+                image_t* img = (image_t*) placed[i].user_data;
+                int padding = GetSpritePadding(atlas, img->width, img->height);
+                content_x = placed[i].x + padding;
+                content_y = placed[i].y + padding;
+                img->x = content_x;
+                img->y = content_y;
+                img->page = page;
+                img->rotated = placed[i].rotated;
+
+                region_width = img->rotated ? img->height : img->width;
+                region_height = img->rotated ? img->width : img->height;
+                size_t stride = (size_t) atlas->width * 4;
+                uint8_t* dst = pixels + ((size_t) content_y * atlas->width + content_x) * 4;
+
+                if (!img->pixels)
+                {
+                    for (int py = 0; py < region_height; ++py)
+                    {
+                        FillRgbaRow(dst + py*stride, 0xFFFFFFFF, region_width);
+                    }
+                }
+                else if (!img->rotated)
+                {
+                    for (int py = 0; py < img->height; ++py)
+                    {
+                        CopyRgbaRow(dst + py*stride, img->pixels + (size_t) py * img->width * 4, img->width);
+                    }
+                }
+                else
+                {
+                    // Turned clockwise the source row py becomes the atlas column height - 1 - py
+                    for (int py = 0; py < img->height; ++py)
+                    {
+                        const uint8_t* src = img->pixels + (size_t) py * img->width * 4;
+                        uint8_t* column = dst + (img->height - 1 - py) * 4;
+                        for (int px = 0; px < img->width; ++px)
+                        {
+                            memcpy(column + px*stride, src + px*4, 4);
+                        }
+                    }
+                }
+            } break;
+            
+            case TYPE_GLYPH: { // Fonts
+                packed_glyph_t* glyph = (packed_glyph_t*) placed[i].user_data;
+                int padding = GetSpritePadding(atlas, glyph->width, glyph->height);
+                content_x = placed[i].x + padding;
+                content_y = placed[i].y + padding;
+                region_width = glyph->width;
+                region_height = glyph->height;
+
+                for (int py = 0; py < glyph->height; ++py)
+                {
+                    uint8_t* dst = pixels + ((size_t) (content_y + py) * atlas->width + content_x) * 4;
+                    if (glyph->channels == 4)
+                    {
+                        CopyRgbaRow(dst, glyph->bitmap + (size_t) py * glyph->width * 4, glyph->width);
+                    }
+                    else
+                    {
+                        global_expand_alpha_row(dst, glyph->bitmap + py * glyph->width, glyph->width);
+                    }
+                }
+
+                glyph->x = content_x;
+                glyph->y = content_y;
+                glyph->page = page;
+            } break;
+        }
+
+        if (atlas->mip_levels > 1)
+        {
+            ExtrudeSprite(pixels, atlas->width, &placed[i], content_x, content_y, region_width, region_height);
+        }
+    }
+
+    // Duplicates take the region of the one that was packed
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        image_t* img = &atlas->images[i];
+        if (img->alias != -1)
+        {
+            image_t* source = &atlas->images[img->alias];
+            img->x = source->x;
+            img->y = source->y;
+            img->page = source->page;
+            img->rotated = source->rotated;
+        }
+    }
+
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        atlas->fonts[i].glyphs = (glyph_mapping_t*) calloc(atlas->fonts[i].codepoint_count + 1, sizeof(glyph_mapping_t));
+    }
+
+    for (int i = 0; i < temp_glyph_count; ++i)
+    {
+        packed_glyph_t* glyph = &temp_glyphs[i];
+        packed_glyph_t* source = glyph->alias != -1 ? &temp_glyphs[glyph->alias] : glyph;
+        font_t* font = &atlas->fonts[glyph->font_index];
+
+        font->glyphs[font->glyph_count] = (glyph_mapping_t){
+            .codepoint = glyph->codepoint,
+            .glyph_index = glyph->glyph_index,
+            .glyph = {
+                .u0 = (float)source->x / (float)atlas->width,
+                .v0 = (float)source->y / (float)atlas->height,
+                .u1 = (float)(source->x + glyph->width) / (float)atlas->width,
+                .v1 = (float)(source->y + glyph->height) / (float)atlas->height,
+                .xoff = (float)glyph->xoff,
+                .yoff = (float)glyph->yoff,
+                .xadvance = glyph->xadvance,
+                .w = glyph->width,
+                .h = glyph->height,
+                .page = source->page,
+            }
+        };
+        font->glyph_count++;
+    }
+
+    CollectKerning(atlas);
+
+    for (int i = 0; i < atlas->font_count && CacheEnabled(); ++i)
+    {
+        cache_entry_t* entry = &font_entries[i];
+        bool32_t built = !entry->data;
+        if (built)
+        {
+            entry->data = BuildFontEntry(i, &atlas->fonts[i], temp_glyphs, temp_glyph_count, &entry->size);
+        }
+        KeepCacheEntry(entry->key, "font", entry->data, entry->size, built, &atlas->fonts[i].baked);
+    }
+
+    // Cleanup
+    free(font_entries);
+    free(image_slots);
+    free(glyph_slots);
+    free(result.rects);
+    free(rects);
+    free(bitmap_memory);
+    free(temp_glyphs);
+    
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Premultiplied alpha
+//////////////////////////////////////////////////////////////////////////////
+
+// With PREMULTIPLY the packed pages get their color multiplied by alpha, so
+// the runtime blends with ONE, ONE_MINUS_SRC_ALPHA and filtering no longer
+// pulls the color of transparent texels into the edges. Bands of rows are
+// done on the worker threads.
+//
+// - LINEAR: the sRGB bytes are decoded, multiplied in linear light and
+//   encoded again, which is what an sRGB texture blended in a linear
+//   framebuffer needs. A 256x256 table of alpha by color holds the results.
+// - GAMMA: the stored bytes are multiplied as they are, exact in integers,
+//   for pipelines that blend sRGB values directly.
+//
+// Runs of fully opaque or fully transparent pixels, most of an atlas, are
+// found four at a time and skipped or cleared.
+
+#define PREMULTIPLY_BAND_ROWS 64
+
+GLOBAL uint8_t global_premultiply_table[256][256];    // [alpha][color]
+GLOBAL bool32_t global_premultiply_table_ready;
+
+INTERNAL double
+SrgbToLinear(double value)
+{
+    return value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+}
+
+INTERNAL double
+LinearToSrgb(double value)
+{
+    return value <= 0.0031308 ? value * 12.92 : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+}
+
+INTERNAL void
+InitPremultiplyTable(void)
+{
+    double linear[256];
+    for (int c = 0; c < 256; ++c)
+    {
+        linear[c] = SrgbToLinear(c / 255.0);
+    }
+
+    for (int a = 0; a < 256; ++a)
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            global_premultiply_table[a][c] = (uint8_t) floor(LinearToSrgb(linear[c] * a / 255.0) * 255.0 + 0.5);
+        }
+    }
+    global_premultiply_table_ready = 1;
+}
+
+// Rounded color * alpha / 255
+INTERNAL uint8_t
+MultiplyAlpha(int color, int alpha)
+{
+    int t = color * alpha + 128;
+    return (uint8_t) ((t + (t >> 8)) >> 8);
+}
+
+INTERNAL void
+PremultiplyRowGammaScalar(uint8_t* row, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        uint8_t* pixel = row + i*4;
+        pixel[0] = MultiplyAlpha(pixel[0], pixel[3]);
+        pixel[1] = MultiplyAlpha(pixel[1], pixel[3]);
+        pixel[2] = MultiplyAlpha(pixel[2], pixel[3]);
+    }
+}
+
+INTERNAL void
+PremultiplyRowLinearScalar(uint8_t* row, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        uint8_t* pixel = row + i*4;
+        const uint8_t* table = global_premultiply_table[pixel[3]];
+        pixel[0] = table[pixel[0]];
+        pixel[1] = table[pixel[1]];
+        pixel[2] = table[pixel[2]];
+    }
+}
+
+INTERNAL void
+PremultiplyRowGamma(uint8_t* row, int count)
+{
+    int i = 0;
+
+#if defined(SIMD_SSE2)
+    // Each alpha is spread over its pixel's four 16-bit lanes, the alpha
+    // lane itself is put back afterwards
+    __m128i zero = _mm_setzero_si128();
+    __m128i half = _mm_set1_epi16(128);
+    __m128i alpha_mask = _mm_set1_epi32((int) 0xFF000000);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*) (row + i*4));
+        __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+        __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+        __m128i alpha_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i alpha_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+        lo = _mm_add_epi16(_mm_mullo_epi16(lo, alpha_lo), half);
+        hi = _mm_add_epi16(_mm_mullo_epi16(hi, alpha_hi), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+        __m128i color = _mm_andnot_si128(alpha_mask, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128((__m128i*) (row + i*4), _mm_or_si128(color, _mm_and_si128(pixels, alpha_mask)));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16x4_t pixels = vld4q_u8(row + i*4);
+        for (int c = 0; c < 3; ++c)
+        {
+            // p + ((p + 128) >> 8), then + 128 >> 8 again
+            uint16x8_t lo = vmull_u8(vget_low_u8(pixels.val[c]), vget_low_u8(pixels.val[3]));
+            uint16x8_t hi = vmull_u8(vget_high_u8(pixels.val[c]), vget_high_u8(pixels.val[3]));
+            lo = vrsraq_n_u16(lo, lo, 8);
+            hi = vrsraq_n_u16(hi, hi, 8);
+            pixels.val[c] = vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+        }
+        vst4q_u8(row + i*4, pixels);
+    }
+#endif
+
+    PremultiplyRowGammaScalar(row + i*4, count - i);
+}
+
+INTERNAL void
+PremultiplyRowLinear(uint8_t* row, int count)
+{
+    int i = 0;
+
+#if defined(SIMD_SSE2)
+    __m128i alpha_mask = _mm_set1_epi32((int) 0xFF000000);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*) (row + i*4));
+        __m128i alpha = _mm_and_si128(pixels, alpha_mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alpha_mask)) == 0xFFFF)
+        {
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_setzero_si128())) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i*) (row + i*4), _mm_setzero_si128());
+            continue;
+        }
+        PremultiplyRowLinearScalar(row + i*4, 4);
+    }
+#elif defined(SIMD_NEON)
+    uint32x4_t alpha_mask = vdupq_n_u32(0xFF000000);
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32x4_t alpha = vandq_u32(vld1q_u32((const uint32_t*) (row + i*4)), alpha_mask);
+        if (vminvq_u32(alpha) == 0xFF000000)
+        {
+            continue;
+        }
+        if (vmaxvq_u32(alpha) == 0)
+        {
+            vst1q_u32((uint32_t*) (row + i*4), vdupq_n_u32(0));
+            continue;
+        }
+        PremultiplyRowLinearScalar(row + i*4, 4);
+    }
+#endif
+
+    PremultiplyRowLinearScalar(row + i*4, count - i);
+}
+
+typedef struct
+{
+    uint8_t* pixels;
+    int width;
+    int rows;
+    alpha_mode_t mode;
+} premultiply_work_t;
+
+INTERNAL void
+PremultiplyBandWork(void* data, int index)
+{
+    premultiply_work_t* work = (premultiply_work_t*) data;
+    int y0 = index * PREMULTIPLY_BAND_ROWS;
+    int y1 = y0 + PREMULTIPLY_BAND_ROWS < work->rows ? y0 + PREMULTIPLY_BAND_ROWS : work->rows;
+    for (int y = y0; y < y1; ++y)
+    {
+        uint8_t* row = work->pixels + (size_t) y * work->width * 4;
+        if (work->mode == ALPHA_PREMULTIPLIED)
+        {
+            PremultiplyRowLinear(row, work->width);
+        }
+        else
+        {
+            PremultiplyRowGamma(row, work->width);
+        }
+    }
+}
+
+// Applies the atlas alpha mode to every page
+INTERNAL void
+PremultiplyAtlas(atlas_t* atlas)
+{
+    if (atlas->alpha_mode == ALPHA_STRAIGHT)
+    {
+        return;
+    }
+
+    if (!global_premultiply_table_ready)
+    {
+        InitPremultiplyTable();
+    }
+
+    // The pages follow each other, so they are one tall image
+    premultiply_work_t work = { atlas->pixels, (int) atlas->width, (int) atlas->height * atlas->page_count, atlas->alpha_mode };
+    ParallelFor((work.rows + PREMULTIPLY_BAND_ROWS - 1) / PREMULTIPLY_BAND_ROWS, PremultiplyBandWork, &work);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// PNG writer
+//////////////////////////////////////////////////////////////////////////////
+
+// The image is cut into bands of rows that are filtered and deflated on the
+// worker threads. Each band ends with an empty stored block (a sync flush)
+// so it stops on a byte boundary, which lets the bands follow each other as
+// one zlib stream: band 0 starts with the zlib header, a last empty block
+// ends the stream and the band Adler-32s are combined. Every band is its own
+// IDAT chunk, so the chunk CRCs are computed in parallel too.
+//
+// Matches never reach back into the previous band, which costs a little
+// size on bands of a few hundred KB. Level 0 only stores; higher levels
+// search longer hash chains and, from level 4, try a lazy match one byte
+// ahead, like zlib's levels.
+
+#define PNG_BAND_BYTES MEGABYTES(1)
+#define PNG_DEFAULT_LEVEL 6
+#define PNG_MAX_LEVEL 9
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_BLOCK_TOKENS 32768
+#define DEFLATE_MAX_STORED 65535
+#define DEFLATE_MAX_CODE_LENGTH 15
+#define DEFLATE_MAX_CL_CODE_LENGTH 7
+#define DEFLATE_LITLEN_CODES 286
+#define DEFLATE_DIST_CODES 30
+#define DEFLATE_CL_CODES 19
+
+typedef struct
+{
+    int max_chain;              // Candidates tried per position
+    int nice_length;            // Stop searching at a match this long
+    bool32_t lazy;              // Try a longer match one byte ahead
+} deflate_level_t;
+
+GLOBAL const deflate_level_t deflate_levels[PNG_MAX_LEVEL + 1] = {
+    { 0, 0, 0 },                // Stored
+    { 4, 16, 0 },
+    { 8, 32, 0 },
+    { 16, 64, 0 },
+    { 16, 32, 1 },
+    { 32, 64, 1 },
+    { 64, 128, 1 },
+    { 128, 128, 1 },
+    { 512, 258, 1 },
+    { 4096, 258, 1 },
+};
+
+GLOBAL int global_png_level = PNG_DEFAULT_LEVEL;
+
+GLOBAL const uint16_t deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+GLOBAL const uint8_t deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+GLOBAL const uint16_t deflate_dist_base[DEFLATE_DIST_CODES] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+GLOBAL const uint8_t deflate_dist_extra[DEFLATE_DIST_CODES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+GLOBAL const uint8_t deflate_cl_order[DEFLATE_CL_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+// Symbol lookups, filled once by InitPngWriter
+GLOBAL uint8_t deflate_length_code[DEFLATE_MAX_MATCH + 1];
+GLOBAL uint8_t deflate_dist_code_low[512];      // Distances 1 to 512
+GLOBAL uint8_t deflate_dist_code_high[256];     // (distance - 1) >> 8 past that
+GLOBAL uint32_t crc32_table[256];
+
+typedef struct
+{
+    uint16_t length;            // Match length, or the literal when distance is 0
+    uint16_t distance;
+} deflate_token_t;
+
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    uint64_t bits;
+    int bit_count;
+} bit_writer_t;
+
+INTERNAL void
+InitPngWriter(void)
+{
+    for (int code = 0; code < 29; ++code)
+    {
+        int end = (code == 28) ? DEFLATE_MAX_MATCH + 1 : deflate_length_base[code + 1];
+        for (int length = deflate_length_base[code]; length < end; ++length)
+        {
+            deflate_length_code[length] = (uint8_t) code;
+        }
+    }
+    deflate_length_code[DEFLATE_MAX_MATCH] = 28;
+
+    for (int code = 0; code < DEFLATE_DIST_CODES; ++code)
+    {
+        int end = (code == DEFLATE_DIST_CODES - 1) ? DEFLATE_WINDOW + 1 : deflate_dist_base[code + 1];
+        for (int distance = deflate_dist_base[code]; distance < end; ++distance)
+        {
+            if (distance <= 512)
+            {
+                deflate_dist_code_low[distance - 1] = (uint8_t) code;
+            }
+            else
+            {
+                deflate_dist_code_high[(distance - 1) >> 8] = (uint8_t) code;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crc32_table[i] = crc;
+    }
+}
+
+INTERNAL int
+DeflateDistanceCode(int distance)
+{
+    return distance <= 512 ? deflate_dist_code_low[distance - 1] : deflate_dist_code_high[(distance - 1) >> 8];
+}
+
+INTERNAL uint32_t
+Crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define ADLER32_BASE 65521
+#define ADLER32_NMAX 5552       // Most bytes before the sums can overflow 32 bits
+
+INTERNAL uint32_t
+Adler32(uint32_t adler, const uint8_t* data, size_t size)
+{
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (size > 0)
+    {
+        size_t chunk = size < ADLER32_NMAX ? size : ADLER32_NMAX;
+        size -= chunk;
+        for (size_t i = 0; i < chunk; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        data += chunk;
+        a %= ADLER32_BASE;
+        b %= ADLER32_BASE;
+    }
+    return (b << 16) | a;
+}
+
+// Adler-32 of two buffers back to back, from the checksum of each and the
+// size of the second
+INTERNAL uint32_t
+Adler32Combine(uint32_t first, uint32_t second, size_t second_size)
+{
+    uint32_t remainder = (uint32_t) (second_size % ADLER32_BASE);
+    uint32_t a = first & 0xFFFF;
+    uint32_t b = (uint32_t) (((uint64_t) remainder * a) % ADLER32_BASE);
+    a += (second & 0xFFFF) + ADLER32_BASE - 1;
+    b += (first >> 16) + (second >> 16) + ADLER32_BASE - remainder;
+    if (a >= ADLER32_BASE) a -= ADLER32_BASE;
+    if (a >= ADLER32_BASE) a -= ADLER32_BASE;
+    if (b >= ADLER32_BASE * 2) b -= ADLER32_BASE * 2;
+    if (b >= ADLER32_BASE) b -= ADLER32_BASE;
+    return (b << 16) | a;
+}
+
+INTERNAL void
+ReserveBits(bit_writer_t* writer, size_t bytes)
+{
+    if (writer->size + bytes > writer->capacity)
+    {
+        size_t capacity = writer->capacity ? writer->capacity : KILOBYTES(64);
+        while (writer->size + bytes > capacity)
+        {
+            capacity *= 2;
+        }
+        writer->data = (uint8_t*) realloc(writer->data, capacity);
+        writer->capacity = capacity;
+    }
+}
+
+// Deflate packs bits from the least significant end; count is at most 32
+INTERNAL void
+PutBits(bit_writer_t* writer, uint32_t value, int count)
+{
+    writer->bits |= (uint64_t) value << writer->bit_count;
+    writer->bit_count += count;
+    if (writer->bit_count >= 32)
+    {
+        ReserveBits(writer, 4);
+        for (int i = 0; i < 4; ++i)
+        {
+            writer->data[writer->size++] = (uint8_t) writer->bits;
+            writer->bits >>= 8;
+        }
+        writer->bit_count -= 32;
+    }
+}
+
+INTERNAL void
+AlignBits(bit_writer_t* writer)
+{
+    ReserveBits(writer, 8);
+    while (writer->bit_count > 0)
+    {
+        writer->data[writer->size++] = (uint8_t) writer->bits;
+        writer->bits >>= 8;
+        writer->bit_count = writer->bit_count > 8 ? writer->bit_count - 8 : 0;
+    }
+    writer->bits = 0;
+}
+
+INTERNAL void
+PutBytes(bit_writer_t* writer, const void* data, size_t size)
+{
+    ReserveBits(writer, size);
+    memcpy(writer->data + writer->size, data, size);
+    writer->size += size;
+}
+
+// Non-final stored blocks; with size 0 this is the sync flush
+INTERNAL void
+DeflateStored(bit_writer_t* writer, const uint8_t* data, size_t size)
+{
+    do
+    {
+        size_t chunk = size < DEFLATE_MAX_STORED ? size : DEFLATE_MAX_STORED;
+        PutBits(writer, 0, 3);
+        AlignBits(writer);
+        uint8_t header[4] = {
+            (uint8_t) chunk, (uint8_t) (chunk >> 8),
+            (uint8_t) ~chunk, (uint8_t) (~chunk >> 8),
+        };
+        PutBytes(writer, header, 4);
+        if (chunk)
+        {
+            PutBytes(writer, data, chunk);
+        }
+        data += chunk;
+        size -= chunk;
+    } while (size > 0);
+}
+
+typedef struct
+{
+    uint32_t key;               // Frequency, then reused by the length pass
+    uint16_t symbol;
+} huffman_symbol_t;
+
+INTERNAL int
+CompareHuffmanSymbols(const void* a, const void* b)
+{
+    const huffman_symbol_t* sa = (const huffman_symbol_t*) a;
+    const huffman_symbol_t* sb = (const huffman_symbol_t*) b;
+    if (sa->key != sb->key) return sa->key < sb->key ? -1 : 1;
+    return (int) sa->symbol - (int) sb->symbol;
+}
+
+// Code lengths of an optimal prefix code limited to max_length bits. The
+// lengths come from Moffat and Katajainen's in-place method over the sorted
+// frequencies; codes past the limit are then pulled in and the tree
+// rebalanced by lengthening the deepest codes that still have room.
+INTERNAL void
+BuildHuffmanLengths(const uint32_t* freq, int count, int max_length, OUT uint8_t* lengths)
+{
+    huffman_symbol_t symbols[DEFLATE_LITLEN_CODES];
+    int used = 0;
+    memset(lengths, 0, count);
+    for (int i = 0; i < count; ++i)
+    {
+        if (freq[i])
+        {
+            symbols[used++] = (huffman_symbol_t){ freq[i], (uint16_t) i };
+        }
+    }
+    if (used == 0)
+    {
+        return;
+    }
+    if (used == 1)
+    {
+        lengths[symbols[0].symbol] = 1;
+        return;
+    }
+    qsort(symbols, used, sizeof(huffman_symbol_t), CompareHuffmanSymbols);
+
+    // Parent pointers, then depths, then the leaf depths
+    huffman_symbol_t* a = symbols;
+    int n = used;
+    a[0].key += a[1].key;
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; ++next)
+    {
+        if (leaf >= n || a[root].key < a[leaf].key)
+        {
+            a[next].key = a[root].key;
+            a[root++].key = (uint32_t) next;
+        }
+        else
+        {
+            a[next].key = a[leaf++].key;
+        }
+        if (leaf >= n || (root < next && a[root].key < a[leaf].key))
+        {
+            a[next].key += a[root].key;
+            a[root++].key = (uint32_t) next;
+        }
+        else
+        {
+            a[next].key += a[leaf++].key;
+        }
+    }
+    a[n - 2].key = 0;
+    for (int next = n - 3; next >= 0; --next)
+    {
+        a[next].key = a[a[next].key].key + 1;
+    }
+    int available = 1, taken = 0, depth = 0;
+    root = n - 2;
+    int next = n - 1;
+    while (available > 0)
+    {
+        while (root >= 0 && (int) a[root].key == depth)
+        {
+            taken++;
+            root--;
+        }
+        while (available > taken)
+        {
+            a[next--].key = (uint32_t) depth;
+            available--;
+        }
+        available = 2 * taken;
+        depth++;
+        taken = 0;
+    }
+
+    int length_counts[33] = { 0 };
+    for (int i = 0; i < n; ++i)
+    {
+        length_counts[a[i].key < 32 ? a[i].key : 32]++;
+    }
+    for (int length = max_length + 1; length <= 32; ++length)
+    {
+        length_counts[max_length] += length_counts[length];
+    }
+    uint32_t total = 0;
+    for (int length = max_length; length > 0; --length)
+    {
+        total += (uint32_t) length_counts[length] << (max_length - length);
+    }
+    while (total != (1u << max_length))
+    {
+        length_counts[max_length]--;
+        for (int length = max_length - 1; length > 0; --length)
+        {
+            if (length_counts[length])
+            {
+                length_counts[length]--;
+                length_counts[length + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // Rarest symbols get the longest codes
+    int symbol = n;
+    for (int length = 1; length <= max_length; ++length)
+    {
+        for (int i = length_counts[length]; i > 0; --i)
+        {
+            lengths[a[--symbol].symbol] = (uint8_t) length;
+        }
+    }
+}
+
+// Canonical codes, bit reversed since deflate sends Huffman codes starting
+// from the most significant bit
+INTERNAL void
+BuildHuffmanCodes(const uint8_t* lengths, int count, OUT uint16_t* codes)
+{
+    int length_counts[DEFLATE_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int i = 0; i < count; ++i)
+    {
+        length_counts[lengths[i]]++;
+    }
+    length_counts[0] = 0;
+
+    int next_code[DEFLATE_MAX_CODE_LENGTH + 1];
+    int code = 0;
+    for (int length = 1; length <= DEFLATE_MAX_CODE_LENGTH; ++length)
+    {
+        code = (code + length_counts[length - 1]) << 1;
+        next_code[length] = code;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        int length = lengths[i];
+        codes[i] = 0;
+        if (length)
+        {
+            int value = next_code[length]++;
+            int reversed = 0;
+            for (int bit = 0; bit < length; ++bit)
+            {
+                reversed = (reversed << 1) | ((value >> bit) & 1);
+            }
+            codes[i] = (uint16_t) reversed;
+        }
+    }
+}
+
+// Writes one dynamic Huffman block for the tokens, or stored blocks for the
+// raw bytes they cover when that is smaller
+INTERNAL void
+DeflateBlock(bit_writer_t* writer, const deflate_token_t* tokens, int token_count, const uint8_t* raw, size_t raw_size)
+{
+    uint32_t litlen_freq[DEFLATE_LITLEN_CODES] = { 0 };
+    uint32_t dist_freq[DEFLATE_DIST_CODES] = { 0 };
+    for (int i = 0; i < token_count; ++i)
+    {
+        if (tokens[i].distance == 0)
+        {
+            litlen_freq[tokens[i].length]++;
+        }
+        else
+        {
+            litlen_freq[257 + deflate_length_code[tokens[i].length]]++;
+            dist_freq[DeflateDistanceCode(tokens[i].distance)]++;
+        }
+    }
+    litlen_freq[256] = 1;
+
+    uint8_t lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    uint8_t* litlen_lengths = lengths;
+    uint8_t* dist_lengths = lengths + DEFLATE_LITLEN_CODES;
+    BuildHuffmanLengths(litlen_freq, DEFLATE_LITLEN_CODES, DEFLATE_MAX_CODE_LENGTH, litlen_lengths);
+    BuildHuffmanLengths(dist_freq, DEFLATE_DIST_CODES, DEFLATE_MAX_CODE_LENGTH, dist_lengths);
+
+    int litlen_count = DEFLATE_LITLEN_CODES;
+    while (litlen_count > 257 && litlen_lengths[litlen_count - 1] == 0)
+    {
+        litlen_count--;
+    }
+    int dist_count = DEFLATE_DIST_CODES;
+    while (dist_count > 1 && dist_lengths[dist_count - 1] == 0)
+    {
+        dist_count--;
+    }
+
+    // The two code length lists are sent back to back, run-length coded
+    // with symbols 16 (repeat the last length), 17 and 18 (runs of zeros)
+    uint8_t all_lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    memcpy(all_lengths, litlen_lengths, litlen_count);
+    memcpy(all_lengths + litlen_count, dist_lengths, dist_count);
+    int all_count = litlen_count + dist_count;
+
+    uint8_t cl_symbols[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    uint8_t cl_extra[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    int cl_count = 0;
+    uint32_t cl_freq[DEFLATE_CL_CODES] = { 0 };
+    for (int i = 0; i < all_count;)
+    {
+        int length = all_lengths[i];
+        int run = 1;
+        while (i + run < all_count && all_lengths[i + run] == length)
+        {
+            run++;
+        }
+        i += run;
+
+        if (length == 0)
+        {
+            while (run >= 11)
+            {
+                int step = run < 138 ? run : 138;
+                cl_symbols[cl_count] = 18;
+                cl_extra[cl_count++] = (uint8_t) (step - 11);
+                run -= step;
+            }
+            if (run >= 3)
+            {
+                cl_symbols[cl_count] = 17;
+                cl_extra[cl_count++] = (uint8_t) (run - 3);
+                run = 0;
+            }
+        }
+        else
+        {
+            cl_symbols[cl_count] = (uint8_t) length;
+            cl_extra[cl_count++] = 0;
+            run--;
+            while (run >= 3)
+            {
+                int step = run < 6 ? run : 6;
+                cl_symbols[cl_count] = 16;
+                cl_extra[cl_count++] = (uint8_t) (step - 3);
+                run -= step;
+            }
+        }
+        while (run-- > 0)
+        {
+            cl_symbols[cl_count] = (uint8_t) length;
+            cl_extra[cl_count++] = 0;
+        }
+    }
+    for (int i = 0; i < cl_count; ++i)
+    {
+        cl_freq[cl_symbols[i]]++;
+    }
+
+    uint8_t cl_lengths[DEFLATE_CL_CODES];
+    BuildHuffmanLengths(cl_freq, DEFLATE_CL_CODES, DEFLATE_MAX_CL_CODE_LENGTH, cl_lengths);
+    int cl_order_count = DEFLATE_CL_CODES;
+    while (cl_order_count > 4 && cl_lengths[deflate_cl_order[cl_order_count - 1]] == 0)
+    {
+        cl_order_count--;
+    }
+
+    static const uint8_t cl_extra_bits[DEFLATE_CL_CODES] = { [16] = 2, [17] = 3, [18] = 7 };
+    uint64_t bits = 3 + 5 + 5 + 4 + 3 * cl_order_count;
+    for (int i = 0; i < DEFLATE_CL_CODES; ++i)
+    {
+        bits += (uint64_t) cl_freq[i] * (cl_lengths[i] + cl_extra_bits[i]);
+    }
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; ++i)
+    {
+        bits += (uint64_t) litlen_freq[i] * (litlen_lengths[i] + (i >= 257 ? deflate_length_extra[i - 257] : 0));
+    }
+    for (int i = 0; i < DEFLATE_DIST_CODES; ++i)
+    {
+        bits += (uint64_t) dist_freq[i] * (dist_lengths[i] + deflate_dist_extra[i]);
+    }
+    uint64_t stored_bits = (raw_size + 5 * (raw_size / DEFLATE_MAX_STORED + 1)) * 8;
+    if (stored_bits <= bits)
+    {
+        DeflateStored(writer, raw, raw_size);
+        return;
+    }
+
+    uint16_t litlen_codes[DEFLATE_LITLEN_CODES];
+    uint16_t dist_codes[DEFLATE_DIST_CODES];
+    uint16_t cl_codes[DEFLATE_CL_CODES];
+    BuildHuffmanCodes(litlen_lengths, DEFLATE_LITLEN_CODES, litlen_codes);
+    BuildHuffmanCodes(dist_lengths, DEFLATE_DIST_CODES, dist_codes);
+    BuildHuffmanCodes(cl_lengths, DEFLATE_CL_CODES, cl_codes);
+
+    PutBits(writer, 2 << 1, 3);         // Not final, dynamic Huffman
+    PutBits(writer, litlen_count - 257, 5);
+    PutBits(writer, dist_count - 1, 5);
+    PutBits(writer, cl_order_count - 4, 4);
+    for (int i = 0; i < cl_order_count; ++i)
+    {
+        PutBits(writer, cl_lengths[deflate_cl_order[i]], 3);
+    }
+    for (int i = 0; i < cl_count; ++i)
+    {
+        int symbol = cl_symbols[i];
+        PutBits(writer, cl_codes[symbol], cl_lengths[symbol]);
+        if (cl_extra_bits[symbol])
+        {
+            PutBits(writer, cl_extra[i], cl_extra_bits[symbol]);
+        }
+    }
+
+    for (int i = 0; i < token_count; ++i)
+    {
+        deflate_token_t token = tokens[i];
+        if (token.distance == 0)
+        {
+            PutBits(writer, litlen_codes[token.length], litlen_lengths[token.length]);
+        }
+        else
+        {
+            int code = deflate_length_code[token.length];
+            PutBits(writer, litlen_codes[257 + code], litlen_lengths[257 + code]);
+            PutBits(writer, token.length - deflate_length_base[code], deflate_length_extra[code]);
+            code = DeflateDistanceCode(token.distance);
+            PutBits(writer, dist_codes[code], dist_lengths[code]);
+            PutBits(writer, token.distance - deflate_dist_base[code], deflate_dist_extra[code]);
+        }
+    }
+    PutBits(writer, litlen_codes[256], litlen_lengths[256]);
+}
+
+INTERNAL uint32_t
+DeflateHash(const uint8_t* data)
+{
+    uint32_t value = (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16);
+    return (value * 0x9E3779B1u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+INTERNAL int
+CountMatchingBytes(const uint8_t* a, const uint8_t* b, int limit)
+{
+    int length = 0;
+    while (length + 8 <= limit)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y)
+        {
+            break;
+        }
+        length += 8;
+    }
+    while (length < limit && a[length] == b[length])
+    {
+        length++;
+    }
+    return length;
+}
+
+typedef struct
+{
+    const uint8_t* data;
+    int size;
+    int32_t* head;              // Last position per hash, -1 when none
+    int32_t* prev;              // Previous position with the same hash
+    const deflate_level_t* level;
+} deflate_matcher_t;
+
+INTERNAL void
+DeflateInsert(deflate_matcher_t* m, int position)
+{
+    if (position + DEFLATE_MIN_MATCH <= m->size)
+    {
+        uint32_t hash = DeflateHash(m->data + position);
+        m->prev[position] = m->head[hash];
+        m->head[hash] = position;
+    }
+}
+
+// Longest match for position among the positions already inserted
+INTERNAL int
+DeflateFindMatch(deflate_matcher_t* m, int position, OUT int* distance)
+{
+    int limit = m->size - position;
+    if (limit > DEFLATE_MAX_MATCH) limit = DEFLATE_MAX_MATCH;
+    if (limit < DEFLATE_MIN_MATCH)
+    {
+        return 0;
+    }
+
+    const uint8_t* current = m->data + position;
+    int best = DEFLATE_MIN_MATCH - 1;
+    int chain = m->level->max_chain;
+    int candidate = m->head[DeflateHash(current)];
+    while (candidate >= 0 && position - candidate <= DEFLATE_WINDOW && chain-- > 0)
+    {
+        const uint8_t* other = m->data + candidate;
+        if (other[best] == current[best] && other[0] == current[0])
+        {
+            int length = CountMatchingBytes(other, current, limit);
+            if (length > best)
+            {
+                best = length;
+                *distance = position - candidate;
+                if (length >= m->level->nice_length || length == limit)
+                {
+                    break;
+                }
+            }
+        }
+        candidate = m->prev[candidate];
+    }
+
+    return best >= DEFLATE_MIN_MATCH ? best : 0;
+}
+
+// Compresses the data as non-final blocks followed by a sync flush, so the
+// output ends on a byte boundary and more blocks can follow it
+INTERNAL void
+DeflateBand(bit_writer_t* writer, const uint8_t* data, int size, int level)
+{
+    if (level == 0)
+    {
+        if (size > 0)
+        {
+            DeflateStored(writer, data, size);
+        }
+        DeflateStored(writer, 0, 0);
+        return;
+    }
+
+    deflate_matcher_t m = { 0 };
+    m.data = data;
+    m.size = size;
+    m.level = &deflate_levels[level];
+    m.head = (int32_t*) malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+    m.prev = (int32_t*) malloc(sizeof(int32_t) * (size_t) (size > 0 ? size : 1));
+    memset(m.head, 0xFF, sizeof(int32_t) << DEFLATE_HASH_BITS);
+    deflate_token_t* tokens = (deflate_token_t*) malloc(sizeof(deflate_token_t) * DEFLATE_BLOCK_TOKENS);
+
+    int token_count = 0;
+    int block_start = 0;
+    int next_position = -1;     // Match already found one byte ahead by the lazy check
+    int next_length = 0, next_distance = 0;
+    int position = 0;
+    while (position < size)
+    {
+        int distance = 0;
+        int length;
+        if (position == next_position)
+        {
+            length = next_length;
+            distance = next_distance;
+        }
+        else
+        {
+            length = DeflateFindMatch(&m, position, &distance);
+        }
+        DeflateInsert(&m, position);
+
+        if (length && m.level->lazy && length < m.level->nice_length)
+        {
+            next_position = position + 1;
+            next_distance = 0;
+            next_length = DeflateFindMatch(&m, next_position, &next_distance);
+            if (next_length > length)
+            {
+                length = 0;
+            }
+        }
+
+        if (length)
+        {
+            tokens[token_count++] = (deflate_token_t){ (uint16_t) length, (uint16_t) distance };
+            for (int i = 1; i < length; ++i)
+            {
+                DeflateInsert(&m, position + i);
+            }
+            position += length;
+        }
+        else
+        {
+            tokens[token_count++] = (deflate_token_t){ data[position], 0 };
+            position++;
+        }
+
+        if (token_count == DEFLATE_BLOCK_TOKENS)
+        {
+            DeflateBlock(writer, tokens, token_count, data + block_start, position - block_start);
+            token_count = 0;
+            block_start = position;
+        }
+    }
+    if (token_count > 0)
+    {
+        DeflateBlock(writer, tokens, token_count, data + block_start, position - block_start);
+    }
+    DeflateStored(writer, 0, 0);
+
+    free(tokens);
+    free(m.prev);
+    free(m.head);
+}
+
+INTERNAL int
+PaethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+INTERNAL int
+PngPredict(int filter, int left, int up, int up_left)
+{
+    switch (filter)
+    {
+        case 1: return left;
+        case 2: return up;
+        case 3: return (left + up) >> 1;
+        case 4: return PaethPredictor(left, up, up_left);
+    }
+    return 0;
+}
+
+// Filters one RGBA row into out (filter type byte first); above is a row of
+// zeros for the first row. Level 0 stores rows unfiltered, otherwise the
+// filter with the smallest sum of absolute signed differences is used, the
+// usual PNG heuristic.
+INTERNAL void
+FilterPngRow(uint8_t* out, const uint8_t* row, const uint8_t* above, int width, int level)
+{
+    int size = width * 4;
+    if (level == 0)
+    {
+        out[0] = 0;
+        memcpy(out + 1, row, size);
+        return;
+    }
+
+    // The first pixel has no left neighbour
+    uint32_t costs[5] = { 0 };
+    for (int i = 0; i < 4 && i < size; ++i)
+    {
+        int up = above[i];
+        costs[0] += abs((int8_t) row[i]);
+        costs[1] += abs((int8_t) row[i]);
+        costs[2] += abs((int8_t) (row[i] - up));
+        costs[3] += abs((int8_t) (row[i] - (up >> 1)));
+        costs[4] += abs((int8_t) (row[i] - up));
+    }
+    for (int i = 4; i < size; ++i)
+    {
+        int left = row[i - 4];
+        int up = above[i];
+        int up_left = above[i - 4];
+        costs[0] += abs((int8_t) row[i]);
+        costs[1] += abs((int8_t) (row[i] - left));
+        costs[2] += abs((int8_t) (row[i] - up));
+        costs[3] += abs((int8_t) (row[i] - ((left + up) >> 1)));
+        costs[4] += abs((int8_t) (row[i] - PaethPredictor(left, up, up_left)));
+    }
+
+    int filter = 0;
+    for (int f = 1; f < 5; ++f)
+    {
+        if (costs[f] < costs[filter])
+        {
+            filter = f;
+        }
+    }
+
+    out[0] = (uint8_t) filter;
+    out++;
+    for (int i = 0; i < 4 && i < size; ++i)
+    {
+        out[i] = (uint8_t) (row[i] - PngPredict(filter, 0, above[i], 0));
+    }
+    switch (filter)
+    {
+        case 0: memcpy(out + 4, row + 4, size - 4); break;
+        case 1: for (int i = 4; i < size; ++i) out[i] = (uint8_t) (row[i] - row[i - 4]); break;
+        case 2: for (int i = 4; i < size; ++i) out[i] = (uint8_t) (row[i] - above[i]); break;
+        case 3: for (int i = 4; i < size; ++i) out[i] = (uint8_t) (row[i] - ((row[i - 4] + above[i]) >> 1)); break;
+        case 4: for (int i = 4; i < size; ++i) out[i] = (uint8_t) (row[i] - PaethPredictor(row[i - 4], above[i], above[i - 4])); break;
+    }
+}
+
+typedef struct
+{
+    bit_writer_t output;        // IDAT chunk data, band 0 starts with the zlib header
+    size_t raw_size;            // Filtered bytes in the band
+    uint32_t adler;             // Adler-32 of the filtered bytes
+    uint32_t crc;               // CRC of the IDAT chunk
+} png_band_t;
+
+typedef struct
+{
+    const uint8_t* pixels;
+    int width;
+    int height;
+    int rows_per_band;
+    int level;
+    png_band_t* bands;
+} png_work_t;
+
+INTERNAL void
+PngBandWork(void* data, int index)
+{
+    png_work_t* work = (png_work_t*) data;
+    png_band_t* band = &work->bands[index];
+    size_t stride = (size_t) work->width * 4;
+
+    int first_row = index * work->rows_per_band;
+    int row_count = work->height - first_row;
+    if (row_count > work->rows_per_band) row_count = work->rows_per_band;
+
+    band->raw_size = (size_t) row_count * (stride + 1);
+    uint8_t* filtered = (uint8_t*) malloc(band->raw_size);
+    uint8_t* zeros = (first_row == 0) ? (uint8_t*) calloc(stride, 1) : 0;
+    for (int y = 0; y < row_count; ++y)
+    {
+        const uint8_t* row = work->pixels + (size_t) (first_row + y) * stride;
+        const uint8_t* above = (first_row + y > 0) ? row - stride : zeros;
+        FilterPngRow(filtered + (size_t) y * (stride + 1), row, above, work->width, work->level);
+    }
+    free(zeros);
+    band->adler = Adler32(1, filtered, band->raw_size);
+
+    uint8_t chunk_type[4] = { 'I', 'D', 'A', 'T' };
+    if (index == 0)
+    {
+        // CMF 0x78: deflate with a 32K window. FLG: the level hint and check bits.
+        uint8_t zlib_header[2] = { 0x78, work->level == 0 ? 0x01 : (work->level < 6 ? 0x5E : (work->level == 6 ? 0x9C : 0xDA)) };
+        PutBytes(&band->output, zlib_header, 2);
+    }
+    DeflateBand(&band->output, filtered, (int) band->raw_size, work->level);
+    band->crc = Crc32(Crc32(0, chunk_type, 4), band->output.data, band->output.size);
+
+    free(filtered);
+}
+
+INTERNAL void
+PutBigEndian32(uint8_t* out, uint32_t value)
+{
+    out[0] = (uint8_t) (value >> 24);
+    out[1] = (uint8_t) (value >> 16);
+    out[2] = (uint8_t) (value >> 8);
+    out[3] = (uint8_t) value;
+}
+
+INTERNAL bool32_t
+WritePngChunk(FILE* f, const char* type, const uint8_t* data, uint32_t size, uint32_t crc)
+{
+    uint8_t header[8];
+    uint8_t footer[4];
+    PutBigEndian32(header, size);
+    memcpy(header + 4, type, 4);
+    PutBigEndian32(footer, crc);
+    return fwrite(header, 8, 1, f) == 1 && (size == 0 || fwrite(data, size, 1, f) == 1) && fwrite(footer, 4, 1, f) == 1;
+}
+
+INTERNAL bool32_t
+WritePngChunkData(FILE* f, const char* type, const uint8_t* data, uint32_t size)
+{
+    uint32_t crc = Crc32(Crc32(0, (const uint8_t*) type, 4), data, size);
+    return WritePngChunk(f, type, data, size, crc);
+}
+
+// Writes an 8-bit RGBA PNG. Level 0 stores, 1 is fastest and 9 smallest.
+INTERNAL bool32_t
+WritePng(FILE* f, const uint8_t* pixels, int width, int height, int level)
+{
+    png_work_t work = { 0 };
+    work.pixels = pixels;
+    work.width = width;
+    work.height = height;
+    work.level = level;
+    work.rows_per_band = (int) (PNG_BAND_BYTES / ((size_t) width * 4 + 1));
+    if (work.rows_per_band < 1) work.rows_per_band = 1;
+
+    int band_count = (height + work.rows_per_band - 1) / work.rows_per_band;
+    work.bands = (png_band_t*) calloc(band_count, sizeof(png_band_t));
+    ParallelFor(band_count, PngBandWork, &work);
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    uint8_t header[13] = { 0 };
+    PutBigEndian32(header, (uint32_t) width);
+    PutBigEndian32(header + 4, (uint32_t) height);
+    header[8] = 8;              // Bit depth
+    header[9] = 6;              // RGBA
+
+    bool32_t ok = fwrite(signature, sizeof(signature), 1, f) == 1 && WritePngChunkData(f, "IHDR", header, sizeof(header));
+
+    uint32_t adler = 1;
+    for (int i = 0; i < band_count; ++i)
+    {
+        png_band_t* band = &work.bands[i];
+        ok = ok && WritePngChunk(f, "IDAT", band->output.data, (uint32_t) band->output.size, band->crc);
+        adler = Adler32Combine(adler, band->adler, band->raw_size);
+        free(band->output.data);
+    }
+    free(work.bands);
+
+    // Final empty fixed Huffman block, then the checksum of the whole stream
+    uint8_t end[6] = { 0x03, 0x00 };
+    PutBigEndian32(end + 2, adler);
+    ok = ok && WritePngChunkData(f, "IDAT", end, sizeof(end));
+    ok = ok && WritePngChunkData(f, "IEND", 0, 0);
+
+    return ok;
+}
+
+// A level number, or one of the names for the ends of the range
+INTERNAL bool32_t
+ParsePngLevel(const char* text, OUT int* level)
+{
+    if (strcmp(text, "store") == 0) { *level = 0; return 1; }
+    if (strcmp(text, "fast") == 0) { *level = 1; return 1; }
+    if (strcmp(text, "default") == 0) { *level = PNG_DEFAULT_LEVEL; return 1; }
+    if (strcmp(text, "max") == 0) { *level = PNG_MAX_LEVEL; return 1; }
+    if (text[0] >= '0' && text[0] <= '0' + PNG_MAX_LEVEL && text[1] == 0)
+    {
+        *level = text[0] - '0';
+        return 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Texture compression
+//////////////////////////////////////////////////////////////////////////////
+
+// CPU encoders for the GPU block formats, written to KTX2 next to the PNG so
+// the runtime can upload them as they are. Every 4x4 block is encoded on its
+// own, one row of blocks per work item; pixels past the atlas edge repeat
+// the last row and column. They aim for a sound result in a single pass
+// rather than the best possible one:
+//
+// - BC1: endpoints along the principal axis of the colors, refined once by
+//   least squares. Blocks with pixels below half alpha use the three color
+//   mode with the transparent index.
+// - BC3: BC1 colors (always four color) and an alpha block trying both the
+//   eight and the six value ramp.
+// - BC7: mode 6 only, one RGBA subset with 7-bit endpoints plus a p-bit and
+//   16 interpolation steps, the best single mode for smooth sprites.
+// - ETC2: RGBA8, the ETC1 compatible individual and differential modes with
+//   both block flips and every intensity table, and EAC alpha with every
+//   table stretched over the block's range. The T, H and planar modes are
+//   not used.
+//
+// With BLOCK_ALIGN every packed rect (sprite plus padding) covers whole
+// blocks, so no block mixes two sprites and nothing bleeds between them.
+
+typedef void encode_block_proc_t(const uint8_t* block, uint8_t* out);
+
+INTERNAL int
+ColorDistance(const uint8_t* a, const uint8_t* b)
+{
+    int dr = a[0] - b[0];
+    int dg = a[1] - b[1];
+    int db = a[2] - b[2];
+    return dr*dr + dg*dg + db*db;
+}
+
+INTERNAL int
+ClampByte(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Copies the 4x4 block at (bx, by) blocks into 64 bytes of RGBA
+INTERNAL void
+FetchBlock(const uint8_t* pixels, int width, int height, int bx, int by, OUT uint8_t* block)
+{
+    for (int y = 0; y < TEXTURE_BLOCK_SIZE; ++y)
+    {
+        int py = by * TEXTURE_BLOCK_SIZE + y;
+        if (py >= height) py = height - 1;
+        for (int x = 0; x < TEXTURE_BLOCK_SIZE; ++x)
+        {
+            int px = bx * TEXTURE_BLOCK_SIZE + x;
+            if (px >= width) px = width - 1;
+            memcpy(block + (y * TEXTURE_BLOCK_SIZE + x) * 4, pixels + ((size_t) py * width + px) * 4, 4);
+        }
+    }
+}
+
+// Mean and principal axis of the selected pixels' first channel_count
+// channels, by power iteration on the covariance matrix
+INTERNAL void
+PrincipalAxis(const uint8_t* block, const bool32_t* selected, int channel_count, OUT float* mean, OUT float* axis)
+{
+    int count = 0;
+    for (int c = 0; c < channel_count; ++c) mean[c] = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        if (selected[i])
+        {
+            for (int c = 0; c < channel_count; ++c) mean[c] += block[i*4 + c];
+            count++;
+        }
+    }
+    for (int c = 0; c < channel_count; ++c) mean[c] /= (float) (count ? count : 1);
+
+    float covariance[4][4] = { { 0 } };
+    for (int i = 0; i < 16; ++i)
+    {
+        if (!selected[i]) continue;
+        for (int a = 0; a < channel_count; ++a)
+        {
+            for (int b = a; b < channel_count; ++b)
+            {
+                covariance[a][b] += (block[i*4 + a] - mean[a]) * (block[i*4 + b] - mean[b]);
+            }
+        }
+    }
+    for (int a = 0; a < channel_count; ++a)
+    {
+        for (int b = 0; b < a; ++b) covariance[a][b] = covariance[b][a];
+    }
+
+    for (int c = 0; c < channel_count; ++c) axis[c] = 1.0f;
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[4] = { 0 };
+        float length = 0.0f;
+        for (int a = 0; a < channel_count; ++a)
+        {
+            for (int b = 0; b < channel_count; ++b) next[a] += covariance[a][b] * axis[b];
+            length = fmaxf(length, fabsf(next[a]));
+        }
+        if (length < 1e-6f)
+        {
+            break;
+        }
+        for (int c = 0; c < channel_count; ++c) axis[c] = next[c] / length;
+    }
+}
+
+// Ends of the selected pixels along the axis through the mean
+INTERNAL void
+AxisEndpoints(const uint8_t* block, const bool32_t* selected, int channel_count, const float* mean, const float* axis,
+              OUT float* low, OUT float* high)
+{
+    float min_t = FLT_MAX, max_t = -FLT_MAX;
+    float length = 0.0f;
+    for (int c = 0; c < channel_count; ++c) length += axis[c] * axis[c];
+    for (int i = 0; i < 16; ++i)
+    {
+        if (!selected[i]) continue;
+        float t = 0.0f;
+        for (int c = 0; c < channel_count; ++c) t += (block[i*4 + c] - mean[c]) * axis[c];
+        if (t < min_t) min_t = t;
+        if (t > max_t) max_t = t;
+    }
+    if (length > 0.0f)
+    {
+        min_t /= length;
+        max_t /= length;
+    }
+    else
+    {
+        min_t = max_t = 0.0f;
+    }
+    for (int c = 0; c < channel_count; ++c)
+    {
+        low[c] = fminf(fmaxf(mean[c] + axis[c] * min_t, 0.0f), 255.0f);
+        high[c] = fminf(fmaxf(mean[c] + axis[c] * max_t, 0.0f), 255.0f);
+    }
+}
+
+// Endpoints minimizing the squared error for fixed interpolation weights:
+// each pixel is (1 - w) * low + w * high
+INTERNAL bool32_t
+SolveEndpoints(const uint8_t* block, const bool32_t* selected, const float* weights, int channel_count,
+               OUT float* low, OUT float* high)
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = { 0 }, bx[4] = { 0 };
+    for (int i = 0; i < 16; ++i)
+    {
+        if (!selected[i]) continue;
+        float b = weights[i];
+        float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channel_count; ++c)
+        {
+            ax[c] += a * block[i*4 + c];
+            bx[c] += b * block[i*4 + c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (fabsf(determinant) < 1e-6f)
+    {
+        return 0;
+    }
+    for (int c = 0; c < channel_count; ++c)
+    {
+        low[c] = fminf(fmaxf((ax[c] * bb - bx[c] * ab) / determinant, 0.0f), 255.0f);
+        high[c] = fminf(fmaxf((bx[c] * aa - ax[c] * ab) / determinant, 0.0f), 255.0f);
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// BC1 / BC3
+
+INTERNAL uint16_t
+PackRgb565(const float* color)
+{
+    int r = (int) (color[0] * 31.0f / 255.0f + 0.5f);
+    int g = (int) (color[1] * 63.0f / 255.0f + 0.5f);
+    int b = (int) (color[2] * 31.0f / 255.0f + 0.5f);
+    return (uint16_t) ((r << 11) | (g << 5) | b);
+}
+
+INTERNAL void
+UnpackRgb565(uint16_t packed, OUT uint8_t* color)
+{
+    int r = (packed >> 11) & 31;
+    int g = (packed >> 5) & 63;
+    int b = packed & 31;
+    color[0] = (uint8_t) ((r << 3) | (r >> 2));
+    color[1] = (uint8_t) ((g << 2) | (g >> 4));
+    color[2] = (uint8_t) ((b << 3) | (b >> 2));
+    color[3] = 255;
+}
+
+// The four colors a BC1 block decodes to; three plus transparent black when
+// c0 <= c1 and three_color is allowed
+INTERNAL void
+Bc1Palette(uint16_t c0, uint16_t c1, bool32_t three_color, OUT uint8_t palette[4][4])
+{
+    UnpackRgb565(c0, palette[0]);
+    UnpackRgb565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        if (three_color && c0 <= c1)
+        {
+            palette[2][c] = (uint8_t) ((palette[0][c] + palette[1][c]) / 2);
+            palette[3][c] = 0;
+        }
+        else
+        {
+            palette[2][c] = (uint8_t) ((2*palette[0][c] + palette[1][c]) / 3);
+            palette[3][c] = (uint8_t) ((palette[0][c] + 2*palette[1][c]) / 3);
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = (three_color && c0 <= c1) ? 0 : 255;
+}
+
+// Picks the nearest palette entry for every selected pixel, transparent
+// pixels get index 3. Returns the total squared error.
+INTERNAL int
+Bc1Indices(const uint8_t* block, const bool32_t* opaque, uint8_t palette[4][4], int usable, OUT uint8_t* indices)
+{
+    int error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        if (!opaque[i])
+        {
+            indices[i] = 3;
+            continue;
+        }
+        int best = INT_MAX;
+        for (int p = 0; p < usable; ++p)
+        {
+            int distance = ColorDistance(block + i*4, palette[p]);
+            if (distance < best)
+            {
+                best = distance;
+                indices[i] = (uint8_t) p;
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+INTERNAL void
+WriteBc1Block(uint16_t c0, uint16_t c1, const uint8_t* indices, OUT uint8_t* out)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        bits |= (uint32_t) indices[i] << (i * 2);
+    }
+    out[0] = (uint8_t) c0;
+    out[1] = (uint8_t) (c0 >> 8);
+    out[2] = (uint8_t) c1;
+    out[3] = (uint8_t) (c1 >> 8);
+    out[4] = (uint8_t) bits;
+    out[5] = (uint8_t) (bits >> 8);
+    out[6] = (uint8_t) (bits >> 16);
+    out[7] = (uint8_t) (bits >> 24);
+}
+
+// Encodes the color part of a BC1 or BC3 block. With transparency, pixels
+// below half alpha use the three color mode's transparent index.
+INTERNAL void
+EncodeBc1Color(const uint8_t* block, bool32_t transparency, OUT uint8_t* out)
+{
+    bool32_t opaque[16];
+    bool32_t any_transparent = 0;
+    bool32_t any_opaque = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        opaque[i] = !transparency || block[i*4 + 3] >= 128;
+        any_transparent |= !opaque[i];
+        any_opaque |= opaque[i];
+    }
+
+    uint8_t indices[16];
+    if (!any_opaque)
+    {
+        memset(indices, 3, sizeof(indices));
+        WriteBc1Block(0, 0xFFFF, indices, out);
+        return;
+    }
+
+    float mean[4], axis[4], low[4], high[4];
+    PrincipalAxis(block, opaque, 3, mean, axis);
+    AxisEndpoints(block, opaque, 3, mean, axis, low, high);
+
+    // Three color mode needs c0 <= c1, four color mode c0 > c1
+    int usable = any_transparent ? 3 : 4;
+    uint16_t best_c0 = 0, best_c1 = 0;
+    uint8_t best_indices[16];
+    int best_error = INT_MAX;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        uint16_t c0 = PackRgb565(high);
+        uint16_t c1 = PackRgb565(low);
+        if (any_transparent ? c0 > c1 : c0 < c1)
+        {
+            uint16_t swap = c0; c0 = c1; c1 = swap;
+        }
+
+        uint8_t palette[4][4];
+        Bc1Palette(c0, c1, transparency, palette);
+        int error = Bc1Indices(block, opaque, palette, (c0 == c1 && !any_transparent) ? 1 : usable, indices);
+        if (error < best_error)
+        {
+            best_error = error;
+            best_c0 = c0;
+            best_c1 = c1;
+            memcpy(best_indices, indices, sizeof(indices));
+        }
+        if (error == 0)
+        {
+            break;
+        }
+
+        // Refit the endpoints to the chosen indices
+        static const float four_color_weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+        static const float three_color_weights[4] = { 0.0f, 1.0f, 0.5f, 0.0f };
+        const float* ramp = any_transparent ? three_color_weights : four_color_weights;
+        float weights[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            weights[i] = ramp[best_indices[i]];
+        }
+        float c0_color[4], c1_color[4];
+        if (!SolveEndpoints(block, opaque, weights, 3, c0_color, c1_color))
+        {
+            break;
+        }
+        memcpy(high, c0_color, sizeof(high));
+        memcpy(low, c1_color, sizeof(low));
+    }
+
+    WriteBc1Block(best_c0, best_c1, best_indices, out);
+}
+
+INTERNAL void
+EncodeBc1Block(const uint8_t* block, uint8_t* out)
+{
+    EncodeBc1Color(block, 1, out);
+}
+
+// Values of a BC3 alpha (BC4) block. a0 > a1 gives eight steps from a0 to
+// a1, otherwise six steps plus 0 and 255.
+INTERNAL void
+Bc4Palette(int a0, int a1, OUT int* palette)
+{
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1)
+    {
+        for (int i = 1; i < 7; ++i)
+        {
+            palette[i + 1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+        }
+    }
+    else
+    {
+        for (int i = 1; i < 5; ++i)
+        {
+            palette[i + 1] = ((5 - i) * a0 + i * a1 + 2) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+INTERNAL int
+Bc4Indices(const uint8_t* block, const int* palette, OUT uint8_t* indices)
+{
+    int error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = INT_MAX;
+        for (int p = 0; p < 8; ++p)
+        {
+            int difference = block[i*4 + 3] - palette[p];
+            if (difference * difference < best)
+            {
+                best = difference * difference;
+                indices[i] = (uint8_t) p;
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+INTERNAL void
+EncodeBc4Alpha(const uint8_t* block, OUT uint8_t* out)
+{
+    int min_alpha = 255, max_alpha = 0;
+    int min_inner = 255, max_inner = 0;     // Ignoring 0 and 255, for the six value ramp
+    for (int i = 0; i < 16; ++i)
+    {
+        int alpha = block[i*4 + 3];
+        if (alpha < min_alpha) min_alpha = alpha;
+        if (alpha > max_alpha) max_alpha = alpha;
+        if (alpha != 0 && alpha != 255)
+        {
+            if (alpha < min_inner) min_inner = alpha;
+            if (alpha > max_inner) max_inner = alpha;
+        }
+    }
+
+    int palette[8];
+    uint8_t indices[16], best_indices[16];
+    int a0 = max_alpha, a1 = min_alpha;
+    if (a0 == a1)
+    {
+        memset(best_indices, 0, sizeof(best_indices));
+    }
+    else
+    {
+        Bc4Palette(a0, a1, palette);
+        int best_error = Bc4Indices(block, palette, best_indices);
+        if (best_error > 0 && min_inner <= max_inner)
+        {
+            Bc4Palette(min_inner, max_inner, palette);
+            if (Bc4Indices(block, palette, indices) < best_error)
+            {
+                a0 = min_inner;
+                a1 = max_inner;
+                memcpy(best_indices, indices, sizeof(indices));
+            }
+        }
+    }
+
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        bits |= (uint64_t) best_indices[i] << (i * 3);
+    }
+    out[0] = (uint8_t) a0;
+    out[1] = (uint8_t) a1;
+    for (int i = 0; i < 6; ++i)
+    {
+        out[2 + i] = (uint8_t) (bits >> (i * 8));
+    }
+}
+
+INTERNAL void
+EncodeBc3Block(const uint8_t* block, uint8_t* out)
+{
+    EncodeBc4Alpha(block, out);
+    EncodeBc1Color(block, 0, out + 8);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// BC7
+
+GLOBAL const int bc7_weights2[4] = { 0, 21, 43, 64 };
+GLOBAL const int bc7_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+INTERNAL int
+Bc7Interpolate(int e0, int e1, int weight)
+{
+    return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+}
+
+// Quantizes an endpoint to 7 bits per channel plus the given p-bit
+INTERNAL void
+Bc7QuantizeEndpoint(const float* color, int pbit, OUT int* quantized)
+{
+    for (int c = 0; c < 4; ++c)
+    {
+        int q = (int) ((color[c] - pbit) / 2.0f + 0.5f);
+        quantized[c] = q < 0 ? 0 : (q > 127 ? 127 : q);
+    }
+}
+
+INTERNAL void
+Bc7ExpandEndpoints(const int q[2][4], const int* p, OUT int e[2][4])
+{
+    for (int end = 0; end < 2; ++end)
+    {
+        for (int c = 0; c < 4; ++c) e[end][c] = (q[end][c] << 1) | p[end];
+    }
+}
+
+INTERNAL int
+Bc7Indices(const uint8_t* block, const int* e0, const int* e1, OUT uint8_t* indices)
+{
+    int palette[16][4];
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 4; ++c) palette[i][c] = Bc7Interpolate(e0[c], e1[c], bc7_weights4[i]);
+    }
+
+    // The palette lies on the line between the endpoints and its weights are
+    // close to even steps, so the nearest entry is within two of where the
+    // pixel projects onto that line
+    float direction[4], length = 0.0f;
+    for (int c = 0; c < 4; ++c)
+    {
+        direction[c] = (float) (e1[c] - e0[c]);
+        length += direction[c] * direction[c];
+    }
+
+    int error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        float t = 0.0f;
+        for (int c = 0; c < 4; ++c) t += (block[i*4 + c] - e0[c]) * direction[c];
+        int guess = length > 0.0f ? (int) (t / length * 15.0f + 0.5f) : 0;
+        guess = guess < 2 ? 2 : (guess > 13 ? 13 : guess);
+
+        int best = INT_MAX;
+        for (int p = guess - 2; p <= guess + 2; ++p)
+        {
+            int distance = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int difference = block[i*4 + c] - palette[p][c];
+                distance += difference * difference;
+            }
+            if (distance < best)
+            {
+                best = distance;
+                indices[i] = (uint8_t) p;
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+// Quantizes both endpoints with each of the four p-bit pairs and keeps the
+// pair whose palette fits the block best. Returns its squared error.
+INTERNAL int
+Bc7QuantizeEndpoints(const uint8_t* block, const float* low, const float* high,
+                     OUT int q[2][4], OUT int* p, OUT uint8_t* indices)
+{
+    int best = INT_MAX;
+    for (int pbits = 0; pbits < 4; ++pbits)
+    {
+        int candidate_q[2][4], candidate_p[2] = { pbits & 1, pbits >> 1 }, e[2][4];
+        uint8_t candidate_indices[16];
+        Bc7QuantizeEndpoint(low, candidate_p[0], candidate_q[0]);
+        Bc7QuantizeEndpoint(high, candidate_p[1], candidate_q[1]);
+        Bc7ExpandEndpoints(candidate_q, candidate_p, e);
+
+        int error = Bc7Indices(block, e[0], e[1], candidate_indices);
+        if (error < best)
+        {
+            best = error;
+            memcpy(q, candidate_q, sizeof(candidate_q));
+            memcpy(p, candidate_p, sizeof(candidate_p));
+            memcpy(indices, candidate_indices, sizeof(candidate_indices));
+        }
+    }
+    return best;
+}
+
+INTERNAL void
+PutBlockBits(uint64_t* bits, int* position, uint64_t value, int count)
+{
+    for (int i = 0; i < count; ++i, ++*position)
+    {
+        if ((value >> i) & 1)
+        {
+            bits[*position >> 6] |= 1ull << (*position & 63);
+        }
+    }
+}
+
+// Mode 6: one RGBA line, 7 bit endpoints with a p-bit each and 4 bit
+// indices. Returns the squared error.
+INTERNAL int
+EncodeBc7Mode6(const uint8_t* block, OUT uint8_t* out)
+{
+    bool32_t all[16];
+    bool32_t constant_alpha = 1;
+    for (int i = 0; i < 16; ++i)
+    {
+        all[i] = 1;
+        constant_alpha &= block[i*4 + 3] == block[3];
+    }
+
+    // Opaque blocks only fit the color line, the alpha endpoints stay exact
+    int channel_count = constant_alpha ? 3 : 4;
+    float mean[4], axis[4], low[4], high[4];
+    PrincipalAxis(block, all, channel_count, mean, axis);
+    AxisEndpoints(block, all, channel_count, mean, axis, low, high);
+    if (constant_alpha)
+    {
+        low[3] = high[3] = block[3];
+    }
+
+    int best_q[2][4] = { { 0 } }, best_p[2] = { 0 };
+    uint8_t indices[16], best_indices[16];
+    int best_error = INT_MAX;
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        int q[2][4], p[2] = { 0 };
+        int error = Bc7QuantizeEndpoints(block, low, high, q, p, indices);
+        if (error >= best_error)
+        {
+            break;
+        }
+        best_error = error;
+        memcpy(best_q, q, sizeof(q));
+        memcpy(best_p, p, sizeof(p));
+        memcpy(best_indices, indices, sizeof(indices));
+        if (error == 0)
+        {
+            break;
+        }
+
+        float weights[16];
+        for (int i = 0; i < 16; ++i) weights[i] = bc7_weights4[best_indices[i]] / 64.0f;
+        if (!SolveEndpoints(block, all, weights, channel_count, low, high))
+        {
+            break;
+        }
+    }
+
+    // The first pixel's index is stored without its top bit, so it must be
+    // below 8; swapping the endpoints mirrors the indices
+    if (best_indices[0] >= 8)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            int swap = best_q[0][c]; best_q[0][c] = best_q[1][c]; best_q[1][c] = swap;
+        }
+        int swap = best_p[0]; best_p[0] = best_p[1]; best_p[1] = swap;
+        for (int i = 0; i < 16; ++i) best_indices[i] = (uint8_t) (15 - best_indices[i]);
+    }
+
+    uint64_t bits[2] = { 0 };
+    int position = 0;
+    PutBlockBits(bits, &position, 1 << 6, 7);      // Mode 6
+    for (int c = 0; c < 4; ++c)
+    {
+        PutBlockBits(bits, &position, best_q[0][c], 7);
+        PutBlockBits(bits, &position, best_q[1][c], 7);
+    }
+    PutBlockBits(bits, &position, best_p[0], 1);
+    PutBlockBits(bits, &position, best_p[1], 1);
+    for (int i = 0; i < 16; ++i)
+    {
+        PutBlockBits(bits, &position, best_indices[i], i == 0 ? 3 : 4);
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        out[i] = (uint8_t) (bits[i >> 3] >> ((i & 7) * 8));
+    }
+
+    return best_error;
+}
+
+INTERNAL int
+Bc7Expand7(int value)
+{
+    return (value << 1) | (value >> 6);
+}
+
+// Fits a line with 2 bit indices to count channels starting at block[0];
+// pass block + 3 for alpha. Endpoints are 7 bit, or 8 bit for alpha.
+// Returns the squared error.
+INTERNAL int
+Bc7FitMode5Channels(const uint8_t* block, int count, OUT int q[2][4], OUT uint8_t* indices)
+{
+    bool32_t all[16];
+    for (int i = 0; i < 16; ++i) all[i] = 1;
+
+    float mean[4], axis[4], low[4], high[4];
+    PrincipalAxis(block, all, count, mean, axis);
+    AxisEndpoints(block, all, count, mean, axis, low, high);
+
+    int best_error = INT_MAX;
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        int candidate[2][4], e[2][4];
+        for (int c = 0; c < count; ++c)
+        {
+            candidate[0][c] = count == 1 ? (int) (low[c] + 0.5f) : (int) (low[c] * 127.0f / 255.0f + 0.5f);
+            candidate[1][c] = count == 1 ? (int) (high[c] + 0.5f) : (int) (high[c] * 127.0f / 255.0f + 0.5f);
+            e[0][c] = count == 1 ? candidate[0][c] : Bc7Expand7(candidate[0][c]);
+            e[1][c] = count == 1 ? candidate[1][c] : Bc7Expand7(candidate[1][c]);
+        }
+
+        int error = 0;
+        uint8_t candidate_indices[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = INT_MAX;
+            for (int w = 0; w < 4; ++w)
+            {
+                int distance = 0;
+                for (int c = 0; c < count; ++c)
+                {
+                    int difference = block[i*4 + c] - Bc7Interpolate(e[0][c], e[1][c], bc7_weights2[w]);
+                    distance += difference * difference;
+                }
+                if (distance < best)
+                {
+                    best = distance;
+                    candidate_indices[i] = (uint8_t) w;
+                }
+            }
+            error += best;
+        }
+
+        if (error >= best_error)
+        {
+            break;
+        }
+        best_error = error;
+        memcpy(q, candidate, sizeof(candidate));
+        memcpy(indices, candidate_indices, sizeof(candidate_indices));
+        if (error == 0)
+        {
+            break;
+        }
+
+        float weights[16];
+        for (int i = 0; i < 16; ++i) weights[i] = bc7_weights2[indices[i]] / 64.0f;
+        if (!SolveEndpoints(block, all, weights, count, low, high))
+        {
+            break;
+        }
+    }
+
+    // The first index is stored without its top bit
+    if (indices[0] >= 2)
+    {
+        for (int c = 0; c < count; ++c)
+        {
+            int swap = q[0][c]; q[0][c] = q[1][c]; q[1][c] = swap;
+        }
+        for (int i = 0; i < 16; ++i) indices[i] = (uint8_t) (3 - indices[i]);
+    }
+
+    return best_error;
+}
+
+// Mode 5: separate color and alpha lines, 2 bit indices each, for blocks
+// where alpha does not follow the color. Returns the squared error.
+INTERNAL int
+EncodeBc7Mode5(const uint8_t* block, OUT uint8_t* out)
+{
+    int color[2][4] = { { 0 } }, alpha[2][4] = { { 0 } };
+    uint8_t color_indices[16], alpha_indices[16];
+    int error = Bc7FitMode5Channels(block, 3, color, color_indices);
+    error += Bc7FitMode5Channels(block + 3, 1, alpha, alpha_indices);
+
+    uint64_t bits[2] = { 0 };
+    int position = 0;
+    PutBlockBits(bits, &position, 1 << 5, 6);      // Mode 5
+    PutBlockBits(bits, &position, 0, 2);           // No channel rotation
+    for (int c = 0; c < 3; ++c)
+    {
+        PutBlockBits(bits, &position, color[0][c], 7);
+        PutBlockBits(bits, &position, color[1][c], 7);
+    }
+    PutBlockBits(bits, &position, alpha[0][0], 8);
+    PutBlockBits(bits, &position, alpha[1][0], 8);
+    for (int i = 0; i < 16; ++i)
+    {
+        PutBlockBits(bits, &position, color_indices[i], i == 0 ? 1 : 2);
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        PutBlockBits(bits, &position, alpha_indices[i], i == 0 ? 1 : 2);
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        out[i] = (uint8_t) (bits[i >> 3] >> ((i & 7) * 8));
+    }
+
+    return error;
+}
+
+INTERNAL void
+EncodeBc7Block(const uint8_t* block, uint8_t* out)
+{
+    int error = EncodeBc7Mode6(block, out);
+
+    bool32_t constant_alpha = 1;
+    for (int i = 0; i < 16; ++i) constant_alpha &= block[i*4 + 3] == block[3];
+    if (!constant_alpha && error > 0)
+    {
+        uint8_t separate[16];
+        if (EncodeBc7Mode5(block, separate) < error)
+        {
+            memcpy(out, separate, sizeof(separate));
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// ETC2
+
+GLOBAL const int etc1_modifiers[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 },
+};
+
+GLOBAL const int eac_modifiers[16][8] = {
+    { -3, -6, -9, -15, 2, 5, 8, 14 },
+    { -3, -7, -10, -13, 2, 6, 9, 12 },
+    { -2, -5, -8, -13, 1, 4, 7, 12 },
+    { -2, -4, -6, -13, 1, 3, 5, 12 },
+    { -3, -6, -8, -12, 2, 5, 7, 11 },
+    { -3, -7, -9, -11, 2, 6, 8, 10 },
+    { -4, -7, -8, -11, 3, 6, 7, 10 },
+    { -3, -5, -8, -11, 2, 4, 7, 10 },
+    { -2, -6, -8, -10, 1, 5, 7, 9 },
+    { -2, -5, -8, -10, 1, 4, 7, 9 },
+    { -2, -4, -8, -10, 1, 3, 7, 9 },
+    { -2, -5, -7, -10, 1, 4, 6, 9 },
+    { -3, -4, -7, -10, 2, 3, 6, 9 },
+    { -1, -2, -3, -10, 0, 1, 2, 9 },
+    { -4, -6, -8, -9, 3, 5, 7, 8 },
+    { -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+// ETC modifier for a 2-bit pixel index: 0 and 1 add the small and large
+// step, 2 and 3 subtract them
+INTERNAL int
+Etc1Modifier(int table, int index)
+{
+    int step = etc1_modifiers[table][index & 1];
+    return (index & 2) ? -step : step;
+}
+
+// Pixels of a sub-block in ETC order (x * 4 + y). Without flip the sub-blocks
+// are the left and right 2x4 halves, with flip the top and bottom 4x2.
+INTERNAL int
+EtcSubBlockPixels(bool32_t flip, int sub_block, OUT int* pixels)
+{
+    int count = 0;
+    for (int x = 0; x < 4; ++x)
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            int half = flip ? (y >= 2) : (x >= 2);
+            if (half == sub_block)
+            {
+                pixels[count++] = x * 4 + y;
+            }
+        }
+    }
+    return count;
+}
+
+// Best intensity table and indices for a sub-block around the base color.
+// Returns the squared error.
+INTERNAL int
+EtcFitSubBlock(const uint8_t* block, const int* pixels, const int* base, OUT int* table, OUT uint8_t* indices)
+{
+    int best_error = INT_MAX;
+    for (int t = 0; t < 8; ++t)
+    {
+        int error = 0;
+        uint8_t table_indices[16];
+        for (int i = 0; i < 8 && error < best_error; ++i)
+        {
+            int pixel = pixels[i];
+            const uint8_t* color = block + ((pixel & 3) * 4 + (pixel >> 2)) * 4;     // ETC order is column major
+            int best = INT_MAX;
+            for (int index = 0; index < 4; ++index)
+            {
+                int modifier = Etc1Modifier(t, index);
+                int distance = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    int difference = color[c] - ClampByte(base[c] + modifier);
+                    distance += difference * difference;
+                }
+                if (distance < best)
+                {
+                    best = distance;
+                    table_indices[pixel] = (uint8_t) index;
+                }
+            }
+            error += best;
+        }
+        if (error < best_error)
+        {
+            best_error = error;
+            *table = t;
+            for (int i = 0; i < 8; ++i) indices[pixels[i]] = table_indices[pixels[i]];
+        }
+    }
+    return best_error;
+}
+
+INTERNAL void
+EtcSubBlockAverage(const uint8_t* block, const int* pixels, OUT float* average)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        float sum = 0.0f;
+        for (int i = 0; i < 8; ++i)
+        {
+            int pixel = pixels[i];
+            sum += block[((pixel & 3) * 4 + (pixel >> 2)) * 4 + c];
+        }
+        average[c] = sum / 8.0f;
+    }
+}
+
+INTERNAL void
+EncodeEtc2Color(const uint8_t* block, OUT uint8_t* out)
+{
+    uint64_t best_bits = 0;
+    int best_error = INT_MAX;
+    for (int flip = 0; flip < 2; ++flip)
+    {
+        int pixels[2][8];
+        float average[2][3];
+        for (int s = 0; s < 2; ++s)
+        {
+            EtcSubBlockPixels(flip, s, pixels[s]);
+            EtcSubBlockAverage(block, pixels[s], average[s]);
+        }
+
+        for (int differential = 0; differential < 2; ++differential)
+        {
+            // Individual: 4 bits per channel for each sub-block. Differential:
+            // 5 bits for the first and a 3-bit signed delta for the second.
+            int quantized[2][3], base[2][3];
+            for (int c = 0; c < 3; ++c)
+            {
+                if (differential)
+                {
+                    int first = (int) (average[0][c] * 31.0f / 255.0f + 0.5f);
+                    int second = (int) (average[1][c] * 31.0f / 255.0f + 0.5f);
+                    int delta = second - first;
+                    delta = delta < -4 ? -4 : (delta > 3 ? 3 : delta);
+                    quantized[0][c] = first;
+                    quantized[1][c] = first + delta;
+                    for (int s = 0; s < 2; ++s)
+                    {
+                        base[s][c] = (quantized[s][c] << 3) | (quantized[s][c] >> 2);
+                    }
+                }
+                else
+                {
+                    for (int s = 0; s < 2; ++s)
+                    {
+                        quantized[s][c] = (int) (average[s][c] * 15.0f / 255.0f + 0.5f);
+                        base[s][c] = quantized[s][c] * 17;
+                    }
+                }
+            }
+
+            int tables[2];
+            uint8_t indices[16] = { 0 };
+            int error = EtcFitSubBlock(block, pixels[0], base[0], &tables[0], indices) +
+                        EtcFitSubBlock(block, pixels[1], base[1], &tables[1], indices);
+            if (error >= best_error)
+            {
+                continue;
+            }
+            best_error = error;
+
+            uint64_t bits = 0;
+            for (int c = 0; c < 3; ++c)
+            {
+                int shift = 56 - c * 8;
+                if (differential)
+                {
+                    bits |= (uint64_t) quantized[0][c] << (shift + 3);
+                    bits |= (uint64_t) ((quantized[1][c] - quantized[0][c]) & 7) << shift;
+                }
+                else
+                {
+                    bits |= (uint64_t) quantized[0][c] << (shift + 4);
+                    bits |= (uint64_t) quantized[1][c] << shift;
+                }
+            }
+            bits |= (uint64_t) tables[0] << 37;
+            bits |= (uint64_t) tables[1] << 34;
+            bits |= (uint64_t) differential << 33;
+            bits |= (uint64_t) flip << 32;
+            for (int i = 0; i < 16; ++i)
+            {
+                bits |= (uint64_t) (indices[i] >> 1) << (16 + i);
+                bits |= (uint64_t) (indices[i] & 1) << i;
+            }
+            best_bits = bits;
+        }
+    }
+
+    for (int i = 0; i < 8; ++i)
+    {
+        out[i] = (uint8_t) (best_bits >> (56 - i * 8));
+    }
+}
+
+// Squared error of the best EAC indices for one base, multiplier and table,
+// giving up once it reaches limit
+INTERNAL int
+EacFit(const uint8_t* block, int base, int multiplier, int table, int limit, OUT uint8_t* indices)
+{
+    int values[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        values[i] = ClampByte(base + eac_modifiers[table][i] * multiplier);
+    }
+
+    int error = 0;
+    for (int i = 0; i < 16 && error < limit; ++i)
+    {
+        int alpha = block[i*4 + 3];
+        int best = INT_MAX;
+        for (int index = 0; index < 8; ++index)
+        {
+            int difference = alpha - values[index];
+            if (difference * difference < best)
+            {
+                best = difference * difference;
+                indices[i] = (uint8_t) index;
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+// Every table is tried with the base and multiplier that stretch it over
+// the block's range, then the best one is refined by a step either way
+INTERNAL void
+EncodeEacAlpha(const uint8_t* block, OUT uint8_t* out)
+{
+    int min_alpha = 255, max_alpha = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int alpha = block[i*4 + 3];
+        if (alpha < min_alpha) min_alpha = alpha;
+        if (alpha > max_alpha) max_alpha = alpha;
+    }
+
+    // Table 13 has a zero step, exact for a flat block
+    int best_base = min_alpha, best_multiplier = 1, best_table = 13;
+    uint8_t indices[16], best_indices[16];
+    memset(best_indices, 4, sizeof(best_indices));
+    int best_error = (min_alpha == max_alpha) ? 0 : INT_MAX;
+
+    for (int t = 0; t < 16 && best_error > 0; ++t)
+    {
+        int low = eac_modifiers[t][3], high = eac_modifiers[t][7];
+        int multiplier = (int) ((max_alpha - min_alpha) / (float) (high - low) + 0.5f);
+        multiplier = multiplier < 1 ? 1 : (multiplier > 15 ? 15 : multiplier);
+        int base = ClampByte((min_alpha + max_alpha + 1) / 2 - (multiplier * (low + high)) / 2);
+        int error = EacFit(block, base, multiplier, t, best_error, indices);
+        if (error < best_error)
+        {
+            best_error = error;
+            best_base = base;
+            best_multiplier = multiplier;
+            best_table = t;
+            memcpy(best_indices, indices, sizeof(indices));
+        }
+    }
+
+    int center_base = best_base, center_multiplier = best_multiplier;
+    for (int multiplier = center_multiplier - 1; multiplier <= center_multiplier + 1 && best_error > 0; ++multiplier)
+    {
+        for (int base = center_base - 1; base <= center_base + 1; ++base)
+        {
+            if (multiplier < 1 || multiplier > 15 || base < 0 || base > 255)
+            {
+                continue;
+            }
+            int error = EacFit(block, base, multiplier, best_table, best_error, indices);
+            if (error < best_error)
+            {
+                best_error = error;
+                best_base = base;
+                best_multiplier = multiplier;
+                memcpy(best_indices, indices, sizeof(indices));
+            }
+        }
+    }
+
+    uint64_t bits = (uint64_t) best_base << 56 | (uint64_t) best_multiplier << 52 | (uint64_t) best_table << 48;
+    for (int x = 0; x < 4; ++x)
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            int pixel = x * 4 + y;
+            bits |= (uint64_t) best_indices[y * 4 + x] << (45 - pixel * 3);
+        }
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        out[i] = (uint8_t) (bits >> (56 - i * 8));
+    }
+}
+
+INTERNAL void
+EncodeEtc2Block(const uint8_t* block, uint8_t* out)
+{
+    EncodeEacAlpha(block, out);
+    EncodeEtc2Color(block, out + 8);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    int block_bytes;
+    uint32_t vk_format_unorm;
+    uint32_t vk_format_srgb;
+    uint8_t color_model;        // KHR_DF_MODEL_*
+    encode_block_proc_t* encode;
+} texture_format_info_t;
+
+GLOBAL const texture_format_info_t texture_formats[TEXTURE_COUNT] = {
+    { 4, 37, 43, 1, 0 },                        // VK_FORMAT_R8G8B8A8_*, KHR_DF_MODEL_RGBSDA, mip chains without COMPRESS
+    { 8, 133, 134, 128, EncodeBc1Block },       // VK_FORMAT_BC1_RGBA_*, KHR_DF_MODEL_BC1A
+    { 16, 137, 138, 130, EncodeBc3Block },      // VK_FORMAT_BC3_*, KHR_DF_MODEL_BC3
+    { 16, 145, 146, 134, EncodeBc7Block },      // VK_FORMAT_BC7_*, KHR_DF_MODEL_BC7
+    { 16, 151, 152, 161, EncodeEtc2Block },     // VK_FORMAT_ETC2_R8G8B8A8_*, KHR_DF_MODEL_ETC2
+};
+
+typedef struct
+{
+    const uint8_t* pixels;
+    int width;
+    int height;
+    int blocks_x;
+    encode_block_proc_t* encode;
+    int block_bytes;
+    uint8_t* output;
+} encode_texture_work_t;
+
+INTERNAL void
+EncodeTextureRowWork(void* data, int index)
+{
+    encode_texture_work_t* work = (encode_texture_work_t*) data;
+    uint8_t block[64], previous[64];
+    uint8_t* out = work->output + (size_t) index * work->blocks_x * work->block_bytes;
+    for (int bx = 0; bx < work->blocks_x; ++bx)
+    {
+        // Runs of identical blocks, mostly the empty space between sprites,
+        // are encoded once
+        FetchBlock(work->pixels, work->width, work->height, bx, index, block);
+        if (bx > 0 && memcmp(block, previous, sizeof(block)) == 0)
+        {
+            memcpy(out + (size_t) bx * work->block_bytes, out + (size_t) (bx - 1) * work->block_bytes, work->block_bytes);
+            continue;
+        }
+        work->encode(block, out + (size_t) bx * work->block_bytes);
+        memcpy(previous, block, sizeof(block));
+    }
+}
+
+// Encodes an RGBA image into a malloc'd buffer of blocks, row by row.
+// TEXTURE_NONE gives a copy of the pixels.
+INTERNAL uint8_t*
+EncodeTexture(texture_format_t format, const uint8_t* pixels, int width, int height, OUT size_t* size)
+{
+    const texture_format_info_t* info = &texture_formats[format];
+    if (!info->encode)
+    {
+        *size = (size_t) width * height * 4;
+        uint8_t* output = (uint8_t*) malloc(*size);
+        memcpy(output, pixels, *size);
+        return output;
+    }
+
+    encode_texture_work_t work = { 0 };
+    work.pixels = pixels;
+    work.width = width;
+    work.height = height;
+    work.blocks_x = (width + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+    work.encode = info->encode;
+    work.block_bytes = info->block_bytes;
+
+    int blocks_y = (height + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+    *size = (size_t) work.blocks_x * blocks_y * info->block_bytes;
+    work.output = (uint8_t*) malloc(*size);
+    ParallelFor(blocks_y, EncodeTextureRowWork, &work);
+
+    return work.output;
+}
+
+// KTX2 container, see the Khronos KTX 2.0 specification. Levels are given
+// largest first and stored smallest first, as the format asks; there is no
+// supercompression and no key/value data.
+
+#define KTX2_HEADER_SIZE 80
+#define KTX2_LEVEL_INDEX_SIZE 24
+
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+} texture_level_t;
+
+INTERNAL void
+PutLittleEndian32(uint8_t* out, uint32_t value)
+{
+    out[0] = (uint8_t) value;
+    out[1] = (uint8_t) (value >> 8);
+    out[2] = (uint8_t) (value >> 16);
+    out[3] = (uint8_t) (value >> 24);
+}
+
+INTERNAL void
+PutLittleEndian64(uint8_t* out, uint64_t value)
+{
+    PutLittleEndian32(out, (uint32_t) value);
+    PutLittleEndian32(out + 4, (uint32_t) (value >> 32));
+}
+
+// Basic data format descriptor block: for the block compressed formats one
+// sample covering the block for BC1 and BC7, a 64-bit alpha then a 64-bit
+// color sample for BC3 and ETC2; for plain RGBA8 one 8-bit sample per
+// channel, alpha marked linear when the color is sRGB
+INTERNAL size_t
+BuildKtx2Dfd(texture_format_t format, bool32_t srgb, bool32_t premultiplied, OUT uint8_t* out)
+{
+    const texture_format_info_t* info = &texture_formats[format];
+    int sample_count = format == TEXTURE_NONE ? 4 : (format == TEXTURE_BC3 || format == TEXTURE_ETC2) ? 2 : 1;
+    int block_pixels = format == TEXTURE_NONE ? 1 : TEXTURE_BLOCK_SIZE;
+    uint32_t sample_bits = info->block_bytes * 8 / sample_count;
+    uint32_t block_size = 24 + 16 * sample_count;
+
+    PutLittleEndian32(out, 4 + block_size);                         // dfdTotalSize
+    PutLittleEndian32(out + 4, 0);                                  // Khronos vendor, basic descriptor
+    PutLittleEndian32(out + 8, 2 | (block_size << 16));             // Version 2
+    PutLittleEndian32(out + 12, info->color_model |
+                      1 << 8 |                                      // BT.709 primaries
+                      (srgb ? 2 : 1) << 16 |                        // sRGB or linear transfer
+                      (premultiplied ? 1u : 0u) << 24);             // KHR_DF_FLAG_ALPHA_PREMULTIPLIED
+    PutLittleEndian32(out + 16, (block_pixels - 1) | (block_pixels - 1) << 8);
+    PutLittleEndian32(out + 20, info->block_bytes);                 // bytesPlane0
+    PutLittleEndian32(out + 24, 0);
+
+    // Channel ids: BC1A alpha 1, BC3/ETC2 alpha 15, BC3/BC7 color 0, ETC2 color 2,
+    // RGBA8 red 0, green 1, blue 2, alpha 15
+    uint8_t* sample = out + 28;
+    for (int i = 0; i < sample_count; ++i, sample += 16)
+    {
+        int channel;
+        if (format == TEXTURE_NONE) channel = i < 3 ? i : 15 | (srgb ? 0x10 : 0);
+        else if (format == TEXTURE_BC1) channel = 1;
+        else if (sample_count == 2 && i == 0) channel = 15;
+        else channel = (format == TEXTURE_ETC2) ? 2 : 0;
+
+        PutLittleEndian32(sample, i * sample_bits | (sample_bits - 1) << 16 | (uint32_t) channel << 24);
+        PutLittleEndian32(sample + 4, 0);
+        PutLittleEndian32(sample + 8, 0);
+        PutLittleEndian32(sample + 12, format == TEXTURE_NONE ? 0xFF : 0xFFFFFFFFu);
+    }
+
+    return 4 + block_size;
+}
+
+INTERNAL bool32_t
+WriteKtx2(FILE* f, texture_format_t format, bool32_t srgb, bool32_t premultiplied, int width, int height,
+          const texture_level_t* levels, int level_count)
+{
+    const texture_format_info_t* info = &texture_formats[format];
+    uint8_t dfd[4 + 24 + 16 * 4];
+    size_t dfd_size = BuildKtx2Dfd(format, srgb, premultiplied, dfd);
+
+    size_t dfd_offset = KTX2_HEADER_SIZE + (size_t) KTX2_LEVEL_INDEX_SIZE * level_count;
+    size_t size = dfd_offset + dfd_size;
+    uint64_t offsets[32];
+    for (int level = level_count - 1; level >= 0; --level)
+    {
+        size = (size + info->block_bytes - 1) / info->block_bytes * info->block_bytes;
+        offsets[level] = size;
+        size += levels[level].size;
+    }
+
+    uint8_t* file = (uint8_t*) calloc(size, 1);
+    static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    memcpy(file, identifier, sizeof(identifier));
+    PutLittleEndian32(file + 12, srgb ? info->vk_format_srgb : info->vk_format_unorm);
+    PutLittleEndian32(file + 16, 1);                // typeSize
+    PutLittleEndian32(file + 20, width);
+    PutLittleEndian32(file + 24, height);
+    PutLittleEndian32(file + 28, 0);                // pixelDepth
+    PutLittleEndian32(file + 32, 0);                // layerCount
+    PutLittleEndian32(file + 36, 1);                // faceCount
+    PutLittleEndian32(file + 40, level_count);
+    PutLittleEndian32(file + 44, 0);                // supercompressionScheme
+    PutLittleEndian32(file + 48, (uint32_t) dfd_offset);
+    PutLittleEndian32(file + 52, (uint32_t) dfd_size);
+
+    for (int level = 0; level < level_count; ++level)
+    {
+        uint8_t* entry = file + KTX2_HEADER_SIZE + level * KTX2_LEVEL_INDEX_SIZE;
+        PutLittleEndian64(entry, offsets[level]);
+        PutLittleEndian64(entry + 8, levels[level].size);
+        PutLittleEndian64(entry + 16, levels[level].size);
+        memcpy(file + offsets[level], levels[level].data, levels[level].size);
+    }
+    memcpy(file + dfd_offset, dfd, dfd_size);
+
+    bool32_t ok = fwrite(file, 1, size, f) == size;
+    free(file);
+
+    return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Mipmaps
+//////////////////////////////////////////////////////////////////////////////
+
+// With MIPMAPS the KTX2 holds the whole chain, each level made from the one
+// above it. The rows of a level are split in bands over the worker threads.
+// Channels are filtered as stored, like a GPU does for a UNORM texture:
+//
+// - BOX: the plain 2x2 average, in integers.
+// - KAISER: a 6 tap Kaiser windowed sinc applied across then down, in
+//   floats with the four channels of a pixel in one SIMD register. It keeps
+//   more detail than the box but its wider reach needs the extruded padding.
+//
+// CreateAtlas grows the padding of each sprite with the level count, and
+// with the reach of the taps for KAISER, keeps the packed rects on a power
+// of two grid, so a texel never mixes two sprites, and fills the padding
+// with the sprite's own edge pixels.
+
+#define MIP_BAND_ROWS 16
+#define MIP_KAISER_ALPHA 4.0
+
+// Averages two rows of count * 2 pixels down to count pixels
+INTERNAL void
+BoxDownsampleRowScalar(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            dst[i*4 + c] = (uint8_t) ((row0[i*8 + c] + row0[i*8 + 4 + c] + row1[i*8 + c] + row1[i*8 + 4 + c] + 2) >> 2);
+        }
+    }
+}
+
+INTERNAL void
+BoxDownsampleRow(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int count)
+{
+    int i = 0;
+
+#if defined(SIMD_SSE2)
+    // Channels are widened to 16 bits, the two rows added, then the 64-bit
+    // halves holding neighbouring pixels
+    __m128i zero = _mm_setzero_si128();
+    __m128i two = _mm_set1_epi16(2);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i*) (row0 + i*8));
+        __m128i a1 = _mm_loadu_si128((const __m128i*) (row0 + i*8 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*) (row1 + i*8));
+        __m128i b1 = _mm_loadu_si128((const __m128i*) (row1 + i*8 + 16));
+
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+        __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i*) (dst + i*4), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(SIMD_NEON)
+    // Loading whole pixels two ways apart splits the even and odd ones
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32x4x2_t a = vld2q_u32((const uint32_t*) (row0 + i*8));
+        uint32x4x2_t b = vld2q_u32((const uint32_t*) (row1 + i*8));
+        uint8x16_t a_even = vreinterpretq_u8_u32(a.val[0]);
+        uint8x16_t a_odd = vreinterpretq_u8_u32(a.val[1]);
+        uint8x16_t b_even = vreinterpretq_u8_u32(b.val[0]);
+        uint8x16_t b_odd = vreinterpretq_u8_u32(b.val[1]);
+
+        uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a_even), vget_low_u8(a_odd)),
+                                  vaddl_u8(vget_low_u8(b_even), vget_low_u8(b_odd)));
+        uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a_even), vget_high_u8(a_odd)),
+                                  vaddl_u8(vget_high_u8(b_even), vget_high_u8(b_odd)));
+        vst1q_u8(dst + i*4, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+    }
+#endif
+
+    BoxDownsampleRowScalar(dst + i*4, row0 + i*8, row1 + i*8, count - i);
+}
+
+INTERNAL double
+BesselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; ++k)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Weights of the source pixels 2x - 2 to 2x + 3 for destination pixel x
+INTERNAL void
+GetKaiserWeights(OUT float* weights)
+{
+    double pi = 3.14159265358979323846;
+    double radius = MIP_KAISER_TAPS / 2;
+    double values[MIP_KAISER_TAPS];
+    double total = 0.0;
+    for (int t = 0; t < MIP_KAISER_TAPS; ++t)
+    {
+        // Distance from the destination pixel center, in source pixels
+        double d = t - (MIP_KAISER_TAPS - 1) / 2.0;
+        double sinc = sin(pi * d / 2.0) / (pi * d / 2.0);
+        double window = BesselI0(MIP_KAISER_ALPHA * sqrt(1.0 - (d / radius) * (d / radius))) / BesselI0(MIP_KAISER_ALPHA);
+        values[t] = sinc * window;
+        total += values[t];
+    }
+
+    for (int t = 0; t < MIP_KAISER_TAPS; ++t)
+    {
+        weights[t] = (float) (values[t] / total);
+    }
+}
+
+INTERNAL void
+RgbaRowToFloat(float* dst, const uint8_t* src, int count)
+{
+    int i = 0;
+
+#if defined(SIMD_SSE2)
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*) (src + i*4));
+        __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+        __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+        _mm_storeu_ps(dst + i*4 + 0, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(dst + i*4 + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(dst + i*4 + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(dst + i*4 + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+#elif defined(SIMD_NEON)
+    for (; i + 4 <= count; i += 4)
+    {
+        uint8x16_t pixels = vld1q_u8(src + i*4);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(pixels));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(pixels));
+        vst1q_f32(dst + i*4 + 0, vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))));
+        vst1q_f32(dst + i*4 + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))));
+        vst1q_f32(dst + i*4 + 8, vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))));
+        vst1q_f32(dst + i*4 + 12, vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))));
+    }
+#endif
+
+    for (; i < count*4; ++i)
+    {
+        dst[i] = (float) src[i];
+    }
+}
+
+// Weighted sum of MIP_KAISER_TAPS float RGBA pixels
+INTERNAL void
+MixPixels(float* dst, const float* const* pixels, const float* weights)
+{
+#if defined(SIMD_SSE2)
+    __m128 sum = _mm_mul_ps(_mm_loadu_ps(pixels[0]), _mm_set1_ps(weights[0]));
+    for (int t = 1; t < MIP_KAISER_TAPS; ++t)
+    {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(pixels[t]), _mm_set1_ps(weights[t])));
+    }
+    _mm_storeu_ps(dst, sum);
+#elif defined(SIMD_NEON)
+    float32x4_t sum = vmulq_n_f32(vld1q_f32(pixels[0]), weights[0]);
+    for (int t = 1; t < MIP_KAISER_TAPS; ++t)
+    {
+        sum = vmlaq_n_f32(sum, vld1q_f32(pixels[t]), weights[t]);
+    }
+    vst1q_f32(dst, sum);
+#else
+    for (int c = 0; c < 4; ++c)
+    {
+        float sum = 0.0f;
+        for (int t = 0; t < MIP_KAISER_TAPS; ++t)
+        {
+            sum += pixels[t][c] * weights[t];
+        }
+        dst[c] = sum;
+    }
+#endif
+}
+
+// Rounds and clamps a float RGBA pixel to bytes
+INTERNAL void
+StorePixel(uint8_t* dst, const float* pixel)
+{
+#if defined(SIMD_SSE2)
+    __m128i value = _mm_cvtps_epi32(_mm_loadu_ps(pixel));
+    value = _mm_packs_epi32(value, value);
+    value = _mm_packus_epi16(value, value);
+    uint32_t packed = (uint32_t) _mm_cvtsi128_si32(value);
+    memcpy(dst, &packed, 4);
+#elif defined(SIMD_NEON)
+    uint16x4_t value = vqmovun_s32(vcvtnq_s32_f32(vld1q_f32(pixel)));
+    uint8x8_t bytes = vqmovn_u16(vcombine_u16(value, value));
+    vst1_lane_u32((uint32_t*) dst, vreinterpret_u32_u8(bytes), 0);
+#else
+    for (int c = 0; c < 4; ++c)
+    {
+        dst[c] = (uint8_t) ClampByte((int) floorf(pixel[c] + 0.5f));
+    }
+#endif
+}
+
+// Filters a float row of src_width pixels across, down to width pixels
+INTERNAL void
+KaiserFilterRow(float* dst, const float* src, int src_width, int width, const float* weights)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        const float* taps[MIP_KAISER_TAPS];
+        for (int t = 0; t < MIP_KAISER_TAPS; ++t)
+        {
+            int sx = 2*x - (MIP_KAISER_TAPS / 2 - 1) + t;
+            sx = sx < 0 ? 0 : (sx >= src_width ? src_width - 1 : sx);
+            taps[t] = src + sx*4;
+        }
+        MixPixels(dst + x*4, taps, weights);
+    }
+}
+
+// Filters MIP_KAISER_TAPS float rows down into one row of bytes
+INTERNAL void
+KaiserFilterColumn(uint8_t* dst, const float* const* rows, int width, const float* weights)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        const float* taps[MIP_KAISER_TAPS];
+        for (int t = 0; t < MIP_KAISER_TAPS; ++t)
+        {
+            taps[t] = rows[t] + x*4;
+        }
+
+        float pixel[4];
+        MixPixels(pixel, taps, weights);
+        StorePixel(dst + x*4, pixel);
+    }
+}
+
+typedef struct
+{
+    mip_filter_t filter;
+    float weights[MIP_KAISER_TAPS];
+    const uint8_t* src;
+    int src_width;
+    int src_height;
+    uint8_t* dst;
+    int width;
+    int height;
+} mip_work_t;
+
+INTERNAL void
+MipBandWork(void* data, int index)
+{
+    mip_work_t* work = (mip_work_t*) data;
+    int y0 = index * MIP_BAND_ROWS;
+    int y1 = y0 + MIP_BAND_ROWS < work->height ? y0 + MIP_BAND_ROWS : work->height;
+    size_t src_stride = (size_t) work->src_width * 4;
+    size_t dst_stride = (size_t) work->width * 4;
+
+    if (work->filter == MIP_BOX)
+    {
+        // Odd sizes drop the last row and column, except a single one
+        int pairs = work->src_width / 2;
+        for (int y = y0; y < y1; ++y)
+        {
+            const uint8_t* row0 = work->src + (size_t) (2*y) * src_stride;
+            const uint8_t* row1 = work->src + (size_t) (2*y + 1 < work->src_height ? 2*y + 1 : 2*y) * src_stride;
+            uint8_t* dst = work->dst + (size_t) y * dst_stride;
+            BoxDownsampleRow(dst, row0, row1, pairs);
+            if (pairs == 0)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    dst[c] = (uint8_t) ((row0[c] + row1[c] + 1) >> 1);
+                }
+            }
+        }
+        return;
+    }
+
+    // Source rows 2*y0 - 2 to 2*y1 + 1 are filtered across once, then
+    // every destination row mixes six of them
+    int first = 2*y0 - (MIP_KAISER_TAPS / 2 - 1);
+    int row_count = 2*(y1 - y0) + MIP_KAISER_TAPS - 2;
+    float* line = (float*) malloc((size_t) work->src_width * 4 * sizeof(float));
+    float* rows = (float*) malloc((size_t) row_count * dst_stride * sizeof(float));
+
+    for (int r = 0; r < row_count; ++r)
+    {
+        int sy = first + r;
+        sy = sy < 0 ? 0 : (sy >= work->src_height ? work->src_height - 1 : sy);
+        RgbaRowToFloat(line, work->src + (size_t) sy * src_stride, work->src_width);
+        KaiserFilterRow(rows + (size_t) r * dst_stride, line, work->src_width, work->width, work->weights);
+    }
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const float* taps[MIP_KAISER_TAPS];
+        for (int t = 0; t < MIP_KAISER_TAPS; ++t)
+        {
+            taps[t] = rows + (size_t) (2*(y - y0) + t) * dst_stride;
+        }
+        KaiserFilterColumn(work->dst + (size_t) y * dst_stride, taps, work->width, work->weights);
+    }
+
+    free(rows);
+    free(line);
+}
+
+INTERNAL int
+GetMipSize(int size, int level)
+{
+    return (size >> level) > 0 ? size >> level : 1;
+}
+
+// Levels of the chain for an image, the requested count or fewer when the
+// image gets down to 1x1 first
+INTERNAL int
+GetMipLevelCount(int width, int height, int levels)
+{
+    int count = 1;
+    while (count < levels && (GetMipSize(width, count - 1) > 1 || GetMipSize(height, count - 1) > 1))
+    {
+        count++;
+    }
+    return count;
+}
+
+// Fills levels[1] to levels[count - 1] with malloc'd images, each half the
+// size of the one before; levels[0] is the given image
+INTERNAL void
+GenerateMipChain(mip_filter_t filter, const uint8_t* pixels, int width, int height, int count, OUT uint8_t** levels)
+{
+    mip_work_t work = { 0 };
+    work.filter = filter;
+    GetKaiserWeights(work.weights);
+
+    levels[0] = (uint8_t*) pixels;
+    for (int level = 1; level < count; ++level)
+    {
+        work.src = levels[level - 1];
+        work.src_width = GetMipSize(width, level - 1);
+        work.src_height = GetMipSize(height, level - 1);
+        work.width = GetMipSize(width, level);
+        work.height = GetMipSize(height, level);
+        work.dst = (uint8_t*) malloc((size_t) work.width * work.height * 4);
+        ParallelFor((work.height + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS, MipBandWork, &work);
+        levels[level] = work.dst;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+INTERNAL bool32_t
+ExportPng(atlas_t* atlas, int page, const char* filename)
+{
+    char temp[MAX_FILENAME + 8];
+    GetTempFilename(filename, temp, sizeof(temp));
+
+    FILE* f = fopen(temp, "wb");
+    if (!f)
+    {
+        printf("Error: Cannot write %s\n", filename);
+        return 0;
+    }
+
+    uint8_t* pixels = atlas->pixels + (size_t) page * atlas->width * atlas->height * 4;
+    bool32_t ok = WritePng(f, pixels, atlas->width, atlas->height, global_png_level);
+    if (fclose(f) != 0 || !ok)
+    {
+        printf("Error: Cannot write %s\n", filename);
+        remove(temp);
+        return 0;
+    }
+
+    return CommitTempFile(temp, filename);
+}
+
+// Color is tagged sRGB like the PNG's, except with MSDF fonts whose RGB
+// channels hold distances that must reach the shader unconverted
+INTERNAL bool32_t
+TextureIsSrgb(const atlas_t* atlas)
+{
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        if (atlas->fonts[i].mode == GLYPH_MSDF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+INTERNAL bool32_t
+ExportKtx2(atlas_t* atlas, int page, const char* filename)
+{
+    char temp[MAX_FILENAME + 8];
+    GetTempFilename(filename, temp, sizeof(temp));
+
+    FILE* f = fopen(temp, "wb");
+    if (!f)
+    {
+        printf("Error: Cannot write %s\n", filename);
+        return 0;
+    }
+
+    uint8_t* pixels = atlas->pixels + (size_t) page * atlas->width * atlas->height * 4;
+    int level_count = GetMipLevelCount(atlas->width, atlas->height, atlas->mip_levels);
+    uint8_t* mips[MAX_MIP_LEVELS];
+    GenerateMipChain(atlas->mip_filter, pixels, atlas->width, atlas->height, level_count, mips);
+
+    texture_level_t levels[MAX_MIP_LEVELS];
+    for (int level = 0; level < level_count; ++level)
+    {
+        levels[level].data = EncodeTexture(atlas->texture_format, mips[level], GetMipSize(atlas->width, level),
+                                           GetMipSize(atlas->height, level), &levels[level].size);
+    }
+    bool32_t ok = WriteKtx2(f, atlas->texture_format, TextureIsSrgb(atlas), atlas->alpha_mode != ALPHA_STRAIGHT,
+                            atlas->width, atlas->height, levels, level_count);
+
+    for (int level = 0; level < level_count; ++level)
+    {
+        free(levels[level].data);
+        if (level > 0)
+        {
+            free(mips[level]);
+        }
+    }
+
+    if (fclose(f) != 0 || !ok)
+    {
+        printf("Error: Cannot write %s\n", filename);
+        remove(temp);
+        return 0;
+    }
+
+    return CommitTempFile(temp, filename);
+}
+
+INTERNAL void
+GetImageUV(atlas_t* atlas, image_t* image, OUT float* u0, OUT float* v0, OUT float* u1, OUT float* v1)
+{
+    int region_width = image->rotated ? image->height : image->width;
+    int region_height = image->rotated ? image->width : image->height;
+    *u0 = (float)image->x / (float)atlas->width;
+    *v0 = (float)image->y / (float)atlas->height;
+    *u1 = (float)(image->x + region_width) / (float)atlas->width;
+    *v1 = (float)(image->y + region_height) / (float)atlas->height;
+}
+
+#define GLYPH_PAGE_BITS 8
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_BITS)
+
+typedef struct
+{
+    uint32_t* pages;            // Block of each page, block 0 is empty
+    uint32_t* blocks;           // GLYPH_PAGE_SIZE entries per block, glyph index + 1 or 0
+    int page_count;
+    int block_count;
+} glyph_page_table_t;
+
+// Two-level lookup for glyphs[first..glyph_count): pages maps codepoint >> 8
+// to a block, and the block's 256 entries hold the glyph index from first + 1
+// (0 when the font lacks it). Block 0 is all zeros and shared by every empty
+// page. Expects the glyphs sorted by codepoint.
+INTERNAL void
+BuildGlyphPageTable(const font_t* font, int first, OUT glyph_page_table_t* table)
+{
+    memset(table, 0, sizeof(*table));
+    if (first >= font->glyph_count)
+    {
+        return;
+    }
+
+    table->page_count = (font->glyphs[font->glyph_count - 1].codepoint >> GLYPH_PAGE_BITS) + 1;
+    table->pages = (uint32_t*) calloc(table->page_count, sizeof(uint32_t));
+    table->block_count = 1;
+    for (int j = first; j < font->glyph_count; ++j)
+    {
+        int page = font->glyphs[j].codepoint >> GLYPH_PAGE_BITS;
+        if (table->pages[page] == 0)
+        {
+            table->pages[page] = table->block_count++;
+        }
+    }
+
+    // Blocks are numbered in page order, so the glyphs fill them in order too
+    table->blocks = (uint32_t*) calloc((size_t) table->block_count * GLYPH_PAGE_SIZE, sizeof(uint32_t));
+    for (int j = first; j < font->glyph_count; ++j)
+    {
+        int codepoint = font->glyphs[j].codepoint;
+        uint32_t block = table->pages[codepoint >> GLYPH_PAGE_BITS];
+        table->blocks[block * GLYPH_PAGE_SIZE + (codepoint & (GLYPH_PAGE_SIZE - 1))] = (uint32_t) (j - first + 1);
+    }
+}
+
+INTERNAL void
+FreeGlyphPageTable(glyph_page_table_t* table)
+{
+    free(table->pages);
+    free(table->blocks);
+}
+
+// Lookup table for the glyphs past ASCII, as uint16_t to keep the header
+// small. Fails when a glyph index + 1 would not fit.
+INTERNAL bool32_t
+ExportGlyphPageTable(FILE* f, const font_t* font)
+{
+    int ascii_count = 0;
+    while (ascii_count < font->glyph_count && font->glyphs[ascii_count].codepoint < 128)
+    {
+        ascii_count++;
+    }
+
+    if (font->glyph_count - ascii_count >= 0xFFFF)
+    {
+        printf("Error: Font %s has %d glyphs past ASCII, the header lookup table holds at most %d.\n",
+               font->name, font->glyph_count - ascii_count, 0xFFFF - 1);
+        return 0;
+    }
+
+    glyph_page_table_t table;
+    BuildGlyphPageTable(font, ascii_count, &table);
+
+    fprintf(f, "static const uint16_t BACKED_FONT_%s_GLYPH_PAGES[] = {\n", font->name);
+    for (int page = 0; page < table.page_count; ++page)
+    {
+        fprintf(f, "%s%u,%s", (page % 16) == 0 ? "    " : " ", table.pages[page],
+                (page % 16) == 15 || page == table.page_count - 1 ? "\n" : "");
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "static const uint16_t BACKED_FONT_%s_GLYPH_BLOCKS[] = {\n", font->name);
+    for (int b = 0; b < table.block_count; ++b)
+    {
+        uint32_t* block = table.blocks + (size_t) b * GLYPH_PAGE_SIZE;
+        if (b > 0)
+        {
+            // First glyph of the block names its page
+            for (int j = 0; j < GLYPH_PAGE_SIZE; ++j)
+            {
+                if (block[j])
+                {
+                    fprintf(f, "    // U+%04X\n", font->glyphs[ascii_count + block[j] - 1].codepoint & ~(GLYPH_PAGE_SIZE - 1));
+                    break;
+                }
+            }
+        }
+
+        for (int j = 0; j < GLYPH_PAGE_SIZE; ++j)
+        {
+            fprintf(f, "%s%u,%s", (j % 16) == 0 ? "    " : " ", block[j], (j % 16) == 15 ? "\n" : "");
+        }
+    }
+    fprintf(f, "};\n\n");
+
+    FreeGlyphPageTable(&table);
+    return 1;
+}
+
+INTERNAL bool32_t
+ExportHeader(atlas_t* atlas, const char* filename)
+{
+    char temp[MAX_FILENAME + 8];
+    GetTempFilename(filename, temp, sizeof(temp));
+
+    FILE* f = fopen(temp, "w");
+    if (!f)
+    {
+        printf("Error: Cannot create header file.\n");
+        return 0;
+    }
+
+    static const char* alpha_mode_names[] = {
+        "ALPHA_MODE_STRAIGHT",
+        "ALPHA_MODE_PREMULTIPLIED",
+        "ALPHA_MODE_PREMULTIPLIED_GAMMA",
+    };
+
+    // Levels in the KTX2 pages, for the sampler's maximum LOD
+    char mip_define[64] = "";
+    if (atlas->mip_levels > 1)
+    {
+        snprintf(mip_define, sizeof(mip_define), "#define BACKED_ATLAS_MIP_LEVELS %d\n\n",
+                 GetMipLevelCount(atlas->width, atlas->height, atlas->mip_levels));
+    }
+
+    fprintf(f, "// Auto-generated sprite atlas - DO NOT EDIT!\n"
+               "// Generated by sprite backer tool\n"
+               "// Contains %d fonts and %d images\n\n"
+               "#pragma once\n\n"
+               "#include <stdint.h>\n\n"
+               "#define BACKED_ATLAS_PAGE_COUNT %d\n\n"
+               "%s"
+               "#define ALPHA_MODE_STRAIGHT 0               // Blend with SRC_ALPHA, ONE_MINUS_SRC_ALPHA\n"
+               "#define ALPHA_MODE_PREMULTIPLIED 1          // Color times alpha in linear light, blend with ONE, ONE_MINUS_SRC_ALPHA\n"
+               "#define ALPHA_MODE_PREMULTIPLIED_GAMMA 2    // Color bytes times alpha, blend with ONE, ONE_MINUS_SRC_ALPHA\n"
+               "#define BACKED_ATLAS_ALPHA_MODE %s\n\n"
+               "typedef struct\n{\n"
+               "    int32_t x, y, w, h;    // Position in atlas and sprite size\n"
+               "    float u0, v0, u1, v1;   // UV coordinates\n"
+               "    int32_t page;           // Atlas page\n"
+               "    int32_t rotated;        // Stored turned 90 degrees clockwise, the atlas region is h x w\n"
+               "    int32_t trim_x, trim_y; // Offset of the trimmed region in the source image\n"
+               "    int32_t source_w, source_h; // Source image size before trimming\n"
+               "} sprite_t;\n\n"
+               "typedef enum\n{\n",
+               atlas->font_count,
+               atlas->image_count,
+               atlas->page_count,
+               mip_define,
+               alpha_mode_names[atlas->alpha_mode]);
+
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        fprintf(f, "    SPRITE_%s,\n", atlas->images[i].name);
+    }
+
+    fprintf(f, "    SPRITE_COUNT,\n"
+                 "} sprite_id;\n\n"
+                 "static const sprite_t BACKED_SPRITE_LIST[] = {\n");
+
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        image_t* image = &atlas->images[i];
+        float u0, v0, u1, v1;
+        GetImageUV(atlas, image, &u0, &v0, &u1, &v1);
+
+        fprintf(f,
+            "    [SPRITE_%s] = {%d, %d, %d, %d, %ff, %ff, %ff, %ff, %d, %d, %d, %d, %d, %d},\n",
+            image->name,
+            image->x, image->y,
+            image->width, image->height,
+            u0, v0, u1, v1,
+            image->page,
+            image->rotated,
+            image->trim_x, image->trim_y,
+            image->source_width, image->source_height
+        );
+    }
+
+    fprintf(f, "};\n\n"
+                 "typedef struct\n{\n"
+                 "    uint64_t codepoint;     // Unicode codepoint\n"
+                 "    int32_t w, h;          // Dimensions\n"
+                 "    float u0, v0, u1, v1;   // UV coordinates\n"
+                 "    float xoff, yoff;       // Offset from baseline\n"
+                 "    float advance;          // Advance to next glyph\n"
+                 "    int32_t page;           // Atlas page\n"
+                 "} glyph_t;\n\n"
+                 "typedef enum\n{\n"
+                 "    GLYPH_MODE_BITMAP,             // Coverage in alpha\n"
+                 "    GLYPH_MODE_SDF,                // Signed distance in alpha\n"
+                 "    GLYPH_MODE_MSDF,               // Multi-channel distance in RGB, true distance in alpha\n"
+                 "} glyph_mode_t;\n\n"
+                 "typedef struct\n{\n"
+                 "    int size;                      // Size in pixels\n"
+                 "    int ascent, descent, line_gap; // Metrics\n"
+                 "    glyph_mode_t mode;             // What the glyph texels hold\n"
+                 "    float distance_range;          // Distance fields: pixels from value 0 to 1, 0.5 is the edge\n"
+                 "    glyph_t ascii_cache[128];      // Glyphs\n"
+                 "    const glyph_t* glyphs;         // Glyphs past ASCII, by codepoint\n"
+                 "    uint32_t glyph_count;          // Number of glyphs\n"
+                 "    const uint16_t* glyph_pages;   // Block of each 256 codepoints past ASCII\n"
+                 "    const uint16_t* glyph_blocks;  // 256 glyph indices + 1 per block, 0 when missing\n"
+                 "    uint32_t glyph_page_count;     // Number of glyph pages\n"
+                 "    const uint64_t* kern_keys;     // first << 32 | second codepoint, ascending\n"
+                 "    const float* kern_advances;    // Pixels to add between the pair\n"
+                 "    uint32_t kern_count;           // Number of kerning pairs\n"
+                 "} font_t;\n\n"
+                 "// Glyph for a codepoint, or 0 when the font does not have it\n"
+                 "static inline const glyph_t* GetBackedGlyph(const font_t* font, uint32_t codepoint)\n"
+                 "{\n"
+                 "    if (codepoint < 128)\n"
+                 "    {\n"
+                 "        // Unused cache entries are zeroed, so 0 never matches\n"
+                 "        return codepoint && font->ascii_cache[codepoint].codepoint == codepoint ? &font->ascii_cache[codepoint] : 0;\n"
+                 "    }\n"
+                 "    uint32_t page = codepoint >> 8;\n"
+                 "    if (page >= font->glyph_page_count)\n"
+                 "    {\n"
+                 "        return 0;\n"
+                 "    }\n"
+                 "    uint32_t index = font->glyph_blocks[((uint32_t) font->glyph_pages[page] << 8) | (codepoint & 0xFF)];\n"
+                 "    return index ? &font->glyphs[index - 1] : 0;\n"
+                 "}\n\n"
+                 "// Kerning between two codepoints, 0 when the pair has none\n"
+                 "static inline float GetBackedKerning(const font_t* font, uint32_t first, uint32_t second)\n"
+                 "{\n"
+                 "    uint64_t key = ((uint64_t) first << 32) | second;\n"
+                 "    uint32_t lo = 0, hi = font->kern_count;\n"
+                 "    while (lo < hi)\n"
+                 "    {\n"
+                 "        uint32_t mid = lo + (hi - lo) / 2;\n"
+                 "        if (font->kern_keys[mid] < key) lo = mid + 1; else hi = mid;\n"
+                 "    }\n"
+                 "    return (lo < font->kern_count && font->kern_keys[lo] == key) ? font->kern_advances[lo] : 0.0f;\n"
+                 "}\n\n"
+                 "typedef enum\n{\n");
+
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        fprintf(f, "    FONT_%s,\n", atlas->fonts[i].name);
+    }
+
+    fprintf(f, "    FONT_COUNT,\n"
+                 "} font_id;\n\n");
+
+    // Glyphs past ASCII go in one array per font, sized to what it has
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        // Sort glyphs by codepoint, codepoints are unique within a font
+        qsort(atlas->fonts[i].glyphs, atlas->fonts[i].glyph_count, sizeof(glyph_mapping_t), CompareGlyphMappings);
+
+        font_t* font = &atlas->fonts[i];
+        if (font->glyph_count == 0 || font->glyphs[font->glyph_count - 1].codepoint < 128)
+        {
+            continue;
+        }
+
+        fprintf(f, "static const glyph_t BACKED_FONT_%s_GLYPHS[] = {\n", font->name);
+
+        int index = 0;
+        for (int j = 0; j < font->glyph_count; ++j)
+        {
+            glyph_mapping_t* glyph = &font->glyphs[j];
+            if (glyph->codepoint >= 128)
+            {
+                fprintf(f, "    [%d] = { %d, %d, %d, %ff, %ff, %ff, %ff, %ff, %ff, %ff, %d },\n",
+                index++, glyph->codepoint,
+                glyph->glyph.w, glyph->glyph.h,
+                glyph->glyph.u0, glyph->glyph.v0,
+                glyph->glyph.u1, glyph->glyph.v1,
+                glyph->glyph.xoff, glyph->glyph.yoff,
+                glyph->glyph.xadvance, glyph->glyph.page);
+            }
+        }
+
+        fprintf(f, "};\n\n");
+
+        if (!ExportGlyphPageTable(f, font))
+        {
+            fclose(f);
+            remove(temp);
+            return 0;
+        }
+    }
+
+    // Kerning keys and advances in separate arrays, the search only reads keys
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        if (font->kerning_count == 0)
+        {
+            continue;
+        }
+
+        fprintf(f, "static const uint64_t BACKED_FONT_%s_KERN_KEYS[] = {\n", font->name);
+        for (int j = 0; j < font->kerning_count; ++j)
+        {
+            fprintf(f, "%s0x%016llXull,%s", (j % 4) == 0 ? "    " : " ",
+                    (unsigned long long) font->kerning[j].key, (j % 4) == 3 ? "\n" : "");
+        }
+        fprintf(f, "%s};\n\n", (font->kerning_count % 4) ? "\n" : "");
+
+        fprintf(f, "static const float BACKED_FONT_%s_KERN_ADVANCES[] = {\n", font->name);
+        for (int j = 0; j < font->kerning_count; ++j)
+        {
+            fprintf(f, "%s%ff,%s", (j % 8) == 0 ? "    " : " ",
+                    font->kerning[j].advance, (j % 8) == 7 ? "\n" : "");
+        }
+        fprintf(f, "%s};\n\n", (font->kerning_count % 8) ? "\n" : "");
+    }
+
+    fprintf(f, "static const font_t BACKED_FONT_LIST[] = {\n");
+    
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        const char* mode_names[] = { "GLYPH_MODE_BITMAP", "GLYPH_MODE_SDF", "GLYPH_MODE_MSDF" };
+        float distance_range = font->mode == GLYPH_BITMAP ? 0.0f : (float) font->spread * 2.0f;
+
+        fprintf(f, "    [FONT_%s] = {\n"
+                     "        .size = %d,\n"
+                     "        .ascent = %d,\n"
+                     "        .descent = %d,\n"
+                     "        .line_gap = %d,\n"
+                     "        .mode = %s,\n"
+                     "        .distance_range = %ff,\n"
+                     "        .ascii_cache = {\n",
+                     font->name, font->size, font->ascent,
+                     font->descent, font->line_gap,
+                     mode_names[font->mode], distance_range);
+
+        int ascii_count = 0;
+
+        for (int j = 0; j < font->glyph_count; ++j)
+        {
+            glyph_mapping_t* glyph = &font->glyphs[j];
+            if (glyph->codepoint < 128)
+            {
+                ascii_count++;
+                fprintf(f, "            [0x%02X] = { %d, %d, %d, %ff, %ff, %ff, %ff, %ff, %ff, %ff, %d },\n",
+                             glyph->codepoint, glyph->codepoint,
+                             glyph->glyph.w, glyph->glyph.h,
+                             glyph->glyph.u0, glyph->glyph.v0,
+                             glyph->glyph.u1, glyph->glyph.v1,
+                             glyph->glyph.xoff, glyph->glyph.yoff,
+                             glyph->glyph.xadvance, glyph->glyph.page);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        fprintf(f, "        },\n");
+
+        if (font->glyph_count <= ascii_count)
+        {
+            fprintf(f, "        .glyph_count = 0,\n");
+        }
+        else
+        {
+            fprintf(f, "        .glyph_count = %d,\n"
+                         "        .glyphs = BACKED_FONT_%s_GLYPHS,\n"
+                         "        .glyph_page_count = %d,\n"
+                         "        .glyph_pages = BACKED_FONT_%s_GLYPH_PAGES,\n"
+                         "        .glyph_blocks = BACKED_FONT_%s_GLYPH_BLOCKS,\n",
+                         font->glyph_count - ascii_count, font->name,
+                         (font->glyphs[font->glyph_count - 1].codepoint >> GLYPH_PAGE_BITS) + 1,
+                         font->name, font->name);
+        }
+
+        if (font->kerning_count > 0)
+        {
+            fprintf(f, "        .kern_count = %d,\n"
+                         "        .kern_keys = BACKED_FONT_%s_KERN_KEYS,\n"
+                         "        .kern_advances = BACKED_FONT_%s_KERN_ADVANCES,\n",
+                         font->kerning_count, font->name, font->name);
+        }
+
+        fprintf(f, "    },\n");
+    }
+
+    fprintf(f, "};\n");
+    if (fclose(f) != 0)
+    {
+        remove(temp);
+        return 0;
+    }
+
+    return CommitTempFile(temp, filename);
+}
+
+#define BINARY_ALIGN 8
+
+INTERNAL uint32_t
+ReserveBinary(OUT size_t* size, size_t bytes)
+{
+    size_t offset = (*size + BINARY_ALIGN - 1) & ~(size_t) (BINARY_ALIGN - 1);
+    *size = offset + bytes;
+    return (uint32_t) offset;
+}
+
+// Lays out the binary atlas described in backed_atlas.h. Offsets are found in
+// one pass over the sizes, then the tables are filled in place.
+INTERNAL uint8_t*
+BuildBinary(atlas_t* atlas, OUT size_t* size)
+{
+    uint32_t probe = 1;
+    if (*(uint8_t*) &probe != 1)
+    {
+        printf("Error: The binary atlas can only be written on a little-endian machine.\n");
+        return 0;
+    }
+
+    glyph_page_table_t* tables = (glyph_page_table_t*) calloc(atlas->font_count + 1, sizeof(glyph_page_table_t));
+    backed_font_t* fonts = (backed_font_t*) calloc(atlas->font_count + 1, sizeof(backed_font_t));
+
+    size_t total = 0;
+    ReserveBinary(&total, sizeof(backed_atlas_t));
+    uint32_t sprite_offset = ReserveBinary(&total, (size_t) atlas->image_count * sizeof(backed_sprite_t));
+    uint32_t font_offset = ReserveBinary(&total, (size_t) atlas->font_count * sizeof(backed_font_t));
+
+    size_t string_size = 0;
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        string_size += strlen(atlas->images[i].name) + 1;
+    }
+
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        backed_font_t* out = &fonts[i];
+
+        qsort(font->glyphs, font->glyph_count, sizeof(glyph_mapping_t), CompareGlyphMappings);
+        BuildGlyphPageTable(font, 0, &tables[i]);
+
+        out->glyph_count = font->glyph_count;
+        out->glyphs = ReserveBinary(&total, (size_t) font->glyph_count * sizeof(backed_glyph_t));
+        out->glyph_page_count = tables[i].page_count;
+        out->glyph_pages = ReserveBinary(&total, (size_t) tables[i].page_count * sizeof(uint32_t));
+        out->glyph_blocks = ReserveBinary(&total, (size_t) tables[i].block_count * GLYPH_PAGE_SIZE * sizeof(uint32_t));
+        out->kern_count = font->kerning_count;
+        out->kern_keys = ReserveBinary(&total, (size_t) font->kerning_count * sizeof(uint64_t));
+        out->kern_advances = ReserveBinary(&total, (size_t) font->kerning_count * sizeof(float));
+
+        string_size += strlen(font->name) + 1;
+    }
+
+    uint32_t string_offset = ReserveBinary(&total, string_size);
+    ReserveBinary(&total, 0);
+
+    if (total > UINT32_MAX)
+    {
+        printf("Error: The binary atlas is larger than 4 GiB.\n");
+        for (int i = 0; i < atlas->font_count; ++i)
+        {
+            FreeGlyphPageTable(&tables[i]);
+        }
+        free(tables);
+        free(fonts);
+        return 0;
+    }
+
+    uint8_t* data = (uint8_t*) calloc(total, 1);
+    backed_atlas_t* header = (backed_atlas_t*) data;
+    header->magic = BACKED_ATLAS_MAGIC;
+    header->version = BACKED_ATLAS_VERSION;
+    header->file_size = (uint32_t) total;
+    header->page_count = atlas->page_count;
+    header->width = atlas->width;
+    header->height = atlas->height;
+    header->sprite_count = atlas->image_count;
+    header->sprites = sprite_offset;
+    header->font_count = atlas->font_count;
+    header->fonts = font_offset;
+    header->strings = string_offset;
+    header->string_size = (uint32_t) string_size;
+    header->alpha_mode = atlas->alpha_mode;
+
+    char* strings = (char*) data + string_offset;
+    uint32_t string_used = 0;
+
+    backed_sprite_t* sprites = (backed_sprite_t*) (data + sprite_offset);
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        image_t* image = &atlas->images[i];
+        backed_sprite_t* sprite = &sprites[i];
+        sprite->x = image->x;
+        sprite->y = image->y;
+        sprite->w = image->width;
+        sprite->h = image->height;
+        GetImageUV(atlas, image, &sprite->u0, &sprite->v0, &sprite->u1, &sprite->v1);
+        sprite->page = image->page;
+        sprite->rotated = image->rotated;
+        sprite->trim_x = image->trim_x;
+        sprite->trim_y = image->trim_y;
+        sprite->source_w = image->source_width;
+        sprite->source_h = image->source_height;
+
+        sprite->name = string_used;
+        size_t length = strlen(image->name) + 1;
+        memcpy(strings + string_used, image->name, length);
+        string_used += (uint32_t) length;
+    }
+
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        backed_font_t* out = &fonts[i];
+
+        out->size = font->size;
+        out->ascent = font->ascent;
+        out->descent = font->descent;
+        out->line_gap = font->line_gap;
+        out->mode = font->mode;
+        out->distance_range = font->mode == GLYPH_BITMAP ? 0.0f : (float) font->spread * 2.0f;
+
+        backed_glyph_t* glyphs = (backed_glyph_t*) (data + out->glyphs);
+        for (int j = 0; j < font->glyph_count; ++j)
+        {
+            glyph_mapping_t* mapping = &font->glyphs[j];
+            glyphs[j] = (backed_glyph_t){
+                .codepoint = mapping->codepoint,
+                .w = mapping->glyph.w,
+                .h = mapping->glyph.h,
+                .u0 = mapping->glyph.u0,
+                .v0 = mapping->glyph.v0,
+                .u1 = mapping->glyph.u1,
+                .v1 = mapping->glyph.v1,
+                .xoff = mapping->glyph.xoff,
+                .yoff = mapping->glyph.yoff,
+                .advance = mapping->glyph.xadvance,
+                .page = mapping->glyph.page,
+            };
+        }
+
+        memcpy(data + out->glyph_pages, tables[i].pages, (size_t) tables[i].page_count * sizeof(uint32_t));
+        memcpy(data + out->glyph_blocks, tables[i].blocks, (size_t) tables[i].block_count * GLYPH_PAGE_SIZE * sizeof(uint32_t));
+
+        uint64_t* keys = (uint64_t*) (data + out->kern_keys);
+        float* advances = (float*) (data + out->kern_advances);
+        for (int j = 0; j < font->kerning_count; ++j)
+        {
+            keys[j] = font->kerning[j].key;
+            advances[j] = font->kerning[j].advance;
+        }
+
+        out->name = string_used;
+        size_t length = strlen(font->name) + 1;
+        memcpy(strings + string_used, font->name, length);
+        string_used += (uint32_t) length;
+
+        FreeGlyphPageTable(&tables[i]);
+    }
+
+    memcpy(data + font_offset, fonts, (size_t) atlas->font_count * sizeof(backed_font_t));
+
+    free(tables);
+    free(fonts);
+
+    *size = total;
+    return data;
+}
+
+INTERNAL bool32_t
+ExportBinary(atlas_t* atlas, const char* filename)
+{
+    size_t size;
+    uint8_t* data = BuildBinary(atlas, &size);
+    if (!data)
+    {
+        return 0;
+    }
+
+    char temp[MAX_FILENAME + 8];
+    GetTempFilename(filename, temp, sizeof(temp));
+
+    FILE* f = fopen(temp, "wb");
+    if (!f)
+    {
+        printf("Error: Cannot create binary file.\n");
+        free(data);
+        return 0;
+    }
+
+    bool32_t ok = fwrite(data, 1, size, f) == size;
+    ok = (fclose(f) == 0) && ok;
+    free(data);
+
+    if (!ok)
+    {
+        remove(temp);
+        return 0;
+    }
+
+    return CommitTempFile(temp, filename);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Baking
+//////////////////////////////////////////////////////////////////////////////
+
+// Frees everything ParseConfig, LoadAssets and CreateAtlas allocated and
+// clears the atlas for the next ParseConfig
+INTERNAL void
+FreeAtlas(atlas_t* atlas)
+{
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        free(atlas->images[i].name);
+        free(atlas->images[i].filename);
+        free(atlas->images[i].pixels);
+    }
+
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        for (int j = 0; j < font->charset_file_count; ++j)
+        {
+            free(font->charset_files[j].filename);
+        }
+        free(font->charset_files);
+        free(font->name);
+        free(font->filename);
+        free(font->data);
+        free(font->glyphs);
+        free(font->kerning);
+        free(font->codepoints);
+        free(font->baked.data);
+    }
+
+    free(atlas->images);
+    free(atlas->fonts);
+    free(atlas->pixels);
+    free(atlas->baked_layout.data);
+    memset(atlas, 0, sizeof(*atlas));
+}
+
+INTERNAL bool32_t
+LoadAtlas(const char* config_file, atlas_t* atlas)
+{
+    global_cache_image_hits = 0;
+
+    if (!ParseConfig(config_file, atlas))
+    {
+        printf("Error: Invalid config file: %s\n", config_file);
+        return 0;
+    }
+
+    if (!LoadAssets(atlas))
+    {
+        printf("Error: Failed to load assets of config file: %s\n", config_file);
+        return 0;
+    }
+
+    return 1;
+}
+
+// <output_name>.<extension>, or <output_name>_<page>.<extension> with pages
+INTERNAL void
+GetPageFilename(const atlas_t* atlas, int page, const char* output_name, const char* extension, char* filename, size_t size)
+{
+    if (atlas->page_count == 1)
+    {
+        snprintf(filename, size, "%s.%s", output_name, extension);
+    }
+    else
+    {
+        snprintf(filename, size, "%s_%d.%s", output_name, page, extension);
+    }
+}
+
+// Packs the loaded assets and writes the pages, then the header and binary
+INTERNAL bool32_t
+BakeAtlas(atlas_t* atlas, const char* output_name)
+{
+    global_cache_font_hits = 0;
+
+    if (!CreateAtlas(atlas))
+    {
+        printf("Error: Failed to pack atlas\n");
+        return 0;
+    }
+    PremultiplyAtlas(atlas);
+
+    char filename[MAX_FILENAME];
+    for (int page = 0; page < atlas->page_count; ++page)
+    {
+        GetPageFilename(atlas, page, output_name, "png", filename, sizeof(filename));
+        if (!ExportPng(atlas, page, filename))
+        {
+            return 0;
+        }
+
+        if (atlas->texture_format != TEXTURE_NONE || atlas->mip_levels > 1)
+        {
+            GetPageFilename(atlas, page, output_name, "ktx2", filename, sizeof(filename));
+            if (!ExportKtx2(atlas, page, filename))
+            {
+                return 0;
+            }
+        }
+    }
+
+    snprintf(filename, sizeof(filename), "%s.h", output_name);
+    if (!ExportHeader(atlas, filename))
+    {
+        printf("Error: Failed to create header file.\n");
+        return 0;
+    }
+
+    if (global_export_binary)
+    {
+        snprintf(filename, sizeof(filename), "%s.bin", output_name);
+        if (!ExportBinary(atlas, filename))
+        {
+            printf("Error: Failed to create binary file.\n");
+            return 0;
+        }
+    }
+
+    if (global_print_stats)
+    {
+        size_t atlas_size = (size_t) atlas->width * atlas->height * 4 * atlas->page_count;
+        printf("Atlas pixels: %.1f MB\n", (double) atlas_size / (1024.0 * 1024.0));
+        if (CacheEnabled())
+        {
+            printf("Cache: %ld of %d images, %d of %d fonts, layout %s\n",
+                   global_cache_image_hits, atlas->image_count - 1,
+                   global_cache_font_hits, atlas->font_count,
+                   global_cache_layout_hit ? "reused" : "packed");
+        }
+        printf("Peak memory: %.1f MB\n", (double) GetPeakMemoryUsage() / (1024.0 * 1024.0));
+    }
+
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Watch mode
+//////////////////////////////////////////////////////////////////////////////
+
+// The config, charset files, fonts and images are checked by size and write
+// time, against the stamps the loaders took before reading each file. On
+// Linux inotify wakes the loop as soon as one of their directories changes,
+// elsewhere (or when inotify is unavailable) they are polled. Changed
+// images are reloaded on their own; any other change reloads the whole
+// config. Unchanged fonts and layouts come from the last bake.
+
+#if defined(PLATFORM_LINUX)
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#define WATCH_POLL_MS 500
+#define WATCH_SETTLE_MS 100     // Editors often save in several steps
+
+typedef enum
+{
+    WATCH_CONFIG,               // Also fonts and charset files, reload everything
+    WATCH_IMAGE,
+} watch_kind_t;
+
+typedef struct
+{
+    const char* filename;
+    watch_kind_t kind;
+    int index;                  // Image index
+    file_stamp_t stamp;
+} watched_file_t;
+
+// Starts from the stamp taken when the file was read. Files a failed load
+// never got to are stamped now.
+INTERNAL void
+AddWatchedFile(watched_file_t** files, int* count, int* capacity, const char* filename, file_stamp_t stamp,
+               watch_kind_t kind, int index)
+{
+    if (!filename)
+    {
+        return;
+    }
+
+    *files = (watched_file_t*) GrowArray(*files, *count, capacity, sizeof(watched_file_t));
+    watched_file_t* file = &(*files)[(*count)++];
+    file->filename = filename;
+    file->kind = kind;
+    file->index = index;
+    file->stamp = (stamp.time || stamp.size) ? stamp : GetFileStamp(filename);
+}
+
+// The filenames point into the atlas, collect again after reloading it
+INTERNAL watched_file_t*
+CollectWatchedFiles(const char* config_file, const atlas_t* atlas, OUT int* count)
+{
+    watched_file_t* files = 0;
+    int capacity = 0;
+    *count = 0;
+
+    AddWatchedFile(&files, count, &capacity, config_file, atlas->config_stamp, WATCH_CONFIG, 0);
+    for (int i = 0; i < atlas->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        AddWatchedFile(&files, count, &capacity, font->filename, font->stamp, WATCH_CONFIG, 0);
+        for (int j = 0; j < font->charset_file_count; ++j)
+        {
+            AddWatchedFile(&files, count, &capacity, font->charset_files[j].filename, font->charset_files[j].stamp,
+                           WATCH_CONFIG, 0);
+        }
+    }
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        AddWatchedFile(&files, count, &capacity, atlas->images[i].filename, atlas->images[i].stamp, WATCH_IMAGE, i);
+    }
+
+    return files;
+}
+
+// Blocks until a watched directory reports a change or the poll interval
+// passes, whichever comes first
+INTERNAL void
+WaitForFileEvents(int notify_fd)
+{
+#if defined(PLATFORM_LINUX)
+    if (notify_fd >= 0)
+    {
+        struct pollfd fd = { notify_fd, POLLIN, 0 };
+        if (poll(&fd, 1, WATCH_POLL_MS) > 0)
+        {
+            uint8_t buffer[4096];
+            while (read(notify_fd, buffer, sizeof(buffer)) > 0)
+            {
+            }
+        }
+        return;
+    }
+#endif
+    (void) notify_fd;
+    SleepMilliseconds(WATCH_POLL_MS);
+}
+
+INTERNAL int
+StartFileEvents(const watched_file_t* files, int count)
+{
+#if defined(PLATFORM_LINUX)
+    int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd < 0)
+    {
+        return -1;
+    }
+
+    // Editors often save by replacing the file, so watch the directories.
+    // Adding the same directory again just returns its existing watch.
+    for (int i = 0; i < count; ++i)
+    {
+        char directory[MAX_FILENAME];
+        snprintf(directory, sizeof(directory), "%s", files[i].filename);
+        char* slash = strrchr(directory, '/');
+        if (slash)
+        {
+            *slash = '\0';
+        }
+        else
+        {
+            strcpy(directory, ".");
+        }
+
+        inotify_add_watch(notify_fd, directory[0] ? directory : "/",
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+    }
+
+    return notify_fd;
+#else
+    (void) files;
+    (void) count;
+    return -1;
+#endif
+}
+
+INTERNAL void
+StopFileEvents(int notify_fd)
+{
+#if defined(PLATFORM_LINUX)
+    if (notify_fd >= 0)
+    {
+        close(notify_fd);
+    }
+#else
+    (void) notify_fd;
+#endif
+}
+
+// Marks the files whose stamp differs from the one collected and updates it.
+// Returns the number of changed files.
+INTERNAL int
+UpdateFileStamps(watched_file_t* files, int count, OUT bool32_t* changed)
+{
+    int changed_count = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        file_stamp_t stamp = GetFileStamp(files[i].filename);
+        changed[i] = stamp.time != files[i].stamp.time || stamp.size != files[i].stamp.size;
+        files[i].stamp = stamp;
+        changed_count += changed[i] ? 1 : 0;
+    }
+
+    return changed_count;
+}
+
+INTERNAL bool32_t
+ReloadImages(atlas_t* atlas, int* indices, int count)
+{
+    // Images left alone count as reused, like the kept ones in ReloadAtlas
+    global_cache_image_hits = atlas->image_count - 1 - count;
+
+    for (int i = 0; i < count; ++i)
+    {
+        image_t* image = &atlas->images[indices[i]];
+        free(image->pixels);
+        image->pixels = 0;
+        image->trim_x = 0;
+        image->trim_y = 0;
+    }
+
+    bool32_t* loaded = (bool32_t*) calloc(atlas->image_count + 1, sizeof(bool32_t));
+    load_images_work_t work = { atlas->images, loaded, atlas->trim, indices, 0, 0 };
+    ParallelFor(count, LoadImageWork, &work);
+
+    bool32_t ok = 1;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!loaded[indices[i]])
+        {
+            printf("Error: Failed to load image: %s\n", atlas->images[indices[i]].filename);
+            ok = 0;
+        }
+    }
+
+    free(loaded);
+    return ok;
+}
+
+// Reparses the config, handing the kept fonts and layout of the last bake
+// to the new atlas; they are only used if their keys still match. Decoded
+// images are handed over by filename and only copied while the file keeps
+// its stamp, so only changed images are decoded again.
+INTERNAL bool32_t
+ReloadAtlas(const char* config_file, atlas_t* atlas)
+{
+    int kept_count = atlas->font_count;
+    cache_entry_t* kept = (cache_entry_t*) calloc(kept_count + 1, sizeof(cache_entry_t));
+    for (int i = 0; i < kept_count; ++i)
+    {
+        kept[i] = atlas->fonts[i].baked;
+        atlas->fonts[i].baked.data = 0;
+    }
+    cache_entry_t layout = atlas->baked_layout;
+    atlas->baked_layout.data = 0;
+
+    int kept_image_count = 0;
+    image_t* kept_images = (image_t*) calloc(atlas->image_count + 1, sizeof(image_t));
+    for (int i = 0; i < atlas->image_count; ++i)
+    {
+        image_t* image = &atlas->images[i];
+        if (image->filename && image->pixels)
+        {
+            kept_images[kept_image_count] = *image;
+            kept_images[kept_image_count].name = 0;
+            kept_image_count++;
+            image->filename = 0;
+            image->pixels = 0;
+        }
+    }
+    qsort(kept_images, kept_image_count, sizeof(image_t), CompareImageFilenames);
+    bool32_t kept_trim = atlas->trim;
+
+    FreeAtlas(atlas);
+    atlas->kept_images = kept_images;
+    atlas->kept_image_count = kept_image_count;
+    atlas->kept_trim = kept_trim;
+    bool32_t ok = LoadAtlas(config_file, atlas);
+
+    for (int i = 0; i < kept_image_count; ++i)
+    {
+        free(kept_images[i].filename);
+        free(kept_images[i].pixels);
+    }
+    free(kept_images);
+    atlas->kept_images = 0;
+    atlas->kept_image_count = 0;
+
+    for (int i = 0; i < kept_count; ++i)
+    {
+        if (i < atlas->font_count)
+        {
+            atlas->fonts[i].baked = kept[i];
+        }
+        else
+        {
+            free(kept[i].data);
+        }
+    }
+    atlas->baked_layout = layout;
+    free(kept);
+
+    return ok;
+}
+
+// Never returns, the process is stopped with Ctrl+C. Failed loads and bakes
+// are reported and the files watched until they are fixed.
+INTERNAL int
+WatchAtlas(const char* config_file, const char* output_name, atlas_t* atlas, bool32_t loaded)
+{
+    for (;;)
+    {
+        int count;
+        watched_file_t* files = CollectWatchedFiles(config_file, atlas, &count);
+        bool32_t* changed = (bool32_t*) calloc(count + 1, sizeof(bool32_t));
+        int notify_fd = StartFileEvents(files, count);
+
+        printf("Watching %d files for changes, Ctrl+C to stop\n", count);
+        fflush(stdout);
+
+        do
+        {
+            WaitForFileEvents(notify_fd);
+        } while (UpdateFileStamps(files, count, changed) == 0);
+
+        // Let the writer finish, then take everything that changed meanwhile
+        SleepMilliseconds(WATCH_SETTLE_MS);
+        bool32_t* settled = (bool32_t*) calloc(count + 1, sizeof(bool32_t));
+        UpdateFileStamps(files, count, settled);
+
+        bool32_t reload = !loaded;
+        int* images = (int*) calloc(count + 1, sizeof(int));
+        int image_count = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            if (changed[i] || settled[i])
+            {
+                printf("Changed: %s\n", files[i].filename);
+                if (files[i].kind == WATCH_IMAGE)
+                {
+                    images[image_count++] = files[i].index;
+                }
+                else
+                {
+                    reload = 1;
+                }
+            }
+        }
+
+        double start = GetSeconds();
+        if (reload)
+        {
+            loaded = ReloadAtlas(config_file, atlas);
+        }
+        else
+        {
+            loaded = ReloadImages(atlas, images, image_count);
+        }
+
+        if (loaded && BakeAtlas(atlas, output_name))
+        {
+            printf("Baked %s in %.3f s\n", output_name, GetSeconds() - start);
+        }
+
+        free(images);
+        free(settled);
+        free(changed);
+        free(files);
+        StopFileEvents(notify_fd);
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Internal tools
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef BUILD_INTERNAL
+
+INTERNAL uint32_t
+RandomNext(uint32_t* state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Reference placement that scans every slot, used to validate the indices
+INTERNAL int
+MaxRectsFindPositionLinear(maxrects_t* mr, int width, int height, OUT int* x, OUT int* y)
+{
+    int best_short_side = INT_MAX;
+    int best_long_side = INT_MAX;
+    int best_index = -1;
+
+    for (int i = 0; i < mr->count; ++i)
+    {
+        rect_t r = mr->rects[i];
+        if (r.width >= width && r.height >= height)
+        {
+            int leftover_width = r.width - width;
+            int leftover_height = r.height - height;
+            int short_side = leftover_height < leftover_width ? leftover_height : leftover_width;
+            int long_side = leftover_height > leftover_width ? leftover_height : leftover_width;
+
+            if (short_side < best_short_side || (short_side == best_short_side && long_side < best_long_side))
+            {
+                best_short_side = short_side;
+                best_long_side = long_side;
+                best_index = i;
+                *x = r.x;
+                *y = r.y;
+            }
+        }
+    }
+
+    return best_index;
+}
+
+INTERNAL void
+MaxRectsPlaceRectLinear(maxrects_t* mr, rect_t placed)
+{
+    int first_new = mr->count;
+    for (int i = 0; i < first_new; ++i)
+    {
+        if (mr->rects[i].width > 0 && RectIntersects(placed, mr->rects[i]))
+        {
+            MaxRectsSplitFreeRect(mr, i, placed.x, placed.y, placed.width, placed.height);
+        }
+    }
+
+    for (int n = first_new; n < mr->count; ++n)
+    {
+        if (mr->rects[n].width == 0)
+        {
+            continue;
+        }
+
+        bool32_t contained = 0;
+        for (int i = 0; i < mr->count; ++i)
+        {
+            if (i != n && mr->rects[i].width > 0 && RectContains(mr->rects[i], mr->rects[n]))
+            {
+                contained = 1;
+                break;
+            }
+        }
+
+        if (contained)
+        {
+            MaxRectsRemoveRect(mr, n);
+            continue;
+        }
+
+        for (int i = 0; i < mr->count; ++i)
+        {
+            if (i != n && mr->rects[i].width > 0 && RectContains(mr->rects[n], mr->rects[i]))
+            {
+                MaxRectsRemoveRect(mr, i);
+            }
+        }
+    }
+}
+
+INTERNAL double
+BenchmarkMaxRects(int rect_count, bool32_t linear, OUT int* positions, OUT int* peak_free_rects)
+{
+    uint32_t seed = 12345;
+    int* sizes = (int*) calloc(rect_count * 2, sizeof(int));
+    long long total_area = 0;
+    for (int i = 0; i < rect_count; ++i)
+    {
+        sizes[i*2 + 0] = 4 + (int)(RandomNext(&seed) % 29);
+        sizes[i*2 + 1] = 4 + (int)(RandomNext(&seed) % 29);
+        total_area += sizes[i*2 + 0] * sizes[i*2 + 1];
+    }
+
+    int side = (int) sqrt((double) total_area * 1.4) + 64;
+    maxrects_t mr = CreateMaxRects(side, side);
+    *peak_free_rects = 0;
+
+    double start = GetSeconds();
+    for (int i = 0; i < rect_count; ++i)
+    {
+        int x = -1, y = -1;
+        int score_a, score_b;
+        int index = linear
+            ? MaxRectsFindPositionLinear(&mr, sizes[i*2 + 0], sizes[i*2 + 1], &x, &y)
+            : MaxRectsFindBest(&mr, HEURISTIC_SHORT_SIDE_FIT, sizes[i*2 + 0], sizes[i*2 + 1], &x, &y, &score_a, &score_b);
+
+        positions[i*2 + 0] = x;
+        positions[i*2 + 1] = y;
+
+        if (index != -1)
+        {
+            rect_t placed = {x, y, sizes[i*2 + 0], sizes[i*2 + 1]};
+            if (linear)
+            {
+                MaxRectsPlaceRectLinear(&mr, placed);
+            }
+            else
+            {
+                MaxRectsPlaceRect(&mr, placed);
+            }
+        }
+
+        MaxRectsCompactIfSparse(&mr);
+
+        if (mr.free_count > *peak_free_rects)
+        {
+            *peak_free_rects = mr.free_count;
+        }
+    }
+    double elapsed = GetSeconds() - start;
+
+    FreeMaxRects(&mr);
+    free(sizes);
+
+    return elapsed;
+}
+
+INTERNAL int
+RunMaxRectsBenchmark(int argc, char* argv[])
+{
+    int counts[16] = { 100, 1000, 5000, 20000, 50000 };
+    int count_count = 5;
+
+    if (argc > 0)
+    {
+        count_count = 0;
+        for (int i = 0; i < argc && count_count < 16; ++i)
+        {
+            counts[count_count++] = atoi(argv[i]);
+        }
+    }
+
+    printf("%8s %12s %12s %12s %10s %s\n", "rects", "free_rects", "indexed_ms", "linear_ms", "speedup", "match");
+    for (int i = 0; i < count_count; ++i)
+    {
+        int count = counts[i];
+        int* indexed_positions = (int*) calloc(count * 2, sizeof(int));
+        int* linear_positions = (int*) calloc(count * 2, sizeof(int));
+        int peak_free_rects, linear_peak_free_rects;
+
+        double indexed = BenchmarkMaxRects(count, 0, indexed_positions, &peak_free_rects);
+        double linear = BenchmarkMaxRects(count, 1, linear_positions, &linear_peak_free_rects);
+        bool32_t match = memcmp(indexed_positions, linear_positions, count * 2 * sizeof(int)) == 0;
+
+        printf("%8d %12d %12.2f %12.2f %9.1fx %s\n", count, peak_free_rects,
+               indexed * 1000.0, linear * 1000.0, linear / indexed, match ? "yes" : "NO");
+
+        free(indexed_positions);
+        free(linear_positions);
+    }
+
+    return 0;
+}
+
+// Runs the size search over a few rect sets with every POT and NONSQUARE
+// combination. Each has to find one atlas within max_size, with power of
+// two sides when asked, and a non-square atlas no larger than the square one.
+INTERNAL int
+RunSizeSearchTest(void)
+{
+    enum { MAX_TEST_RECTS = 300 };
+    packed_rect_t rects[MAX_TEST_RECTS];
+    const char* names[] = { "wide", "tall", "strips", "mixed" };
+    int failures = 0;
+
+    for (int set = 0; set < 4; ++set)
+    {
+        int count = 0;
+        uint32_t seed = 777;
+        if (set == 0)
+        {
+            // A single 256x16 image with its padding, no power of two fits
+            // between the narrowest and the widest width tried
+            rects[count++] = (packed_rect_t){ .width = 260, .height = 20 };
+        }
+        else if (set == 1)
+        {
+            rects[count++] = (packed_rect_t){ .width = 20, .height = 260 };
+        }
+        else if (set == 2)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                rects[count++] = (packed_rect_t){ .width = 700, .height = 10 };
+            }
+        }
+        else
+        {
+            while (count < MAX_TEST_RECTS)
+            {
+                rects[count++] = (packed_rect_t){ .width = 8 + (int)(RandomNext(&seed) % 40),
+                                                  .height = 8 + (int)(RandomNext(&seed) % 40) };
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            rects[i].type = TYPE_IMAGE;
+            rects[i].original_index = i;
+            rects[i].order = i;
+        }
+
+        for (int pot = 0; pot < 2; ++pot)
+        {
+            long long square_area = 0;
+            for (int non_square = 0; non_square < 2; ++non_square)
+            {
+                atlas_t atlas = { 0 };
+                atlas.max_size = 2048;
+                atlas.power_of_two = pot;
+                atlas.non_square = non_square;
+
+                pack_attempt_t result = { 0 };
+                bool32_t found = FindSmallestAtlas(&atlas, rects, count, &result);
+                bool32_t ok = found && result.width <= atlas.max_size && result.height <= atlas.max_size;
+                if (ok && pot)
+                {
+                    ok = result.width == NextPowerOfTwo(result.width) && result.height == NextPowerOfTwo(result.height);
+                }
+
+                long long area = found ? (long long) result.width * result.height : 0;
+                if (!non_square)
+                {
+                    square_area = area;
+                }
+                else if (ok)
+                {
+                    ok = area <= square_area;
+                }
+
+                // A single rect gets an atlas of its own size, rounded up
+                if (ok && non_square && count == 1)
+                {
+                    int width = pot ? NextPowerOfTwo(rects[0].width) : rects[0].width;
+                    int height = pot ? NextPowerOfTwo(rects[0].height) : rects[0].height;
+                    ok = result.width == width && result.height == height;
+                }
+
+                printf("%-8s %-4s %-10s %5dx%-5d %s\n", names[set], pot ? "POT" : "", non_square ? "NONSQUARE" : "",
+                       result.width, result.height, ok ? "ok" : "FAILED");
+                failures += !ok;
+                free(result.rects);
+            }
+        }
+    }
+
+    return failures ? 1 : 0;
+}
+
+// Checks every expand kernel this CPU can run against the scalar one, over
+// all lengths up to a few vectors and every source and destination offset
+INTERNAL int
+RunBlitTest(void)
+{
+    typedef struct
+    {
+        const char* name;
+        expand_alpha_row_proc_t* proc;
+    } kernel_t;
+
+    kernel_t kernels[4];
+    int kernel_count = 0;
+    kernels[kernel_count++] = (kernel_t){ "scalar", ExpandAlphaRowScalar };
+#if defined(SIMD_SSE2)
+    kernels[kernel_count++] = (kernel_t){ "sse2", ExpandAlphaRowSse2 };
+    if (CpuHasAvx2())
+    {
+        kernels[kernel_count++] = (kernel_t){ "avx2", ExpandAlphaRowAvx2 };
+    }
+#elif defined(SIMD_NEON)
+    kernels[kernel_count++] = (kernel_t){ "neon", ExpandAlphaRowNeon };
+#endif
+
+    enum { MAX_LENGTH = 200, MAX_OFFSET = 16 };
+    uint8_t src[MAX_LENGTH + MAX_OFFSET];
+    uint8_t expected[(MAX_LENGTH + MAX_OFFSET + 1) * 4];
+    uint8_t actual[(MAX_LENGTH + MAX_OFFSET + 1) * 4];
+
+    uint32_t state = 1;
+    for (int i = 0; i < MAX_LENGTH + MAX_OFFSET; ++i)
+    {
+        src[i] = (uint8_t) RandomNext(&state);
+    }
+
+    int failures = 0;
+    for (int k = 0; k < kernel_count; ++k)
+    {
+        int kernel_failures = 0;
+        for (int length = 0; length <= MAX_LENGTH; ++length)
+        {
+            for (int offset = 0; offset < MAX_OFFSET; ++offset)
+            {
+                // Canary past the end catches kernels writing too far
+                memset(expected, 0xAB, sizeof(expected));
+                memset(actual, 0xAB, sizeof(actual));
+                ExpandAlphaRowScalar(expected + offset, src + offset, length);
+                kernels[k].proc(actual + offset, src + offset, length);
+
+                if (memcmp(expected, actual, sizeof(expected)) != 0)
+                {
+                    if (kernel_failures == 0)
+                    {
+                        printf("    %s: mismatch at length %d, offset %d\n", kernels[k].name, length, offset);
+                    }
+                    kernel_failures++;
+                }
+            }
+        }
+
+        printf("%-8s %s\n", kernels[k].name, kernel_failures ? "FAILED" : "ok");
+        failures += kernel_failures;
+    }
+
+    uint8_t fill[MAX_LENGTH * 4 + 4];
+    memset(fill, 0xAB, sizeof(fill));
+    FillRgbaRow(fill, 0xFFFFFFFF, MAX_LENGTH);
+    for (int i = 0; i < (int) sizeof(fill); ++i)
+    {
+        if (fill[i] != (i < MAX_LENGTH * 4 ? 0xFF : 0xAB))
+        {
+            printf("fill     FAILED\n");
+            failures++;
+            break;
+        }
+    }
+
+    // Every color and alpha pair, against the definitions and at each offset
+    // against the scalar rows. Equal alphas come in runs of 256, so the
+    // opaque and transparent shortcuts are taken too.
+    enum { PAIR_COUNT = 256 * 256 };
+    uint8_t* source = (uint8_t*) malloc((PAIR_COUNT + 4) * 4);
+    uint8_t* scalar = (uint8_t*) malloc((PAIR_COUNT + 4) * 4);
+    uint8_t* simd = (uint8_t*) malloc((PAIR_COUNT + 4) * 4);
+    for (int i = 0; i < PAIR_COUNT + 4; ++i)
+    {
+        int color = i & 0xFF;
+        source[i*4 + 0] = (uint8_t) color;
+        source[i*4 + 1] = (uint8_t) (255 - color);
+        source[i*4 + 2] = (uint8_t) (color ^ 0x5A);
+        source[i*4 + 3] = (uint8_t) (i >> 8);
+    }
+
+    InitPremultiplyTable();
+    int premultiply_failures = 0;
+    for (int i = 0; i < PAIR_COUNT; ++i)
+    {
+        int color = i & 0xFF;
+        int alpha = i >> 8;
+        double linear = SrgbToLinear(color / 255.0) * alpha / 255.0;
+        int expected_gamma = (int) floor(color * alpha / 255.0 + 0.5);
+        int expected_linear = (int) floor(LinearToSrgb(linear) * 255.0 + 0.5);
+        if (MultiplyAlpha(color, alpha) != expected_gamma || global_premultiply_table[alpha][color] != expected_linear)
+        {
+            premultiply_failures++;
+        }
+    }
+
+    typedef void premultiply_row_proc_t(uint8_t* row, int count);
+    premultiply_row_proc_t* scalar_rows[2] = { PremultiplyRowLinearScalar, PremultiplyRowGammaScalar };
+    premultiply_row_proc_t* simd_rows[2] = { PremultiplyRowLinear, PremultiplyRowGamma };
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        for (int offset = 0; offset < 4; ++offset)
+        {
+            memcpy(scalar, source, (PAIR_COUNT + 4) * 4);
+            memcpy(simd, source, (PAIR_COUNT + 4) * 4);
+            scalar_rows[mode](scalar + offset*4, PAIR_COUNT - offset);
+            simd_rows[mode](simd + offset*4, PAIR_COUNT - offset);
+            if (memcmp(scalar, simd, (PAIR_COUNT + 4) * 4) != 0)
+            {
+                premultiply_failures++;
+            }
+        }
+    }
+    printf("premultiply %s\n", premultiply_failures ? "FAILED" : "ok");
+    failures += premultiply_failures;
+    free(source);
+    free(scalar);
+    free(simd);
+
+    printf("Selected: %s\n", global_expand_alpha_row_name);
+    return failures ? 1 : 0;
+}
+
+#define CHECK_BINARY(condition, ...) \
+    if (!(condition)) { if (failures++ < 10) { printf("    " __VA_ARGS__); printf("\n"); } }
+
+// Reads the numbers of one initializer in the generated header, from the
+// '{' at start to its closing brace. Designators, identifiers and comments
+// are skipped, so an array of structs comes back flattened in field order.
+// Kerning keys fit in 53 bits, so a double holds every value exactly.
+INTERNAL double*
+ReadHeaderNumbers(const char* start, OUT int* count)
+{
+    double* values = 0;
+    int capacity = 0;
+    *count = 0;
+    if (!start)
+    {
+        return 0;
+    }
+
+    const char* p = start;
+    int depth = 0;
+    while (*p)
+    {
+        char c = *p;
+        if (c == '/' && p[1] == '/')
+        {
+            while (*p && *p != '\n')
+            {
+                p++;
+            }
+        }
+        else if (c == '[')
+        {
+            while (*p && *p != ']')
+            {
+                p++;
+            }
+        }
+        else if (c == '{')
+        {
+            depth++;
+            p++;
+        }
+        else if (c == '}')
+        {
+            if (--depth == 0)
+            {
+                break;
+            }
+            p++;
+        }
+        else if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            char* end;
+            double value = (c == '0' && p[1] == 'x') ? (double) strtoull(p, &end, 16) : strtod(p, &end);
+            values = (double*) GrowArray(values, *count, &capacity, sizeof(double));
+            values[(*count)++] = value;
+
+            // Suffixes: f, ull
+            p = end;
+            while (*p == 'f' || *p == 'u' || *p == 'l')
+            {
+                p++;
+            }
+        }
+        else if (c == '_' || c == '.' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+        {
+            while (*p == '_' || *p == '.' || (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9'))
+            {
+                p++;
+            }
+        }
+        else
+        {
+            p++;
+        }
+    }
+
+    return values;
+}
+
+// Numbers of the header array called name, 0 when the header has none
+INTERNAL double*
+ReadHeaderArray(const char* header, const char* name, OUT int* count)
+{
+    char key[MAX_NAME * 2 + 64];
+    snprintf(key, sizeof(key), "%s[] = ", name);
+    const char* p = strstr(header, key);
+    return ReadHeaderNumbers(p ? strchr(p, '{') : 0, count);
+}
+
+// Text after ".field = " in one font of BACKED_FONT_LIST, 0 when that font
+// does not set it
+INTERNAL const char*
+FindHeaderField(const char* font_block, const char* field)
+{
+    const char* end = strstr(font_block, "\n    },");
+    const char* p = strstr(font_block, field);
+    if (!p || (end && p > end))
+    {
+        return 0;
+    }
+    return p + strlen(field);
+}
+
+// The header prints floats with %f, so they only agree to six decimals
+INTERNAL bool32_t
+HeaderFloatMatches(double text, float value)
+{
+    return fabs(text - (double) value) <= 1e-6;
+}
+
+// Fields of a glyph_t entry: codepoint, w, h, u0, v0, u1, v1, xoff, yoff,
+// advance, page
+#define HEADER_GLYPH_FIELDS 11
+
+INTERNAL bool32_t
+HeaderGlyphMatches(const double* h, const backed_glyph_t* glyph)
+{
+    return h[0] == glyph->codepoint && h[1] == glyph->w && h[2] == glyph->h &&
+           HeaderFloatMatches(h[3], glyph->u0) && HeaderFloatMatches(h[4], glyph->v0) &&
+           HeaderFloatMatches(h[5], glyph->u1) && HeaderFloatMatches(h[6], glyph->v1) &&
+           HeaderFloatMatches(h[7], glyph->xoff) && HeaderFloatMatches(h[8], glyph->yoff) &&
+           HeaderFloatMatches(h[9], glyph->advance) && h[10] == glyph->page;
+}
+
+// Reads the header ExportHeader writes for the atlas back and checks that
+// it agrees with the binary on every sprite, every codepoint through
+// GetBackedGlyph's lookup and every kerning pair
+INTERNAL int
+CheckBinaryAgainstHeader(atlas_t* atlas, const backed_atlas_t* binary)
+{
+    int failures = 0;
+    const char* header_name = "sprite_backer_binary_test.h";
+    if (!ExportHeader(atlas, header_name))
+    {
+        printf("    header export failed\n");
+        return 1;
+    }
+
+    size_t size;
+    uint8_t* file = ReadEntireFile(header_name, &size);
+    remove(header_name);
+    if (!file)
+    {
+        printf("    header cannot be read back\n");
+        return 1;
+    }
+    char* header = (char*) malloc(size + 1);
+    memcpy(header, file, size);
+    header[size] = 0;
+    free(file);
+
+    const char* define = strstr(header, "#define BACKED_ATLAS_PAGE_COUNT ");
+    CHECK_BINARY(define && strtoul(define + 32, 0, 10) == binary->page_count, "header page count differs");
+
+    // Sprite entries: x, y, w, h, u0, v0, u1, v1, page, rotated, trim_x,
+    // trim_y, source_w, source_h
+    int sprite_value_count;
+    double* sprite_values = ReadHeaderArray(header, "BACKED_SPRITE_LIST", &sprite_value_count);
+    CHECK_BINARY(sprite_value_count == (int) binary->sprite_count * 14, "header lists %d sprite values for %u sprites",
+                 sprite_value_count, binary->sprite_count);
+
+    const backed_sprite_t* sprites = BackedAtlasSprites(binary);
+    for (int i = 0; i < (int) binary->sprite_count && (i + 1) * 14 <= sprite_value_count; ++i)
+    {
+        const backed_sprite_t* s = &sprites[i];
+        const double* h = sprite_values + i * 14;
+        const char* name = BackedAtlasString(binary, s->name);
+
+        char designator[MAX_NAME + 16];
+        snprintf(designator, sizeof(designator), "[SPRITE_%s] = ", name);
+        CHECK_BINARY(strstr(header, designator) != 0, "sprite %s missing from the header", name);
+        CHECK_BINARY(h[0] == s->x && h[1] == s->y && h[2] == s->w && h[3] == s->h &&
+                     HeaderFloatMatches(h[4], s->u0) && HeaderFloatMatches(h[5], s->v0) &&
+                     HeaderFloatMatches(h[6], s->u1) && HeaderFloatMatches(h[7], s->v1) &&
+                     h[8] == s->page && h[9] == s->rotated && h[10] == s->trim_x && h[11] == s->trim_y &&
+                     h[12] == s->source_w && h[13] == s->source_h,
+                     "sprite %s differs from the header", name);
+    }
+    free(sprite_values);
+
+    const char* mode_names[] = { "GLYPH_MODE_BITMAP", "GLYPH_MODE_SDF", "GLYPH_MODE_MSDF" };
+    const backed_font_t* fonts = BackedAtlasFonts(binary);
+    for (int i = 0; i < (int) binary->font_count; ++i)
+    {
+        const backed_font_t* out = &fonts[i];
+        const char* name = BackedAtlasString(binary, out->name);
+
+        char key[MAX_NAME + 64];
+        snprintf(key, sizeof(key), "    [FONT_%s] = {", name);
+        const char* block = strstr(header, key);
+        CHECK_BINARY(block != 0, "font %s missing from the header", name);
+        if (!block)
+        {
+            continue;
+        }
+
+        const char* field;
+        CHECK_BINARY((field = FindHeaderField(block, ".size = ")) && atoi(field) == out->size &&
+                     (field = FindHeaderField(block, ".ascent = ")) && atoi(field) == out->ascent &&
+                     (field = FindHeaderField(block, ".descent = ")) && atoi(field) == out->descent &&
+                     (field = FindHeaderField(block, ".line_gap = ")) && atoi(field) == out->line_gap &&
+                     (field = FindHeaderField(block, ".distance_range = ")) && HeaderFloatMatches(strtod(field, 0), out->distance_range) &&
+                     out->mode < 3 && (field = FindHeaderField(block, ".mode = ")) &&
+                     strncmp(field, mode_names[out->mode], strlen(mode_names[out->mode])) == 0 &&
+                     field[strlen(mode_names[out->mode])] == ',',
+                     "font %s metrics differ from the header", name);
+
+        // GetBackedGlyph over the header's arrays
+        int ascii_value_count, glyph_value_count, page_count, block_value_count;
+        field = FindHeaderField(block, ".ascii_cache = ");
+        double* ascii_values = ReadHeaderNumbers(field ? strchr(field, '{') : 0, &ascii_value_count);
+        snprintf(key, sizeof(key), "BACKED_FONT_%s_GLYPHS", name);
+        double* glyph_values = ReadHeaderArray(header, key, &glyph_value_count);
+        snprintf(key, sizeof(key), "BACKED_FONT_%s_GLYPH_PAGES", name);
+        double* pages = ReadHeaderArray(header, key, &page_count);
+        snprintf(key, sizeof(key), "BACKED_FONT_%s_GLYPH_BLOCKS", name);
+        double* blocks = ReadHeaderArray(header, key, &block_value_count);
+
+        field = FindHeaderField(block, ".glyph_page_count = ");
+        int header_page_count = field ? atoi(field) : 0;
+        CHECK_BINARY(header_page_count <= page_count, "font %s header has %d of %d glyph pages", name, page_count, header_page_count);
+
+        const double* ascii[128] = { 0 };
+        for (int j = 0; j + HEADER_GLYPH_FIELDS <= ascii_value_count; j += HEADER_GLYPH_FIELDS)
+        {
+            int codepoint = (int) ascii_values[j];
+            CHECK_BINARY(codepoint >= 0 && codepoint < 128, "font %s ASCII entry U+%04X", name, codepoint);
+            if (codepoint >= 0 && codepoint < 128)
+            {
+                ascii[codepoint] = ascii_values + j;
+            }
+        }
+
+        for (uint32_t codepoint = 0; codepoint <= MAX_CODEPOINT; ++codepoint)
+        {
+            const double* expected = 0;
+            if (codepoint < 128)
+            {
+                expected = codepoint && ascii[codepoint] && ascii[codepoint][0] == codepoint ? ascii[codepoint] : 0;
+            }
+            else if ((int) (codepoint >> 8) < header_page_count && (int) (codepoint >> 8) < page_count)
+            {
+                int entry = ((int) pages[codepoint >> 8] << 8) | (int) (codepoint & 0xFF);
+                int index = entry < block_value_count ? (int) blocks[entry] : -1;
+                CHECK_BINARY(index >= 0 && index * HEADER_GLYPH_FIELDS <= glyph_value_count,
+                             "font %s header lookup for U+%04X out of range", name, codepoint);
+                expected = index > 0 && index * HEADER_GLYPH_FIELDS <= glyph_value_count
+                    ? glyph_values + (index - 1) * HEADER_GLYPH_FIELDS : 0;
+            }
+
+            const backed_glyph_t* glyph = BackedAtlasGlyph(binary, out, codepoint);
+            if (!expected || !glyph)
+            {
+                CHECK_BINARY(!expected == !glyph, "font %s U+%04X is %s in the header but %s in the binary", name, codepoint,
+                             expected ? "found" : "missing", glyph ? "found" : "missing");
+                continue;
+            }
+            CHECK_BINARY(HeaderGlyphMatches(expected, glyph), "font %s U+%04X differs from the header", name, codepoint);
+        }
+
+        free(ascii_values);
+        free(glyph_values);
+        free(pages);
+        free(blocks);
+
+        int key_count, advance_count;
+        snprintf(key, sizeof(key), "BACKED_FONT_%s_KERN_KEYS", name);
+        double* kern_keys = ReadHeaderArray(header, key, &key_count);
+        snprintf(key, sizeof(key), "BACKED_FONT_%s_KERN_ADVANCES", name);
+        double* kern_advances = ReadHeaderArray(header, key, &advance_count);
+        field = FindHeaderField(block, ".kern_count = ");
+
+        CHECK_BINARY((field ? (uint32_t) atoi(field) : 0) == out->kern_count &&
+                     key_count == (int) out->kern_count && advance_count == (int) out->kern_count,
+                     "font %s header has %d kerning pairs, the binary %u", name, key_count, out->kern_count);
+        for (int j = 0; j < key_count && j < advance_count; ++j)
+        {
+            uint64_t pair = (uint64_t) kern_keys[j];
+            uint32_t first = (uint32_t) (pair >> 32);
+            uint32_t second = (uint32_t) pair;
+            CHECK_BINARY(HeaderFloatMatches(kern_advances[j], BackedAtlasKerning(binary, out, first, second)),
+                         "font %s kerning U+%04X U+%04X differs from the header", name, first, second);
+        }
+
+        free(kern_keys);
+        free(kern_advances);
+    }
+
+    free(header);
+    return failures;
+}
+
+// Bakes a config and checks that the binary read back through backed_atlas.h
+// holds the same values as the atlas and as the header ExportHeader writes
+// for it, and that every codepoint and kerning pair resolves the same way
+INTERNAL int
+RunBinaryTest(const char* config_file)
+{
+    global_thread_count = GetProcessorCount();
+    InitBlitKernels();
+
+    atlas_t* atlas = &global_atlas;
+    if (!ParseConfig(config_file, atlas) || !LoadAssets(atlas) || !CreateAtlas(atlas))
+    {
+        printf("Error: Failed to bake %s\n", config_file);
+        return 1;
+    }
+
+    size_t size;
+    uint8_t* data = BuildBinary(atlas, &size);
+    const backed_atlas_t* binary = BackedAtlasOpen(data, size);
+    if (!binary)
+    {
+        printf("FAILED: binary atlas does not open\n");
+        return 1;
+    }
+
+    int failures = 0;
+    CHECK_BINARY(binary->file_size == size, "file size %u, built %zu", binary->file_size, size);
+    CHECK_BINARY(BackedAtlasOpen(data, size - 1) == 0, "truncated file opens");
+    CHECK_BINARY(binary->page_count == (uint32_t) atlas->page_count &&
+                 binary->width == (uint32_t) atlas->width && binary->height == (uint32_t) atlas->height,
+                 "atlas size differs");
+    CHECK_BINARY(binary->sprite_count == (uint32_t) atlas->image_count, "sprite count differs");
+    CHECK_BINARY(binary->font_count == (uint32_t) atlas->font_count, "font count differs");
+    CHECK_BINARY(binary->alpha_mode == (uint32_t) atlas->alpha_mode, "alpha mode differs");
 
-    for (int i = 0; i < mr->count; ++i)
+    const backed_sprite_t* sprites = BackedAtlasSprites(binary);
+    for (int i = 0; i < atlas->image_count && i < (int) binary->sprite_count; ++i)
     {
-        rect_t r = mr->rects[i];
+        image_t* image = &atlas->images[i];
+        const backed_sprite_t* sprite = &sprites[i];
+        float u0, v0, u1, v1;
+        GetImageUV(atlas, image, &u0, &v0, &u1, &v1);
 
-        if (r.width >= width && r.height >= height)
+        CHECK_BINARY(strcmp(BackedAtlasString(binary, sprite->name), image->name) == 0, "sprite %d name", i);
+        CHECK_BINARY(sprite->x == image->x && sprite->y == image->y &&
+                     sprite->w == image->width && sprite->h == image->height &&
+                     sprite->page == image->page && sprite->rotated == (int32_t) image->rotated,
+                     "sprite %s placement", image->name);
+        CHECK_BINARY(sprite->u0 == u0 && sprite->v0 == v0 && sprite->u1 == u1 && sprite->v1 == v1,
+                     "sprite %s UVs", image->name);
+        CHECK_BINARY(sprite->trim_x == image->trim_x && sprite->trim_y == image->trim_y &&
+                     sprite->source_w == image->source_width && sprite->source_h == image->source_height,
+                     "sprite %s trim", image->name);
+    }
+
+    const backed_font_t* fonts = BackedAtlasFonts(binary);
+    for (int i = 0; i < atlas->font_count && i < (int) binary->font_count; ++i)
+    {
+        font_t* font = &atlas->fonts[i];
+        const backed_font_t* out = &fonts[i];
+
+        CHECK_BINARY(strcmp(BackedAtlasString(binary, out->name), font->name) == 0, "font %d name", i);
+        CHECK_BINARY(out->size == font->size && out->ascent == font->ascent &&
+                     out->descent == font->descent && out->line_gap == font->line_gap &&
+                     out->mode == (uint32_t) font->mode, "font %s metrics", font->name);
+
+        // Glyphs are sorted, so a merge against the codepoint walk finds each once
+        int next = 0;
+        for (uint32_t codepoint = 0; codepoint <= MAX_CODEPOINT; ++codepoint)
         {
-            int leftover_width = r.width - width;
-            int leftover_height = r.height - height;
-            int short_side = leftover_height < leftover_width ? leftover_height : leftover_width;
-            int long_side = leftover_height > leftover_width ? leftover_height : leftover_width;
+            const backed_glyph_t* glyph = BackedAtlasGlyph(binary, out, codepoint);
+            glyph_mapping_t* expected = 0;
+            if (next < font->glyph_count && (uint32_t) font->glyphs[next].codepoint == codepoint)
+            {
+                expected = &font->glyphs[next++];
+            }
 
-            if (short_side < best_short_side || (short_side == best_short_side && long_side < best_long_side))
+            if (!expected)
             {
-                best_short_side = short_side;
-                best_long_side = long_side;
-                best_index = i;
-                best_x = r.x;
-                best_y = r.y;
+                CHECK_BINARY(glyph == 0, "font %s has no U+%04X but finds one", font->name, codepoint);
+                continue;
             }
+
+            CHECK_BINARY(glyph != 0, "font %s misses U+%04X", font->name, codepoint);
+            if (glyph)
+            {
+                CHECK_BINARY(glyph->codepoint == codepoint &&
+                             glyph->w == expected->glyph.w && glyph->h == expected->glyph.h &&
+                             glyph->u0 == expected->glyph.u0 && glyph->v0 == expected->glyph.v0 &&
+                             glyph->u1 == expected->glyph.u1 && glyph->v1 == expected->glyph.v1 &&
+                             glyph->xoff == expected->glyph.xoff && glyph->yoff == expected->glyph.yoff &&
+                             glyph->advance == expected->glyph.xadvance && glyph->page == expected->glyph.page,
+                             "font %s U+%04X differs", font->name, codepoint);
+            }
+        }
+
+        CHECK_BINARY(out->kern_count == (uint32_t) font->kerning_count, "font %s kerning count", font->name);
+        for (int j = 0; j < font->kerning_count; ++j)
+        {
+            uint32_t first = (uint32_t) (font->kerning[j].key >> 32);
+            uint32_t second = (uint32_t) font->kerning[j].key;
+            CHECK_BINARY(BackedAtlasKerning(binary, out, first, second) == font->kerning[j].advance,
+                         "font %s kerning U+%04X U+%04X", font->name, first, second);
         }
+        CHECK_BINARY(BackedAtlasKerning(binary, out, MAX_CODEPOINT + 1, 0) == 0.0f, "font %s kerning past the keys", font->name);
     }
 
-    if (best_index != -1)
+    failures += CheckBinaryAgainstHeader(atlas, binary);
+
+    printf("%zu bytes, %d sprites, %d fonts: %s\n", size, atlas->image_count, atlas->font_count, failures ? "FAILED" : "ok");
+    free(data);
+
+    return failures ? 1 : 0;
+}
+
+// Reference decoders for the formats EncodeTexture writes, written from the
+// format specifications with their own tables rather than the encoder's
+// helpers, so a mistake shared by both cannot cancel out. They only cover
+// the modes the encoder uses and return 0 for a block they cannot decode.
+
+// S3TC colors are defined on normalized values, rounded once to 8 bits
+INTERNAL uint8_t
+ReferenceUnorm(double value)
+{
+    return (uint8_t) floor(value * 255.0 + 0.5);
+}
+
+INTERNAL bool32_t
+DecodeBc1Color(const uint8_t* in, bool32_t three_color, OUT uint8_t* block)
+{
+    uint16_t c0 = (uint16_t) (in[0] | in[1] << 8);
+    uint16_t c1 = (uint16_t) (in[2] | in[3] << 8);
+    uint32_t bits = (uint32_t) in[4] | (uint32_t) in[5] << 8 | (uint32_t) in[6] << 16 | (uint32_t) in[7] << 24;
+
+    double color[4][4];
+    for (int end = 0; end < 2; ++end)
+    {
+        uint16_t packed = end ? c1 : c0;
+        color[end][0] = ((packed >> 11) & 31) / 31.0;
+        color[end][1] = ((packed >> 5) & 63) / 63.0;
+        color[end][2] = (packed & 31) / 31.0;
+        color[end][3] = 1.0;
+    }
+    for (int c = 0; c < 3; ++c)
     {
-        *x = best_x;
-        *y = best_y;
+        if (c0 > c1 || !three_color)
+        {
+            color[2][c] = (2.0 * color[0][c] + color[1][c]) / 3.0;
+            color[3][c] = (color[0][c] + 2.0 * color[1][c]) / 3.0;
+        }
+        else
+        {
+            color[2][c] = (color[0][c] + color[1][c]) / 2.0;
+            color[3][c] = 0.0;
+        }
     }
+    color[2][3] = 1.0;
+    color[3][3] = (c0 > c1 || !three_color) ? 1.0 : 0.0;
 
-    return best_index;
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            block[i*4 + c] = ReferenceUnorm(color[(bits >> (i * 2)) & 3][c]);
+        }
+    }
+    return 1;
 }
 
 INTERNAL bool32_t
-RectContains(rect_t a, rect_t b)
+DecodeBc1Block(const uint8_t* in, OUT uint8_t* block)
 {
-    return a.x <= b.x &&
-           a.y <= b.y &&
-           (a.x + a.width) >= (b.x + b.width) &&
-           (a.y + a.height) >= (b.y + b.height);
+    return DecodeBc1Color(in, 1, block);
 }
 
-INTERNAL void
-MaxRectsPruneRects(maxrects_t* mr)
+INTERNAL bool32_t
+DecodeBc3Block(const uint8_t* in, OUT uint8_t* block)
 {
-    // Remove rectangles that are contained within other rectangles
-    for (int i = 0; i < mr->count; i++)
+    DecodeBc1Color(in + 8, 0, block);
+
+    double a0 = in[0] / 255.0, a1 = in[1] / 255.0;
+    double alpha[8] = { a0, a1 };
+    for (int code = 2; code < 8; ++code)
     {
-        for (int j = i + 1; j < mr->count; j++)
+        if (in[0] > in[1])
         {
-            if (RectContains(mr->rects[i], mr->rects[j]))
-            {
-                memmove(&mr->rects[j], &mr->rects[j + 1], (mr->count - j - 1) * sizeof(rect_t));
-                mr->count--;
-                j--;
-            }
-            else if (RectContains(mr->rects[j], mr->rects[i]))
-            {
-                memmove(&mr->rects[i], &mr->rects[i + 1], (mr->count - i - 1) * sizeof(rect_t));
-                mr->count--;
-                i--;
-                break;
-            }
+            alpha[code] = ((8 - code) * a0 + (code - 1) * a1) / 7.0;
         }
+        else if (code < 6)
+        {
+            alpha[code] = ((6 - code) * a0 + (code - 1) * a1) / 5.0;
+        }
+        else
+        {
+            alpha[code] = code == 6 ? 0.0 : 1.0;
+        }
+    }
+
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; ++i) bits |= (uint64_t) in[2 + i] << (i * 8);
+    for (int i = 0; i < 16; ++i)
+    {
+        block[i*4 + 3] = ReferenceUnorm(alpha[(bits >> (i * 3)) & 7]);
     }
+    return 1;
 }
 
-INTERNAL void
-MaxRectsAddRect(maxrects_t* mr, rect_t rect)
+INTERNAL uint32_t
+GetBlockBits(const uint8_t* in, int* position, int count)
 {
-    if (mr->count >= mr->capacity)
+    uint32_t value = 0;
+    for (int i = 0; i < count; ++i, ++*position)
     {
-        mr->capacity *= 2;
-        mr->rects = (rect_t*)realloc(mr->rects, mr->capacity * sizeof(rect_t));
+        value |= (uint32_t) ((in[*position >> 3] >> (*position & 7)) & 1) << i;
     }
-    mr->rects[mr->count++] = rect;
+    return value;
 }
 
-INTERNAL void
-MaxRectsSplitFreeRect(maxrects_t* mr, int index, int x, int y, int width, int height)
+// BC7 modes 5 and 6, the single subset modes with and without separate
+// alpha indices
+INTERNAL bool32_t
+DecodeBc7Block(const uint8_t* in, OUT uint8_t* block)
 {
-    rect_t free_rect = mr->rects[index];
+    static const int weights2[4] = { 0, 21, 43, 64 };
+    static const int weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
 
-    memmove(&mr->rects[index], &mr->rects[index+1], (mr->count - index - 1) * sizeof(rect_t));
-    mr->count--;
+    int mode = 0;
+    while (mode < 8 && !((in[0] >> mode) & 1)) mode++;
+    if (mode != 5 && mode != 6)
+    {
+        return 0;
+    }
 
-    rect_t new_rects[4];
-    int new_count = 0;
+    int position = mode + 1;
+    int rotation = mode == 5 ? (int) GetBlockBits(in, &position, 2) : 0;
+    int color_bits = 7;
+    int alpha_bits = mode == 5 ? 8 : 7;
 
-    // Top
-    if (y > free_rect.y)
+    int e[2][4];
+    for (int c = 0; c < 4; ++c)
     {
-        new_rects[new_count++] = (rect_t){
-            free_rect.x, free_rect.y,
-            free_rect.width, y - free_rect.y
-        };
+        for (int end = 0; end < 2; ++end)
+        {
+            e[end][c] = (int) GetBlockBits(in, &position, c < 3 ? color_bits : alpha_bits);
+        }
     }
-
-    // Bottom
-    if (y + height < free_rect.y + free_rect.height)
+    for (int end = 0; end < 2; ++end)
     {
-        new_rects[new_count++] = (rect_t){
-            free_rect.x, y + height,
-            free_rect.width, free_rect.y + free_rect.height - (y + height)
-        };
+        if (mode == 6)
+        {
+            int pbit = (int) GetBlockBits(in, &position, 1);
+            for (int c = 0; c < 4; ++c) e[end][c] = (e[end][c] << 1) | pbit;
+        }
+        else
+        {
+            for (int c = 0; c < 3; ++c) e[end][c] = (e[end][c] << 1) | (e[end][c] >> 6);
+        }
     }
-    
-    // Left
-    if (x > free_rect.x)
+
+    // The first index of each set drops its top bit, which is always zero
+    int index_bits = mode == 5 ? 2 : 4;
+    int color_index[16], alpha_index[16];
+    for (int i = 0; i < 16; ++i)
     {
-        new_rects[new_count++] = (rect_t){
-            free_rect.x, free_rect.y,
-            x - free_rect.x, free_rect.height
-        };
+        color_index[i] = (int) GetBlockBits(in, &position, i == 0 ? index_bits - 1 : index_bits);
     }
-    
-    // Right
-    if (x + width < free_rect.x + free_rect.width)
+    for (int i = 0; i < 16; ++i)
     {
-        new_rects[new_count++] = (rect_t){
-            x + width, free_rect.y,
-            free_rect.x + free_rect.width - (x + width), free_rect.height
-        };
+        alpha_index[i] = mode == 5 ? (int) GetBlockBits(in, &position, i == 0 ? 1 : 2) : color_index[i];
     }
 
-    // Add new rectangles, removing those that are contained by others
-    for (int i = 0; i < new_count; i++)
+    const int* weights = mode == 5 ? weights2 : weights4;
+    for (int i = 0; i < 16; ++i)
     {
-        bool32_t contained = 0;
-        
-        // Check if this rect is contained by any other new rect
-        for (int j = 0; j < new_count; j++)
+        uint8_t* out = block + i*4;
+        for (int c = 0; c < 4; ++c)
         {
-            if (i != j && RectContains(new_rects[j], new_rects[i]))
-            {
-                contained = 1;
-                break;
-            }
+            int weight = weights[c < 3 ? color_index[i] : alpha_index[i]];
+            out[c] = (uint8_t) (((64 - weight) * e[0][c] + weight * e[1][c] + 32) >> 6);
         }
-        
-        if (!contained)
+        if (rotation)
         {
-            MaxRectsAddRect(mr, new_rects[i]);
+            uint8_t swap = out[3]; out[3] = out[rotation - 1]; out[rotation - 1] = swap;
         }
     }
+    return 1;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// Create atlas
-//////////////////////////////////////////////////////////////////////////////
-
-typedef enum {
-    TYPE_IMAGE,
-    TYPE_GLYPH,
-} rect_type_t;
-
-typedef struct
-{
-    int width, height;
-    int original_index;
-    void* user_data;
-    rect_type_t type; // 0=white, 1=image, 2=glyph
-} packed_rect_t;
-
+// ETC2 RGB in individual or differential mode, with EAC alpha
 INTERNAL bool32_t
-CreateAtlas(OUT atlas_t* atlas)
+DecodeEtc2Block(const uint8_t* in, OUT uint8_t* block)
 {
-    atlas->pixels = (uint8_t*) calloc(atlas->width * atlas->height * 4, 1);
-    if (!atlas->pixels)
+    static const int intensity_modifiers[8][4] = {
+        { -8, -2, 2, 8 }, { -17, -5, 5, 17 }, { -29, -9, 9, 29 }, { -42, -13, 13, 42 },
+        { -60, -18, 18, 60 }, { -80, -24, 24, 80 }, { -106, -33, 33, 106 }, { -183, -47, 47, 183 },
+    };
+    // Pixel index (msb, lsb) to table column: 00 small up, 01 large up,
+    // 10 small down, 11 large down
+    static const int index_column[4] = { 2, 3, 1, 0 };
+    static const int alpha_modifiers[16][8] = {
+        { -3, -6, -9, -15, 2, 5, 8, 14 }, { -3, -7, -10, -13, 2, 6, 9, 12 },
+        { -2, -5, -8, -13, 1, 4, 7, 12 }, { -2, -4, -6, -13, 1, 3, 5, 12 },
+        { -3, -6, -8, -12, 2, 5, 7, 11 }, { -3, -7, -9, -11, 2, 6, 8, 10 },
+        { -4, -7, -8, -11, 3, 6, 7, 10 }, { -3, -5, -8, -11, 2, 4, 7, 10 },
+        { -2, -6, -8, -10, 1, 5, 7, 9 }, { -2, -5, -8, -10, 1, 4, 7, 9 },
+        { -2, -4, -8, -10, 1, 3, 7, 9 }, { -2, -5, -7, -10, 1, 4, 6, 9 },
+        { -3, -4, -7, -10, 2, 3, 6, 9 }, { -1, -2, -3, -10, 0, 1, 2, 9 },
+        { -4, -6, -8, -9, 3, 5, 7, 8 }, { -3, -5, -7, -9, 2, 4, 6, 8 },
+    };
+
+    uint64_t alpha = 0, color = 0;
+    for (int i = 0; i < 8; ++i)
     {
-        printf("Error: Cannot allocate memory for atlas.\n");
-        return 0;
+        alpha = (alpha << 8) | in[i];
+        color = (color << 8) | in[8 + i];
     }
 
-    maxrects_t maxrects = CreateMaxRects(atlas->width, atlas->height);
-    int padding = 2;
-    
-    // Collect and sort all rects
-    int total_rects = atlas->image_count + (atlas->font_count * MAX_GLYPHS) + 1;
-
-    packed_rect_t* rects = (packed_rect_t*) calloc(total_rects * sizeof(packed_rect_t), 1);
-    int rect_index = 0;
+    int base_alpha = (int) (alpha >> 56);
+    int multiplier = (int) (alpha >> 52) & 15;
+    int table = (int) (alpha >> 48) & 15;
+    bool32_t differential = (color >> 33) & 1;
+    bool32_t flip = (color >> 32) & 1;
+    int base[2][3];
+    for (int c = 0; c < 3; ++c)
+    {
+        int shift = 56 - c * 8;
+        if (differential)
+        {
+            int first = (int) (color >> (shift + 3)) & 31;
+            int delta = (int) (color >> shift) & 7;
+            int second = first + (delta >= 4 ? delta - 8 : delta);
+            if (second < 0 || second > 31)
+            {
+                return 0;       // T, H or planar mode
+            }
+            base[0][c] = (first << 3) | (first >> 2);
+            base[1][c] = (second << 3) | (second >> 2);
+        }
+        else
+        {
+            int first = (int) (color >> (shift + 4)) & 15;
+            int second = (int) (color >> shift) & 15;
+            base[0][c] = (first << 4) | first;
+            base[1][c] = (second << 4) | second;
+        }
+    }
+    int tables[2] = { (int) (color >> 37) & 7, (int) (color >> 34) & 7 };
 
-    // Images
-    for (int i = 0; i < atlas->image_count; ++i)
+    // Pixels are numbered down the columns
+    for (int x = 0; x < 4; ++x)
     {
-        rects[rect_index].width = atlas->images[i].width + (padding*2);
-        rects[rect_index].height = atlas->images[i].height + (padding*2);
-        rects[rect_index].type = TYPE_IMAGE;
-        rects[rect_index].original_index = i;
-        rects[rect_index].user_data = &atlas->images[i];
-        rect_index++;
+        for (int y = 0; y < 4; ++y)
+        {
+            int pixel = x * 4 + y;
+            int sub_block = flip ? (y >= 2) : (x >= 2);
+            int index = (int) ((color >> (16 + pixel)) & 1) << 1 | (int) ((color >> pixel) & 1);
+            int modifier = intensity_modifiers[tables[sub_block]][index_column[index]];
+            uint8_t* out = block + (y * 4 + x) * 4;
+            for (int c = 0; c < 3; ++c)
+            {
+                int value = base[sub_block][c] + modifier;
+                out[c] = (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+            }
+            int alpha_index = (int) (alpha >> (45 - pixel * 3)) & 7;
+            int value = base_alpha + alpha_modifiers[table][alpha_index] * multiplier;
+            out[3] = (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
     }
+    return 1;
+}
 
-    // Fonts
-    int temp_glyph_count = 0;
-    packed_glyph_t* temp_glyphs = (packed_glyph_t*) calloc(
-        atlas->font_count * MAX_GLYPHS * sizeof(packed_glyph_t), 1);
+typedef bool32_t decode_block_proc_t(const uint8_t* in, uint8_t* block);
 
-    void* bitmap_memory = calloc(GIGABYTES(1), 1);
-    if (!bitmap_memory)
+// Encodes flat blocks of random colors, which every format should get close
+// to, then the atlas pages, reporting time and error per format
+INTERNAL int
+RunTextureTest(const char* config_file)
+{
+    global_thread_count = GetProcessorCount();
+    InitBlitKernels();
+
+    atlas_t* atlas = &global_atlas;
+    if (!ParseConfig(config_file, atlas) || !LoadAssets(atlas) || !CreateAtlas(atlas))
     {
-        printf("Error: Cannot allocate memory for font bitmaps.\n");
-        return 0;
+        printf("Error: Failed to bake %s\n", config_file);
+        return 1;
     }
 
-    uint8_t* bitmap = (uint8_t*) bitmap_memory;
-    for (int i = 0; i < atlas->font_count; ++i)
+    static decode_block_proc_t* const decoders[TEXTURE_COUNT] = {
+        0, DecodeBc1Block, DecodeBc3Block, DecodeBc7Block, DecodeEtc2Block,
+    };
+    // Largest channel error allowed on a flat block: 5 or 6 bits for BC1,
+    // BC3 colors and the ETC base colors, the p-bit for BC7
+    static const int flat_tolerance[TEXTURE_COUNT] = { 0, 8, 8, 1, 8 };
+
+    size_t page_size = (size_t) atlas->width * atlas->height * 4;
+    printf("%d x %dx%d pages, %d threads\n", atlas->page_count, atlas->width, atlas->height, global_thread_count);
+    printf("%-6s %10s %10s %8s %10s %10s %s\n", "format", "bytes", "ms", "MP/s", "rgb_psnr", "a_psnr", "flat");
+
+    int failures = 0;
+    uint32_t state = 1;
+    for (int format = TEXTURE_BC1; format < TEXTURE_COUNT; ++format)
     {
-        font_t* font = &atlas->fonts[i];
+        const texture_format_info_t* info = &texture_formats[format];
+        decode_block_proc_t* decode = decoders[format];
 
-        for (int j = 0; j < font->codepoint_count; ++j)
+        int flat_failures = 0;
+        for (int i = 0; i < 256; ++i)
         {
-            int c = font->codepoints[j];
-            
-            int glyph_index = stbtt_FindGlyphIndex(&font->info, c);
-            if (glyph_index == 0)
+            uint8_t block[64], decoded[64], encoded[16];
+            uint32_t color = RandomNext(&state) | (RandomNext(&state) << 24);
+            if (format == TEXTURE_BC1) color |= 0xFF000000;     // One bit alpha
+            for (int p = 0; p < 16; ++p) memcpy(block + p*4, &color, 4);
+
+            info->encode(block, encoded);
+            if (!decode(encoded, decoded))
             {
-                printf("Error: Cannot find glyph index for codepoint (%d) of %s\n", c, font->name);
+                flat_failures++;
                 continue;
             }
+            for (int p = 0; p < 64; ++p)
+            {
+                int tolerance = (p & 3) == 3 ? (format == TEXTURE_BC7 ? 1 : 0) : flat_tolerance[format];
+                if (abs(decoded[p] - block[p]) > tolerance)
+                {
+                    if (flat_failures++ == 0)
+                    {
+                        printf("    %s: flat %08X decodes channel %d as %d\n", texture_format_names[format], color, p & 3, decoded[p]);
+                    }
+                    break;
+                }
+            }
+        }
 
-            int ix0, iy0, ix1, iy1;
-            stbtt_GetGlyphBitmapBox(&font->info, glyph_index, font->scale, font->scale, &ix0, &iy0, &ix1, &iy1);
-            int gw = ix1 - ix0;
-            int gh = iy1 - iy0;
-            int xoff = ix0;
-            int yoff = iy0;
+        size_t bytes = 0;
+        double seconds = 0.0;
+        double rgb_error = 0.0, alpha_error = 0.0;
+        int bad_blocks = 0;
+        int blocks_x = (atlas->width + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+        int blocks_y = (atlas->height + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+        for (int page = 0; page < atlas->page_count; ++page)
+        {
+            const uint8_t* pixels = atlas->pixels + page * page_size;
+            size_t size;
+            double start = GetSeconds();
+            uint8_t* encoded = EncodeTexture((texture_format_t) format, pixels, atlas->width, atlas->height, &size);
+            seconds += GetSeconds() - start;
+            bytes += size;
 
-            if ((gw == 0 && gh == 0))
+            for (int by = 0; by < blocks_y; ++by)
             {
-                printf("Error: Cannot get codepoint (%d) of %s\n", c, font->name);
-                continue;
+                for (int bx = 0; bx < blocks_x; ++bx)
+                {
+                    uint8_t block[64], decoded[64];
+                    FetchBlock(pixels, atlas->width, atlas->height, bx, by, block);
+                    if (!decode(encoded + ((size_t) by * blocks_x + bx) * info->block_bytes, decoded))
+                    {
+                        bad_blocks++;
+                        continue;
+                    }
+                    for (int p = 0; p < 16; ++p)
+                    {
+                        // BC1 keeps color only where alpha survives
+                        bool32_t visible = format != TEXTURE_BC1 || block[p*4 + 3] >= 128;
+                        for (int c = 0; c < 3 && visible; ++c)
+                        {
+                            double difference = decoded[p*4 + c] - block[p*4 + c];
+                            rgb_error += difference * difference;
+                        }
+                        double difference = decoded[p*4 + 3] - block[p*4 + 3];
+                        alpha_error += difference * difference;
+                    }
+                }
+            }
+            free(encoded);
+        }
+
+        double samples = (double) blocks_x * blocks_y * 16 * atlas->page_count;
+        double rgb_psnr = 10.0 * log10(255.0 * 255.0 / fmax(rgb_error / (samples * 3), 1e-10));
+        double alpha_psnr = 10.0 * log10(255.0 * 255.0 / fmax(alpha_error / samples, 1e-10));
+        double megapixels = samples / 1e6;
+        printf("%-6s %10zu %10.2f %8.1f %10.2f %10.2f %s\n", texture_format_names[format], bytes, seconds * 1000.0,
+               megapixels / seconds, rgb_psnr, alpha_psnr, flat_failures ? "FAILED" : "ok");
+        if (bad_blocks)
+        {
+            printf("    %s: %d blocks do not decode\n", texture_format_names[format], bad_blocks);
+        }
+        failures += flat_failures + bad_blocks;
+    }
+
+    return failures ? 1 : 0;
+}
+
+// Straightforward double precision version of one mip level, for checking
+// the banded SIMD filters
+INTERNAL void
+DownsampleReference(mip_filter_t filter, const uint8_t* src, int src_width, int src_height,
+                    uint8_t* dst, int width, int height)
+{
+    float kaiser[MIP_KAISER_TAPS];
+    GetKaiserWeights(kaiser);
+    static const float box[MIP_KAISER_TAPS] = { 0.0f, 0.0f, 0.5f, 0.5f, 0.0f, 0.0f };
+    const float* weights = filter == MIP_BOX ? box : kaiser;
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                double sum = 0.0;
+                for (int ty = 0; ty < MIP_KAISER_TAPS; ++ty)
+                {
+                    int sy = 2*y - (MIP_KAISER_TAPS / 2 - 1) + ty;
+                    sy = sy < 0 ? 0 : (sy >= src_height ? src_height - 1 : sy);
+                    for (int tx = 0; tx < MIP_KAISER_TAPS; ++tx)
+                    {
+                        int sx = 2*x - (MIP_KAISER_TAPS / 2 - 1) + tx;
+                        sx = sx < 0 ? 0 : (sx >= src_width ? src_width - 1 : sx);
+                        sum += (double) weights[ty] * weights[tx] * src[((size_t) sy * src_width + sx) * 4 + c];
+                    }
+                }
+                dst[((size_t) y * width + x) * 4 + c] = (uint8_t) ClampByte((int) floor(sum + 0.5));
             }
+        }
+    }
+}
 
-            stbtt_MakeGlyphBitmap(&font->info, bitmap, gw, gh, gw, font->scale, font->scale, glyph_index);
+// Checks the box row kernel against the scalar one, then builds the full
+// chain of every page with both filters and compares each level with the
+// reference, reporting time and the largest channel error
+INTERNAL int
+RunMipTest(const char* config_file)
+{
+    global_thread_count = GetProcessorCount();
+    InitBlitKernels();
 
-            int advance, lsb;
-            stbtt_GetGlyphHMetrics(&font->info, glyph_index, &advance, &lsb);
+    atlas_t* atlas = &global_atlas;
+    if (!ParseConfig(config_file, atlas) || !LoadAssets(atlas) || !CreateAtlas(atlas))
+    {
+        printf("Error: Failed to bake %s\n", config_file);
+        return 1;
+    }
 
-            temp_glyphs[temp_glyph_count].font_index = i;
-            temp_glyphs[temp_glyph_count].codepoint = c;
-            temp_glyphs[temp_glyph_count].bitmap = bitmap;
-            temp_glyphs[temp_glyph_count].width = gw;
-            temp_glyphs[temp_glyph_count].height = gh;
-            temp_glyphs[temp_glyph_count].xoff = xoff;
-            temp_glyphs[temp_glyph_count].yoff = yoff;
-            temp_glyphs[temp_glyph_count].xadvance = advance * font->scale;
+    enum { MAX_LENGTH = 100, MAX_OFFSET = 8 };
+    uint8_t rows[2][(MAX_LENGTH + MAX_OFFSET) * 8];
+    uint8_t expected[(MAX_LENGTH + MAX_OFFSET + 1) * 4];
+    uint8_t actual[(MAX_LENGTH + MAX_OFFSET + 1) * 4];
+
+    uint32_t state = 1;
+    for (int i = 0; i < (int) sizeof(rows); ++i)
+    {
+        rows[i / sizeof(rows[0])][i % sizeof(rows[0])] = (uint8_t) RandomNext(&state);
+    }
 
-            rects[rect_index].width = gw + (padding*2);
-            rects[rect_index].height = gh + (padding*2);
-            rects[rect_index].type = TYPE_GLYPH;
-            rects[rect_index].original_index = temp_glyph_count;
-            rects[rect_index].user_data = &temp_glyphs[temp_glyph_count];
+    int failures = 0;
+    for (int length = 0; length <= MAX_LENGTH; ++length)
+    {
+        for (int offset = 0; offset < MAX_OFFSET; ++offset)
+        {
+            // Canary past the end catches kernels writing too far
+            memset(expected, 0xAB, sizeof(expected));
+            memset(actual, 0xAB, sizeof(actual));
+            BoxDownsampleRowScalar(expected + offset*4, rows[0] + offset*8, rows[1] + offset*8, length);
+            BoxDownsampleRow(actual + offset*4, rows[0] + offset*8, rows[1] + offset*8, length);
 
-            bitmap = (uint8_t*) ((uintptr_t) bitmap + (gw * gh));
-            rect_index++;
-            temp_glyph_count++;
+            if (memcmp(expected, actual, sizeof(expected)) != 0)
+            {
+                if (failures == 0)
+                {
+                    printf("    box row: mismatch at length %d, offset %d\n", length, offset);
+                }
+                failures++;
+            }
         }
     }
+    printf("box row  %s\n", failures ? "FAILED" : "ok");
 
-    // Sort by area (descending)
-    for (int i = 0; i < rect_index - 1; ++i)
+    // Box is exact, Kaiser may round the other way after float sums
+    static const int tolerance[MIP_FILTER_COUNT] = { 0, 1 };
+
+    size_t page_size = (size_t) atlas->width * atlas->height * 4;
+    int level_count = GetMipLevelCount(atlas->width, atlas->height, MAX_MIP_LEVELS);
+    printf("%d x %dx%d pages, %d levels, %d threads\n", atlas->page_count, atlas->width, atlas->height,
+           level_count, global_thread_count);
+    printf("%-8s %10s %8s %10s\n", "filter", "ms", "MP/s", "max_error");
+
+    for (int filter = 0; filter < MIP_FILTER_COUNT; ++filter)
     {
-        for (int j = i+1; j < rect_index; ++j)
+        double seconds = 0.0;
+        double megapixels = 0.0;
+        int max_error = 0;
+        for (int page = 0; page < atlas->page_count; ++page)
         {
-            int area_i = rects[i].width * rects[i].height;
-            int area_j = rects[j].width * rects[j].height;
+            const uint8_t* pixels = atlas->pixels + page * page_size;
+            uint8_t* levels[MAX_MIP_LEVELS];
+            double start = GetSeconds();
+            GenerateMipChain((mip_filter_t) filter, pixels, atlas->width, atlas->height, level_count, levels);
+            seconds += GetSeconds() - start;
+
+            for (int level = 1; level < level_count; ++level)
+            {
+                int width = GetMipSize(atlas->width, level);
+                int height = GetMipSize(atlas->height, level);
+                size_t size = (size_t) width * height * 4;
+                uint8_t* reference = (uint8_t*) malloc(size);
+                DownsampleReference((mip_filter_t) filter, levels[level - 1], GetMipSize(atlas->width, level - 1),
+                                    GetMipSize(atlas->height, level - 1), reference, width, height);
 
-            if (area_j > area_i)
+                for (size_t i = 0; i < size; ++i)
+                {
+                    int difference = abs(levels[level][i] - reference[i]);
+                    max_error = difference > max_error ? difference : max_error;
+                }
+                megapixels += (double) width * height / 1e6;
+                free(reference);
+            }
+
+            for (int level = 1; level < level_count; ++level)
             {
-                packed_rect_t temp = rects[i];
-                rects[i] = rects[j];
-                rects[j] = temp;
+                free(levels[level]);
             }
         }
+
+        bool32_t ok = max_error <= tolerance[filter];
+        printf("%-8s %10.2f %8.1f %10d %s\n", mip_filter_names[filter], seconds * 1000.0,
+               megapixels / seconds, max_error, ok ? "ok" : "FAILED");
+        failures += !ok;
     }
 
-    // Pack rectangles
-    for (int i = 0; i < rect_index; ++i)
+    return failures ? 1 : 0;
+}
+
+// Checks the kerning walked from the font tables against asking stb about
+// every ordered pair of baked glyphs, the way kerning used to be collected
+INTERNAL int
+RunKerningTest(const char* config_file)
+{
+    global_thread_count = GetProcessorCount();
+    InitBlitKernels();
+
+    atlas_t* atlas = &global_atlas;
+    if (!ParseConfig(config_file, atlas) || !LoadAssets(atlas) || !CreateAtlas(atlas))
     {
-        int x, y;
-        int best_index = MaxRectsFindPosition(&maxrects, rects[i].width, rects[i].height, &x, &y);
+        printf("Error: Failed to bake %s\n", config_file);
+        return 1;
+    }
 
-        if (best_index == -1)
-        {
-            printf("Error: Atlas is too small.\n");
-            return 0; // Program will exit, no need to free memory
-        }
+    printf("%-16s %8s %8s %10s %10s\n", "font", "glyphs", "pairs", "walk_ms", "all_ms");
+
+    int failures = 0;
+    for (int f = 0; f < atlas->font_count; ++f)
+    {
+        font_t* font = &atlas->fonts[f];
+        int mismatches = 0;
+        int expected_count = 0;
 
-        int content_x = x + padding;
-        int content_y = y + padding;
+        // The bake already sorted the glyphs, time the walk again on its own
+        kern_pair_t* baked = font->kerning;
+        int baked_count = font->kerning_count;
+        font->kerning = 0;
+        font->kerning_count = 0;
+        double start = GetSeconds();
+        CollectKerning(atlas);
+        double walk_seconds = GetSeconds() - start;
+        free(font->kerning);
+        font->kerning = baked;
+        font->kerning_count = baked_count;
 
-        // Place content based on type
-        switch (rects[i].type)
+        start = GetSeconds();
+        for (int i = 0; i < font->glyph_count; ++i)
         {
-            case TYPE_IMAGE: { // Images
-                image_t* img = (image_t*) rects[i].user_data;
-                img->x = content_x;
-                img->y = content_y;
-                
-                for (int py = 0; py < img->height; ++py)
+            for (int j = 0; j < font->glyph_count; ++j)
+            {
+                int advance = stbtt_GetGlyphKernAdvance(&font->info, font->glyphs[i].glyph_index,
+                                                        font->glyphs[j].glyph_index);
+                if (advance == 0)
                 {
-                    for (int px = 0; px < img->width; ++px)
-                    {
-                        int src = ((py * img->width) + px) * 4;
-                        int dst = (((content_y + py) * atlas->width) + (content_x + px)) * 4;
-                        if (img->pixels)
-                        {
-                            atlas->pixels[dst + 0] = img->pixels[src + 0];
-                            atlas->pixels[dst + 1] = img->pixels[src + 1];
-                            atlas->pixels[dst + 2] = img->pixels[src + 2];
-                            atlas->pixels[dst + 3] = img->pixels[src + 3];
-                        }
-                        else
-                        {
-                            atlas->pixels[dst + 0] = 0xFF;
-                            atlas->pixels[dst + 1] = 0xFF;
-                            atlas->pixels[dst + 2] = 0xFF;
-                            atlas->pixels[dst + 3] = 0xFF;
-                        }
-                    }
+                    continue;
                 }
-            } break;
-            
-            case TYPE_GLYPH: { // Fonts
-                packed_glyph_t* glyph = (packed_glyph_t*) rects[i].user_data;
-                font_t* font = &atlas->fonts[glyph->font_index];
 
-                for (int py = 0; py < glyph->height; ++py)
+                uint64_t key = ((uint64_t) (uint32_t) font->glyphs[i].codepoint << 32) |
+                               (uint32_t) font->glyphs[j].codepoint;
+                int lo = 0, hi = font->kerning_count;
+                while (lo < hi)
                 {
-                    for (int px = 0; px < glyph->width; ++px)
-                    {
-                        int src = ((py * glyph->width) + px);
-                        int dst = (((content_y + py) * atlas->width) + (content_x + px)) * 4;
-                        atlas->pixels[dst + 0] = 255;
-                        atlas->pixels[dst + 1] = 255;
-                        atlas->pixels[dst + 2] = 255;
-                        atlas->pixels[dst + 3] = glyph->bitmap[src];
-                    }
+                    int mid = (lo + hi) / 2;
+                    if (font->kerning[mid].key < key) lo = mid + 1; else hi = mid;
                 }
 
-                font->glyphs[font->glyph_count] = (glyph_mapping_t){
-                    .codepoint = glyph->codepoint,
-                    .glyph = {
-                        .u0 = (float)content_x / (float)atlas->width,
-                        .v0 = (float)content_y / (float)atlas->height,
-                        .u1 = (float)(content_x + glyph->width) / (float)atlas->width,
-                        .v1 = (float)(content_y + glyph->height) / (float)atlas->height,
-                        .xoff = (float)glyph->xoff,
-                        .yoff = (float)glyph->yoff,
-                        .xadvance = glyph->xadvance,
-                        .w = glyph->width,
-                        .h = glyph->height,
+                if (lo == font->kerning_count || font->kerning[lo].key != key ||
+                    font->kerning[lo].advance != advance * font->scale)
+                {
+                    if (mismatches == 0)
+                    {
+                        printf("    %s: pair U+%04X U+%04X should be %d units\n", font->name,
+                               font->glyphs[i].codepoint, font->glyphs[j].codepoint, advance);
                     }
-                };
-                font->glyph_count++;
-            } break;
+                    mismatches++;
+                }
+                expected_count++;
+            }
         }
+        double all_seconds = GetSeconds() - start;
 
-        // Split the free rectangle
-        rect_t placed = {x, y, rects[i].width, rects[i].height};
-    
-        for (int j = 0; j < maxrects.count; )
+        bool32_t ok = mismatches == 0 && expected_count == font->kerning_count;
+        printf("%-16s %8d %8d %10.2f %10.2f %s\n", font->name, font->glyph_count, font->kerning_count,
+               walk_seconds * 1000.0, all_seconds * 1000.0, ok ? "ok" : "FAILED");
+        failures += !ok;
+    }
+
+    return failures ? 1 : 0;
+}
+
+INTERNAL void
+CountPngBytes(void* context, void* data, int size)
+{
+    (void) data;
+    *(size_t*) context += size;
+}
+
+// Writes every page of a baked config at each PNG level, plus through
+// stb_image_write for comparison. Each file is decoded again with stb_image
+// and compared with the atlas pixels.
+INTERNAL int
+RunPngBenchmark(const char* config_file)
+{
+    global_thread_count = GetProcessorCount();
+    InitBlitKernels();
+    InitPngWriter();
+
+    atlas_t* atlas = &global_atlas;
+    if (!ParseConfig(config_file, atlas) || !LoadAssets(atlas) || !CreateAtlas(atlas))
+    {
+        printf("Error: Failed to bake %s\n", config_file);
+        return 1;
+    }
+
+    size_t page_size = (size_t) atlas->width * atlas->height * 4;
+    double megabytes = (double) page_size * atlas->page_count / (1024.0 * 1024.0);
+    printf("%d x %dx%d pages, %.1f MB of pixels, %d threads\n", atlas->page_count, atlas->width, atlas->height,
+           megabytes, global_thread_count);
+    printf("%8s %12s %8s %10s %10s %s\n", "level", "bytes", "ratio", "ms", "MB/s", "decodes");
+
+    int failures = 0;
+    for (int level = 0; level <= PNG_MAX_LEVEL; ++level)
+    {
+        size_t bytes = 0;
+        double seconds = 0.0;
+        bool32_t match = 1;
+        for (int page = 0; page < atlas->page_count; ++page)
         {
-            rect_t free_rect = maxrects.rects[j];
-            
-            // Check if this free rect intersects with our placed rect
-            if (!(placed.x >= free_rect.x + free_rect.width ||
-                placed.x + placed.width <= free_rect.x ||
-                placed.y >= free_rect.y + free_rect.height ||
-                placed.y + placed.height <= free_rect.y))
-            {
-                MaxRectsSplitFreeRect(&maxrects, j, placed.x, placed.y, placed.width, placed.height);
-            }
-            else
+            FILE* f = tmpfile();
+            if (!f)
             {
-                j++;
+                printf("Error: Cannot create a temporary file\n");
+                return 1;
             }
+
+            const uint8_t* pixels = atlas->pixels + page * page_size;
+            double start = GetSeconds();
+            bool32_t ok = WritePng(f, pixels, atlas->width, atlas->height, level);
+            seconds += GetSeconds() - start;
+
+            long size = ftell(f);
+            uint8_t* file = (uint8_t*) malloc(size > 0 ? size : 1);
+            rewind(f);
+            ok = ok && size > 0 && fread(file, 1, size, f) == (size_t) size;
+            fclose(f);
+
+            int width = 0, height = 0, channels;
+            uint8_t* decoded = ok ? stbi_load_from_memory(file, (int) size, &width, &height, &channels, 4) : 0;
+            match = match && decoded && width == (int) atlas->width && height == (int) atlas->height &&
+                    memcmp(decoded, pixels, page_size) == 0;
+            stbi_image_free(decoded);
+            free(file);
+            bytes += size > 0 ? size : 0;
         }
-        
-        // Periodically prune redundant rectangles
-        if (i % 50 == 0)
-        {
-            MaxRectsPruneRects(&maxrects);
-        }
+
+        printf("%8d %12zu %7.1f%% %10.2f %10.1f %s\n", level, bytes, 100.0 * bytes / (page_size * atlas->page_count),
+               seconds * 1000.0, megabytes / seconds, match ? "yes" : "NO");
+        failures += !match;
     }
 
-    MaxRectsPruneRects(&maxrects);
+    size_t bytes = 0;
+    double start = GetSeconds();
+    for (int page = 0; page < atlas->page_count; ++page)
+    {
+        stbi_write_png_to_func(CountPngBytes, &bytes, atlas->width, atlas->height, 4,
+                               atlas->pixels + page * page_size, atlas->width * 4);
+    }
+    double seconds = GetSeconds() - start;
+    printf("%8s %12zu %7.1f%% %10.2f %10.1f\n", "stb", bytes, 100.0 * bytes / (page_size * atlas->page_count),
+           seconds * 1000.0, megabytes / seconds);
 
-    // Cleanup
-    free(rects);
-    free(bitmap_memory);
-    free(temp_glyphs);
-    FreeMaxRects(&maxrects);
-    
-    return 1;
+    return failures ? 1 : 0;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-
-INTERNAL void
-ExportPng(atlas_t* atlas, const char* filename)
+INTERNAL int
+RunInternalTool(int argc, char* argv[])
 {
-    stbi_write_png(filename, atlas->width, atlas->height, 4, atlas->pixels, atlas->width*4);
-}
+    if (argc >= 1 && strcmp(argv[0], "bench-maxrects") == 0)
+    {
+        return RunMaxRectsBenchmark(argc - 1, argv + 1);
+    }
 
-INTERNAL bool32_t
-ExportHeader(atlas_t* atlas, const char* filename)
-{
-    FILE* f = fopen(filename, "w");
-    if (!f)
+    if (argc >= 1 && strcmp(argv[0], "test-size-search") == 0)
     {
-        printf("Error: Cannot create header file.\n");
-        return 0;
+        return RunSizeSearchTest();
     }
 
-    fprintf(f, "// Auto-generated sprite atlas - DO NOT EDIT!\n"
-               "// Generated by sprite backer tool\n"
-               "// Contains %d fonts and %d images\n\n"
-               "#pragma once\n\n"
-               "#include <stdint.h>\n\n"
-               "typedef struct\n{\n"
-               "    int32_t x, y, w, h;    // Position and size in atlas\n"
-               "    float u0, v0, u1, v1;   // UV coordinates\n"
-               "} sprite_t;\n\n"
-               "typedef enum\n{\n",
-               atlas->font_count,
-               atlas->image_count);
+    if (argc >= 1 && strcmp(argv[0], "test-blit") == 0)
+    {
+        InitBlitKernels();
+        return RunBlitTest();
+    }
 
-    for (int i = 0; i < atlas->image_count; ++i)
+    if (argc == 2 && strcmp(argv[0], "test-binary") == 0)
     {
-        fprintf(f, "    SPRITE_%s,\n", atlas->images[i].name);
+        return RunBinaryTest(argv[1]);
     }
 
-    fprintf(f, "    SPRITE_COUNT,\n"
-                 "} sprite_id;\n\n"
-                 "static const sprite_t BACKED_SPRITE_LIST[] = {\n");
+    if (argc == 2 && strcmp(argv[0], "bench-png") == 0)
+    {
+        return RunPngBenchmark(argv[1]);
+    }
 
-    for (int i = 0; i < atlas->image_count; ++i)
+    if (argc == 2 && strcmp(argv[0], "test-texture") == 0)
     {
-        image_t* image = &atlas->images[i];
-        float u0 = (float)image->x / (float)atlas->width;
-        float v0 = (float)image->y / (float)atlas->height;
-        float u1 = (float)(image->x + image->width) / (float)atlas->width;
-        float v1 = (float)(image->y + image->height) / (float)atlas->height;
+        return RunTextureTest(argv[1]);
+    }
 
-        fprintf(f,
-            "    [SPRITE_%s] = {%d, %d, %d, %d, %ff, %ff, %ff, %ff},\n",
-            image->name,
-            image->x, image->y,
-            image->width, image->height,
-            u0, v0, u1, v1
-        );
+    if (argc == 2 && strcmp(argv[0], "test-mips") == 0)
+    {
+        return RunMipTest(argv[1]);
     }
 
-    fprintf(f, "};\n\n"
-                 "typedef struct\n{\n"
-                 "    uint64_t codepoint;     // Unicode codepoint\n"
-                 "    int32_t w, h;          // Dimensions\n"
-                 "    float u0, v0, u1, v1;   // UV coordinates\n"
-                 "    float xoff, yoff;       // Offset from baseline\n"
-                 "    float advance;          // Advance to next glyph\n"
-                 "} glyph_t;\n\n"
-                 "typedef struct\n{\n"
-                 "    int size;                      // Size in pixels\n"
-                 "    int ascent, descent, line_gap; // Metrics\n"
-                 "    glyph_t ascii_cache[128];      // Glyphs\n"
-                 "    glyph_t glyphs[%d];            // All glyphs\n"
-                 "    uint32_t glyph_count;          // Number of glyphs\n"
-                 "} font_t;\n\n"
-                 "typedef enum\n{\n", MAX_GLYPHS);
+    if (argc == 2 && strcmp(argv[0], "test-kerning") == 0)
+    {
+        return RunKerningTest(argv[1]);
+    }
 
-    for (int i = 0; i < atlas->font_count; ++i)
+    printf("Usage: sprite_backer --internal <tool>\n\n"
+           "Tools:\n"
+           "    bench-maxrects [count...]    Time free-rect search and split, 100 to 50k rects by default\n"
+           "    test-size-search             Check the ATLAS_SIZE AUTO search with every POT and NONSQUARE setting\n"
+           "    test-blit                    Check the SIMD blit kernels against the scalar ones\n"
+           "    test-binary <config_file>    Bake a config and check the binary against the atlas and the header\n"
+           "    bench-png <config_file>      Time and size of each PNG level, checked by decoding\n"
+           "    test-texture <config_file>   Encode every GPU format, decode it again and report the error\n"
+           "    test-mips <config_file>      Build every mip chain and check it against a reference filter\n"
+           "    test-kerning <config_file>   Check the kerning pairs against a lookup of every glyph pair\n");
+    return 1;
+}
+
+#endif
+
+int
+main(int argc, char* argv[])
+{
+#ifdef BUILD_INTERNAL
+    if (argc >= 2 && strcmp(argv[1], "--internal") == 0)
     {
-        fprintf(f, "    FONT_%s,\n", atlas->fonts[i].name);
+        return RunInternalTool(argc - 2, argv + 2);
     }
+#endif
 
-    fprintf(f, "    FONT_COUNT,\n"
-                 "} font_id;\n\n"
-                 "static const font_t BACKED_FONT_LIST[] = {\n");
-    
-    for (int i = 0; i < atlas->font_count; ++i)
+    const char* config_file = 0;
+    const char* output_name = 0;
+    int positional_count = 0;
+
+    for (int i = 1; i < argc; ++i)
     {
-        // Sort glyphs by codepoint
-        for (int gi = 0; gi < atlas->fonts[i].glyph_count - 1; ++gi)
+        if (strcmp(argv[i], "--stats") == 0)
         {
-            for (int gj = gi+1; gj < atlas->fonts[i].glyph_count; ++gj)
-            {
-                if (atlas->fonts[i].glyphs[gi].codepoint > atlas->fonts[i].glyphs[gj].codepoint)
-                {
-                    glyph_mapping_t temp = atlas->fonts[i].glyphs[gi];
-                    atlas->fonts[i].glyphs[gi] = atlas->fonts[i].glyphs[gj];
-                    atlas->fonts[i].glyphs[gj] = temp;
-                }
-            }
+            global_print_stats = 1;
         }
-
-        font_t* font = &atlas->fonts[i];
-        fprintf(f, "    [FONT_%s] = {\n"
-                     "        .size = %d,\n"
-                     "        .ascent = %d,\n"
-                     "        .descent = %d,\n"
-                     "        .line_gap = %d,\n"
-                     "        .ascii_cache = {\n",
-                     font->name, font->size, font->ascent,
-                     font->descent, font->line_gap);
-
-        int ascii_count = 0;
-
-        for (int j = 0; j < font->glyph_count; ++j)
+        else if (strcmp(argv[i], "--binary") == 0)
         {
-            glyph_mapping_t* glyph = &font->glyphs[j];
-            if (glyph->codepoint < 128)
-            {
-                ascii_count++;
-                fprintf(f, "            [0x%02X] = { %d, %d, %d, %ff, %ff, %ff, %ff, %ff, %ff, %ff },\n",
-                             glyph->codepoint, glyph->codepoint,
-                             glyph->glyph.w, glyph->glyph.h,
-                             glyph->glyph.u0, glyph->glyph.v0,
-                             glyph->glyph.u1, glyph->glyph.v1,
-                             glyph->glyph.xoff, glyph->glyph.yoff,
-                             glyph->glyph.xadvance);
-            }
-            else
+            global_export_binary = 1;
+        }
+        else if (strcmp(argv[i], "--watch") == 0)
+        {
+            global_watch = 1;
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            global_cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc)
+        {
+            if (!ParsePngLevel(argv[++i], &global_png_level))
             {
+                printf("Error: Unknown PNG level: %s\n", argv[i]);
+                positional_count = -1;
                 break;
             }
         }
-
-        fprintf(f, "        },\n");
-
-        if (font->glyph_count <= ascii_count)
+        else if (strncmp(argv[i], "--", 2) == 0)
         {
-            fprintf(f, "        .glyph_count = 0,\n");
+            printf("Error: Unknown option: %s\n", argv[i]);
+            positional_count = -1;
+            break;
+        }
+        else if (positional_count == 0)
+        {
+            config_file = argv[i];
+            positional_count++;
+        }
+        else if (positional_count == 1)
+        {
+            output_name = argv[i];
+            positional_count++;
         }
         else
         {
-            fprintf(f, "        .glyph_count = %d,\n"
-                         "        .glyphs = {\n",
-                         font->glyph_count - ascii_count);
-
-            int index = 0;
-            for (int j = 0; j < font->glyph_count; ++j)
-            {
-                glyph_mapping_t* glyph = &font->glyphs[j];
-                if (glyph->codepoint >= 128)
-                {
-                    fprintf(f, "            [%d] = { %d, %d, %d, %ff, %ff, %ff, %ff, %ff, %ff, %ff },\n",
-                    index++, glyph->codepoint,
-                    glyph->glyph.w, glyph->glyph.h,
-                    glyph->glyph.u0, glyph->glyph.v0,
-                    glyph->glyph.u1, glyph->glyph.v1,
-                    glyph->glyph.xoff, glyph->glyph.yoff,
-                    glyph->glyph.xadvance);
-                }
-            }
-
-            fprintf(f, "        },\n");
+            positional_count++;
         }
-
-        fprintf(f, "    },\n");
     }
 
-    fprintf(f, "};\n");
-    fclose(f);
-
-    return 1;
-}
-
-int
-main(int argc, char* argv[])
-{
-    if (argc != 3)
+    if (positional_count != 2)
     {
-        printf("Usage: %s <config_file> <output_name>\n\n", argv[0]);
+        printf("Usage: %s [--stats] [--binary] [--cache <dir>] [--watch] [--png-level <level>] <config_file> <output_name>\n\n"
+               "Options:\n"
+               "    --stats                Print glyph bitmap and peak memory usage\n"
+               "    --binary               Also write <output_name>.bin, see src/backed_atlas.h\n"
+               "    --cache <dir>          Reuse decoded images, glyphs and layouts from earlier runs\n"
+               "    --watch                Keep running and bake again whenever an input changes\n"
+               "    --png-level <level>    PNG compression, 0 (store) to 9 (max), or store, fast, default, max\n\n", argv[0]);
         return 1;
     }
 
-    if (!ParseConfig(argv[1], &global_atlas))
-    {
-        printf("Error: Invalid config file: %s\n", argv[1]);
-        return 1;
-    }
+    global_thread_count = GetProcessorCount();
+    InitBlitKernels();
+    InitPngWriter();
 
-    if (!CreateAtlas(&global_atlas))
+    if (global_cache_dir && !CreateCacheDirectory(global_cache_dir))
     {
-        printf("Error: Failed to pack atlas\n");
         return 1;
     }
-        
-    char filename[256];
-    snprintf(filename, sizeof(filename), "%s.png", argv[2]);
-    ExportPng(&global_atlas, filename);
 
-    snprintf(filename, sizeof(filename), "%s.h", argv[2]);
-    if (!ExportHeader(&global_atlas, filename))
+    bool32_t loaded = LoadAtlas(config_file, &global_atlas);
+    bool32_t baked = loaded && BakeAtlas(&global_atlas, output_name);
+
+    if (global_watch)
     {
-        printf("Error: Failed to create header file.\n");
-        return 1;
+        return WatchAtlas(config_file, output_name, &global_atlas, loaded);
     }
 
-    return 0;
+    return baked ? 0 : 1;
 }